@@ -19,14 +19,26 @@
  * DEALINGS IN THE SOFTWARE. */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
 #include <math.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
 #include "cop/cop_vec.h"
 #include "cop/cop_filemap.h"
 #include "cop/cop_alloc.h"
+#include "cop/cop_thread.h"
 #include "smplwav/smplwav_mount.h"
 #include "smplwav/smplwav_serialise.h"
 #include "smplwav/smplwav_convert.h"
 #include "opendiapason/odfilter.h"
+#include "opendiapason/app_common/apputil.h"
 
 /* How the algorithm works
  *
@@ -44,7 +56,8 @@
  *    correlation matrix which maps each sample to each other sample over a
  *    period of LONG_WINDOW_LENGTH. This is CPU intensive and means that the
  *    ranges we search over should be limited. The complexity goes up with
- *    sample pitch.
+ *    sample pitch. The windows of a range are packed together so the long
+ *    correlations can be computed as a blocked gram matrix.
  * 5) Using the correlation matrix and the envelop, we can convert the
  *    correlation matrix into a mean-squared-error matrix mapping the error of
  *    looping between each possible point. The values closest to zero will
@@ -66,47 +79,6 @@
 #define LONG_WINDOW_LENGTH  (3801) /* ~ 100ms at 48 kHz */
 #define MAX_NB_XCDATA       (256)
 
-#define BUILD_MERGESORT(name_, data_, comparison_) \
-void sort_ ## name_(data_ *inout, data_ *scratch, uint_fast32_t nb_elements) \
-{ \
-	if (nb_elements <= 8) { \
-		uint_fast32_t i, j; \
-		for (i = 0; i < nb_elements; i++) { \
-			uint_fast32_t biggest = i; \
-			for (j = i+1; j < nb_elements; j++) { \
-				if (comparison_((inout + biggest), (inout + j))) \
-					biggest = j; \
-			} \
-			if (biggest != i) { \
-				data_ tmp = inout[biggest]; \
-				inout[biggest] = inout[i]; \
-				inout[i] = tmp; \
-			} \
-		} \
-	} else { \
-		uint_fast32_t l1 = nb_elements / 2; \
-		uint_fast32_t l2 = nb_elements - l1; \
-		data_ *p1 = scratch; \
-		data_ *p2 = scratch + l1; \
-		memcpy(scratch, inout, nb_elements * sizeof(data_)); \
-		sort_ ## name_(p1, inout, l1); \
-		sort_ ## name_(p2, inout, l2); \
-		while (l1 && l2) { \
-			if (comparison_(p1, p2)) { \
-				*inout++ = *p2++; \
-				l2--; \
-			} else { \
-				*inout++ = *p1++; \
-				l1--; \
-			} \
-		} \
-		while (l1--) \
-			*inout++ = *p1++; \
-		while (l2--) \
-			*inout++ = *p2++; \
-	} \
-}
-
 struct scaninfo {
 	uint_fast32_t position;
 	float         rms3;
@@ -121,13 +93,109 @@ struct xcdata {
 	float         mratio;
 };
 
-#define SCINFO_COMPARISON(a_, b_) ((a_)->rms3 < (b_)->rms3)
-BUILD_MERGESORT(scinfo, struct scaninfo, SCINFO_COMPARISON)
-#undef SCINFO_COMPARISON
+static uint_fast32_t scaninfo_key(const struct scaninfo *sc)
+{
+	uint32_t bits;
+	memcpy(&bits, &(sc->rms3), sizeof(bits));
+	return bits;
+}
+
+/* Put x at the root of the heap and move it down to where it belongs. */
+static void xcheap_sift_down(struct xcdata *heap, unsigned nb_heap, const struct xcdata *x)
+{
+	unsigned pos = 0;
+	for (;;) {
+		unsigned child = pos * 2 + 1;
+		if (child >= nb_heap)
+			break;
+		if (child + 1 < nb_heap && heap[child].xc < heap[child + 1].xc)
+			child++;
+		if (!(x->xc < heap[child].xc))
+			break;
+		heap[pos] = heap[child];
+		pos = child;
+	}
+	heap[pos] = *x;
+}
+
+/* Sort peaks into order of descending rms3 keeping peaks with equal values
+ * in their original order. The values are positive so their bit patterns
+ * sort in the same order as the values themselves, which means a stable
+ * radix sort over 8-bit buckets can be used rather than a comparison sort.
+ * scratch must have space for nb_elements elements. */
+static void sort_scinfo(struct scaninfo *inout, struct scaninfo *scratch, uint_fast32_t nb_elements)
+{
+	struct scaninfo *src = inout;
+	struct scaninfo *dst = scratch;
+	unsigned         shift;
+
+	for (shift = 0; shift < 32; shift += 8) {
+		uint_fast32_t    counts[256];
+		uint_fast32_t    i, sum;
+		struct scaninfo *tmp;
+
+		memset(counts, 0, sizeof(counts));
+		for (i = 0; i < nb_elements; i++)
+			counts[(~scaninfo_key(&(src[i])) >> shift) & 0xFF]++;
+		for (i = 0, sum = 0; i < 256; i++) {
+			uint_fast32_t c = counts[i];
+			counts[i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < nb_elements; i++)
+			dst[counts[(~scaninfo_key(&(src[i])) >> shift) & 0xFF]++] = src[i];
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	/* There were an even number of passes so the result is in inout. */
+	assert(src == inout);
+}
+
+/* Add a pair to a max-heap (on xc) which holds the best MAX_NB_XCDATA pairs
+ * found so far. Once the heap is full, a pair only gets in by replacing the
+ * worst one. */
+static void xcheap_add(struct xcdata *heap, unsigned *nb_heap, const struct xcdata *x)
+{
+	unsigned pos;
+
+	if (*nb_heap < MAX_NB_XCDATA) {
+		pos = (*nb_heap)++;
+		while (pos > 0 && heap[(pos - 1) / 2].xc < x->xc) {
+			heap[pos] = heap[(pos - 1) / 2];
+			pos = (pos - 1) / 2;
+		}
+		heap[pos] = *x;
+		return;
+	}
+
+	if (!(x->xc < heap[0].xc))
+		return;
+
+	xcheap_sift_down(heap, *nb_heap, x);
+}
 
-#define XCINFO_COMPARISON(a_, b_) ((a_)->xc > (b_)->xc)
-BUILD_MERGESORT(xcinfo, struct xcdata, XCINFO_COMPARISON)
-#undef XCINFO_COMPARISON
+/* Turn the heap into an array sorted by ascending xc. */
+static void xcheap_sort(struct xcdata *heap, unsigned nb_heap)
+{
+	while (nb_heap > 1) {
+		struct xcdata last = heap[--nb_heap];
+		heap[nb_heap] = heap[0];
+		xcheap_sift_down(heap, nb_heap, &last);
+	}
+}
+
+/* A loop found by do_processing(). The loop jumps from start+length back to
+ * start. Lower values of xc are better. */
+struct loop_candidate {
+	uint_fast32_t start;
+	uint_fast32_t length;
+	float         xc;
+	float         pratio;
+	float         mratio;
+};
 
 static float cross(float *a, float *b, unsigned len)
 {
@@ -138,6 +206,70 @@ static float cross(float *a, float *b, unsigned len)
 	return acc;
 }
 
+/* Number of floats in a packed long window of one channel. */
+#define LONG_WINDOW_STRIDE  (VLF_PAD_LENGTH(LONG_WINDOW_LENGTH))
+
+/* Fill out the lower triangle of the gram matrix of nb_rows packed windows.
+ * i.e. gram[i*MAX_NB_XCDATA+j] for j < i is set to the dot product of rows i
+ * and j. The rows of windows must be aligned, row_len elements long (a
+ * multiple of 4) and there must be zeroed rows up to the next multiple of 4.
+ *
+ * This is the same thing as calling cross() for every pair, but each block of
+ * 2 rows gets compared against 4 rows at once so that every load is used for
+ * several products and there are 8 independent accumulators. It is many times
+ * faster. */
+static void gram_lower(float *gram, const float *windows, unsigned nb_rows, unsigned row_len)
+{
+	unsigned i, j, k;
+	for (i = 0; i < nb_rows; i += 2) {
+		const float *r0 = windows + i * row_len;
+		const float *r1 = r0 + row_len;
+		for (j = 0; j < i + 1; j += 4) {
+			const float *c0 = windows + j * row_len;
+			const float *c1 = c0 + row_len;
+			const float *c2 = c1 + row_len;
+			const float *c3 = c2 + row_len;
+			v4f a00 = v4f_broadcast(0.0f), a01 = a00, a02 = a00, a03 = a00;
+			v4f a10 = a00, a11 = a00, a12 = a00, a13 = a00;
+			float VEC_ALIGN_BEST sums[2][4][4];
+			unsigned r, c;
+
+			for (k = 0; k < row_len; k += 4) {
+				v4f x0 = v4f_ld(r0 + k);
+				v4f x1 = v4f_ld(r1 + k);
+				v4f y  = v4f_ld(c0 + k);
+				a00 = v4f_add(a00, v4f_mul(x0, y));
+				a10 = v4f_add(a10, v4f_mul(x1, y));
+				y   = v4f_ld(c1 + k);
+				a01 = v4f_add(a01, v4f_mul(x0, y));
+				a11 = v4f_add(a11, v4f_mul(x1, y));
+				y   = v4f_ld(c2 + k);
+				a02 = v4f_add(a02, v4f_mul(x0, y));
+				a12 = v4f_add(a12, v4f_mul(x1, y));
+				y   = v4f_ld(c3 + k);
+				a03 = v4f_add(a03, v4f_mul(x0, y));
+				a13 = v4f_add(a13, v4f_mul(x1, y));
+			}
+
+			v4f_st(sums[0][0], a00);
+			v4f_st(sums[0][1], a01);
+			v4f_st(sums[0][2], a02);
+			v4f_st(sums[0][3], a03);
+			v4f_st(sums[1][0], a10);
+			v4f_st(sums[1][1], a11);
+			v4f_st(sums[1][2], a12);
+			v4f_st(sums[1][3], a13);
+
+			for (r = 0; r < 2 && i + r < nb_rows; r++) {
+				for (c = 0; c < 4 && j + c < i + r; c++) {
+					float *s = sums[r][c];
+					gram[(i + r) * MAX_NB_XCDATA + j + c] = (s[0] + s[1]) + (s[2] + s[3]);
+				}
+			}
+		}
+	}
+}
+
 /* A recursive summation to increase floating point accuracy in summation. */
 static float accusum(float *buf, unsigned len)
 {
@@ -165,27 +297,26 @@ do_processing
 	,uint_fast32_t             chanstride
 	,uint_fast32_t             buf_start
 	,uint_fast32_t             buf_len
+	,struct loop_candidate    *candidates
+	,unsigned                 *nb_candidates
 	)
 {
 	struct scaninfo    *scinfo;
 	float              *tmp_buf;
 	unsigned            i, j;
 	uint_fast32_t       nb_scinfo;
-	uint_fast32_t       nb_xc, sc_start;
-	struct xcdata      *xcbuf;
-	struct xcdata      *xcscratch;
+	uint_fast32_t       sc_start;
 	struct xcdata      *xcresults;
-	struct xcdata      *xcresults2;
-	struct xcdata      *xcresults3;
+	float              *xcwindows;
+	float              *gram;
+	unsigned            win_row_len = LONG_WINDOW_STRIDE * sample->format.channels;
 	unsigned            nb_results = 0;
 
 	if  (   (tmp_buf      = cop_salloc(mem, sizeof(float) * buf_len, 32)) == NULL
 	    ||  (scinfo       = cop_salloc(mem, sizeof(*scinfo) * buf_len * 2, 32)) == NULL
-	    ||  (xcbuf        = cop_salloc(mem, sizeof(*xcbuf) * (MAX_NB_XCDATA * (MAX_NB_XCDATA + 1) / 2), 32)) == NULL
-	    ||  (xcscratch    = cop_salloc(mem, sizeof(*xcscratch) * (MAX_NB_XCDATA * (MAX_NB_XCDATA + 1) / 2), 32)) == NULL
-	    ||  (xcresults    = cop_salloc(mem, sizeof(*xcscratch) * MAX_NB_XCDATA, 32)) == NULL
-	    ||  (xcresults2   = cop_salloc(mem, sizeof(*xcscratch) * MAX_NB_XCDATA, 32)) == NULL
-	    ||  (xcresults3   = cop_salloc(mem, sizeof(*xcscratch) * MAX_NB_XCDATA, 32)) == NULL
+	    ||  (xcresults    = cop_salloc(mem, sizeof(*xcresults) * MAX_NB_XCDATA, 32)) == NULL
+	    ||  (xcwindows    = cop_salloc(mem, sizeof(float) * win_row_len * (MAX_NB_XCDATA + 3), 32)) == NULL
+	    ||  (gram         = cop_salloc(mem, sizeof(float) * MAX_NB_XCDATA * MAX_NB_XCDATA, 32)) == NULL
 	    ) {
 		fprintf(stderr, "out of memory\n");
 		return -1;
@@ -249,187 +380,270 @@ do_processing
 
 		if (sc_end - sc_start > 32) {
 			uint_fast32_t nb_xcd = sc_end - sc_start;
-			unsigned new_results = 0;
-			struct xcdata *swaptmp;
 
 			/* Get long RMS power levels. */
 			for (i = 0; i < nb_xcd; i++) {
 				scinfo[sc_start+i].rms_long = envelope_buf[scinfo[sc_start+i].position];
 			}
 
-			/* Build the triangular correlation matrix. */
-			nb_xc = 0;
+			/* Copy the long window around every peak (all channels end to
+			 * end) into an aligned row so that the long correlations of
+			 * every pair can be found as one gram matrix. The padding and
+			 * the rows past the end are zero so they add nothing. */
+			memset(xcwindows, 0, sizeof(float) * win_row_len * ((nb_xcd + 3) & ~3u));
+			for (i = 0; i < nb_xcd; i++) {
+				unsigned ch;
+				for (ch = 0; ch < sample->format.channels; ch++)
+					memcpy
+						(xcwindows + i * win_row_len + ch * LONG_WINDOW_STRIDE
+						,wave_data + ch * chanstride + scinfo[sc_start+i].position - (LONG_WINDOW_LENGTH-1)/2
+						,sizeof(float) * LONG_WINDOW_LENGTH
+						);
+			}
+			gram_lower(gram, xcwindows, nb_xcd, win_row_len);
+
+			/* Go through the triangular correlation matrix. Every pair which
+			 * is far enough apart goes into the heap of the best pairs found
+			 * in any region, so there is no need to keep the whole matrix
+			 * and sort it. Pairs which cannot get into the heap are thrown
+			 * out before the short correlation is computed. */
 			for (i = 1; i < nb_xcd; i++) {
-				for (j = 0; j < i; j++, nb_xc++) {
-					float    *wd = wave_data;
-					unsigned  ch;
-					float     acc1 = 0.0f;
-					float     acc2 = 0.0f;
-					float     tmp1;
-					float     tmp2;
+				for (j = 0; j < i; j++) {
+					float        *wd = wave_data;
+					unsigned      ch;
+					float         acc2 = 0.0f;
+					float         tmp1;
+					float         tmp2;
+					struct xcdata x;
+					uint_fast32_t pi = scinfo[sc_start+i].position;
+					uint_fast32_t pj = scinfo[sc_start+j].position;
+
+					if (((pi > pj) ? (pi - pj) : (pj - pi)) <= 24000)
+						continue;
+
+					tmp1 = scinfo[sc_start+i].rms_long;
+					tmp2 = scinfo[sc_start+j].rms_long;
+					x.xc = (tmp2 + tmp1 - 2.0f * gram[i * MAX_NB_XCDATA + j]) / (tmp2 + tmp1);
+
+					if (nb_results == MAX_NB_XCDATA && !(x.xc < xcresults[0].xc))
+						continue;
 
 					for (ch = 0; ch < sample->format.channels; ch++, wd += chanstride) {
 						float *ps1;
 						float *ps2;
 
-						ps1 = wd + scinfo[sc_start+i].position - (LONG_WINDOW_LENGTH-1)/2;
-						ps2 = wd + scinfo[sc_start+j].position - (LONG_WINDOW_LENGTH-1)/2;
-						acc1 += cross(ps1, ps2, LONG_WINDOW_LENGTH);
-
-						ps1 = wd + scinfo[sc_start+i].position - (SHORT_WINDOW_LENGTH-1)/2;
-						ps2 = wd + scinfo[sc_start+j].position - (SHORT_WINDOW_LENGTH-1)/2;
+						ps1 = wd + pi - (SHORT_WINDOW_LENGTH-1)/2;
+						ps2 = wd + pj - (SHORT_WINDOW_LENGTH-1)/2;
 						acc2 += cross(ps1, ps2, SHORT_WINDOW_LENGTH);
 					}
 
-					xcbuf[nb_xc].p1 = i+sc_start;
-					xcbuf[nb_xc].p2 = j+sc_start;
-
-					tmp1 = scinfo[sc_start+i].rms_long;
-					tmp2 = scinfo[sc_start+j].rms_long;
-					xcbuf[nb_xc].xc = (tmp2 + tmp1 - 2.0f * acc1) / (tmp2 + tmp1);
+					x.p1 = i+sc_start;
+					x.p2 = j+sc_start;
 
 					tmp1 = scinfo[sc_start+i].rms3;
 					tmp2 = scinfo[sc_start+j].rms3;
 					tmp1 *= tmp1;
 					tmp2 *= tmp2;
-					xcbuf[nb_xc].pratio = (tmp1 + tmp2 - 2.0f * acc2) / (tmp2 + tmp1);
-					xcbuf[nb_xc].mratio = tmp1 / tmp2;
-				}
-			}
+					x.pratio = (tmp1 + tmp2 - 2.0f * acc2) / (tmp2 + tmp1);
+					x.mratio = tmp1 / tmp2;
 
-			/* Sort sc elements. */
-			sort_xcinfo(xcbuf, xcscratch, nb_xc);
-			for (i = 0, j = 0; i < nb_xc && j < MAX_NB_XCDATA; i++) {
-				unsigned p1 = scinfo[xcbuf[i].p1].position;
-				unsigned p2 = scinfo[xcbuf[i].p2].position;
-				unsigned ps = (p1 > p2) ? p2 : p1;
-				unsigned pe = (p1 > p2) ? p1 : p2;
-				if (pe - ps > 24000) {
-					xcresults2[j] = xcbuf[i];
-					j++;
+					xcheap_add(xcresults, &nb_results, &x);
 				}
 			}
-
-			nb_xc = j;
-
-			swaptmp = xcresults3;
-			xcresults3 = xcresults;
-			xcresults = swaptmp;
-
-			/* Merge. */
-			i = 0;
-			j = 0;
-			new_results = 0;
-			while (i < nb_xc && j < nb_results && new_results < MAX_NB_XCDATA) {
-				if (xcresults2[i].xc < xcresults3[j].xc) {
-					xcresults[new_results++] = xcresults2[i++];
-				} else {
-					xcresults[new_results++] = xcresults3[j++];
-				}
-			}
-			while (i < nb_xc && new_results < MAX_NB_XCDATA) {
-				xcresults[new_results++] = xcresults2[i++];
-			}
-			while (j < nb_results && new_results < MAX_NB_XCDATA) {
-				xcresults[new_results++] = xcresults3[j++];
-			}
-
-			nb_results = new_results;
 		}
 
 		sc_start = sc_end;
 	}
 
+	xcheap_sort(xcresults, nb_results);
+
 	for (i = 0; i < nb_results; i++) {
 		unsigned p1 = scinfo[xcresults[i].p1].position;
 		unsigned p2 = scinfo[xcresults[i].p2].position;
-		unsigned ps = (p1 > p2) ? p2 : p1;
-		unsigned pe = (p1 > p2) ? p1 : p2;
-		printf("%u,%u,%f,%f,%f\n", ps, pe-ps, 10.0 * log10(xcresults[i].xc), 10.0 * log10(xcresults[i].pratio), 10.0 * log10(xcresults[i].mratio));
-
-
+		candidates[i].start  = (p1 > p2) ? p2 : p1;
+		candidates[i].length = ((p1 > p2) ? p1 : p2) - candidates[i].start;
+		candidates[i].xc     = xcresults[i].xc;
+		candidates[i].pratio = xcresults[i].pratio;
+		candidates[i].mratio = xcresults[i].mratio;
 	}
 
+	*nb_candidates = nb_results;
+
 	return 0;
 }
 
+/* The most loops which can be kept for each file in batch mode and the
+ * number of threads used unless told otherwise. */
+#define MAX_WRITE_LOOPS       (8)
+#define BATCH_DEFAULT_THREADS (4)
 
-int main(int argc, char *argv[])
+/* Pick up to max_selected of the candidates (which are ordered best first)
+ * skipping any which have almost the same start and duration as a loop which
+ * has already been picked. */
+static unsigned
+select_loops
+	(struct loop_candidate       *selected
+	,unsigned                     max_selected
+	,const struct loop_candidate *candidates
+	,unsigned                     nb_candidates
+	)
 {
-	struct cop_filemap          infile;
-	struct smplwav              sample;
-	struct cop_salloc_iface     mem;
-	struct cop_alloc_grp_temps  mem_impl;
-	int                         err;
-	float                      *wave_data;
-	uint_fast32_t               chanstride;
-	float                      *square_buf;
-	float                      *envelope_buf;
-	uint_fast32_t               i;
-	uint_fast32_t               start_search;
-	uint_fast32_t               end_search;
-	struct odfilter             filter;
-	struct odfilter_temporaries filter_temps;
-	struct fftset               fftset;
+	unsigned i, j, nb_selected = 0;
+	for (i = 0; i < nb_candidates && nb_selected < max_selected; i++) {
+		for (j = 0; j < nb_selected; j++) {
+			long dl = (long)candidates[i].length - (long)selected[j].length;
+			long ds = (long)candidates[i].start - (long)selected[j].start;
+			if (dl >= -2 && dl <= 2 && ds > -LONG_WINDOW_LENGTH && ds < LONG_WINDOW_LENGTH)
+				break;
+		}
+		if (j == nb_selected)
+			selected[nb_selected++] = candidates[i];
+	}
+	return nb_selected;
+}
 
-	if (argc < 2) {
-		fprintf(stderr, "need a filename\n");
-		return -1;
+/* Move the temporary file over the original. rename() will not replace an
+ * existing file on Windows. */
+static int replace_file(const char *from, const char *to)
+{
+#ifdef _WIN32
+	return !MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+	return rename(from, to) != 0;
+#endif
+}
+
+/* Replace the file with the contents of buf. The data is written to a
+ * temporary file next to it which is only moved over the original once it
+ * has been completely written, so a failure part way through never leaves a
+ * truncated sample behind. */
+static const char *write_entire_file(const char *filename, size_t sz, void *buf)
+{
+	const char *err = NULL;
+	size_t      len = strlen(filename);
+	char       *tmpname;
+	FILE       *f;
+
+	if ((tmpname = malloc(len + 5)) == NULL)
+		return "out of memory";
+	memcpy(tmpname, filename, len);
+	memcpy(tmpname + len, ".tmp", 5);
+
+	if ((f = fopen(tmpname, "wb")) != NULL) {
+		if (fwrite(buf, 1, sz, f) != sz)
+			err = "failed to write file";
+		if (fclose(f) != 0 && err == NULL)
+			err = "failed to write file";
+		if (err == NULL && replace_file(tmpname, filename))
+			err = "failed to replace file";
+		if (err != NULL)
+			remove(tmpname);
+	} else {
+		err = "failed to open file for writing";
 	}
 
-	if (cop_filemap_open(&infile, argv[1], COP_FILEMAP_FLAG_R)) {
-		fprintf(stderr, "could not open file '%s'\n", argv[1]);
-		return -1;
+	free(tmpname);
+	return err;
+}
+
+/* Serialise the sample with all of its loops replaced by the given ones.
+ * Markers without a length (i.e. release markers) are kept. Loops which do
+ * not fit in the remaining markers are dropped and nb_stored is set to the
+ * number which were kept. The returned buffer is allocated from mem. */
+static unsigned char *
+serialise_with_loops
+	(struct cop_salloc_iface     *mem
+	,const struct smplwav        *sample
+	,const struct loop_candidate *loops
+	,unsigned                     nb_loops
+	,unsigned                    *nb_stored
+	,unsigned long               *size
+	)
+{
+	struct smplwav  out = *sample;
+	unsigned char  *buf;
+	unsigned        i;
+
+	out.nb_marker = 0;
+	for (i = 0; i < sample->nb_marker; i++)
+		if (sample->markers[i].length == 0)
+			out.markers[out.nb_marker++] = sample->markers[i];
+	for (i = 0; i < nb_loops && out.nb_marker < SMPLWAV_MAX_MARKERS; i++, out.nb_marker++) {
+		memset(&(out.markers[out.nb_marker]), 0, sizeof(out.markers[0]));
+		out.markers[out.nb_marker].position = loops[i].start;
+		out.markers[out.nb_marker].length   = loops[i].length;
 	}
+	*nb_stored = i;
+
+	*size = smplwav_serialise(&out, NULL, 1);
+	if ((buf = cop_salloc(mem, *size, 0)) == NULL)
+		return NULL;
+	(void)smplwav_serialise(&out, buf, 1);
+	return buf;
+}
+
+/* Find the loops of a single file. The filter is the LONG_WINDOW_LENGTH
+ * rectangle which is shared by every thread. All memory comes from mem and
+ * can be released once the results have been used. If max_selected is not
+ * zero, the best distinct loops are put into selected and if write_loops is
+ * set, the file is rewritten with them. */
+static const char *
+analyse_file
+	(const char                  *filename
+	,struct cop_salloc_iface     *mem
+	,const struct odfilter       *filter
+	,struct odfilter_temporaries *filter_temps
+	,struct loop_candidate       *candidates
+	,unsigned                    *nb_candidates
+	,struct loop_candidate       *selected
+	,unsigned                    *nb_selected
+	,unsigned                     max_selected
+	,int                          write_loops
+	)
+{
+	struct cop_filemap  infile;
+	struct smplwav      sample;
+	float              *wave_data;
+	uint_fast32_t       chanstride;
+	float              *square_buf;
+	float              *envelope_buf;
+	uint_fast32_t       i;
+	uint_fast32_t       start_search;
+	uint_fast32_t       end_search;
+	unsigned char      *outbuf = NULL;
+	unsigned long       outsize = 0;
+
+	*nb_candidates = 0;
+	*nb_selected   = 0;
+
+	if (cop_filemap_open(&infile, filename, COP_FILEMAP_FLAG_R))
+		return "could not open file";
 
 	{
 		unsigned uerr;
 		if (SMPLWAV_ERROR_CODE(uerr = smplwav_mount(&sample, infile.ptr, infile.size, 0))) {
 			cop_filemap_close(&infile);
-			fprintf(stderr, "could not load '%s' as a waveform sample %u\n", argv[1], SMPLWAV_ERROR_CODE(uerr));
-			return -1;
+			return "could not load file as a waveform sample";
 		}
 		if (uerr)
-			fprintf(stderr, "%s had issues (%u). check the output file carefully.\n", argv[1], uerr);
+			fprintf(stderr, "%s had issues (%u). check the output file carefully.\n", filename, uerr);
 	}
 
 	if (sample.data_frames < 2*LONG_WINDOW_LENGTH) {
 		cop_filemap_close(&infile);
-		fprintf(stderr, "not enought data in '%s' to loop.\n", argv[1]);
-		return -1;
-	}
-
-	if (cop_alloc_grp_temps_init(&mem_impl, &mem, 1024*1024*256, 1024*1024, 32)) {
-		cop_filemap_close(&infile);
-		fprintf(stderr, "out of memory.\n");
-		return -1;
-	}
-
-	if (fftset_init(&fftset)) {
-		cop_alloc_grp_temps_free(&mem_impl);
-		cop_filemap_close(&infile);
-		fprintf(stderr, "out of memory.\n");
-		return -1;
+		return "not enough data to loop";
 	}
 
 	/* Allocate memory for the various awful things this program does. */
 	chanstride = ((sample.data_frames + VLF_WIDTH - 1) / VLF_WIDTH) * VLF_WIDTH;
-	if  (   (wave_data    = cop_salloc(&mem, sizeof(float) * chanstride * sample.format.channels, 32)) == NULL
-		||  (square_buf   = cop_salloc(&mem, sizeof(float) * sample.data_frames, 32)) == NULL
-		||  (envelope_buf = cop_salloc(&mem, sizeof(float) * sample.data_frames, 32)) == NULL
-		||  (odfilter_init_filter(&filter, &mem.iface, &fftset, LONG_WINDOW_LENGTH))
-		||  (odfilter_init_temporaries(&filter_temps, &mem.iface, &filter))
+	if  (   (wave_data    = cop_salloc(mem, sizeof(float) * chanstride * sample.format.channels, 32)) == NULL
+		||  (square_buf   = cop_salloc(mem, sizeof(float) * sample.data_frames, 32)) == NULL
+		||  (envelope_buf = cop_salloc(mem, sizeof(float) * sample.data_frames, 32)) == NULL
 		) {
-		fftset_destroy(&fftset);
-		cop_alloc_grp_temps_free(&mem_impl);
 		cop_filemap_close(&infile);
-		fprintf(stderr, "out of memory\n");
-		return -1;
+		return "out of memory";
 	}
 
-	/* Build the long filter to get the envelope of the input. */
-	odfilter_build_rect(&filter, &filter_temps, LONG_WINDOW_LENGTH, 1.0f);
-
 	/* Convert the wave data into floating point. */
 	smplwav_convert_deinterleave_floats(wave_data, chanstride, sample.data, sample.data_frames, sample.format.channels, sample.format.format);
 
@@ -455,7 +669,7 @@ int main(int argc, char *argv[])
 	}
 
 	/* Create the envelope of the signal. */
-	odfilter_run(square_buf, envelope_buf, 0, 0, sample.data_frames, (LONG_WINDOW_LENGTH-1)/2, 0, &filter_temps, &filter);
+	odfilter_run(square_buf, envelope_buf, 0, 0, sample.data_frames, (LONG_WINDOW_LENGTH-1)/2, 0, filter_temps, filter);
 
 	/* Find a decent search region. This hopefully chops the releases off the
 	 * search region. */
@@ -467,21 +681,501 @@ int main(int argc, char *argv[])
 		for (; start_search < end_search && envelope_buf[end_search] < total_ms_power * 0.5; end_search--);
 	}
 
-	err =
-		do_processing
+	if  (do_processing
 			(&sample
-			,&mem
+			,mem
 			,wave_data
 			,square_buf
 			,envelope_buf
 			,chanstride
 			,start_search
 			,end_search - start_search + 1
-			);
+			,candidates
+			,nb_candidates
+			)
+		) {
+		cop_filemap_close(&infile);
+		return "out of memory";
+	}
+
+	*nb_selected = select_loops(selected, max_selected, candidates, *nb_candidates);
+
+	/* The new file has to be built while the old one is still mapped. */
+	if (write_loops && *nb_selected) {
+		unsigned nb_stored;
+		if ((outbuf = serialise_with_loops(mem, &sample, selected, *nb_selected, &nb_stored, &outsize)) == NULL) {
+			cop_filemap_close(&infile);
+			return "out of memory";
+		}
+		if (nb_stored < *nb_selected) {
+			fprintf(stderr, "%s: only room for %u of the %u loops in the markers. the rest were dropped.\n", filename, nb_stored, *nb_selected);
+			*nb_selected = nb_stored;
+		}
+
+		/* Don't take the existing loops away if none of ours fit. */
+		if (nb_stored == 0)
+			outbuf = NULL;
+	}
+
+	cop_filemap_close(&infile);
+
+	return (outbuf != NULL) ? write_entire_file(filename, outsize, outbuf) : NULL;
+}
+
+struct file_list {
+	char     **names;
+	unsigned   nb_names;
+	unsigned   max_names;
+};
+
+static int add_file(struct file_list *fl, const char *path)
+{
+	char *name;
+	if (fl->nb_names == fl->max_names) {
+		unsigned new_max = fl->max_names ? fl->max_names * 2 : 256;
+		char **new_names = realloc(fl->names, sizeof(char *) * new_max);
+		if (new_names == NULL)
+			return -1;
+		fl->names     = new_names;
+		fl->max_names = new_max;
+	}
+	if ((name = malloc(strlen(path) + 1)) == NULL)
+		return -1;
+	strcpy(name, path);
+	fl->names[fl->nb_names++] = name;
+	return 0;
+}
+
+static int is_wave_name(const char *name)
+{
+	size_t len = strlen(name);
+	return
+		(   len > 4
+		&&  name[len-4] == '.'
+		&&  tolower((unsigned char)name[len-3]) == 'w'
+		&&  tolower((unsigned char)name[len-2]) == 'a'
+		&&  tolower((unsigned char)name[len-1]) == 'v'
+		);
+}
+
+/* Add every wave file below the given directory to the list. Returns
+ * non-zero if out of memory. Directories which cannot be read are
+ * reported and skipped. */
+static int scan_directory(struct file_list *fl, const char *path)
+{
+	size_t  plen = strlen(path);
+	char   *child;
+	int     err = 0;
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	HANDLE           h;
+
+	if ((child = malloc(plen + MAX_PATH + 3)) == NULL)
+		return -1;
+	sprintf(child, "%s\\*", path);
+	if ((h = FindFirstFileA(child, &fd)) == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "could not read directory '%s'\n", path);
+		free(child);
+		return 0;
+	}
+	do {
+		if (!strcmp(fd.cFileName, ".") || !strcmp(fd.cFileName, ".."))
+			continue;
+		sprintf(child, "%s\\%s", path, fd.cFileName);
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			err = scan_directory(fl, child);
+		else if (is_wave_name(fd.cFileName))
+			err = add_file(fl, child);
+	} while (!err && FindNextFileA(h, &fd));
+	FindClose(h);
+#else
+	DIR           *d;
+	struct dirent *de;
+	struct stat    st;
+
+	if ((d = opendir(path)) == NULL) {
+		fprintf(stderr, "could not read directory '%s'\n", path);
+		return 0;
+	}
+	child = NULL;
+	while (!err && (de = readdir(d)) != NULL) {
+		char *new_child;
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if ((new_child = realloc(child, plen + strlen(de->d_name) + 2)) == NULL) {
+			err = -1;
+			break;
+		}
+		child = new_child;
+		sprintf(child, "%s/%s", path, de->d_name);
+		if (stat(child, &st))
+			continue;
+		if (S_ISDIR(st.st_mode))
+			err = scan_directory(fl, child);
+		else if (S_ISREG(st.st_mode) && is_wave_name(de->d_name))
+			err = add_file(fl, child);
+	}
+	closedir(d);
+#endif
+	free(child);
+	return err;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+struct file_result {
+	const char            *err;
+	unsigned               nb_candidates;
+	unsigned               nb_selected;
+	struct loop_candidate  selected[MAX_WRITE_LOOPS];
+	uint_fast64_t          ns;
+};
+
+struct batch {
+	const struct file_list *files;
+	struct file_result     *results;
+	const struct odfilter  *filter;
+	unsigned                nb_loops;
+	int                     write_loops;
+
+	cop_mutex               lock;
+	unsigned                next_file;
+	unsigned                nb_finished;
+};
+
+struct batch_thread {
+	struct batch               *batch;
+	struct cop_salloc_iface     mem;
+	struct cop_alloc_grp_temps  mem_impl;
+	struct odfilter_temporaries filter_temps;
+	cop_thread                  thread;
+};
+
+static void *batch_thread_proc(void *argument)
+{
+	struct batch_thread   *bt = argument;
+	struct batch          *b  = bt->batch;
+	struct loop_candidate  candidates[MAX_NB_XCDATA];
+	size_t                 mem_reset = cop_salloc_save(&(bt->mem));
+
+	for (;;) {
+		struct file_result *res;
+		unsigned            idx;
+		unsigned            nb_finished;
+
+		cop_mutex_lock(&(b->lock));
+		idx = b->next_file;
+		if (idx < b->files->nb_names)
+			b->next_file++;
+		cop_mutex_unlock(&(b->lock));
+
+		if (idx >= b->files->nb_names)
+			break;
+
+		res     = &(b->results[idx]);
+		res->ns = now_ns();
+		res->err =
+			analyse_file
+				(b->files->names[idx]
+				,&(bt->mem)
+				,b->filter
+				,&(bt->filter_temps)
+				,candidates
+				,&(res->nb_candidates)
+				,res->selected
+				,&(res->nb_selected)
+				,b->nb_loops
+				,b->write_loops
+				);
+		res->ns = now_ns() - res->ns;
+		cop_salloc_restore(&(bt->mem), mem_reset);
+
+		cop_mutex_lock(&(b->lock));
+		nb_finished = ++b->nb_finished;
+		cop_mutex_unlock(&(b->lock));
+
+		if (res->err != NULL)
+			fprintf(stderr, "[%u/%u] %s: %s\n", nb_finished, b->files->nb_names, b->files->names[idx], res->err);
+		else
+			fprintf(stderr, "[%u/%u] %s: %u loops\n", nb_finished, b->files->nb_names, b->files->names[idx], res->nb_selected);
+	}
+
+	return NULL;
+}
+
+static void write_report(FILE *f, const struct file_list *files, const struct file_result *results)
+{
+	unsigned i, j;
+	fprintf(f, "file,status,candidates,loop,start,length,xc_db,pratio_db,mratio_db,ms\n");
+	for (i = 0; i < files->nb_names; i++) {
+		const struct file_result *r = &(results[i]);
+		if (r->err != NULL || r->nb_selected == 0) {
+			fprintf(f, "\"%s\",\"%s\",%u,,,,,,,%.1f\n", files->names[i], (r->err != NULL) ? r->err : "no loops", r->nb_candidates, r->ns / 1000000.0);
+			continue;
+		}
+		for (j = 0; j < r->nb_selected; j++) {
+			const struct loop_candidate *c = &(r->selected[j]);
+			fprintf(f, "\"%s\",\"ok\",%u,%u,%lu,%lu,%f,%f,%f,%.1f\n", files->names[i], r->nb_candidates, j, (unsigned long)c->start, (unsigned long)c->length, 10.0 * log10(c->xc), 10.0 * log10(c->pratio), 10.0 * log10(c->mratio), r->ns / 1000000.0);
+		}
+	}
+}
+
+static int
+run_batch
+	(const char            *directory
+	,const struct odfilter *filter
+	,unsigned               nb_threads
+	,unsigned               nb_loops
+	,int                    write_loops
+	,const char            *report_file
+	)
+{
+	struct file_list     files = {NULL, 0, 0};
+	struct batch         b;
+	struct batch_thread *threads;
+	unsigned             i, nb_started = 0;
+	unsigned             nb_failed = 0, nb_looped = 0;
+	uint_fast64_t        start_ns = now_ns();
+	FILE                *report;
+	int                  err = 0;
+
+	if (scan_directory(&files, directory)) {
+		fprintf(stderr, "out of memory\n");
+		err = -1;
+	} else if (files.nb_names == 0) {
+		fprintf(stderr, "no wave files found in '%s'\n", directory);
+		err = -1;
+	}
+
+	if (!err)
+		qsort(files.names, files.nb_names, sizeof(files.names[0]), compare_names);
+
+	b.files       = &files;
+	b.filter      = filter;
+	b.nb_loops    = nb_loops;
+	b.write_loops = write_loops;
+	b.next_file   = 0;
+	b.nb_finished = 0;
+	b.results     = NULL;
+	threads       = NULL;
+
+	if  (   !err
+	    &&  (   (b.results = calloc(files.nb_names, sizeof(b.results[0]))) == NULL
+	        ||  (threads = calloc(nb_threads, sizeof(threads[0]))) == NULL
+	        )
+	    ) {
+		fprintf(stderr, "out of memory\n");
+		err = -1;
+	}
+
+	if (!err && cop_mutex_create(&(b.lock))) {
+		fprintf(stderr, "could not create lock\n");
+		err = -1;
+	}
+
+	if (!err) {
+		/* Every thread gets its own arena and filter temporaries. The
+		 * filter kernel is read-only and is shared. */
+		for (nb_started = 0; nb_started < nb_threads; nb_started++) {
+			struct batch_thread *bt = &(threads[nb_started]);
+			bt->batch = &b;
+			if (cop_alloc_grp_temps_init(&(bt->mem_impl), &(bt->mem), 1024*1024*256, 1024*1024, 32))
+				break;
+			if  (   odfilter_init_temporaries(&(bt->filter_temps), &(bt->mem.iface), filter)
+			    ||  cop_thread_create(&(bt->thread), batch_thread_proc, bt, 0, 0)
+			    ) {
+				cop_alloc_grp_temps_free(&(bt->mem_impl));
+				break;
+			}
+		}
+
+		if (nb_started == 0) {
+			fprintf(stderr, "could not start any threads\n");
+			err = -1;
+		}
+
+		for (i = 0; i < nb_started; i++) {
+			cop_thread_join(threads[i].thread, NULL);
+			cop_alloc_grp_temps_free(&(threads[i].mem_impl));
+		}
+
+		cop_mutex_destroy(&(b.lock));
+	}
+
+	if (!err) {
+		for (i = 0; i < files.nb_names; i++) {
+			if (b.results[i].err != NULL)
+				nb_failed++;
+			else if (b.results[i].nb_selected)
+				nb_looped++;
+		}
+
+		report = (report_file != NULL) ? fopen(report_file, "w") : stdout;
+		if (report != NULL) {
+			write_report(report, &files, b.results);
+			if (report != stdout)
+				fclose(report);
+		} else {
+			fprintf(stderr, "could not create report '%s'\n", report_file);
+			err = -1;
+		}
+
+		{
+			double secs = (now_ns() - start_ns) / 1000000000.0;
+			fprintf
+				(stderr
+				,"%u files: %u %s, %u without loops, %u failed in %.2f s using %u threads (%.1f files/s)\n"
+				,files.nb_names
+				,nb_looped
+				,write_loops ? "written" : "looped"
+				,files.nb_names - nb_looped - nb_failed
+				,nb_failed
+				,secs
+				,nb_started
+				,(secs > 0.0) ? files.nb_names / secs : 0.0
+				);
+		}
+	}
+
+	free(threads);
+	free(b.results);
+	for (i = 0; i < files.nb_names; i++)
+		free(files.names[i]);
+	free(files.names);
+
+	return err;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: autoloop <file.wav>\n");
+	fprintf(stderr, "       autoloop --batch <directory> [options]\n");
+	fprintf(stderr, "batch options:\n");
+	fprintf(stderr, "  --threads <n>    number of worker threads (default %u, max 256)\n", BATCH_DEFAULT_THREADS);
+	fprintf(stderr, "  --loops <n>      number of loops to keep per file (default 1, max %u)\n", MAX_WRITE_LOOPS);
+	fprintf(stderr, "  --write          replace the loops in every file with the ones found\n");
+	fprintf(stderr, "  --report <file>  write the CSV report to a file instead of stdout\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct cop_salloc_iface     mem;
+	struct cop_alloc_grp_temps  mem_impl;
+	int                         err;
+	struct odfilter             filter;
+	struct odfilter_temporaries filter_temps;
+	struct fftset               fftset;
+	const char                 *batch_dir   = NULL;
+	const char                 *report_file = NULL;
+	const char                 *filename    = NULL;
+	unsigned                    nb_threads  = BATCH_DEFAULT_THREADS;
+	unsigned                    nb_loops    = 1;
+	int                         write_loops = 0;
+
+	argc--;
+	argv++;
+
+	while (argc > 0) {
+		const char *opt = *argv;
+		int         bad = 0;
+		if (!strcmp(*argv, "--batch") && argc > 1) {
+			argc--;
+			argv++;
+			batch_dir = *argv;
+		} else if (!strcmp(*argv, "--threads") && argc > 1) {
+			argc--;
+			argv++;
+			bad = parse_uint(*argv, 1, 256, &nb_threads);
+		} else if (!strcmp(*argv, "--loops") && argc > 1) {
+			argc--;
+			argv++;
+			bad = parse_uint(*argv, 1, MAX_WRITE_LOOPS, &nb_loops);
+		} else if (!strcmp(*argv, "--report") && argc > 1) {
+			argc--;
+			argv++;
+			report_file = *argv;
+		} else if (!strcmp(*argv, "--write")) {
+			write_loops = 1;
+		} else if (**argv != '-' && filename == NULL) {
+			filename = *argv;
+		} else {
+			usage();
+			return -1;
+		}
+		if (bad) {
+			fprintf(stderr, "bad value '%s' for %s\n", *argv, opt);
+			usage();
+			return -1;
+		}
+		argc--;
+		argv++;
+	}
+
+	if ((filename == NULL) == (batch_dir == NULL)) {
+		usage();
+		return -1;
+	}
+
+	if (cop_alloc_grp_temps_init(&mem_impl, &mem, 1024*1024*256, 1024*1024, 32)) {
+		fprintf(stderr, "out of memory.\n");
+		return -1;
+	}
+
+	if (fftset_init(&fftset)) {
+		cop_alloc_grp_temps_free(&mem_impl);
+		fprintf(stderr, "out of memory.\n");
+		return -1;
+	}
+
+	/* Build the long filter to get the envelope of the input. This is only
+	 * read after it has been built so every thread can share it. */
+	if  (   (odfilter_init_filter(&filter, &mem.iface, &fftset, LONG_WINDOW_LENGTH))
+		||  (odfilter_init_temporaries(&filter_temps, &mem.iface, &filter))
+		) {
+		fftset_destroy(&fftset);
+		cop_alloc_grp_temps_free(&mem_impl);
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+	odfilter_build_rect(&filter, &filter_temps, LONG_WINDOW_LENGTH, 1.0f);
+
+	if (batch_dir != NULL) {
+		err = run_batch(batch_dir, &filter, nb_threads, nb_loops, write_loops, report_file);
+	} else {
+		struct loop_candidate candidates[MAX_NB_XCDATA];
+		struct loop_candidate selected[MAX_WRITE_LOOPS];
+		unsigned              nb_candidates, nb_selected, i;
+		const char           *errstr;
+
+		errstr =
+			analyse_file
+				(filename
+				,&mem
+				,&filter
+				,&filter_temps
+				,candidates
+				,&nb_candidates
+				,selected
+				,&nb_selected
+				,write_loops ? nb_loops : 0
+				,write_loops
+				);
+
+		if (errstr != NULL) {
+			fprintf(stderr, "%s: %s\n", filename, errstr);
+			err = -1;
+		} else {
+			for (i = 0; i < nb_candidates; i++)
+				printf("%lu,%lu,%f,%f,%f\n", (unsigned long)candidates[i].start, (unsigned long)candidates[i].length, 10.0 * log10(candidates[i].xc), 10.0 * log10(candidates[i].pratio), 10.0 * log10(candidates[i].mratio));
+			err = 0;
+		}
+	}
 
 	fftset_destroy(&fftset);
 	cop_alloc_grp_temps_free(&mem_impl);
-	cop_filemap_close(&infile);
 
 	return err;
 }
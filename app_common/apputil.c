@@ -0,0 +1,73 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+#include <stdlib.h>
+#include "apputil.h"
+#include "cop/cop_alloc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define RNG_A0 (1u+4u*899809363u)
+
+uint_fast64_t now_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint_fast64_t)((count.QuadPart / freq.QuadPart) * 1000000000 + ((count.QuadPart % freq.QuadPart) * 1000000000) / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint_fast64_t)ts.tv_sec * 1000000000u + (uint_fast64_t)ts.tv_nsec;
+#endif
+}
+
+size_t pool_size(void)
+{
+	size_t sysmem = cop_memory_query_system_memory();
+	if (sysmem > 1024*(size_t)1024*1024) {
+		sysmem -= 256*(size_t)1024*1024;
+	} else {
+		sysmem = 3 * (sysmem / 4);
+	}
+	return sysmem;
+}
+
+int parse_uint(const char *s, unsigned min, unsigned max, unsigned *val)
+{
+	char *end;
+	unsigned long v = strtoul(s, &end, 10);
+	if (*s == '\0' || *end != '\0' || v < min || v > max)
+		return -1;
+	*val = (unsigned)v;
+	return 0;
+}
+
+uint_fast32_t rng_next(uint_fast32_t *rval)
+{
+	*rval = (*rval * RNG_A0 + 1) & 0xFFFFFFFF;
+	return *rval >> 16;
+}
@@ -0,0 +1,44 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef APPUTIL_H
+#define APPUTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Helpers shared by the applications and benchmarks. */
+
+/* Monotonic time in nanoseconds. */
+uint_fast64_t now_ns(void);
+
+/* Size of the memory pool to create for loading an organ. This is most of
+ * the memory in the system. */
+size_t pool_size(void);
+
+/* Parse a decimal command line value which must be between min and max
+ * (inclusive). Returns non-zero and leaves val alone if it is not. */
+int parse_uint(const char *s, unsigned min, unsigned max, unsigned *val);
+
+/* Linear congruential generator. Returns the next 16 random bits. */
+uint_fast32_t rng_next(uint_fast32_t *rval);
+
+#endif /* APPUTIL_H */
@@ -0,0 +1,57 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+#include <stdlib.h>
+#include "noisedata.h"
+#include "apputil.h"
+#include "opendiapason/src/decode_least16x2.h"
+
+size_t noise_data_size(unsigned bits, unsigned nb_frames)
+{
+	return (bits == 12) ? 3 * ((size_t)nb_frames + 2) : sizeof(int_least16_t) * 2 * (size_t)nb_frames;
+}
+
+void fill_noise_data(void *data, unsigned bits, unsigned nb_frames, uint_fast32_t *rval)
+{
+	unsigned j;
+	if (bits == 12) {
+		unsigned char *d = data;
+		for (j = 0; j < nb_frames; j++) {
+			int a = (int)(rng_next(rval) & 0xFFF) - 2048;
+			int b = (int)(rng_next(rval) & 0xFFF) - 2048;
+			encode2x12(d + 3 * j, a, b);
+		}
+		encode2x12(d + 3 * j, 0, 0);
+		encode2x12(d + 3 * j + 3, 0, 0);
+	} else {
+		int_least16_t *d = data;
+		for (j = 0; j < 2 * nb_frames; j++)
+			d[j] = (int_least16_t)((uint_least16_t)rng_next(rval));
+	}
+}
+
+void *make_noise_data(unsigned bits, unsigned nb_frames, uint_fast32_t *rval)
+{
+	void *data = malloc(noise_data_size(bits, nb_frames));
+	if (data != NULL)
+		fill_noise_data(data, bits, nb_frames, rval);
+	return data;
+}
@@ -0,0 +1,39 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef NOISEDATA_H
+#define NOISEDATA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Synthetic sample data for the decoder and engine benchmarks. The random
+ * numbers come from rng_next() in apputil.h. */
+
+/* Noise in the given decoder format (12 or 16 bits). 12-bit data gets two
+ * extra frames of silence on the end which the decoder is allowed to read,
+ * noise_data_size() includes these. make_noise_data() returns memory which
+ * must be released with free() or NULL on failure. */
+size_t noise_data_size(unsigned bits, unsigned nb_frames);
+void fill_noise_data(void *data, unsigned bits, unsigned nb_frames, uint_fast32_t *rval);
+void *make_noise_data(unsigned bits, unsigned nb_frames, uint_fast32_t *rval);
+
+#endif /* NOISEDATA_H */
@@ -0,0 +1,203 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "testorgan.h"
+
+/* I have been using samples from Pribac for testing. Each name corresponds to
+ * a sub-directory of where the build is made containing samples named in the
+ * usual way. The first number is the first MIDI note, the second is the
+ * number of pipe samples, the third is a mask of which MIDI channels activate
+ * samples, the final is the harmonic base pitch relative to 16. */
+const struct test_load_entry TEST_ENTRY_LIST[] =
+#if 1
+{	{"II Geigen Principal 8",      36, 51, SW,       2, '1', 48}
+,	{"II Portunal Flaut 8",        36, 51, SW,       2, '2', 49}
+,	{"II Flaut Major 8",           36, 51, SW,       2, '3', 50}
+,	{"II Salicet 8",               36, 51, SW,       2, '4', 51}
+,	{"II Viol-Principal 4",        36, 51, SW,       4, '5', 52}
+,	{"II Portunal Flaut 4",        36, 51, SW,       4, '6', 53}
+#if 1
+,	{"I Trompete 8",               36, 51, PED | GT, 2, 'a', 64}
+,	{"I Bordun 16",                36, 51, PED | GT, 1, 's', 65}
+,	{"I Principal 8",              36, 51, PED | GT, 2, 'd', 66}
+,	{"I Doppelrohrflote 8",        36, 51, PED | GT, 2, 'f', 67}
+,	{"I Gemshorn 8",               36, 51, PED | GT, 2, 'g', 68}
+,	{"I Viola di Gamba 8",         36, 51, PED | GT, 2, 'h', 69}
+,	{"I Octave 4",                 36, 51, PED | GT, 4, 'j', 70}
+,	{"I Quinte 2 23",              36, 51, PED | GT, 6, 'k', 71}
+,	{"I Octave 2",                 36, 51, PED | GT, 8, 'l', 72}
+,	{"I Mixtur 4 Fach",            36, 51, PED | GT, 2, ';', 73}
+,	{"P Posaune 16",               36, 27, PED,      1, 'z', 80}
+,	{"P Principalbass 16",         36, 27, PED,      1, 'x', 81}
+,	{"P Subbass 16",               36, 27, PED,      1, 'c', 82}
+,	{"P Violonbass 16",            36, 27, PED,      1, 'v', 83}
+,	{"P Octavbass 8",              36, 27, PED,      2, 'b', 84}
+,	{"P Flautbass 8",              36, 27, PED,      2, 'n', 85}
+#endif
+};
+#endif
+#if 0
+{	{"III Trompette Harmonique 8", 36, 53, SW,       2, '1', 48}
+,	{"III Hautbois 8",             36, 53, SW,       2, '2', 49}
+,	{"III Aeoline 8",              36, 53, SW,       2, '3', 50}
+,	{"III Bourdon 8",              36, 53, SW,       2, '4', 51}
+,	{"III Flute Traversiere 8",    36, 53, SW,       2, '5', 52}
+,	{"III Fugara 4",               36, 53, SW,       4, '6', 53}
+,	{"III Flute Octaviante 4",     36, 53, SW,       4, '7', 54}
+,	{"III Doublette 2",            36, 53, SW,       8, '8', 55}
+,	{"I Trompette 8",              36, 53, PED | GT, 2, 'a', 64}
+,	{"I Montre 8",                 36, 53, PED | GT, 2, 's', 65}
+,	{"I Bourdon 8",                36, 53, PED | GT, 2, 'd', 66}
+,	{"I Viole de Gambe 8",         36, 53, PED | GT, 2, 'f', 67}
+,	{"I Prestant 4",               36, 53, PED | GT, 4, 'g', 68}
+,	{"I Flute Douce 4",            36, 53, PED | GT, 4, 'h', 69}
+,	{"I Doublette 2",              36, 53, PED | GT, 8, 'j', 70}
+,	{"I Plein Jeu 5x",             36, 53, PED | GT, 2, 'k', 71}
+,	{"P Bombarde 16",              36, 27, PED,      1, 'z', 80}
+,	{"P Contrebasse 16",           36, 27, PED,      1, 'x', 81}
+,	{"P Soubasse 16",              36, 27, PED,      1, 'c', 82}
+,	{"P Violoncelle 8",            36, 27, PED,      2, 'v', 83}
+};
+#endif
+#if 0
+{	{"I Bordun 16",                36, 53, PED | GT,  1, 'a'}
+,	{"I Principal 8",              36, 53, PED | GT,  2, 's'}
+,	{"I Octave 4",                 36, 53, PED | GT,  4, 'd'}
+,	{"I Quinte 2 23",              36, 53, GT,        6, 'f'}
+,	{"I Octave 2",                 36, 53, PED | GT,  8, 'g'}
+,	{"I Mixtur 3f",                36, 53, PED | GT,  2, 'h'}
+,	{"P Posaune 16",               36, 27, PED,       1, 'z'}
+,	{"P Violon 16",                36, 27, PED,       1, 'x'}
+,	{"P Subbass 16",               36, 27, PED,       1, 'c'}
+,	{"P Octavbass 8",              36, 27, PED,       2, 'v'}
+,	{"P Bassflote 8",              36, 27, PED,       2, 'b'}
+,	{"II Viola di Gamba 8",        36, 53, SW,        2, '1'}
+,	{"II Gedact 8",                36, 53, SW,        2, '2'}
+,	{"II Geigen-principal 8",      36, 53, SW,        2, '3'}
+,	{"II Praestant 4",             36, 53, SW,        4, '4'}
+};
+#endif
+
+/* Fails to compile if NUM_TEST_ENTRY_LIST does not match the table. */
+typedef char test_entry_list_size_check[(sizeof(TEST_ENTRY_LIST) / sizeof(TEST_ENTRY_LIST[0]) == NUM_TEST_ENTRY_LIST) ? 1 : -1];
+
+struct pipe_executor *
+load_executors
+	(const char              *path
+	,unsigned                 first_midi
+	,unsigned                 nb_pipes
+	,unsigned                 harmonic16
+	,unsigned                 rank
+	,struct wavldr           *lset
+	,struct strset           *sset
+	,struct cop_alloc_iface  *allocator
+	)
+{
+	struct pipe_executor *pipes = malloc(sizeof(*pipes) * nb_pipes);
+	unsigned i;
+
+	if (pipes == NULL)
+		return NULL;
+
+	for (i = 0; i < nb_pipes; i++) {
+		static const char *NAMES[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+
+		struct sample_load_info *sli = wavldr_add_sample(lset);
+
+		if (sli == NULL) {
+			free(pipes);
+			return NULL;
+		}
+
+		pipes[i].instance     = NULL;
+		pipes[i].nb_insts     = 0;
+		pipes[i].enabled      = 0;
+		relstage_init(&pipes[i].release_stage);
+		pipes[i].target_freq  = ORGAN_PITCH16 * harmonic16 * pow(2.0, (i + first_midi - 36) / 12.0);
+		pipes[i].loaded       = 0;
+		sli->filenames[0]     = strset_sprintf(sset, "%s/A0/%03d-%s.wav", path, i + first_midi, NAMES[(i+first_midi)%12]);
+		sli->load_flags[0]    = SMPL_COMP_LOADFLAG_AS;
+		sli->filenames[1]     = strset_sprintf(sset, "%s/R0/%03d-%s.wav", path, i + first_midi, NAMES[(i+first_midi)%12]);
+		sli->load_flags[1]    = SMPL_COMP_LOADFLAG_R;
+		sli->filenames[2]     = strset_sprintf(sset, "%s/R1/%03d-%s.wav", path, i + first_midi, NAMES[(i+first_midi)%12]);
+		sli->load_flags[2]    = SMPL_COMP_LOADFLAG_R;
+		sli->filenames[3]     = strset_sprintf(sset, "%s/R2/%03d-%s.wav", path, i + first_midi, NAMES[(i+first_midi)%12]);
+		sli->load_flags[3]    = SMPL_COMP_LOADFLAG_R;
+		sli->num_files        = 4;
+		sli->harmonic_number  = harmonic16;
+		sli->load_format      = 16;
+		sli->dest             = &(pipes[i].data);
+		sli->group            = rank;
+		sli->allocator        = allocator;
+
+		if  (   sli->filenames[0] == NULL || sli->filenames[1] == NULL
+		    ||  sli->filenames[2] == NULL || sli->filenames[3] == NULL) {
+			free(pipes);
+			return NULL;
+		}
+	}
+
+	return pipes;
+}
+
+unsigned
+engine_callback
+	(void              *userdata
+	,struct dec_state **states
+	,unsigned           sigmask
+	,unsigned           old_flags
+	,unsigned           sampler_time
+	)
+{
+	struct pipe_executor *pd = userdata;
+
+	/* Initialize sample */
+	if (sigmask & 0x1) {
+		pd->data.attack.instantiate(states[0], &pd->data.attack, 0, 0);
+		states[0]->rate = (pd->target_freq * pd->data.sample_rate) * SMPL_POSITION_SCALE / (PLAYBACK_SAMPLE_RATE * pd->data.frequency) + 0.5;
+
+		/* Only state 0 is enabled and there are no termination conditions. */
+		old_flags = PLAYENG_PACK_CALLBACK_STATUS(0, 0x1, 0x0, 0x0);
+	}
+
+	/* End sample */
+	if (sigmask & 0x2) {
+		struct reltable_data rtd;
+		relstage_start(&pd->release_stage, &pd->data, states[1], states[0], &rtd);
+
+#if OPENDIAPASON_VERBOSE_DEBUG
+		printf("Release pos=(%u,%u),rgain=%f,xfade=%d,id=%d\n", rtd.pos_int, rtd.pos_frac, rtd.gain, rtd.crossfade, rtd.id);
+#endif
+
+		states[1]->rate = states[0]->rate;
+		states[0]->setfade(states[0], rtd.crossfade, 0.0f);
+
+		/* Both state 0 and state 1 are enabled.
+		 * State 0 terminates on fade completion.
+		 * State 1 terminates on entering of loop. */
+		old_flags = PLAYENG_PACK_CALLBACK_STATUS(0, 0x3, 0x1, 0x2);
+	}
+
+	return old_flags;
+}
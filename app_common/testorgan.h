@@ -0,0 +1,113 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef TESTORGAN_H
+#define TESTORGAN_H
+
+#include "opendiapason/src/wavldr.h"
+#include "opendiapason/src/playeng.h"
+#include "opendiapason/src/strset.h"
+#include "opendiapason/src/odatomic.h"
+#include "opendiapason/src/relstage.h"
+
+/* The test organ which is played by app_sampletest and rendered by
+ * app_midirender. Both need to agree on it exactly so that a render sounds
+ * like what is played. */
+
+/* This is high not because I am a deluded "audiophile". It is high, because
+ * it gives the playback system heaps of frequency headroom before aliasing
+ * occurs. The playback rate of a sample can be doubled before aliasing
+ * starts getting folded back down the spectrum.
+ *
+ * I am relying on the sound driver low-pass filtering this... which is
+ * probably a bad assumption. */
+#define PLAYBACK_SAMPLE_RATE (96000)
+
+struct pipe_executor {
+	struct pipe_v1           data;
+	struct playeng_instance *instance;
+	int                      nb_insts;
+	int                      enabled;
+	double                   target_freq;
+
+	/* Release decoders prepared when the note ends. */
+	struct relstage          release_stage;
+
+	/* Set by the loader once data can be used. */
+	odatomic_u32             loaded;
+};
+
+struct test_load_entry {
+	const char     *directory_name;
+	unsigned        first_midi;
+	unsigned        nb_pipes;
+	unsigned        midi_channel_mask;
+	unsigned        harmonic16;
+	int             shortcut;
+	unsigned        midi_shortcut;
+};
+
+#define GT_MIDICH  (0)
+#define SW_MIDICH  (1)
+#define PED_MIDICH (2)
+
+#define GT  (1 << GT_MIDICH)
+#define SW  (1 << SW_MIDICH)
+#define PED (1 << PED_MIDICH)
+
+/* This defines the playback rate of the whole organ. It is the pitch of
+ * bottom C of a 16-foot rank. Everything will be tuned to this. */
+#define ORGAN_PITCH16 (32.5)
+
+/* The ranks of the organ. shortcut is the keyboard character which draws the
+ * stop and midi_shortcut is the controller which draws it over MIDI. The
+ * number of entries is checked against the table in testorgan.c. */
+#define NUM_TEST_ENTRY_LIST (22)
+extern const struct test_load_entry TEST_ENTRY_LIST[];
+
+/* Allocate the executors for a rank and add its samples to the loader. The
+ * samples are put in the given group (which is the index of the rank) and
+ * are allocated from allocator (which may be NULL to use the loader
+ * default). Returns NULL on failure. Samples which were already added to the
+ * loader stay there, but the loader is no use once this has failed. */
+struct pipe_executor *
+load_executors
+	(const char              *path
+	,unsigned                 first_midi
+	,unsigned                 nb_pipes
+	,unsigned                 harmonic16
+	,unsigned                 rank
+	,struct wavldr           *lset
+	,struct strset           *sset
+	,struct cop_alloc_iface  *allocator
+	);
+
+/* Playback engine callback for a pipe. userdata is the pipe_executor. */
+unsigned
+engine_callback
+	(void              *userdata
+	,struct dec_state **states
+	,unsigned           sigmask
+	,unsigned           old_flags
+	,unsigned           sampler_time
+	);
+
+#endif /* TESTORGAN_H */
@@ -0,0 +1,531 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+/* Decoder microbenchmark.
+ *
+ * Runs the decoder kernels from decode_least16x2.h in isolation over
+ * synthetic sample data so that changes to them can be judged on numbers
+ * rather than on how the whole engine feels:
+ *
+ *   dec         - u16c2_dec() and u12c2_dec() at playback rates from 0.5x
+ *                 to 2x, with long, medium, short and multiple (randomly
+ *                 chosen) loops, with and without a fade in progress.
+ *   fade        - fade_process2() on its own, fading and not fading.
+ *   instantiate - uc2_instantiate() at random positions (16 and 12-bit).
+ *
+ * Each measurement is repeated and the fastest repeat is reported in
+ * nanoseconds per output frame (per call for instantiate). On Linux, --perf
+ * also reports cycles, instructions, cache misses and branch misses per
+ * thousand frames using perf_event_open() over all repeats. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "opendiapason/src/decode_least16x2.h"
+#include "opendiapason/app_common/apputil.h"
+#include "opendiapason/app_common/noisedata.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define DEFAULT_FRAMES  (1u << 20)
+#define DEFAULT_LENGTH  (1u << 20)
+#define DEFAULT_REPEATS (5)
+#define MAX_FRAMES      (1u << 30)
+#define MAX_LENGTH      (1u << 26)
+#define MAX_REPEATS     (1000)
+
+/* Output buffers are cleared this often (in calls) so that the sums the
+ * decoders accumulate into them stay small. */
+#define CLEAR_INTERVAL  (1024)
+
+/* Rates are fractions of SMPL_POSITION_SCALE. */
+static const double BENCH_RATES[] = {0.5, 0.7071, 1.0, 1.4142, 2.0};
+#define NB_BENCH_RATES (sizeof(BENCH_RATES) / sizeof(BENCH_RATES[0]))
+
+#define LOOP_LONG   (0) /* one loop over almost all of the data */
+#define LOOP_MEDIUM (1) /* one loop of 4096 frames at the end */
+#define LOOP_SHORT  (2) /* one loop of 256 frames at the end */
+#define LOOP_MULTI  (3) /* MAX_LOOP overlapping loops chosen at random */
+#define NB_LOOP_KINDS (4)
+
+static const char *const LOOP_NAMES[NB_LOOP_KINDS] = {"long", "medium", "short", "multi"};
+
+struct bench_config {
+	unsigned      nb_frames;
+	unsigned      length;
+	unsigned      nb_repeats;
+	int           perf;
+	const char   *filter;
+	FILE         *csv;
+};
+
+/* Hardware counters
+ * --------------------------------------------------------------------------- */
+
+#define COUNTER_CYCLES        (0)
+#define COUNTER_INSTRUCTIONS  (1)
+#define COUNTER_CACHE_MISSES  (2)
+#define COUNTER_BRANCH_MISSES (3)
+#define NB_COUNTERS           (4)
+
+static const char *const COUNTER_NAMES[NB_COUNTERS] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+
+struct perf_counters {
+	int           fds[NB_COUNTERS];
+	uint_fast64_t values[NB_COUNTERS];
+	int           valid[NB_COUNTERS];
+};
+
+static void counters_open(struct perf_counters *pc, int enable)
+{
+	unsigned i;
+	for (i = 0; i < NB_COUNTERS; i++) {
+		pc->fds[i]   = -1;
+		pc->valid[i] = 0;
+	}
+#ifdef __linux__
+	if (enable) {
+		static const uint64_t CONFIGS[NB_COUNTERS] =
+			{PERF_COUNT_HW_CPU_CYCLES
+			,PERF_COUNT_HW_INSTRUCTIONS
+			,PERF_COUNT_HW_CACHE_MISSES
+			,PERF_COUNT_HW_BRANCH_MISSES
+			};
+		for (i = 0; i < NB_COUNTERS; i++) {
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.type           = PERF_TYPE_HARDWARE;
+			attr.size           = sizeof(attr);
+			attr.config         = CONFIGS[i];
+			attr.disabled       = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv     = 1;
+			pc->fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+	}
+#else
+	(void)enable;
+#endif
+}
+
+static void counters_close(struct perf_counters *pc)
+{
+#ifdef __linux__
+	unsigned i;
+	for (i = 0; i < NB_COUNTERS; i++)
+		if (pc->fds[i] >= 0)
+			close(pc->fds[i]);
+#endif
+	(void)pc;
+}
+
+static void counters_start(struct perf_counters *pc)
+{
+#ifdef __linux__
+	unsigned i;
+	for (i = 0; i < NB_COUNTERS; i++) {
+		if (pc->fds[i] >= 0) {
+			ioctl(pc->fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(pc->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#endif
+	(void)pc;
+}
+
+static void counters_stop(struct perf_counters *pc)
+{
+	unsigned i;
+	for (i = 0; i < NB_COUNTERS; i++) {
+		pc->valid[i] = 0;
+#ifdef __linux__
+		if (pc->fds[i] >= 0) {
+			uint64_t v;
+			ioctl(pc->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+			if (read(pc->fds[i], &v, sizeof(v)) == sizeof(v)) {
+				pc->values[i] = v;
+				pc->valid[i]  = 1;
+			}
+		}
+#endif
+	}
+}
+
+/* Timing and reporting
+ * --------------------------------------------------------------------------- */
+
+/* Print a result line. best_ns is the fastest repeat of nb_units units and
+ * the counters (if any) were collected over all repeats. */
+static void
+report
+	(const struct bench_config  *cfg
+	,const char                 *kernel
+	,const char                 *format
+	,double                      rate
+	,const char                 *loop
+	,int                         fading
+	,uint_fast64_t               best_ns
+	,uint_fast64_t               nb_units
+	,const struct perf_counters *pc
+	)
+{
+	double   total = (double)nb_units * cfg->nb_repeats;
+	double   per_unit[NB_COUNTERS];
+	unsigned i;
+
+	for (i = 0; i < NB_COUNTERS; i++)
+		per_unit[i] = pc->valid[i] ? pc->values[i] * ((i >= COUNTER_CACHE_MISSES) ? 1000.0 : 1.0) / total : -1.0;
+
+	printf("%-12s %-4s %6.3f %-6s %-3s %9.3f ns", kernel, format, rate, loop, fading ? "yes" : "no", best_ns / (double)nb_units);
+	if (cfg->perf) {
+		for (i = 0; i < NB_COUNTERS; i++) {
+			if (per_unit[i] < 0.0)
+				printf("        n/a");
+			else
+				printf(" %10.3f", per_unit[i]);
+		}
+	}
+	printf("\n");
+
+	if (cfg->csv != NULL) {
+		fprintf(cfg->csv, "%s,%s,%.4f,%s,%d,%.4f", kernel, format, rate, loop, fading, best_ns / (double)nb_units);
+		for (i = 0; i < NB_COUNTERS; i++) {
+			if (per_unit[i] < 0.0)
+				fprintf(cfg->csv, ",");
+			else
+				fprintf(cfg->csv, ",%.4f", per_unit[i]);
+		}
+		fprintf(cfg->csv, "\n");
+	}
+}
+
+/* Synthetic samples
+ * --------------------------------------------------------------------------- */
+
+static void setup_sample(struct dec_smpl *smpl, const void *data, unsigned format, unsigned length, unsigned loop_kind)
+{
+	unsigned i;
+
+	memset(smpl, 0, sizeof(*smpl));
+	smpl->gain        = 1.0f / ((format == 12) ? 2048.0f : 32768.0f);
+	smpl->data        = data;
+	smpl->instantiate = (format == 12) ? u12c2_instantiate : u16c2_instantiate;
+
+	if (loop_kind == LOOP_MULTI) {
+		/* Loops end every 997 frames towards the end of the data and each
+		 * starts 3000 to 4500 frames before its end. Every start can jump
+		 * out at any end after it so the decoder picks one at random. */
+		smpl->nloop = MAX_LOOP;
+		for (i = 0; i < MAX_LOOP; i++) {
+			smpl->ends[i].end_smpl  = length - 1 - (MAX_LOOP - 1 - i) * 997;
+			smpl->ends[i].start_idx = i;
+			smpl->starts[i].start_smpl = smpl->ends[i].end_smpl - 3000 - i * 100;
+		}
+		for (i = 0; i < MAX_LOOP; i++) {
+			unsigned j = 0;
+			while (smpl->ends[j].end_smpl <= smpl->starts[i].start_smpl)
+				j++;
+			smpl->starts[i].first_valid_end = j;
+		}
+	} else {
+		static const unsigned LOOP_LENGTHS[] = {0, 4096, 256};
+		smpl->nloop                     = 1;
+		smpl->ends[0].end_smpl          = length - 1;
+		smpl->ends[0].start_idx         = 0;
+		smpl->starts[0].start_smpl      = (loop_kind == LOOP_LONG) ? 1999 : (length - LOOP_LENGTHS[loop_kind]);
+		smpl->starts[0].first_valid_end = 0;
+	}
+}
+
+/* Kernels
+ * --------------------------------------------------------------------------- */
+
+static void clear_output(float *COP_ATTR_RESTRICT *out)
+{
+	memset(out[0], 0, sizeof(float) * OUTPUT_SAMPLES);
+	memset(out[1], 0, sizeof(float) * OUTPUT_SAMPLES);
+}
+
+static void
+bench_decoder
+	(const struct bench_config *cfg
+	,const void                *data
+	,unsigned                   format
+	,double                     rate
+	,unsigned                   loop_kind
+	,int                        fading
+	)
+{
+	float VEC_ALIGN_BEST  left[OUTPUT_SAMPLES];
+	float VEC_ALIGN_BEST  right[OUTPUT_SAMPLES];
+	float                *out[2];
+	struct dec_smpl       smpl;
+	struct dec_state      st;
+	struct perf_counters  pc;
+	uint_fast64_t         best_ns = UINT64_MAX;
+	unsigned              nb_calls = cfg->nb_frames / OUTPUT_SAMPLES;
+	unsigned              r;
+
+	out[0] = left;
+	out[1] = right;
+	setup_sample(&smpl, data, format, cfg->length, loop_kind);
+	counters_open(&pc, cfg->perf);
+
+	for (r = 0; r < cfg->nb_repeats; r++) {
+		uint_fast64_t t0, t1;
+		unsigned      i;
+
+		smpl.instantiate(&st, &smpl, 0, 0);
+		st.rate = (uint_fast32_t)(rate * SMPL_POSITION_SCALE + 0.5);
+
+		/* A fade which lasts far longer than the measurement. */
+		if (fading)
+			st.setfade(&st, 0x7FFFFFF0u, 0.0f);
+		clear_output(out);
+
+		if (r == 0)
+			counters_start(&pc);
+		t0 = now_ns();
+		for (i = 0; i < nb_calls; i++) {
+			if (i % CLEAR_INTERVAL == CLEAR_INTERVAL - 1)
+				clear_output(out);
+			(void)st.decode(&st, out);
+		}
+		t1 = now_ns();
+		if (t1 - t0 < best_ns)
+			best_ns = t1 - t0;
+	}
+
+	counters_stop(&pc);
+	counters_close(&pc);
+	report(cfg, "dec", (format == 12) ? "u12" : "u16", rate, LOOP_NAMES[loop_kind], fading, best_ns, (uint_fast64_t)nb_calls * OUTPUT_SAMPLES, &pc);
+}
+
+static void bench_fade(const struct bench_config *cfg, int fading)
+{
+	float VEC_ALIGN_BEST  left[OUTPUT_SAMPLES];
+	float VEC_ALIGN_BEST  right[OUTPUT_SAMPLES];
+	float VEC_ALIGN_BEST  in[2*OUTPUT_SAMPLES];
+	float                *out[2];
+	struct fade_state     fs;
+	struct perf_counters  pc;
+	uint_fast64_t         best_ns = UINT64_MAX;
+	unsigned              nb_calls = cfg->nb_frames / OUTPUT_SAMPLES;
+	unsigned              r, i;
+	uint_fast32_t         rval = 1;
+
+	out[0] = left;
+	out[1] = right;
+	for (i = 0; i < 2*OUTPUT_SAMPLES; i++)
+		in[i] = ((int)rng_next(&rval) - 32768) * (1.0f / 32768.0f);
+	counters_open(&pc, cfg->perf);
+
+	for (r = 0; r < cfg->nb_repeats; r++) {
+		uint_fast64_t t0, t1;
+
+		memset(&fs, 0, sizeof(fs));
+		fade_configure(&fs, 0, 1.0f);
+		if (fading)
+			fade_configure(&fs, 0x7FFFFFF0u, 0.0f);
+		clear_output(out);
+
+		if (r == 0)
+			counters_start(&pc);
+		t0 = now_ns();
+		for (i = 0; i < nb_calls; i++) {
+			if (i % CLEAR_INTERVAL == CLEAR_INTERVAL - 1)
+				clear_output(out);
+			(void)fade_process2(&fs, out, in);
+		}
+		t1 = now_ns();
+		if (t1 - t0 < best_ns)
+			best_ns = t1 - t0;
+	}
+
+	counters_stop(&pc);
+	counters_close(&pc);
+	report(cfg, "fade", "-", 1.0, "-", fading, best_ns, (uint_fast64_t)nb_calls * OUTPUT_SAMPLES, &pc);
+}
+
+/* Instantiation pumps the interpolation filter with the frames before the
+ * start position, which is what a release does. Positions are random so the
+ * data is mostly not in cache, like a real release. */
+static void bench_instantiate(const struct bench_config *cfg, const void *data, unsigned format)
+{
+	struct dec_smpl       smpl;
+	struct dec_state      st;
+	struct perf_counters  pc;
+	uint_fast64_t         best_ns = UINT64_MAX;
+	unsigned              nb_calls = cfg->nb_frames / OUTPUT_SAMPLES;
+	unsigned              r;
+	volatile unsigned     sink = 0;
+
+	setup_sample(&smpl, data, format, cfg->length, LOOP_LONG);
+	counters_open(&pc, cfg->perf);
+
+	for (r = 0; r < cfg->nb_repeats; r++) {
+		uint_fast64_t t0, t1;
+		uint_fast32_t rval = 1;
+		unsigned      i;
+
+		if (r == 0)
+			counters_start(&pc);
+		t0 = now_ns();
+		for (i = 0; i < nb_calls; i++) {
+			uint_fast32_t pos = (uint_fast32_t)(((uint_fast64_t)((rng_next(&rval) << 16) | rng_next(&rval)) * (cfg->length - 1)) >> 32);
+			smpl.instantiate(&st, &smpl, pos, pos & (SMPL_POSITION_SCALE - 1));
+			sink += st.ipos;
+		}
+		t1 = now_ns();
+		if (t1 - t0 < best_ns)
+			best_ns = t1 - t0;
+	}
+
+	counters_stop(&pc);
+	counters_close(&pc);
+	report(cfg, "instantiate", (format == 12) ? "u12" : "u16", 0.0, "-", 0, best_ns, nb_calls, &pc);
+}
+
+static int selected(const struct bench_config *cfg, const char *kernel)
+{
+	return cfg->filter == NULL || strstr(kernel, cfg->filter) != NULL;
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr, "usage: decbench [options]\n");
+	fprintf(stderr, "  --frames <n>   output frames per measurement (default %u)\n", DEFAULT_FRAMES);
+	fprintf(stderr, "  --length <n>   frames of synthetic sample data (default %u)\n", DEFAULT_LENGTH);
+	fprintf(stderr, "  --repeats <n>  repeats of each measurement (default %u)\n", DEFAULT_REPEATS);
+	fprintf(stderr, "  --only <name>  only run kernels containing name (dec, fade, instantiate)\n");
+	fprintf(stderr, "  --perf         read hardware counters (Linux only)\n");
+	fprintf(stderr, "  --csv <file>   also write the results to a CSV file\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_config  cfg;
+	const char          *csv_file = NULL;
+	void                *data[2];
+	uint_fast32_t        rval = 1;
+	unsigned             f, i, l, fading;
+
+	cfg.nb_frames  = DEFAULT_FRAMES;
+	cfg.length     = DEFAULT_LENGTH;
+	cfg.nb_repeats = DEFAULT_REPEATS;
+	cfg.perf       = 0;
+	cfg.filter     = NULL;
+	cfg.csv        = NULL;
+
+	argc--;
+	argv++;
+	while (argc > 0) {
+		const char *opt = *argv;
+		int         bad = 0;
+		if (argc > 1 && !strcmp(*argv, "--frames")) {
+			argc--;
+			argv++;
+			bad = parse_uint(*argv, OUTPUT_SAMPLES, MAX_FRAMES, &cfg.nb_frames);
+		} else if (argc > 1 && !strcmp(*argv, "--length")) {
+			/* The multi-loop layout needs MAX_LOOP loops of up to 4500
+			 * frames. */
+			argc--;
+			argv++;
+			bad = parse_uint(*argv, 32768, MAX_LENGTH, &cfg.length);
+		} else if (argc > 1 && !strcmp(*argv, "--repeats")) {
+			argc--;
+			argv++;
+			bad = parse_uint(*argv, 1, MAX_REPEATS, &cfg.nb_repeats);
+		} else if (argc > 1 && !strcmp(*argv, "--only")) {
+			argc--;
+			argv++;
+			cfg.filter = *argv;
+		} else if (argc > 1 && !strcmp(*argv, "--csv")) {
+			argc--;
+			argv++;
+			csv_file = *argv;
+		} else if (!strcmp(*argv, "--perf")) {
+			cfg.perf = 1;
+		} else {
+			print_usage();
+			return -1;
+		}
+		if (bad) {
+			fprintf(stderr, "bad value '%s' for %s\n", *argv, opt);
+			return -1;
+		}
+		argc--;
+		argv++;
+	}
+
+	if (csv_file != NULL) {
+		if ((cfg.csv = fopen(csv_file, "w")) == NULL) {
+			fprintf(stderr, "could not open '%s'\n", csv_file);
+			return -1;
+		}
+		fprintf(cfg.csv, "kernel,format,rate,loop,fading,ns_per_unit");
+		for (i = 0; i < NB_COUNTERS; i++)
+			fprintf(cfg.csv, ",%s%s", COUNTER_NAMES[i], (i >= COUNTER_CACHE_MISSES) ? "_per_k" : "");
+		fprintf(cfg.csv, "\n");
+	}
+
+	data[0] = make_noise_data(16, cfg.length, &rval);
+	data[1] = make_noise_data(12, cfg.length, &rval);
+	if (data[0] == NULL || data[1] == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+
+	printf("%-12s %-4s %6s %-6s %-3s %12s", "kernel", "fmt", "rate", "loop", "fad", "time/unit");
+	if (cfg.perf) {
+		for (i = 0; i < NB_COUNTERS; i++)
+			printf(" %10.10s", COUNTER_NAMES[i]);
+		printf("\n(counters are per frame, misses per thousand frames; instantiate is per call)");
+	}
+	printf("\n");
+
+	if (selected(&cfg, "dec"))
+		for (f = 0; f < 2; f++)
+			for (l = 0; l < NB_LOOP_KINDS; l++)
+				for (i = 0; i < NB_BENCH_RATES; i++)
+					for (fading = 0; fading < 2; fading++)
+						bench_decoder(&cfg, data[f], f ? 12 : 16, BENCH_RATES[i], l, fading);
+
+	if (selected(&cfg, "fade"))
+		for (fading = 0; fading < 2; fading++)
+			bench_fade(&cfg, fading);
+
+	if (selected(&cfg, "instantiate"))
+		for (f = 0; f < 2; f++)
+			bench_instantiate(&cfg, data[f], f ? 12 : 16);
+
+	if (cfg.csv != NULL && fclose(cfg.csv) != 0)
+		fprintf(stderr, "could not write '%s'\n", csv_file);
+
+	free(data[0]);
+	free(data[1]);
+	return 0;
+}
@@ -0,0 +1,816 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+/* Differential checks for the decoders and the playback engine.
+ *
+ * Part one runs u16c2_dec() and u12c2_dec() side by side with a scalar,
+ * double-precision reference decoder written directly from the description
+ * of the decoder in decode_types.h. Every trial uses a random sample, loop
+ * table, start position, rate and fade schedule (all derived from the seed)
+ * and after every call checks that:
+ *
+ *   - the returned DEC_IS_LOOPING/DEC_IS_FADING flags are identical,
+ *   - ipos, fpos, the loop jump random state and the current loop end are
+ *     identical (i.e. the same loop jumps were taken),
+ *   - the audio which was summed into the output is within the tolerance of
+ *     the reference.
+ *
+ * Part two renders a fixed, seeded scene of notes and releases through
+ * playeng_process(). The render must be bit-identical when repeated, within
+ * the tolerance when rendered with a different number of threads and, if a
+ * golden file is given, within the tolerance of the golden render.
+ *
+ * Anything which wants to replace or restructure a decoder or the engine mix
+ * should leave this passing. The exit status is non-zero on any failure. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "opendiapason/src/decode_least16x2.h"
+#include "opendiapason/src/playeng.h"
+#include "opendiapason/app_common/apputil.h"
+#include "opendiapason/app_common/noisedata.h"
+
+#define DEFAULT_SEED       (1)
+#define DEFAULT_TRIALS     (500)
+#define DEFAULT_CALLS      (400)
+#define DEFAULT_TOLERANCE  (1e-4)
+#define DEFAULT_THREADS    (4)
+#define MAX_REPORTS        (10)
+#define MAX_TRIALS         (1000000)
+#define MAX_CALLS          (100000)
+#define MAX_THREADS        (64)
+
+/* Engine scene */
+#define SCENE_VOICES       (48)
+#define SCENE_BLOCK        (256)
+#define SCENE_FRAMES       (48000 * 4)
+#define SCENE_ATTACK_LEN   (24000)
+#define SCENE_RELEASE_LEN  (6000)
+
+#define GOLDEN_MAGIC       "ODGOLD01"
+#define GOLDEN_HEADER_SIZE (20)
+
+struct check_config {
+	uint_fast32_t  seed;
+	unsigned       nb_trials;
+	unsigned       nb_calls;
+	double         tolerance;
+	unsigned       nb_threads;
+	const char    *golden;
+	const char    *write_golden;
+	int            skip_decoders;
+	int            skip_engine;
+};
+
+/* Uniform in [0, n). */
+static unsigned rng_below(uint_fast32_t *rval, unsigned n)
+{
+	uint_fast32_t v = (rng_next(rval) << 16) | rng_next(rval);
+	return (unsigned)(((uint_fast64_t)v * n) >> 32);
+}
+
+/* Reference decoder
+ * ---------------------------------------------------------------------------
+ * Each output frame is the dot product of the last SMPL_INTERP_TAPS input
+ * frames (oldest first) with the row of SMPL_INTERP selected by the
+ * fractional position. After producing a frame the position advances by the
+ * rate and every whole input frame which is passed is pushed into the
+ * history. Pushing the frame at a loop end jumps to the start of that loop
+ * and picks the next loop end at random from the ends which the start may
+ * jump out of.
+ *
+ * A fade moves the gain linearly to the target in groups of FADE_VEC_LEN
+ * frames over at least the requested number of frames. */
+
+struct ref_fade {
+	double   start;
+	double   step;
+	unsigned nb_groups;
+	unsigned groups_done;
+	double   target;
+};
+
+struct ref_dec {
+	const struct dec_smpl *smpl;
+	unsigned               bits;
+	double                 hist[2][SMPL_INTERP_TAPS];
+	uint_fast32_t          ipos;
+	uint_fast32_t          fpos;
+	uint_fast32_t          rate;
+	uint_fast32_t          rndstate;
+	struct dec_loop_end    loopend;
+	struct ref_fade        fade;
+};
+
+static void ref_fetch(const struct ref_dec *ref, uint_fast32_t idx, double *l, double *r)
+{
+	if (ref->bits == 12) {
+		const unsigned char *p = (const unsigned char *)ref->smpl->data + 3 * idx;
+		long v = (long)p[0] | ((long)p[1] << 8) | ((long)p[2] << 16);
+		long a = (v >> 12) & 0xFFF;
+		long b = v & 0xFFF;
+		*l = (double)((a >= 2048) ? (a - 4096) : a);
+		*r = (double)((b >= 2048) ? (b - 4096) : b);
+	} else {
+		const int_least16_t *p = (const int_least16_t *)ref->smpl->data + 2 * idx;
+		*l = p[0];
+		*r = p[1];
+	}
+}
+
+static void ref_push(struct ref_dec *ref, double l, double r)
+{
+	unsigned i;
+	for (i = 0; i < SMPL_INTERP_TAPS - 1; i++) {
+		ref->hist[0][i] = ref->hist[0][i+1];
+		ref->hist[1][i] = ref->hist[1][i+1];
+	}
+	ref->hist[0][SMPL_INTERP_TAPS-1] = l;
+	ref->hist[1][SMPL_INTERP_TAPS-1] = r;
+}
+
+/* Gain applied to frame j (0 to FADE_VEC_LEN-1) of the next group. */
+static double ref_fade_gain(const struct ref_fade *fade, unsigned j)
+{
+	if (fade->groups_done >= fade->nb_groups)
+		return fade->target;
+	return fade->start + (FADE_VEC_LEN * fade->groups_done + j + 1) * fade->step;
+}
+
+static void ref_setfade(struct ref_dec *ref, unsigned target_samples, double gain)
+{
+	struct ref_fade *fade = &ref->fade;
+	gain *= ref->smpl->gain;
+	if (target_samples != 0) {
+		unsigned nb_groups = (target_samples + FADE_VEC_LEN - 1) / FADE_VEC_LEN;
+		fade->start        = ref_fade_gain(fade, FADE_VEC_LEN - 1);
+		fade->step         = (gain - fade->start) / (nb_groups * (double)FADE_VEC_LEN);
+		fade->nb_groups    = nb_groups;
+	} else {
+		fade->nb_groups    = 0;
+	}
+	fade->groups_done = 0;
+	fade->target      = gain;
+}
+
+static void ref_instantiate(struct ref_dec *ref, const struct dec_smpl *smpl, unsigned bits, uint_fast32_t ipos, uint_fast32_t fpos)
+{
+	uint_fast32_t i;
+	memset(ref, 0, sizeof(*ref));
+	ref->smpl             = smpl;
+	ref->bits             = bits;
+	ref->ipos             = ipos;
+	ref->fpos             = fpos;
+	ref->loopend          = smpl->ends[0];
+	ref->fade.nb_groups   = 0;
+	ref->fade.target      = smpl->gain;
+	for (i = (ipos > SMPL_INTERP_TAPS) ? (ipos - SMPL_INTERP_TAPS) : 0; i < ipos; i++) {
+		double l, r;
+		ref_fetch(ref, i, &l, &r);
+		ref_push(ref, l, r);
+	}
+}
+
+/* Sums OUTPUT_SAMPLES frames into out and returns the DEC_* flags. */
+static unsigned ref_decode(struct ref_dec *ref, double *out[2])
+{
+	const struct dec_smpl *smpl = ref->smpl;
+	unsigned               flags = 0;
+	unsigned               i;
+
+	for (i = 0; i < OUTPUT_SAMPLES; i++) {
+		const float *coefs = SMPL_INTERP[ref->fpos];
+		double       l = 0.0;
+		double       r = 0.0;
+		unsigned     k;
+
+		for (k = 0; k < SMPL_INTERP_TAPS; k++) {
+			l += ref->hist[0][k] * coefs[k];
+			r += ref->hist[1][k] * coefs[k];
+		}
+
+		out[0][i] += l * ref_fade_gain(&ref->fade, i % FADE_VEC_LEN);
+		out[1][i] += r * ref_fade_gain(&ref->fade, i % FADE_VEC_LEN);
+		if (i % FADE_VEC_LEN == FADE_VEC_LEN - 1 && ref->fade.groups_done < ref->fade.nb_groups)
+			ref->fade.groups_done++;
+
+		for (ref->fpos += ref->rate; ref->fpos >= SMPL_POSITION_SCALE; ref->fpos -= SMPL_POSITION_SCALE) {
+			double dl, dr;
+			ref_fetch(ref, ref->ipos, &dl, &dr);
+			ref_push(ref, dl, dr);
+			if (ref->ipos >= ref->loopend.end_smpl) {
+				const struct dec_loop_def *def = &smpl->starts[ref->loopend.start_idx];
+				ref->ipos     = def->start_smpl;
+				ref->rndstate = update_rnd(ref->rndstate);
+				ref->loopend  = smpl->ends[def->first_valid_end + ref->rndstate % (smpl->nloop - def->first_valid_end)];
+			} else {
+				ref->ipos++;
+			}
+		}
+	}
+
+	if (ref->ipos >= smpl->starts[ref->loopend.start_idx].start_smpl)
+		flags |= DEC_IS_LOOPING;
+	if (ref->fade.groups_done < ref->fade.nb_groups)
+		flags |= DEC_IS_FADING;
+	return flags;
+}
+
+/* Random samples
+ * --------------------------------------------------------------------------- */
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint_fast32_t x = *(const uint_fast32_t *)a;
+	uint_fast32_t y = *(const uint_fast32_t *)b;
+	return (x < y) ? -1 : (x > y);
+}
+
+/* Build a random, valid loop table. Loop ends are sorted and distinct.
+ * Start s is always before end s, each end jumps to a start which is before
+ * it and each start may jump out at any end after it. Roughly a quarter of
+ * the loops are very short to exercise several jumps per output frame. */
+static void make_loops(struct dec_smpl *smpl, unsigned length, uint_fast32_t *rval)
+{
+	uint_fast32_t ends[MAX_LOOP];
+	unsigned      nloop = 1 + rng_below(rval, MAX_LOOP);
+	unsigned      i, j;
+
+	for (i = 0; i < nloop; i++) {
+		do {
+			ends[i] = SMPL_INTERP_TAPS + 64 + rng_below(rval, length - SMPL_INTERP_TAPS - 64);
+			for (j = 0; j < i && ends[j] != ends[i]; j++);
+		} while (j < i);
+	}
+	qsort(ends, nloop, sizeof(ends[0]), compare_u32);
+
+	smpl->nloop = nloop;
+	for (i = 0; i < nloop; i++) {
+		unsigned len = (rng_below(rval, 4) == 0) ? (1 + rng_below(rval, 8)) : (1 + rng_below(rval, ends[i] - 1));
+		smpl->ends[i].end_smpl     = ends[i];
+		smpl->starts[i].start_smpl = ends[i] - len;
+	}
+	for (i = 0; i < nloop; i++) {
+		do {
+			j = rng_below(rval, i + 1);
+		} while (smpl->starts[j].start_smpl >= ends[i]);
+		smpl->ends[i].start_idx = j;
+		for (j = 0; ends[j] <= smpl->starts[i].start_smpl; j++);
+		smpl->starts[i].first_valid_end = j;
+	}
+}
+
+static uint_fast32_t random_rate(uint_fast32_t *rval)
+{
+	switch (rng_below(rval, 4)) {
+	case 0:  return SMPL_POSITION_SCALE;
+	case 1:  return SMPL_POSITION_SCALE / 2 + rng_below(rval, 3 * SMPL_POSITION_SCALE / 2 + 1);
+	case 2:  return 2 * SMPL_POSITION_SCALE;
+	default: return SMPL_POSITION_SCALE / 2 + rng_below(rval, 64);
+	}
+}
+
+/* Decoder checks
+ * --------------------------------------------------------------------------- */
+
+struct trial_stats {
+	double        max_error;
+	unsigned long nb_jumps;
+	unsigned long nb_fades;
+	unsigned long nb_failures;
+};
+
+static void
+report_failure
+	(struct trial_stats *stats
+	,unsigned            trial
+	,unsigned            bits
+	,unsigned            call
+	,const char         *what
+	,unsigned long       got
+	,unsigned long       expected
+	)
+{
+	if (stats->nb_failures++ < MAX_REPORTS)
+		fprintf(stderr, "trial %u (u%u), call %u: %s is %lu, expected %lu\n", trial, bits, call, what, got, expected);
+}
+
+/* Returns non-zero if the trial failed. */
+static int run_trial(const struct check_config *cfg, unsigned trial, struct trial_stats *stats)
+{
+	float VEC_ALIGN_BEST  left[OUTPUT_SAMPLES];
+	float VEC_ALIGN_BEST  right[OUTPUT_SAMPLES];
+	float                 before[2][OUTPUT_SAMPLES];
+	double                ref_left[OUTPUT_SAMPLES];
+	double                ref_right[OUTPUT_SAMPLES];
+	float                *out[2];
+	double               *ref_out[2];
+	struct dec_smpl       smpl;
+	struct dec_state      st;
+	struct ref_dec        ref;
+	uint_fast32_t         rval = cfg->seed * 7919u + trial;
+	unsigned long         failures = stats->nb_failures;
+	unsigned              bits, length, call, i;
+	uint_fast32_t         ipos, fpos;
+	void                 *data;
+
+	out[0]     = left;
+	out[1]     = right;
+	ref_out[0] = ref_left;
+	ref_out[1] = ref_right;
+
+	rng_next(&rval);
+	bits   = rng_below(&rval, 2) ? 12 : 16;
+	length = 512 + rng_below(&rval, 65536);
+	if ((data = make_noise_data(bits, length, &rval)) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	memset(&smpl, 0, sizeof(smpl));
+	smpl.gain        = (float)((0.25 + rng_below(&rval, 1024) / 1024.0) / ((bits == 12) ? 2048.0 : 32768.0));
+	smpl.data        = data;
+	smpl.instantiate = (bits == 12) ? u12c2_instantiate : u16c2_instantiate;
+	make_loops(&smpl, length, &rval);
+
+	/* Half of the trials start at the beginning like an attack, the others
+	 * somewhere before the first loop end like a release. */
+	if (rng_below(&rval, 2)) {
+		ipos = rng_below(&rval, smpl.ends[0].end_smpl + 1);
+		fpos = rng_below(&rval, SMPL_POSITION_SCALE);
+	} else {
+		ipos = 0;
+		fpos = 0;
+	}
+
+	smpl.instantiate(&st, &smpl, ipos, fpos);
+	ref_instantiate(&ref, &smpl, bits, ipos, fpos);
+	st.rate = ref.rate = random_rate(&rval);
+
+	for (call = 0; call < cfg->nb_calls; call++) {
+		unsigned flags, ref_flags;
+		uint_fast32_t old_rnd = ref.rndstate;
+
+		/* Fade schedule: start a fade on about one call in eight (sometimes
+		 * while another one is still running), occasionally jump straight
+		 * to a gain and very occasionally change the rate. */
+		switch (rng_below(&rval, 64)) {
+		case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 7:
+			{
+				unsigned target = 1 + rng_below(&rval, 8192);
+				float    gain   = rng_below(&rval, 1536) / 1024.0f;
+				st.setfade(&st, target, gain);
+				ref_setfade(&ref, target, gain);
+				stats->nb_fades++;
+			}
+			break;
+		case 8:
+			{
+				float gain = rng_below(&rval, 1536) / 1024.0f;
+				st.setfade(&st, 0, gain);
+				ref_setfade(&ref, 0, gain);
+			}
+			break;
+		case 9:
+			st.rate = ref.rate = random_rate(&rval);
+			break;
+		default:
+			break;
+		}
+
+		/* The decoders must sum into whatever is in the buffer. */
+		for (i = 0; i < OUTPUT_SAMPLES; i++) {
+			left[i]      = before[0][i] = ((int)rng_next(&rval) - 32768) / 32768.0f;
+			right[i]     = before[1][i] = ((int)rng_next(&rval) - 32768) / 32768.0f;
+			ref_left[i]  = 0.0;
+			ref_right[i] = 0.0;
+		}
+
+		flags     = st.decode(&st, out);
+		ref_flags = ref_decode(&ref, ref_out);
+
+		if (ref.rndstate != old_rnd)
+			stats->nb_jumps++;
+
+		if (flags != ref_flags)
+			report_failure(stats, trial, bits, call, "flags", flags, ref_flags);
+		if (st.ipos != ref.ipos)
+			report_failure(stats, trial, bits, call, "ipos", (unsigned long)st.ipos, (unsigned long)ref.ipos);
+		if (st.fpos != ref.fpos)
+			report_failure(stats, trial, bits, call, "fpos", (unsigned long)st.fpos, (unsigned long)ref.fpos);
+		if (st.s.uncms.rndstate != ref.rndstate)
+			report_failure(stats, trial, bits, call, "rndstate", (unsigned long)st.s.uncms.rndstate, (unsigned long)ref.rndstate);
+		if (st.s.uncms.loopend.end_smpl != ref.loopend.end_smpl)
+			report_failure(stats, trial, bits, call, "loop end", (unsigned long)st.s.uncms.loopend.end_smpl, (unsigned long)ref.loopend.end_smpl);
+
+		for (i = 0; i < OUTPUT_SAMPLES; i++) {
+			double el = fabs((double)left[i] - before[0][i] - ref_left[i]);
+			double er = fabs((double)right[i] - before[1][i] - ref_right[i]);
+			double e  = (el > er) ? el : er;
+			if (e > stats->max_error)
+				stats->max_error = e;
+			if (e > cfg->tolerance) {
+				if (stats->nb_failures++ < MAX_REPORTS)
+					fprintf(stderr, "trial %u (u%u), call %u, frame %u: error %g exceeds tolerance\n", trial, bits, call, i, e);
+				break;
+			}
+		}
+
+		/* Once the positions have diverged, everything after is noise. */
+		if (stats->nb_failures != failures)
+			break;
+	}
+
+	free(data);
+	return stats->nb_failures != failures;
+}
+
+static int check_decoders(const struct check_config *cfg)
+{
+	struct trial_stats stats;
+	unsigned           trial;
+	unsigned           failed = 0;
+
+	memset(&stats, 0, sizeof(stats));
+	for (trial = 0; trial < cfg->nb_trials; trial++)
+		failed += run_trial(cfg, trial, &stats) != 0;
+
+	printf
+		("decoders: %u/%u trials passed, %lu calls with loop jumps, %lu fades, max error %.3g (tolerance %.3g)\n"
+		,cfg->nb_trials - failed
+		,cfg->nb_trials
+		,stats.nb_jumps
+		,stats.nb_fades
+		,stats.max_error
+		,cfg->tolerance
+		);
+	return failed != 0;
+}
+
+/* Engine checks
+ * --------------------------------------------------------------------------- */
+
+struct scene_voice {
+	struct dec_smpl          attack;
+	struct dec_smpl          release;
+	unsigned                 rate;
+	struct playeng_instance *instance;
+};
+
+static
+unsigned
+engine_callback
+	(void              *userdata
+	,struct dec_state **states
+	,unsigned           sigmask
+	,unsigned           old_flags
+	,unsigned           sampler_time
+	)
+{
+	struct scene_voice *pd = userdata;
+
+	if (sigmask & 0x1) {
+		pd->attack.instantiate(states[0], &pd->attack, 0, 0);
+		states[0]->rate = pd->rate;
+		old_flags = PLAYENG_PACK_CALLBACK_STATUS(0, 0x1, 0x0, 0x0);
+	}
+
+	if (sigmask & 0x2) {
+		pd->release.instantiate(states[1], &pd->release, 0, 0);
+		states[1]->rate = states[0]->rate;
+		states[1]->setfade(states[1], 0, 0.0f);
+		states[1]->setfade(states[1], 1024, 1.0f);
+		states[0]->setfade(states[0], 1024, 0.0f);
+		old_flags = PLAYENG_PACK_CALLBACK_STATUS(0, 0x3, 0x1, 0x2);
+	}
+
+	return old_flags;
+}
+
+static void setup_scene_sample(struct dec_smpl *smpl, const void *data, unsigned bits, unsigned length, unsigned loop_start)
+{
+	memset(smpl, 0, sizeof(*smpl));
+	smpl->gain                      = (float)(1.0 / (((bits == 12) ? 2048.0 : 32768.0) * 8.0));
+	smpl->nloop                     = 1;
+	smpl->starts[0].start_smpl      = loop_start;
+	smpl->starts[0].first_valid_end = 0;
+	smpl->ends[0].end_smpl          = length - 1;
+	smpl->ends[0].start_idx         = 0;
+	smpl->data                      = data;
+	smpl->instantiate               = (bits == 12) ? u12c2_instantiate : u16c2_instantiate;
+}
+
+/* Render the scene into out (SCENE_FRAMES interleaved stereo frames). All
+ * samples, rates and events come from the seed. Returns non-zero on error. */
+static int render_scene(uint_fast32_t seed, unsigned nb_threads, float *out)
+{
+	struct scene_voice  voices[SCENE_VOICES];
+	void               *data[2*SCENE_VOICES];
+	struct playeng     *eng;
+	uint_fast32_t       rval = seed;
+	unsigned            i, frame;
+	int                 err = 0;
+
+	if ((eng = playeng_init(4 * SCENE_VOICES, 2, nb_threads)) == NULL)
+		return 1;
+
+	for (i = 0; i < SCENE_VOICES; i++) {
+		unsigned bits = (i & 1) ? 12 : 16;
+		data[2*i+0] = make_noise_data(bits, SCENE_ATTACK_LEN, &rval);
+		data[2*i+1] = make_noise_data(bits, SCENE_RELEASE_LEN, &rval);
+		if (data[2*i+0] == NULL || data[2*i+1] == NULL)
+			err = 1;
+		setup_scene_sample(&voices[i].attack, data[2*i+0], bits, SCENE_ATTACK_LEN, 1999 + rng_below(&rval, 4000));
+		setup_scene_sample(&voices[i].release, data[2*i+1], bits, SCENE_RELEASE_LEN, SCENE_RELEASE_LEN - 128);
+		voices[i].rate     = random_rate(&rval);
+		voices[i].instance = NULL;
+	}
+
+	for (frame = 0; !err && frame < SCENE_FRAMES; frame += SCENE_BLOCK) {
+		/* About two note events per block. Ringing releases keep going after
+		 * the voice is restarted, so the engine sees plenty of overlap. */
+		unsigned nb_events = rng_below(&rval, 5);
+		while (nb_events--) {
+			struct scene_voice *pd = &voices[rng_below(&rval, SCENE_VOICES)];
+			if (pd->instance != NULL) {
+				playeng_signal_instance(eng, pd->instance, 0x02);
+				pd->instance = NULL;
+			} else {
+				pd->instance = playeng_insert(eng, 2, 1, engine_callback, pd);
+			}
+		}
+		playeng_process(eng, out + 2 * frame, 2, SCENE_BLOCK);
+	}
+
+	playeng_destroy(eng);
+	for (i = 0; i < 2*SCENE_VOICES; i++)
+		free(data[i]);
+	return err;
+}
+
+static double max_difference(const float *a, const float *b, size_t nb_samples)
+{
+	double max = 0.0;
+	size_t i;
+	for (i = 0; i < nb_samples; i++) {
+		double d = fabs((double)a[i] - b[i]);
+		if (d > max)
+			max = d;
+	}
+	return max;
+}
+
+static uint_fast32_t render_hash(const float *buf, size_t nb_samples)
+{
+	uint_fast32_t h = 2166136261u;
+	size_t        i;
+	for (i = 0; i < nb_samples; i++) {
+		union { float f; uint32_t u; } v;
+		unsigned j;
+		v.f = buf[i];
+		for (j = 0; j < 4; j++)
+			h = ((h ^ ((v.u >> (8 * j)) & 0xFF)) * 16777619u) & 0xFFFFFFFFu;
+	}
+	return h;
+}
+
+/* Golden files hold an 8 byte magic, the seed, the channel count and the
+ * frame count (little-endian 32-bit) followed by the interleaved render as
+ * little-endian IEEE floats. */
+static int write_golden(const char *filename, uint_fast32_t seed, const float *buf)
+{
+	unsigned char header[GOLDEN_HEADER_SIZE];
+	FILE         *f;
+	size_t        i;
+	int           err = 0;
+
+	if ((f = fopen(filename, "wb")) == NULL)
+		return 1;
+	memcpy(header, GOLDEN_MAGIC, 8);
+	cop_st_ule32(header + 8, seed);
+	cop_st_ule32(header + 12, 2);
+	cop_st_ule32(header + 16, SCENE_FRAMES);
+	err = fwrite(header, 1, GOLDEN_HEADER_SIZE, f) != GOLDEN_HEADER_SIZE;
+	for (i = 0; !err && i < 2 * (size_t)SCENE_FRAMES; i++) {
+		union { float f; uint32_t u; } v;
+		unsigned char b[4];
+		v.f = buf[i];
+		cop_st_ule32(b, v.u);
+		err = fwrite(b, 1, 4, f) != 4;
+	}
+	if (fclose(f))
+		err = 1;
+	return err;
+}
+
+static const char *read_golden(const char *filename, uint_fast32_t seed, float *buf)
+{
+	unsigned char header[GOLDEN_HEADER_SIZE];
+	const char   *err = NULL;
+	FILE         *f;
+	size_t        i;
+
+	if ((f = fopen(filename, "rb")) == NULL)
+		return "could not open golden file";
+	if (fread(header, 1, GOLDEN_HEADER_SIZE, f) != GOLDEN_HEADER_SIZE || memcmp(header, GOLDEN_MAGIC, 8))
+		err = "not a golden file";
+	else if (cop_ld_ule32(header + 8) != seed)
+		err = "golden file was rendered with a different seed";
+	else if (cop_ld_ule32(header + 12) != 2 || cop_ld_ule32(header + 16) != SCENE_FRAMES)
+		err = "golden file has a different length";
+	for (i = 0; err == NULL && i < 2 * (size_t)SCENE_FRAMES; i++) {
+		union { float f; uint32_t u; } v;
+		unsigned char b[4];
+		if (fread(b, 1, 4, f) != 4) {
+			err = "golden file is truncated";
+		} else {
+			v.u    = cop_ld_ule32(b);
+			buf[i] = v.f;
+		}
+	}
+	fclose(f);
+	return err;
+}
+
+static int check_engine(const struct check_config *cfg)
+{
+	size_t  nb_samples = 2 * (size_t)SCENE_FRAMES;
+	float  *single     = malloc(sizeof(float) * nb_samples);
+	float  *other      = malloc(sizeof(float) * nb_samples);
+	double  diff;
+	int     failed     = 0;
+
+	if (single == NULL || other == NULL) {
+		fprintf(stderr, "out of memory\n");
+		free(single);
+		free(other);
+		return 1;
+	}
+
+	if (render_scene(cfg->seed, 1, single) || render_scene(cfg->seed, 1, other)) {
+		fprintf(stderr, "could not render the engine scene\n");
+		failed = 1;
+	} else {
+		printf("engine: render hash %08lx\n", (unsigned long)render_hash(single, nb_samples));
+
+		if (memcmp(single, other, sizeof(float) * nb_samples)) {
+			printf("engine: FAILED repeated render is not bit-identical (max difference %.3g)\n", max_difference(single, other, nb_samples));
+			failed = 1;
+		} else {
+			printf("engine: repeated render is bit-identical\n");
+		}
+
+		if (cfg->nb_threads > 1) {
+			if (render_scene(cfg->seed, cfg->nb_threads, other)) {
+				fprintf(stderr, "could not render the engine scene\n");
+				failed = 1;
+			} else if ((diff = max_difference(single, other, nb_samples)) > cfg->tolerance) {
+				printf("engine: FAILED %u thread render differs by %.3g\n", cfg->nb_threads, diff);
+				failed = 1;
+			} else {
+				printf("engine: %u thread render within %.3g\n", cfg->nb_threads, diff);
+			}
+		}
+
+		if (cfg->golden != NULL) {
+			const char *err = read_golden(cfg->golden, cfg->seed, other);
+			if (err != NULL) {
+				printf("engine: FAILED %s\n", err);
+				failed = 1;
+			} else if ((diff = max_difference(single, other, nb_samples)) > cfg->tolerance) {
+				printf("engine: FAILED golden render differs by %.3g\n", diff);
+				failed = 1;
+			} else {
+				printf("engine: golden render within %.3g\n", diff);
+			}
+		}
+
+		if (cfg->write_golden != NULL) {
+			if (write_golden(cfg->write_golden, cfg->seed, single)) {
+				fprintf(stderr, "could not write '%s'\n", cfg->write_golden);
+				failed = 1;
+			} else {
+				printf("engine: wrote golden render to '%s'\n", cfg->write_golden);
+			}
+		}
+	}
+
+	free(single);
+	free(other);
+	return failed;
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr, "usage: deccheck [options]\n");
+	fprintf(stderr, "  --seed <n>            seed for everything (default %u)\n", DEFAULT_SEED);
+	fprintf(stderr, "  --trials <n>          random decoder trials (default %u, max %u)\n", DEFAULT_TRIALS, MAX_TRIALS);
+	fprintf(stderr, "  --calls <n>           decode calls per trial (default %u, max %u)\n", DEFAULT_CALLS, MAX_CALLS);
+	fprintf(stderr, "  --tolerance <x>       largest allowed absolute error (default %g)\n", DEFAULT_TOLERANCE);
+	fprintf(stderr, "  --threads <n>         threads for the engine comparison render (default %u, max %u)\n", DEFAULT_THREADS, MAX_THREADS);
+	fprintf(stderr, "  --golden <file>       compare the engine render with a golden file\n");
+	fprintf(stderr, "  --write-golden <file> write the engine render as a golden file\n");
+	fprintf(stderr, "  --no-decoders         skip the decoder checks\n");
+	fprintf(stderr, "  --no-engine           skip the engine checks\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct check_config cfg;
+	int                 failed = 0;
+
+	cfg.seed          = DEFAULT_SEED;
+	cfg.nb_trials     = DEFAULT_TRIALS;
+	cfg.nb_calls      = DEFAULT_CALLS;
+	cfg.tolerance     = DEFAULT_TOLERANCE;
+	cfg.nb_threads    = DEFAULT_THREADS;
+	cfg.golden        = NULL;
+	cfg.write_golden  = NULL;
+	cfg.skip_decoders = 0;
+	cfg.skip_engine   = 0;
+
+	argc--;
+	argv++;
+	while (argc > 0) {
+		const char *opt = *argv;
+		int         bad = 0;
+		if (argc > 1 && !strcmp(*argv, "--seed")) {
+			unsigned seed;
+			argc--;
+			argv++;
+			if ((bad = parse_uint(*argv, 0, 0xFFFFFFFFu, &seed)) == 0)
+				cfg.seed = seed;
+		} else if (argc > 1 && !strcmp(*argv, "--trials")) {
+			argc--;
+			argv++;
+			bad = parse_uint(*argv, 1, MAX_TRIALS, &cfg.nb_trials);
+		} else if (argc > 1 && !strcmp(*argv, "--calls")) {
+			argc--;
+			argv++;
+			bad = parse_uint(*argv, 1, MAX_CALLS, &cfg.nb_calls);
+		} else if (argc > 1 && !strcmp(*argv, "--tolerance")) {
+			argc--;
+			argv++;
+			cfg.tolerance = atof(*argv);
+		} else if (argc > 1 && !strcmp(*argv, "--threads")) {
+			argc--;
+			argv++;
+			bad = parse_uint(*argv, 1, MAX_THREADS, &cfg.nb_threads);
+		} else if (argc > 1 && !strcmp(*argv, "--golden")) {
+			argc--;
+			argv++;
+			cfg.golden = *argv;
+		} else if (argc > 1 && !strcmp(*argv, "--write-golden")) {
+			argc--;
+			argv++;
+			cfg.write_golden = *argv;
+		} else if (!strcmp(*argv, "--no-decoders")) {
+			cfg.skip_decoders = 1;
+		} else if (!strcmp(*argv, "--no-engine")) {
+			cfg.skip_engine = 1;
+		} else {
+			print_usage();
+			return -1;
+		}
+		if (bad) {
+			fprintf(stderr, "bad value '%s' for %s\n", *argv, opt);
+			print_usage();
+			return -1;
+		}
+		argc--;
+		argv++;
+	}
+
+	if (!(cfg.tolerance >= 0.0)) {
+		print_usage();
+		return -1;
+	}
+
+	if (!cfg.skip_decoders)
+		failed |= check_decoders(&cfg);
+	if (!cfg.skip_engine)
+		failed |= check_engine(&cfg);
+
+	printf("%s\n", failed ? "FAILED" : "passed");
+	return failed ? 1 : 0;
+}
@@ -1,47 +1,85 @@
-#include <time.h>
 #include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "opendiapason/src/playeng.h"
 #include "opendiapason/src/decode_least16x2.h"
 #include "cop/cop_alloc.h"
-#ifndef WIN32
-#include <sys/time.h>
-#else
-#include <windows.h>
-#endif
-
-/* Current performance measurements
-
-53*4 consecutive samples
-
-1734229536 TICKS
-1766864469 TICKS
-
-2 threads
-1481126398 TICKS
-1471865085 TICKS
-
-3 threads
-1317146429 TICKS
-1306609837 TICKS
-
-4 threads
-1208621317 TICKS
-1204731602 TICKS
-
-*/
-
-/* We will play back this many samples at the same time. */
-#define NB_SAMPLES (256)
+#include "opendiapason/app_common/apputil.h"
+#include "opendiapason/app_common/noisedata.h"
+
+/* Engine benchmark.
+ *
+ * Plays back a number of synthetic looped voices through the playback engine
+ * and times every call to playeng_process(). Each run renders some audio to
+ * warm up (caches, thread wake-ups, page faults) and then renders the
+ * measured length several times. Every repeat reports throughput as a
+ * real-time factor and the p50/p99/max latency of a call, which is what
+ * matters for an audio callback. Calls which take longer than the audio they
+ * produce are counted as late.
+ *
+ * Churn starts new notes at the given rate (per second of audio). Each new
+ * note releases whatever the voice it lands on was playing, so the engine
+ * sees a steady stream of insertions, releases and retirements on top of
+ * the sustained voices. */
+
+/* Voices share this many distinct sets of sample data between them. */
+#define MAX_DISTINCT_SAMPLES (256)
+
+/* Length of the synthetic attack (which loops) and release. */
+#define ATTACK_LEN  (48000)
+#define RELEASE_LEN (48128)
+
+#define DEFAULT_VOICES      (256)
+#define DEFAULT_THREADS     (4)
+#define DEFAULT_BLOCK       (64)
+#define DEFAULT_SAMPLE_RATE (96000)
+#define DEFAULT_WARMUP_MS   (500)
+#define DEFAULT_LENGTH_MS   (2000)
+#define DEFAULT_REPEATS     (5)
+#define MAX_REPEATS         (100)
+
+/* Distributions of playback rates given to the voices. */
+#define RATES_FIXED  (0) /* every voice plays at its recorded pitch */
+#define RATES_NARROW (1) /* uniform between 0.75 and 1.25 */
+#define RATES_WIDE   (2) /* log-uniform between 0.5 and 2 */
 
 struct pipe_executor {
 	struct dec_smpl          attack;
 	struct dec_smpl          release;
 	unsigned                 rate;
 	struct playeng_instance *instance;
-	int                      nb_insts;
 };
 
+struct bench_config {
+	unsigned                 nb_voices;
+	unsigned                 nb_threads;
+	unsigned                 block;
+	unsigned                 format;
+	unsigned                 rates;
+	double                   churn;
+	unsigned                 sample_rate;
+	unsigned                 warmup_ms;
+	unsigned                 length_ms;
+	unsigned                 nb_repeats;
+};
+
+struct bench_result {
+	uint_fast64_t            frames;
+	uint_fast64_t            wall_ns;
+	uint_fast64_t            p50_ns;
+	uint_fast64_t            p99_ns;
+	uint_fast64_t            max_ns;
+	unsigned long            late_blocks;
+	unsigned long            notes_started;
+	unsigned long            notes_dropped;
+};
+
+static const char *rates_name(unsigned rates)
+{
+	return (rates == RATES_FIXED) ? "fixed" : ((rates == RATES_NARROW) ? "narrow" : "wide");
+}
+
 static
 unsigned
 engine_callback
@@ -81,122 +119,355 @@ engine_callback
 	return old_flags;
 }
 
-#define RNG_A0 (1u+4u*899809363u)
-#define PROCESS_ITERATIONS (7500)
-#define PROCESS_BUFFER_SIZE (64)
+/* Fill a sample with noise in the requested format. */
+static void *make_sample_data(struct cop_salloc_iface *mem, unsigned format, unsigned nb_frames, uint_fast32_t *rval)
+{
+	void *data = cop_salloc(mem, noise_data_size(format, nb_frames), 0);
+	if (data != NULL)
+		fill_noise_data(data, format, nb_frames, rval);
+	return data;
+}
+
+static void
+setup_sample
+	(struct dec_smpl *smpl
+	,const void      *data
+	,unsigned         format
+	,unsigned         length
+	,unsigned         loop_start
+	,unsigned         nb_voices
+	)
+{
+	smpl->gain                       = 1.0 / (((format == 12) ? 2048.0 : 32768.0) * sqrt(nb_voices));
+	smpl->nloop                      = 1;
+	smpl->starts[0].start_smpl       = loop_start;
+	smpl->starts[0].first_valid_end  = 0;
+	smpl->ends[0].end_smpl           = length - 1;
+	smpl->ends[0].start_idx          = 0;
+	smpl->data                       = data;
+	smpl->instantiate                = (format == 12) ? u12c2_instantiate : u16c2_instantiate;
+}
+
+static unsigned pick_rate(unsigned rates, uint_fast32_t *rval)
+{
+	double u = rng_next(rval) / 65536.0;
+	if (rates == RATES_NARROW)
+		return (unsigned)(SMPL_POSITION_SCALE * (0.75 + 0.5 * u));
+	if (rates == RATES_WIDE)
+		return (unsigned)(SMPL_POSITION_SCALE * pow(2.0, 2.0 * u - 1.0));
+	return SMPL_POSITION_SCALE;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+	uint_fast64_t x = *(const uint_fast64_t *)a;
+	uint_fast64_t y = *(const uint_fast64_t *)b;
+	return (x < y) ? -1 : (x > y);
+}
+
+/* Render nb_blocks blocks applying churn before each. If latencies is not
+ * NULL, the duration of every call to playeng_process() is stored in it. */
+static void
+run_blocks
+	(struct playeng             *eng
+	,const struct bench_config  *cfg
+	,struct pipe_executor       *voices
+	,float                      *buf
+	,unsigned long               nb_blocks
+	,uint_fast64_t              *latencies
+	,struct bench_result        *res
+	,double                     *churn_acc
+	,uint_fast32_t              *rval
+	)
+{
+	double        churn_per_block = cfg->churn * cfg->block / cfg->sample_rate;
+	unsigned long i;
+
+	for (i = 0; i < nb_blocks; i++) {
+		uint_fast64_t t0;
+
+		*churn_acc += churn_per_block;
+		while (*churn_acc >= 1.0) {
+			struct pipe_executor *pd = &voices[(rng_next(rval) * cfg->nb_voices) >> 16];
+			if (pd->instance != NULL)
+				playeng_signal_instance(eng, pd->instance, 0x02);
+			if ((pd->instance = playeng_insert(eng, 2, 1, engine_callback, pd)) == NULL)
+				res->notes_dropped++;
+			else
+				res->notes_started++;
+			*churn_acc -= 1.0;
+		}
+
+		t0 = now_ns();
+		playeng_process(eng, buf, 2, cfg->block);
+		if (latencies != NULL)
+			latencies[i] = now_ns() - t0;
+	}
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr, "usage: engprofile [options]\n");
+	fprintf(stderr, "  --voices <n>              sustained voices (default %u)\n", DEFAULT_VOICES);
+	fprintf(stderr, "  --threads <n>             engine threads (default %u)\n", DEFAULT_THREADS);
+	fprintf(stderr, "  --block <n>               frames per playeng_process() call (default %u)\n", DEFAULT_BLOCK);
+	fprintf(stderr, "  --format <u16|u12>        sample data format (default u16)\n");
+	fprintf(stderr, "  --rates <fixed|narrow|wide>\n");
+	fprintf(stderr, "                            playback rate distribution (default narrow)\n");
+	fprintf(stderr, "  --churn <n>               new notes per second of audio (default 0)\n");
+	fprintf(stderr, "  --samplerate <hz>         rate used to convert frames to time (default %u)\n", DEFAULT_SAMPLE_RATE);
+	fprintf(stderr, "  --warmup <ms>             audio rendered before measuring (default %u)\n", DEFAULT_WARMUP_MS);
+	fprintf(stderr, "  --length <ms>             audio rendered by each repeat (default %u)\n", DEFAULT_LENGTH_MS);
+	fprintf(stderr, "  --repeats <n>             number of measured repeats (default %u)\n", DEFAULT_REPEATS);
+	fprintf(stderr, "  --csv <file>              write one row per repeat to a CSV file\n");
+	fprintf(stderr, "  --json <file>             write the configuration and results as JSON\n");
+}
 
+static int write_csv(const char *filename, const struct bench_config *cfg, const struct bench_result *res)
+{
+	unsigned i;
+	FILE *f = fopen(filename, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "repeat,voices,threads,block,format,rates,churn,frames,wall_s,realtime_factor,p50_us,p99_us,max_us,late_blocks,notes_started,notes_dropped\n");
+	for (i = 0; i < cfg->nb_repeats; i++) {
+		fprintf
+			(f
+			,"%u,%u,%u,%u,u%u,%s,%g,%llu,%.6f,%.3f,%.3f,%.3f,%.3f,%lu,%lu,%lu\n"
+			,i
+			,cfg->nb_voices
+			,cfg->nb_threads
+			,cfg->block
+			,cfg->format
+			,rates_name(cfg->rates)
+			,cfg->churn
+			,(unsigned long long)res[i].frames
+			,res[i].wall_ns * 1e-9
+			,res[i].frames * 1e9 / ((double)cfg->sample_rate * res[i].wall_ns)
+			,res[i].p50_ns * 1e-3
+			,res[i].p99_ns * 1e-3
+			,res[i].max_ns * 1e-3
+			,res[i].late_blocks
+			,res[i].notes_started
+			,res[i].notes_dropped
+			);
+	}
+	return (fclose(f) != 0) ? -1 : 0;
+}
+
+static int write_json(const char *filename, const struct bench_config *cfg, const struct bench_result *res)
+{
+	unsigned i;
+	FILE *f = fopen(filename, "w");
+	if (f == NULL)
+		return -1;
+	fprintf(f, "{\n");
+	fprintf(f, "  \"config\": {\"voices\": %u, \"threads\": %u, \"block\": %u, \"format\": \"u%u\", \"rates\": \"%s\", \"churn\": %g, \"sample_rate\": %u, \"warmup_ms\": %u, \"length_ms\": %u},\n", cfg->nb_voices, cfg->nb_threads, cfg->block, cfg->format, rates_name(cfg->rates), cfg->churn, cfg->sample_rate, cfg->warmup_ms, cfg->length_ms);
+	fprintf(f, "  \"repeats\": [\n");
+	for (i = 0; i < cfg->nb_repeats; i++) {
+		fprintf
+			(f
+			,"    {\"frames\": %llu, \"wall_s\": %.6f, \"realtime_factor\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f, \"late_blocks\": %lu, \"notes_started\": %lu, \"notes_dropped\": %lu}%s\n"
+			,(unsigned long long)res[i].frames
+			,res[i].wall_ns * 1e-9
+			,res[i].frames * 1e9 / ((double)cfg->sample_rate * res[i].wall_ns)
+			,res[i].p50_ns * 1e-3
+			,res[i].p99_ns * 1e-3
+			,res[i].max_ns * 1e-3
+			,res[i].late_blocks
+			,res[i].notes_started
+			,res[i].notes_dropped
+			,(i + 1 < cfg->nb_repeats) ? "," : ""
+			);
+	}
+	fprintf(f, "  ]\n}\n");
+	return (fclose(f) != 0) ? -1 : 0;
+}
 
 int main(int argc, char *argv[])
 {
-	float VEC_ALIGN_BEST        buf[PROCESS_BUFFER_SIZE*2];
-	unsigned                    i;
-	struct pipe_executor        samples[NB_SAMPLES];
+	struct bench_config         cfg;
+	struct bench_result        *res;
+	struct pipe_executor       *voices;
+	const void                 *attacks[MAX_DISTINCT_SAMPLES];
+	const void                 *releases[MAX_DISTINCT_SAMPLES];
 	struct cop_salloc_iface     mem;
 	struct cop_alloc_virtual    mem_impl;
 	struct playeng             *eng;
-
+	float                      *buf;
+	uint_fast64_t              *latencies;
+	const char                 *csv_file  = NULL;
+	const char                 *json_file = NULL;
+	unsigned long               nb_blocks, warmup_blocks, block_ns;
+	unsigned                    i, nb_distinct, churn;
+	size_t                      data_size;
+	double                      churn_acc = 0.0;
 	uint_fast32_t               rval = 1;
 
-	if ((eng = playeng_init(2048, 2, 8)) == NULL) {
+	cfg.nb_voices   = DEFAULT_VOICES;
+	cfg.nb_threads  = DEFAULT_THREADS;
+	cfg.block       = DEFAULT_BLOCK;
+	cfg.format      = 16;
+	cfg.rates       = RATES_NARROW;
+	cfg.churn       = 0.0;
+	cfg.sample_rate = DEFAULT_SAMPLE_RATE;
+	cfg.warmup_ms   = DEFAULT_WARMUP_MS;
+	cfg.length_ms   = DEFAULT_LENGTH_MS;
+	cfg.nb_repeats  = DEFAULT_REPEATS;
+
+	argc--;
+	argv++;
+	while (argc > 0) {
+		int bad = 0;
+		if (argc > 1 && !strcmp(*argv, "--voices")) {
+			bad = parse_uint(argv[1], 1, 65536, &cfg.nb_voices);
+		} else if (argc > 1 && !strcmp(*argv, "--threads")) {
+			bad = parse_uint(argv[1], 1, 64, &cfg.nb_threads);
+		} else if (argc > 1 && !strcmp(*argv, "--block")) {
+			bad = parse_uint(argv[1], 1, 1048576, &cfg.block);
+		} else if (argc > 1 && !strcmp(*argv, "--format")) {
+			if (!strcmp(argv[1], "u16"))
+				cfg.format = 16;
+			else if (!strcmp(argv[1], "u12"))
+				cfg.format = 12;
+			else
+				bad = 1;
+		} else if (argc > 1 && !strcmp(*argv, "--rates")) {
+			if (!strcmp(argv[1], "fixed"))
+				cfg.rates = RATES_FIXED;
+			else if (!strcmp(argv[1], "narrow"))
+				cfg.rates = RATES_NARROW;
+			else if (!strcmp(argv[1], "wide"))
+				cfg.rates = RATES_WIDE;
+			else
+				bad = 1;
+		} else if (argc > 1 && !strcmp(*argv, "--churn")) {
+			if (!(bad = parse_uint(argv[1], 0, 1000000, &churn)))
+				cfg.churn = churn;
+		} else if (argc > 1 && !strcmp(*argv, "--samplerate")) {
+			bad = parse_uint(argv[1], 1000, 1000000, &cfg.sample_rate);
+		} else if (argc > 1 && !strcmp(*argv, "--warmup")) {
+			bad = parse_uint(argv[1], 0, 3600000, &cfg.warmup_ms);
+		} else if (argc > 1 && !strcmp(*argv, "--length")) {
+			bad = parse_uint(argv[1], 1, 3600000, &cfg.length_ms);
+		} else if (argc > 1 && !strcmp(*argv, "--repeats")) {
+			bad = parse_uint(argv[1], 1, MAX_REPEATS, &cfg.nb_repeats);
+		} else if (argc > 1 && !strcmp(*argv, "--csv")) {
+			csv_file = argv[1];
+		} else if (argc > 1 && !strcmp(*argv, "--json")) {
+			json_file = argv[1];
+		} else {
+			print_usage();
+			return -1;
+		}
+		if (bad) {
+			fprintf(stderr, "bad value '%s' for %s\n", argv[1], argv[0]);
+			return -1;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+
+	nb_blocks     = (unsigned long)(((uint_fast64_t)cfg.length_ms * cfg.sample_rate / 1000 + cfg.block - 1) / cfg.block);
+	warmup_blocks = (unsigned long)(((uint_fast64_t)cfg.warmup_ms * cfg.sample_rate / 1000 + cfg.block - 1) / cfg.block);
+	block_ns      = (unsigned long)(cfg.block * 1000000000.0 / cfg.sample_rate);
+	nb_distinct   = (cfg.nb_voices < MAX_DISTINCT_SAMPLES) ? cfg.nb_voices : MAX_DISTINCT_SAMPLES;
+
+	/* Releases which are still ringing need voices on top of the sustained
+	 * ones when there is churn. */
+	if ((eng = playeng_init(4 * cfg.nb_voices + 256, 2, cfg.nb_threads)) == NULL) {
 		fprintf(stderr, "could not create instance of playback engine.\n");
 		return -1;
 	}
 
-	if (cop_alloc_virtual_init(&mem_impl, &mem, 512*1024*1024, 32, 0)) {
+	data_size = (size_t)nb_distinct * (ATTACK_LEN + RELEASE_LEN + 2) * 4 + 1024*1024;
+	if (cop_alloc_virtual_init(&mem_impl, &mem, data_size, 32, 0)) {
 		playeng_destroy(eng);
 		return -1;
 	}
 
-	for (i = 0; i < NB_SAMPLES; i++) {
-		unsigned        attack_len  = 48000;
-		unsigned        release_len = 48128;
-		uint_least16_t *data;
-		unsigned        j;
+	voices    = malloc(sizeof(*voices) * cfg.nb_voices);
+	res       = calloc(cfg.nb_repeats, sizeof(*res));
+	latencies = malloc(sizeof(*latencies) * nb_blocks);
+	buf       = malloc(sizeof(float) * 2 * cfg.block);
+	if (voices == NULL || res == NULL || latencies == NULL || buf == NULL) {
+		fprintf(stderr, "out of memory.\n");
+		return -1;
+	}
 
-		if ((data = cop_salloc(&mem, sizeof(int_least16_t) * (attack_len + release_len) * 2, 0)) == NULL) {
+	for (i = 0; i < nb_distinct; i++) {
+		attacks[i]  = make_sample_data(&mem, cfg.format, ATTACK_LEN, &rval);
+		releases[i] = make_sample_data(&mem, cfg.format, RELEASE_LEN, &rval);
+		if (attacks[i] == NULL || releases[i] == NULL) {
 			fprintf(stderr, "out of memory.\n");
 			return -1;
 		}
-
-		for (j = 0; j < 2 * (attack_len + release_len); j++) {
-			data[j] = (int_least16_t)((uint_least16_t)(rval >> 16));
-			rval = (rval * RNG_A0 + 1) & 0xFFFFFFFF;
-		}
-
-		samples[i].attack.gain                       = 1.0 / (32768.0 * sqrt(NB_SAMPLES));
-		samples[i].attack.nloop                      = 1;
-		samples[i].attack.starts[0].start_smpl       = 1999;
-		samples[i].attack.starts[0].first_valid_end  = 0;
-		samples[i].attack.ends[0].end_smpl           = attack_len - 1;
-		samples[i].attack.ends[0].start_idx          = 0;
-		samples[i].attack.data                       = data;
-		samples[i].attack.instantiate                = u16c2_instantiate;
-
-		samples[i].release.gain                      = 1.0 / (32768.0 * sqrt(NB_SAMPLES));
-		samples[i].release.nloop                     = 1;
-		samples[i].release.starts[0].start_smpl      = release_len - 128;
-		samples[i].release.starts[0].first_valid_end = 0;
-		samples[i].release.ends[0].end_smpl          = release_len - 1;
-		samples[i].release.ends[0].start_idx         = 0;
-		samples[i].release.data                      = data + (attack_len * 2);
-		samples[i].release.instantiate               = u16c2_instantiate;
-
-		samples[i].rate                              = ((3*SMPL_POSITION_SCALE)/4) + (rval & (SMPL_POSITION_SCALE/2-1));
-		rval                                         = (rval * RNG_A0 + 1) & 0xFFFFFFFF;
-
-		samples[i].instance                          = playeng_insert(eng, 2, 1, engine_callback, &(samples[i]));
 	}
 
-#if WIN32
-	ULONGLONG spec1 = GetTickCount64();
-	ULONGLONG spec2;
-	unsigned long long t0 = 0;
-#else
-	struct timeval spec1;
-	struct timeval spec2;
-	gettimeofday(&spec1, NULL);
-	unsigned long long t0 = __builtin_readcyclecounter();
-#endif
-
-	vlf zero = vlf_broadcast(0.0f);
-	for (i = 0; i < PROCESS_ITERATIONS; i++) {
-		unsigned j;
-
-		for (j = 0; j < (2 * PROCESS_BUFFER_SIZE) / VLF_WIDTH; j++)
-			vlf_st(buf + VLF_WIDTH * j, zero);
-
-		playeng_process(eng, buf, 2, PROCESS_BUFFER_SIZE);
+	for (i = 0; i < cfg.nb_voices; i++) {
+		setup_sample(&voices[i].attack, attacks[i % nb_distinct], cfg.format, ATTACK_LEN, 1999, cfg.nb_voices);
+		setup_sample(&voices[i].release, releases[i % nb_distinct], cfg.format, RELEASE_LEN, RELEASE_LEN - 128, cfg.nb_voices);
+		voices[i].rate     = pick_rate(cfg.rates, &rval);
+		voices[i].instance = playeng_insert(eng, 2, 1, engine_callback, &voices[i]);
 	}
 
-#if WIN32
-	spec2 = GetTickCount64();
-	double ms1 = spec1;
-	double ms2 = spec2;
-	unsigned long long t1 = 0;
-#else
-	unsigned long long t1 = __builtin_readcyclecounter();
-	gettimeofday(&spec2, NULL);
-	double ms1 = spec1.tv_sec * 1000.0 + spec1.tv_usec / 1000.0;
-	double ms2 = spec2.tv_sec * 1000.0 + spec2.tv_usec / 1000.0;
-#endif
-
-	double execution_time_seconds                 = (ms2 - ms1) / 1000.0;
-
-	/* This is how many stereo output samples were created. */
-	double samples_generated                      = PROCESS_ITERATIONS * PROCESS_BUFFER_SIZE;
-
-	/* This is how many stereo samples can be produced per output sample. */
-	double samples_generated_per_execution_second = samples_generated / execution_time_seconds;
-
-	/* In one second of execution, we can generate this many output samples. */
-	double seconds_generated_per_execution_second = samples_generated_per_execution_second / 44100.0;
-
-	/* In one second of execution, we can generate this many seconds if we
-	 * only have one sample playing back. */
-	double seconds_generated_per_execution_second_one_sample = seconds_generated_per_execution_second * NB_SAMPLES;
+	printf
+		("%u voices, %u threads, %u frame blocks, u%u data, %s rates, %g notes/s churn\n"
+		,cfg.nb_voices
+		,cfg.nb_threads
+		,cfg.block
+		,cfg.format
+		,rates_name(cfg.rates)
+		,cfg.churn
+		);
+
+	{
+		struct bench_result warmup;
+		memset(&warmup, 0, sizeof(warmup));
+		run_blocks(eng, &cfg, voices, buf, warmup_blocks, NULL, &warmup, &churn_acc, &rval);
+	}
 
+	for (i = 0; i < cfg.nb_repeats; i++) {
+		struct bench_result *r = &res[i];
+		unsigned long j;
+		uint_fast64_t t0 = now_ns();
+
+		run_blocks(eng, &cfg, voices, buf, nb_blocks, latencies, r, &churn_acc, &rval);
+
+		r->wall_ns = now_ns() - t0;
+		r->frames  = (uint_fast64_t)nb_blocks * cfg.block;
+		for (j = 0; j < nb_blocks; j++)
+			r->late_blocks += (latencies[j] > block_ns);
+		qsort(latencies, nb_blocks, sizeof(latencies[0]), compare_ns);
+		r->p50_ns = latencies[(nb_blocks - 1) / 2];
+		r->p99_ns = latencies[((nb_blocks - 1) * 99) / 100];
+		r->max_ns = latencies[nb_blocks - 1];
+
+		printf
+			("repeat %u: %.1fx real-time (%.0f voices), p50 %.1f us, p99 %.1f us, max %.1f us, %lu/%lu blocks late (%.1f us deadline)\n"
+			,i
+			,r->frames * 1e9 / ((double)cfg.sample_rate * r->wall_ns)
+			,r->frames * 1e9 * cfg.nb_voices / ((double)cfg.sample_rate * r->wall_ns)
+			,r->p50_ns * 1e-3
+			,r->p99_ns * 1e-3
+			,r->max_ns * 1e-3
+			,r->late_blocks
+			,nb_blocks
+			,block_ns * 1e-3
+			);
+	}
 
+	if (csv_file != NULL && write_csv(csv_file, &cfg, res))
+		fprintf(stderr, "could not write '%s'\n", csv_file);
+	if (json_file != NULL && write_json(json_file, &cfg, res))
+		fprintf(stderr, "could not write '%s'\n", json_file);
 
+	playeng_destroy(eng);
+	cop_alloc_virtual_free(&mem_impl);
+	free(buf);
+	free(latencies);
+	free(res);
+	free(voices);
 
-	printf("%llu TICKS (%f ms %f max poly @44.1k)\n", t1 - t0, ms2 - ms1, seconds_generated_per_execution_second_one_sample);
+	return 0;
 }
@@ -0,0 +1,137 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#include <time.h>
+#include <math.h>
+#include <stdio.h>
+#include "cop/cop_alloc.h"
+#include "fftset/fftset.h"
+#include "opendiapason/odfilter.h"
+
+/* This program measures how much time odfilter_run() spends doing things
+ * other than convolving (gathering input, zero padding and overlap-adding)
+ * by comparing it against calling fftset_fft_conv() the same number of times
+ * on its own. The overhead should be a small fraction of the FFT time. */
+
+#define SIGNAL_LENGTH (48000 * 10)
+#define REPEATS       (8)
+
+static double seconds(clock_t start, clock_t end)
+{
+	return (end - start) / (double)CLOCKS_PER_SEC;
+}
+
+static
+void
+run_benchmark
+	(struct cop_salloc_iface *mem
+	,struct fftset           *fftset
+	,const float             *input
+	,float                   *output
+	,unsigned                 kernel_length
+	,int                      is_looped
+	)
+{
+	struct odfilter             filter;
+	struct odfilter_temporaries tmps;
+	size_t                      save = cop_salloc_save(mem);
+	unsigned                    max_in, nb_frames, i, j;
+	clock_t                     t0, t1, t2;
+	double                      run_time, fft_time;
+
+	if  (   odfilter_init_filter(&filter, &(mem->iface), fftset, kernel_length)
+	    ||  odfilter_init_temporaries(&tmps, &(mem->iface), &filter)
+	    ) {
+		fprintf(stderr, "out of memory\n");
+		cop_salloc_restore(mem, save);
+		return;
+	}
+
+	odfilter_build_rect(&filter, &tmps, kernel_length, 1.0f / kernel_length);
+
+	/* The number of frames odfilter_run() processes with a pre-read of half
+	 * the kernel. */
+	max_in    = filter.conv_len - filter.kern_len + 1;
+	nb_frames = (SIGNAL_LENGTH + kernel_length / 2 + max_in - 1) / max_in;
+
+	t0 = clock();
+	for (i = 0; i < REPEATS; i++)
+		odfilter_run(input, output, 0, SIGNAL_LENGTH / 2, SIGNAL_LENGTH, kernel_length / 2, is_looped, &tmps, &filter);
+	t1 = clock();
+	for (i = 0; i < REPEATS; i++) {
+		for (j = 0; j < nb_frames; j++)
+			fftset_fft_conv(filter.conv, tmps.tmp2, tmps.tmp1, filter.kernel, tmps.tmp3);
+	}
+	t2 = clock();
+
+	run_time = seconds(t0, t1);
+	fft_time = seconds(t1, t2);
+
+	printf
+		("kernel %5u, conv %5u, %s: run %7.2f ms, fft %7.2f ms, overhead %5.1f%%\n"
+		,kernel_length
+		,filter.conv_len
+		,is_looped ? "looped  " : "unlooped"
+		,run_time * 1000.0 / REPEATS
+		,fft_time * 1000.0 / REPEATS
+		,(fft_time > 0.0) ? (run_time - fft_time) * 100.0 / fft_time : 0.0
+		);
+
+	cop_salloc_restore(mem, save);
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned KERNEL_LENGTHS[] = {17, 192, 1024, 4096};
+	struct cop_salloc_iface     mem;
+	struct cop_alloc_grp_temps  mem_impl;
+	struct fftset               fftset;
+	float                      *input;
+	float                      *output;
+	unsigned                    i;
+
+	if (cop_alloc_grp_temps_init(&mem_impl, &mem, 1024*1024*64, 1024*1024, 32)) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+
+	input  = cop_salloc(&mem, sizeof(float) * SIGNAL_LENGTH, 64);
+	output = cop_salloc(&mem, sizeof(float) * SIGNAL_LENGTH, 64);
+	if (input == NULL || output == NULL) {
+		fprintf(stderr, "out of memory\n");
+		cop_alloc_grp_temps_free(&mem_impl);
+		return -1;
+	}
+
+	for (i = 0; i < SIGNAL_LENGTH; i++)
+		input[i] = sinf(i * 0.01f) + 0.25f * sinf(i * 0.37f);
+
+	fftset_init(&fftset);
+
+	for (i = 0; i < sizeof(KERNEL_LENGTHS) / sizeof(KERNEL_LENGTHS[0]); i++) {
+		run_benchmark(&mem, &fftset, input, output, KERNEL_LENGTHS[i], 0);
+		run_benchmark(&mem, &fftset, input, output, KERNEL_LENGTHS[i], 1);
+	}
+
+	fftset_destroy(&fftset);
+	cop_alloc_grp_temps_free(&mem_impl);
+
+	return 0;
+}
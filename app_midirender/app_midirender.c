@@ -0,0 +1,669 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+/* Offline renderer. Plays a standard MIDI file through the same engine as
+ * app_sampletest and writes the output to a wave file as fast as the engine
+ * can go. There is no audio device or MIDI device involved: events are
+ * applied between calls to playeng_process() from the same thread, so the
+ * output only depends on the MIDI file, the samples and the number of
+ * engine threads. Two runs with the same inputs produce identical files. */
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "cop/cop_thread.h"
+#include "cop/cop_alloc.h"
+
+#include "fftset/fftset.h"
+#include "opendiapason/src/wavldr.h"
+#include "opendiapason/src/playeng.h"
+#include "opendiapason/src/wav_dumper.h"
+#include "opendiapason/src/strset.h"
+#include "opendiapason/src/odatomic.h"
+#include "opendiapason/src/relstage.h"
+#include "opendiapason/app_common/testorgan.h"
+#include "opendiapason/app_common/apputil.h"
+
+/* The engine is asked for this many frames at a time unless an event comes
+ * up sooner. Must be a multiple of OUTPUT_SAMPLES. */
+#define RENDER_BATCH (4096)
+
+/* Wave dumper buffers of RENDER_BATCH frames. */
+#define RENDER_DUMP_BUFFERS (8)
+
+#define RENDER_DEFAULT_THREADS (4)
+#define RENDER_DEFAULT_TAIL_MS (5000)
+#define RENDER_MAX_THREADS     (64)
+#define RENDER_MAX_TAIL_MS     (600000)
+#define RENDER_LOADER_THREADS  (4)
+#define RENDER_MAX_POLYPHONY   (4096)
+
+/* Prefilter segments longer than this (in samples) get shared between all
+ * loader threads. */
+#define LOADER_SPLIT_LENGTH (524288)
+
+static struct pipe_executor *loaded_ranks[NUM_TEST_ENTRY_LIST];
+static struct playeng       *engine;
+static unsigned long         polyphony_exceeded;
+
+/* Standard MIDI file reading
+ * ---------------------------------------------------------------------------
+ * Every track is read into one list which is then sorted by time. Only the
+ * events which the renderer cares about are kept: note on, note off,
+ * controllers and tempo changes. */
+
+/* Status used for tempo changes in the event list. */
+#define MIDI_EVENT_TEMPO (0xFF)
+
+/* Tempo of a file with no tempo events (microseconds per quarter note). */
+#define MIDI_DEFAULT_TEMPO (500000)
+
+struct midi_event {
+	uint_fast64_t  tick;
+	uint_fast64_t  frame;
+	unsigned long  seq;
+	unsigned long  tempo;
+	unsigned char  status;
+	unsigned char  data1;
+	unsigned char  data2;
+};
+
+struct midi_song {
+	struct midi_event *events;
+	unsigned long      nb_events;
+	unsigned long      max_events;
+	uint_fast64_t      nb_frames;
+};
+
+static uint_fast32_t ld_ube32(const unsigned char *buf)
+{
+	return ((uint_fast32_t)buf[0] << 24) | ((uint_fast32_t)buf[1] << 16) | ((uint_fast32_t)buf[2] << 8) | buf[3];
+}
+
+static unsigned ld_ube16(const unsigned char *buf)
+{
+	return ((unsigned)buf[0] << 8) | buf[1];
+}
+
+/* Read a variable length quantity. Returns non-zero if it runs past end or
+ * is longer than four bytes. */
+static int read_varlen(const unsigned char *buf, size_t *pos, size_t end, uint_fast32_t *val)
+{
+	unsigned i;
+	*val = 0;
+	for (i = 0; i < 4 && *pos < end; i++) {
+		unsigned char c = buf[(*pos)++];
+		*val = (*val << 7) | (c & 0x7F);
+		if ((c & 0x80) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+static int add_event(struct midi_song *song, uint_fast64_t tick, unsigned status, unsigned data1, unsigned data2, unsigned long tempo)
+{
+	struct midi_event *ev;
+	if (song->nb_events == song->max_events) {
+		unsigned long new_max = song->max_events ? song->max_events * 2 : 1024;
+		if ((ev = realloc(song->events, sizeof(*ev) * new_max)) == NULL)
+			return -1;
+		song->events     = ev;
+		song->max_events = new_max;
+	}
+	ev         = song->events + song->nb_events;
+	ev->tick   = tick;
+	ev->frame  = 0;
+	ev->seq    = song->nb_events++;
+	ev->tempo  = tempo;
+	ev->status = status;
+	ev->data1  = data1;
+	ev->data2  = data2;
+	return 0;
+}
+
+/* Events at the same tick stay in the order they were read (i.e. by track,
+ * then by position in the track). */
+static int event_compare(const void *a, const void *b)
+{
+	const struct midi_event *ea = a;
+	const struct midi_event *eb = b;
+	if (ea->tick != eb->tick)
+		return (ea->tick < eb->tick) ? -1 : 1;
+	return (ea->seq < eb->seq) ? -1 : (ea->seq > eb->seq);
+}
+
+static const char *parse_track(struct midi_song *song, const unsigned char *buf, size_t pos, size_t end)
+{
+	uint_fast64_t tick    = 0;
+	unsigned      running = 0;
+
+	while (pos < end) {
+		uint_fast32_t delta;
+		unsigned char c;
+
+		if (read_varlen(buf, &pos, end, &delta) || pos >= end)
+			return "bad event time";
+		tick += delta;
+		c     = buf[pos];
+
+		if (c == 0xFF) {
+			uint_fast32_t len;
+			unsigned      type;
+			if (++pos >= end)
+				return "truncated meta event";
+			type = buf[pos++];
+			if (read_varlen(buf, &pos, end, &len) || len > end - pos)
+				return "truncated meta event";
+			if (type == 0x2F)
+				break;
+			if (type == 0x51 && len == 3 && add_event(song, tick, MIDI_EVENT_TEMPO, 0, 0, ((unsigned long)buf[pos] << 16) | ((unsigned long)buf[pos+1] << 8) | buf[pos+2]))
+				return "out of memory";
+			pos     += len;
+			running  = 0;
+		} else if (c == 0xF0 || c == 0xF7) {
+			uint_fast32_t len;
+			pos++;
+			if (read_varlen(buf, &pos, end, &len) || len > end - pos)
+				return "truncated system exclusive event";
+			pos     += len;
+			running  = 0;
+		} else {
+			unsigned nb_data, d1, d2, type;
+			if (c & 0x80) {
+				running = c;
+				pos++;
+			} else if (running == 0) {
+				return "data byte without a status byte";
+			}
+			nb_data = ((running & 0xE0) == 0xC0) ? 1 : 2;
+			if (nb_data > end - pos)
+				return "truncated channel event";
+			d1    = buf[pos];
+			d2    = (nb_data > 1) ? buf[pos+1] : 0;
+			pos  += nb_data;
+			type  = running & 0xF0;
+			if ((type == 0x80 || type == 0x90 || type == 0xB0) && add_event(song, tick, running, d1, d2, 0))
+				return "out of memory";
+		}
+	}
+
+	return NULL;
+}
+
+/* Give every event its time in output frames. Returns the frame of the last
+ * event. */
+static uint_fast64_t assign_frames(struct midi_song *song, unsigned division)
+{
+	double        base_frame = 0.0;
+	uint_fast64_t base_tick  = 0;
+	double        frames_per_tick;
+	unsigned long i;
+
+	if (division & 0x8000u) {
+		/* SMPTE time: frames per second is stored negated in the top byte
+		 * (29 means 29.97) and ticks per frame in the bottom byte. */
+		unsigned fps = 256 - (division >> 8);
+		frames_per_tick = PLAYBACK_SAMPLE_RATE / (((fps == 29) ? 30000.0 / 1001.0 : fps) * (division & 0xFFu));
+	} else {
+		frames_per_tick = MIDI_DEFAULT_TEMPO * 1e-6 * PLAYBACK_SAMPLE_RATE / division;
+	}
+
+	for (i = 0; i < song->nb_events; i++) {
+		struct midi_event *ev    = song->events + i;
+		double             frame = base_frame + (ev->tick - base_tick) * frames_per_tick;
+		ev->frame = (uint_fast64_t)(frame + 0.5);
+		if (ev->status == MIDI_EVENT_TEMPO && (division & 0x8000u) == 0 && ev->tempo) {
+			base_frame      = frame;
+			base_tick       = ev->tick;
+			frames_per_tick = ev->tempo * 1e-6 * PLAYBACK_SAMPLE_RATE / division;
+		}
+	}
+
+	return song->nb_events ? song->events[song->nb_events-1].frame : 0;
+}
+
+/* Load a format 0 or 1 standard MIDI file. */
+static const char *load_midi_file(struct midi_song *song, const char *filename)
+{
+	const char    *err = NULL;
+	unsigned char *buf = NULL;
+	long           fsz = -1;
+	size_t         pos, sz;
+	unsigned       format, nb_tracks, division, i;
+	FILE          *f;
+
+	song->events     = NULL;
+	song->nb_events  = 0;
+	song->max_events = 0;
+	song->nb_frames  = 0;
+
+	if ((f = fopen(filename, "rb")) == NULL)
+		return "could not open MIDI file";
+	if (fseek(f, 0, SEEK_END) == 0 && (fsz = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0 && (buf = malloc(fsz)) != NULL) {
+		if (fread(buf, 1, fsz, f) != (size_t)fsz)
+			err = "could not read MIDI file";
+	} else {
+		err = "could not read MIDI file";
+	}
+	fclose(f);
+	if (err != NULL) {
+		free(buf);
+		return err;
+	}
+
+	sz = (size_t)fsz;
+	if (sz < 14 || memcmp(buf, "MThd", 4) != 0 || ld_ube32(buf + 4) < 6 || ld_ube32(buf + 4) > sz - 8) {
+		free(buf);
+		return "not a standard MIDI file";
+	}
+
+	format    = ld_ube16(buf + 8);
+	nb_tracks = ld_ube16(buf + 10);
+	division  = ld_ube16(buf + 12);
+	pos       = 8 + ld_ube32(buf + 4);
+
+	if (format > 1)
+		err = "only format 0 and 1 MIDI files are supported";
+	else if ((division & 0x7FFFu) == 0 || ((division & 0x8000u) && (division & 0xFFu) == 0))
+		err = "bad time division";
+
+	/* Chunks which are not tracks are skipped. */
+	for (i = 0; err == NULL && i < nb_tracks; ) {
+		uint_fast32_t len;
+		if (sz - pos < 8) {
+			err = "file is missing tracks";
+			break;
+		}
+		len = ld_ube32(buf + pos + 4);
+		if (len > sz - pos - 8) {
+			err = "truncated track";
+			break;
+		}
+		if (memcmp(buf + pos, "MTrk", 4) == 0) {
+			err = parse_track(song, buf, pos + 8, pos + 8 + len);
+			i++;
+		}
+		pos += 8 + len;
+	}
+
+	free(buf);
+
+	if (err != NULL) {
+		free(song->events);
+		song->events = NULL;
+		return err;
+	}
+
+	qsort(song->events, song->nb_events, sizeof(song->events[0]), event_compare);
+	song->nb_frames = assign_frames(song, division);
+
+	return NULL;
+}
+
+/* Engine
+ * --------------------------------------------------------------------------- */
+
+static void pipe_loaded(void *context, struct sample_load_info *sli)
+{
+	/* dest is the first member of the pipe executor. */
+	struct pipe_executor *pe = (struct pipe_executor *)sli->dest;
+	odatomic_store(&pe->loaded, 1);
+}
+
+/* Stop a sounding pipe. Everything happens on the rendering thread between
+ * blocks, so the release is always staged from an up to date position. */
+static void release_pipe(struct pipe_executor *pd)
+{
+	uint_fast32_t ipos, fpos, rate;
+	if (playeng_peek_position(pd->instance, 0, &ipos, &fpos, &rate) == 0)
+		relstage_prepare(&pd->release_stage, &pd->data, ipos, fpos, rate);
+	playeng_signal_instance(engine, pd->instance, 0x02);
+	pd->instance = NULL;
+}
+
+static void enable_rank(unsigned rank, int enabled)
+{
+	unsigned k;
+	for (k = 0; k < TEST_ENTRY_LIST[rank].nb_pipes; k++) {
+		struct pipe_executor *pd = &loaded_ranks[rank][k];
+		if (!enabled && pd->nb_insts && pd->instance != NULL)
+			release_pipe(pd);
+		if (!enabled) {
+			pd->instance = NULL;
+			pd->nb_insts = 0;
+		}
+		pd->enabled = enabled;
+	}
+}
+
+/* The same note and stop handling as the MIDI thread of app_sampletest. */
+static void handle_event(const struct midi_event *ev)
+{
+	unsigned channel = ev->status & 0x0F;
+	unsigned evtid   = ev->status & 0xF0;
+	unsigned j;
+
+	if (ev->status == MIDI_EVENT_TEMPO)
+		return;
+
+	for (j = 0; j < NUM_TEST_ENTRY_LIST; j++) {
+		struct pipe_executor *pd;
+		unsigned midx = ev->data1;
+
+		if (evtid == 0xB0) {
+			if (ev->data1 == TEST_ENTRY_LIST[j].midi_shortcut && (ev->data2 != 0) != (loaded_ranks[j][0].enabled != 0))
+				enable_rank(j, ev->data2 != 0);
+			continue;
+		}
+
+		if ((TEST_ENTRY_LIST[j].midi_channel_mask & (1ul << channel)) == 0)
+			continue;
+
+		if (midx < TEST_ENTRY_LIST[j].first_midi)
+			continue;
+
+		midx -= TEST_ENTRY_LIST[j].first_midi;
+
+		if (midx >= TEST_ENTRY_LIST[j].nb_pipes)
+			continue;
+
+		pd = &loaded_ranks[j][midx];
+		if (!pd->enabled || !odatomic_load(&pd->loaded))
+			continue;
+
+		if (evtid == 0x80 || (evtid == 0x90 && ev->data2 == 0x00)) {
+			if (pd->nb_insts < 1)
+				continue;
+
+			pd->nb_insts--;
+
+			if (pd->nb_insts == 0 && pd->instance != NULL)
+				release_pipe(pd);
+		} else if (evtid == 0x90) {
+			pd->nb_insts++;
+
+			if (pd->instance != NULL)
+				continue;
+
+			pd->instance = playeng_insert(engine, 2, 0x01, engine_callback, pd);
+			if (pd->instance == NULL)
+				polyphony_exceeded++;
+		}
+	}
+}
+
+/* Release every pipe which is still sounding at the end of the file. */
+static void release_all(void)
+{
+	unsigned i, j;
+	for (i = 0; i < NUM_TEST_ENTRY_LIST; i++) {
+		for (j = 0; j < TEST_ENTRY_LIST[i].nb_pipes; j++) {
+			struct pipe_executor *pd = &loaded_ranks[i][j];
+			if (pd->nb_insts && pd->instance != NULL)
+				release_pipe(pd);
+			pd->nb_insts = 0;
+		}
+	}
+}
+
+/* Run the whole song through the engine into the dumper. The engine only
+ * takes new instances and signals at the start of a block, so like the note
+ * queue of app_sampletest, every event is applied at the start of the block
+ * of OUTPUT_SAMPLES frames which contains it. Returns non-zero if the output
+ * could not be written. */
+static int render(const struct midi_song *song, struct wav_dumper *dump, uint_fast64_t tail_frames, uint_fast64_t *nb_rendered)
+{
+	float         *buf;
+	uint_fast64_t  pos      = 0;
+	uint_fast64_t  end      = song->nb_frames + tail_frames;
+	unsigned long  next_ev  = 0;
+	int            released = 0;
+	int            ret      = 0;
+
+	if ((buf = malloc(sizeof(float) * 2 * RENDER_BATCH)) == NULL)
+		return -1;
+
+	end = ((end + OUTPUT_SAMPLES - 1) / OUTPUT_SAMPLES) * OUTPUT_SAMPLES;
+
+	while (pos < end) {
+		uint_fast64_t target = pos + RENDER_BATCH;
+		unsigned      nb_frames;
+
+		while (next_ev < song->nb_events && song->events[next_ev].frame < pos + OUTPUT_SAMPLES)
+			handle_event(&song->events[next_ev++]);
+
+		if (next_ev == song->nb_events && !released) {
+			release_all();
+			released = 1;
+		}
+
+		/* Stop at the block containing the next event. */
+		if (next_ev < song->nb_events) {
+			uint_fast64_t ev_block = (song->events[next_ev].frame / OUTPUT_SAMPLES) * OUTPUT_SAMPLES;
+			if (ev_block < target)
+				target = ev_block;
+		}
+		if (target > end)
+			target = end;
+
+		nb_frames = (unsigned)(target - pos);
+		playeng_process(engine, buf, 2, nb_frames);
+		if (wav_dumper_write_from_floats(dump, buf, nb_frames, 2, 1) != nb_frames) {
+			ret = -1;
+			break;
+		}
+		pos = target;
+	}
+
+	free(buf);
+	*nb_rendered = pos;
+	return ret;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: midirender [options] <input.mid> <output.wav>\n");
+	fprintf(stderr, "options:\n");
+	fprintf(stderr, "  --threads <n>          number of engine threads (default %u, max %u)\n", RENDER_DEFAULT_THREADS, RENDER_MAX_THREADS);
+	fprintf(stderr, "  --tail <ms>            time to keep rendering after the last event (default %u,\n", RENDER_DEFAULT_TAIL_MS);
+	fprintf(stderr, "                         max %u)\n", RENDER_MAX_TAIL_MS);
+	fprintf(stderr, "  --format <16|24|float> output sample format (default 24)\n");
+	fprintf(stderr, "  --stops <keys>         stops to draw at the start using the app_sampletest\n");
+	fprintf(stderr, "                         keyboard shortcuts (default all of them)\n");
+	fprintf(stderr, "events are applied at the start of the %u frame engine block which contains\n", OUTPUT_SAMPLES);
+	fprintf(stderr, "them (%.2f ms at %u Hz), the same as notes played into app_sampletest.\n", OUTPUT_SAMPLES * 1000.0 / PLAYBACK_SAMPLE_RATE, (unsigned)PLAYBACK_SAMPLE_RATE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct midi_song         song;
+	struct wav_dumper        dump;
+	struct cop_alloc_virtual mem_impl;
+	struct cop_salloc_iface  mem;
+	struct fftset            fftset;
+	struct odfilter          prefilter;
+	struct strset            ss;
+	struct wavldr            loader;
+	const char              *err;
+	const char              *midi_file   = NULL;
+	const char              *out_file    = NULL;
+	const char              *stops       = NULL;
+	unsigned                 nb_threads  = RENDER_DEFAULT_THREADS;
+	unsigned                 tail_ms     = RENDER_DEFAULT_TAIL_MS;
+	unsigned                 bits        = 24;
+	int                      needed[NUM_TEST_ENTRY_LIST];
+	uint_fast64_t            t0, t1, t2, nb_rendered;
+	unsigned long            i, hits = 0, misses = 0;
+	int                      rv;
+
+	argc--;
+	argv++;
+
+	while (argc > 0) {
+		const char *opt = *argv;
+		int         bad = 0;
+		if (!strcmp(*argv, "--threads") && argc > 1) {
+			argc--;
+			argv++;
+			bad = parse_uint(*argv, 1, RENDER_MAX_THREADS, &nb_threads);
+		} else if (!strcmp(*argv, "--tail") && argc > 1) {
+			argc--;
+			argv++;
+			bad = parse_uint(*argv, 0, RENDER_MAX_TAIL_MS, &tail_ms);
+		} else if (!strcmp(*argv, "--format") && argc > 1) {
+			argc--;
+			argv++;
+			if (!strcmp(*argv, "16")) {
+				bits = 16;
+			} else if (!strcmp(*argv, "24")) {
+				bits = 24;
+			} else if (!strcmp(*argv, "float")) {
+				bits = 32;
+			} else {
+				fprintf(stderr, "unknown output format '%s'\n", *argv);
+				return -1;
+			}
+		} else if (!strcmp(*argv, "--stops") && argc > 1) {
+			argc--;
+			argv++;
+			stops = *argv;
+		} else if (**argv != '-' && midi_file == NULL) {
+			midi_file = *argv;
+		} else if (**argv != '-' && out_file == NULL) {
+			out_file = *argv;
+		} else {
+			usage();
+			return -1;
+		}
+		if (bad) {
+			fprintf(stderr, "bad value '%s' for %s\n", *argv, opt);
+			usage();
+			return -1;
+		}
+		argc--;
+		argv++;
+	}
+
+	if (midi_file == NULL || out_file == NULL) {
+		usage();
+		return -1;
+	}
+
+	if ((err = load_midi_file(&song, midi_file)) != NULL) {
+		fprintf(stderr, "%s: %s\n", midi_file, err);
+		return -1;
+	}
+	printf("%s: %lu events, %.2f s\n", midi_file, song.nb_events, song.nb_frames / (double)PLAYBACK_SAMPLE_RATE);
+
+	/* Only load the stops which get drawn. */
+	for (i = 0; i < NUM_TEST_ENTRY_LIST; i++)
+		needed[i] = (stops == NULL || strchr(stops, TEST_ENTRY_LIST[i].shortcut) != NULL);
+	for (i = 0; i < song.nb_events; i++) {
+		unsigned j;
+		if ((song.events[i].status & 0xF0) != 0xB0 || song.events[i].data2 == 0)
+			continue;
+		for (j = 0; j < NUM_TEST_ENTRY_LIST; j++)
+			if (TEST_ENTRY_LIST[j].midi_shortcut == song.events[i].data1)
+				needed[j] = 1;
+	}
+
+	if ((engine = playeng_init(RENDER_MAX_POLYPHONY, 2, nb_threads)) == NULL) {
+		fprintf(stderr, "couldn't create playback engine. out of memory.\n");
+		free(song.events);
+		return -1;
+	}
+
+	cop_alloc_virtual_init(&mem_impl, &mem, pool_size(), 32, 16*1024*1024);
+	fftset_init(&fftset);
+	strset_init(&ss);
+	(void)odfilter_interp_prefilter_init(&prefilter, &mem, &fftset);
+
+	t0 = now_ns();
+	(void)wavldr_initialise(&loader);
+	for (i = 0; i < NUM_TEST_ENTRY_LIST; i++) {
+		loaded_ranks[i] = load_executors(TEST_ENTRY_LIST[i].directory_name, TEST_ENTRY_LIST[i].first_midi, TEST_ENTRY_LIST[i].nb_pipes, TEST_ENTRY_LIST[i].harmonic16, i, &loader, &ss, NULL);
+		if (loaded_ranks[i] == NULL) {
+			fprintf(stderr, "out of memory\n");
+			abort();
+		}
+	}
+	wavldr_set_mode(&loader, WAVLDR_MODE_ON_DEMAND);
+	wavldr_set_callback(&loader, pipe_loaded, NULL);
+	wavldr_set_split_length(&loader, LOADER_SPLIT_LENGTH);
+	if ((err = wavldr_begin_load(&loader, &(mem.iface), &fftset, &prefilter, RENDER_LOADER_THREADS)) != NULL) {
+		fprintf(stderr, "load start error: %s\n", err);
+		abort();
+	}
+	for (i = 0; i < NUM_TEST_ENTRY_LIST; i++)
+		if (needed[i])
+			wavldr_request_group(&loader, i);
+	if ((err = wavldr_finish(&loader)) != NULL) {
+		fprintf(stderr, "load error: %s\n", err);
+		abort();
+	}
+	t1 = now_ns();
+	printf("loaded in %.2f s\n", (t1 - t0) * 1e-9);
+
+	for (i = 0; i < NUM_TEST_ENTRY_LIST; i++)
+		if (stops == NULL || strchr(stops, TEST_ENTRY_LIST[i].shortcut) != NULL)
+			enable_rank(i, 1);
+
+	if (wav_dumper_begin(&dump, out_file, 2, bits, PLAYBACK_SAMPLE_RATE, RENDER_DUMP_BUFFERS, RENDER_BATCH)) {
+		fprintf(stderr, "could not create '%s'\n", out_file);
+		abort();
+	}
+	wav_dumper_set_blocking(&dump, 1);
+
+	rv = render(&song, &dump, (uint_fast64_t)tail_ms * PLAYBACK_SAMPLE_RATE / 1000, &nb_rendered);
+	if (wav_dumper_end(&dump))
+		rv = -1;
+	t2 = now_ns();
+
+	if (rv)
+		fprintf(stderr, "failed to write '%s'\n", out_file);
+
+	for (i = 0; i < NUM_TEST_ENTRY_LIST; i++) {
+		unsigned j;
+		for (j = 0; j < TEST_ENTRY_LIST[i].nb_pipes; j++) {
+			unsigned long h, m;
+			relstage_query(&loaded_ranks[i][j].release_stage, &h, &m);
+			hits   += h;
+			misses += m;
+		}
+	}
+
+	printf("rendered %.2f s of audio in %.2f s using %u engine threads (%.1fx real-time)\n", nb_rendered / (double)PLAYBACK_SAMPLE_RATE, (t2 - t1) * 1e-9, nb_threads, (t2 > t1) ? (nb_rendered * 1e9) / ((double)PLAYBACK_SAMPLE_RATE * (t2 - t1)) : 0.0);
+	printf("releases: %lu started from staged decoders, %lu instantiated in the callback\n", hits, misses);
+	if (polyphony_exceeded)
+		printf("polyphony exceeded %lu times\n", polyphony_exceeded);
+
+	playeng_destroy(engine);
+	for (i = 0; i < NUM_TEST_ENTRY_LIST; i++)
+		free(loaded_ranks[i]);
+	strset_free(&ss);
+	fftset_destroy(&fftset);
+	cop_alloc_virtual_free(&mem_impl);
+	free(song.events);
+
+	return rv;
+}
@@ -25,229 +25,251 @@
 #include "cop/cop_thread.h"
 #include "cop/cop_conversions.h"
 #include <math.h>
+#include <limits.h>
 
 #include "fftset/fftset.h"
 #include "opendiapason/src/wavldr.h"
 #include "cop/cop_alloc.h"
 #include "portaudio.h"
 #include "portmidi.h"
+#include "porttime.h"
 #include "opendiapason/src/playeng.h"
 #include "opendiapason/src/wav_dumper.h"
 #include "opendiapason/src/strset.h"
+#include "opendiapason/src/smplstream.h"
+#include "opendiapason/src/odatomic.h"
+#include "opendiapason/src/residency.h"
+#include "opendiapason/src/convreverb.h"
+#include "opendiapason/src/relstage.h"
+#include "smplwav/smplwav_mount.h"
+#include "smplwav/smplwav_convert.h"
+#include "opendiapason/app_common/testorgan.h"
+#include "opendiapason/app_common/apputil.h"
 
-/* This is high not because I am a deluded "audiophile". It is high, because
- * it gives the playback system heaps of frequency headroom before aliasing
- * occurs. The playback rate of a sample can be doubled before aliasing
- * starts getting folded back down the spectrum.
- *
- * I am relying on the sound driver low-pass filtering this... which is
- * probably a bad assumption. */
-#define PLAYBACK_SAMPLE_RATE (96000)
-
-struct pipe_executor {
-	struct pipe_v1           data;
-	struct playeng_instance *instance;
-	int                      nb_insts;
-	int                      enabled;
-	double                   target_freq;
-};
-
-struct test_load_entry {
-	const char     *directory_name;
-	unsigned        first_midi;
-	unsigned        nb_pipes;
-	unsigned        midi_channel_mask;
-	unsigned        harmonic16;
-	int             shortcut;
-	unsigned        midi_shortcut;
-};
-
-#define GT_MIDICH  (0)
-#define SW_MIDICH  (1)
-#define PED_MIDICH (2)
-
-#define GT  (1 << GT_MIDICH)
-#define SW  (1 << SW_MIDICH)
-#define PED (1 << PED_MIDICH)
-
-/* This defines the playback rate of the whole organ. It is the pitch of
- * bottom C of a 16-foot rank. Everything will be tuned to this. */
-#define ORGAN_PITCH16 (32.5)
-
-/* I have been using samples from Pribac for testing. Each name corresponds to
- * a sub-directory of where the build is made containing samples named in the
- * usual way. The first number is the first MIDI note, the second is the
- * number of pipe samples, the third is a mask of which MIDI channels activate
- * samples, the final is the harmonic base pitch relative to 16. */
-static const struct test_load_entry TEST_ENTRY_LIST[] =
-#if 1
-{	{"II Geigen Principal 8",      36, 51, SW,       2, '1', 48}
-,	{"II Portunal Flaut 8",        36, 51, SW,       2, '2', 49}
-,	{"II Flaut Major 8",           36, 51, SW,       2, '3', 50}
-,	{"II Salicet 8",               36, 51, SW,       2, '4', 51}
-,	{"II Viol-Principal 4",        36, 51, SW,       4, '5', 52}
-,	{"II Portunal Flaut 4",        36, 51, SW,       4, '6', 53}
-#if 1
-,	{"I Trompete 8",               36, 51, PED | GT, 2, 'a', 64}
-,	{"I Bordun 16",                36, 51, PED | GT, 1, 's', 65}
-,	{"I Principal 8",              36, 51, PED | GT, 2, 'd', 66}
-,	{"I Doppelrohrflote 8",        36, 51, PED | GT, 2, 'f', 67}
-,	{"I Gemshorn 8",               36, 51, PED | GT, 2, 'g', 68}
-,	{"I Viola di Gamba 8",         36, 51, PED | GT, 2, 'h', 69}
-,	{"I Octave 4",                 36, 51, PED | GT, 4, 'j', 70}
-,	{"I Quinte 2 23",              36, 51, PED | GT, 6, 'k', 71}
-,	{"I Octave 2",                 36, 51, PED | GT, 8, 'l', 72}
-,	{"I Mixtur 4 Fach",            36, 51, PED | GT, 2, ';', 73}
-,	{"P Posaune 16",               36, 27, PED,      1, 'z', 80}
-,	{"P Principalbass 16",         36, 27, PED,      1, 'x', 81}
-,	{"P Subbass 16",               36, 27, PED,      1, 'c', 82}
-,	{"P Violonbass 16",            36, 27, PED,      1, 'v', 83}
-,	{"P Octavbass 8",              36, 27, PED,      2, 'b', 84}
-,	{"P Flautbass 8",              36, 27, PED,      2, 'n', 85}
-#endif
-};
-#endif
-#if 0
-{	{"III Trompette Harmonique 8", 36, 53, SW,       2, '1', 48}
-,	{"III Hautbois 8",             36, 53, SW,       2, '2', 49}
-,	{"III Aeoline 8",              36, 53, SW,       2, '3', 50}
-,	{"III Bourdon 8",              36, 53, SW,       2, '4', 51}
-,	{"III Flute Traversiere 8",    36, 53, SW,       2, '5', 52}
-,	{"III Fugara 4",               36, 53, SW,       4, '6', 53}
-,	{"III Flute Octaviante 4",     36, 53, SW,       4, '7', 54}
-,	{"III Doublette 2",            36, 53, SW,       8, '8', 55}
-,	{"I Trompette 8",              36, 53, PED | GT, 2, 'a', 64}
-,	{"I Montre 8",                 36, 53, PED | GT, 2, 's', 65}
-,	{"I Bourdon 8",                36, 53, PED | GT, 2, 'd', 66}
-,	{"I Viole de Gambe 8",         36, 53, PED | GT, 2, 'f', 67}
-,	{"I Prestant 4",               36, 53, PED | GT, 4, 'g', 68}
-,	{"I Flute Douce 4",            36, 53, PED | GT, 4, 'h', 69}
-,	{"I Doublette 2",              36, 53, PED | GT, 8, 'j', 70}
-,	{"I Plein Jeu 5x",             36, 53, PED | GT, 2, 'k', 71}
-,	{"P Bombarde 16",              36, 27, PED,      1, 'z', 80}
-,	{"P Contrebasse 16",           36, 27, PED,      1, 'x', 81}
-,	{"P Soubasse 16",              36, 27, PED,      1, 'c', 82}
-,	{"P Violoncelle 8",            36, 27, PED,      2, 'v', 83}
-};
-#endif
-#if 0
-{	{"I Bordun 16",                36, 53, PED | GT,  1, 'a'}
-,	{"I Principal 8",              36, 53, PED | GT,  2, 's'}
-,	{"I Octave 4",                 36, 53, PED | GT,  4, 'd'}
-,	{"I Quinte 2 23",              36, 53, GT,        6, 'f'}
-,	{"I Octave 2",                 36, 53, PED | GT,  8, 'g'}
-,	{"I Mixtur 3f",                36, 53, PED | GT,  2, 'h'}
-,	{"P Posaune 16",               36, 27, PED,       1, 'z'}
-,	{"P Violon 16",                36, 27, PED,       1, 'x'}
-,	{"P Subbass 16",               36, 27, PED,       1, 'c'}
-,	{"P Octavbass 8",              36, 27, PED,       2, 'v'}
-,	{"P Bassflote 8",              36, 27, PED,       2, 'b'}
-,	{"II Viola di Gamba 8",        36, 53, SW,        2, '1'}
-,	{"II Gedact 8",                36, 53, SW,        2, '2'}
-,	{"II Geigen-principal 8",      36, 53, SW,        2, '3'}
-,	{"II Praestant 4",             36, 53, SW,        4, '4'}
-};
-#endif
+static struct pipe_executor *loaded_ranks[NUM_TEST_ENTRY_LIST];
 
-#define NUM_TEST_ENTRY_LIST (sizeof(TEST_ENTRY_LIST) / sizeof(TEST_ENTRY_LIST[0]))
+/* Sample memory residency configuration. If residency_active is zero, the
+ * samples are allocated from the memory pool like everything else. */
+#define RESIDENCY_RETOUCH_MS (10000)
+struct residency   residency;
+int                residency_active;
+size_t             residency_budget;
+unsigned           residency_flags;
 
-static struct pipe_executor *loaded_ranks[NUM_TEST_ENTRY_LIST];
+struct playeng    *engine;
+struct wav_dumper  dump_file;
+int                dump_file_open;
 
-static struct pipe_executor *
-load_executors
-	(const char              *path
-	,unsigned                 first_midi
-	,unsigned                 nb_pipes
-	,unsigned                 harmonic16
-	,struct wavldr           *lset
-	,struct strset           *sset
-	)
+/* Set by --dumpaudio and --dumpformat. The file is opened once all of the
+ * arguments have been read. bits is 16, 24 or 32 for float. */
+const char        *dump_filename;
+unsigned           dump_bits;
+
+/* Ranks are loaded in the background while playing. Unless preload_all is
+ * set (using --preload), a rank does not get loaded until its stop is
+ * drawn. */
+#define LOADER_THREADS (4)
+#define LAZY_LOADER_THREADS (2)
+
+/* Prefilter segments longer than this (in samples) get shared between all
+ * loader threads. */
+#define LOADER_SPLIT_LENGTH (524288)
+struct wavldr      loader;
+int                preload_all;
+const char        *load_profile;
+
+/* Disk streaming configuration. stream_bank is NULL if streaming was not
+ * requested on the command line. */
+#define STREAM_MAX_VOICES (256)
+#define STREAM_RING_FRAMES (32768)
+const char        *stream_bank;
+unsigned           stream_head_ms;
+struct smplstream  stream;
+int                stream_active;
+
+/* Convolution reverb on the engine output. reverb_file is NULL if no
+ * impulse response was given with --reverb. */
+const char        *reverb_file;
+float              reverb_dry;
+struct convreverb  reverb;
+int                reverb_active;
+
+/* Notes are not given to the engine by the MIDI thread. They are queued with
+ * their PortMidi timestamp (milliseconds) and the audio callback starts or
+ * stops the pipe at the start of the engine block which will be heard
+ * midi_delay_ms after the event. This keeps the relative timing of notes to
+ * within a block instead of depending on when the MIDI thread happened to
+ * wake up. note_lock is held by whichever thread is changing the note counts
+ * of the pipes and queuing notes. midi_delay_ms is set by --mididelay, or
+ * from the output latency of the stream if that was not given. */
+#define NOTE_QUEUE_LENGTH (1024)
+struct note_action {
+	struct pipe_executor *pipe;
+	PmTimestamp           timestamp;
+	int                   start;
+};
+struct note_action note_queue[NOTE_QUEUE_LENGTH];
+odatomic_u32       note_queue_head;
+odatomic_u32       note_queue_tail;
+cop_mutex          note_lock;
+double             midi_delay_ms;
+double             output_latency_ms;
+unsigned long      engine_frames;
+
+/* Counted by the audio callback since the last print_midi_stats(). The
+ * latency is from the timestamp of the event to the block it started in
+ * being heard. Late notes were heard after midi_delay_ms. */
+odatomic_u32       note_count;
+odatomic_u32       note_late;
+odatomic_u32       note_latency_sum_us;
+odatomic_u32       note_latency_max_us;
+odatomic_u32       note_poly_misses;
+odatomic_u32       note_dropped;
+
+/* Load the impulse response in reverb_file and put the reverb on the output
+ * of the engine. Mono responses are used for both channels. */
+static const char *start_reverb(struct cop_alloc_iface *mem, struct fftset *fftset)
 {
-	struct pipe_executor *pipes = malloc(sizeof(*pipes) * nb_pipes);
-	unsigned i;
-	for (i = 0; i < nb_pipes; i++) {
-		static const char *NAMES[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
-
-		struct sample_load_info *sli = wavldr_add_sample(lset);
+	const char     *err = NULL;
+	unsigned char  *fbuf = NULL;
+	float          *ir = NULL;
+	const float    *irs[2];
+	struct smplwav  wav;
+	long            fsz = -1;
+	FILE           *f;
+
+	if ((f = fopen(reverb_file, "rb")) == NULL)
+		return "could not open impulse response";
+	if (fseek(f, 0, SEEK_END) == 0 && (fsz = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0 && (fbuf = malloc(fsz)) != NULL) {
+		if (fread(fbuf, 1, fsz, f) != (size_t)fsz)
+			err = "could not read impulse response";
+	} else {
+		err = "could not read impulse response";
+	}
+	fclose(f);
+
+	if (err == NULL && SMPLWAV_ERROR_CODE(smplwav_mount(&wav, fbuf, fsz, 0)))
+		err = "could not parse impulse response";
+	if (err == NULL && (ir = malloc(sizeof(float) * wav.format.channels * wav.data_frames)) == NULL)
+		err = "out of memory";
+
+	if (err == NULL) {
+		if (wav.format.sample_rate != PLAYBACK_SAMPLE_RATE)
+			printf("warning: impulse response is at %lu Hz, not %u Hz\n", (unsigned long)wav.format.sample_rate, PLAYBACK_SAMPLE_RATE);
+		smplwav_convert_deinterleave_floats(ir, wav.data_frames, wav.data, wav.data_frames, wav.format.channels, wav.format.format);
+		irs[0] = ir;
+		irs[1] = (wav.format.channels > 1) ? ir + wav.data_frames : ir;
+		if (convreverb_init(&reverb, mem, fftset, OUTPUT_SAMPLES, 2, irs, wav.data_frames, reverb_dry, 1.0f))
+			err = "could not create reverb";
+	}
 
-		if (sli == NULL) {
-			printf("out of memory\n");
-			abort();
-		}
-	
-		pipes[i].instance     = NULL;
-		pipes[i].nb_insts     = 0;
-		pipes[i].enabled      = 0;
-		pipes[i].target_freq  = ORGAN_PITCH16 * harmonic16 * pow(2.0, (i + first_midi - 36) / 12.0);
-		sli->filenames[0]     = strset_sprintf(sset, "%s/A0/%03d-%s.wav", path, i + first_midi, NAMES[(i+first_midi)%12]);
-		sli->load_flags[0]    = SMPL_COMP_LOADFLAG_AS;
-		sli->filenames[1]     = strset_sprintf(sset, "%s/R0/%03d-%s.wav", path, i + first_midi, NAMES[(i+first_midi)%12]);
-		sli->load_flags[1]    = SMPL_COMP_LOADFLAG_R;
-		sli->filenames[2]     = strset_sprintf(sset, "%s/R1/%03d-%s.wav", path, i + first_midi, NAMES[(i+first_midi)%12]);
-		sli->load_flags[2]    = SMPL_COMP_LOADFLAG_R;
-		sli->filenames[3]     = strset_sprintf(sset, "%s/R2/%03d-%s.wav", path, i + first_midi, NAMES[(i+first_midi)%12]);
-		sli->load_flags[3]    = SMPL_COMP_LOADFLAG_R;
-		sli->num_files        = 4;
-		sli->harmonic_number  = harmonic16;
-		sli->load_format      = 16;
-		sli->dest             = &(pipes[i].data);
-
-		if  (   sli->filenames[0] == NULL || sli->filenames[1] == NULL
-		    ||  sli->filenames[2] == NULL || sli->filenames[3] == NULL) {
-			abort();
-		}
+	if (err == NULL) {
+		printf("reverb: %.2f s impulse response with %u tail segments\n", wav.data_frames / (double)wav.format.sample_rate, reverb.nb_segments);
+		playeng_set_output_stage(engine, convreverb_output_stage, &reverb);
+		reverb_active = 1;
 	}
 
-	return pipes;
+	free(ir);
+	free(fbuf);
+	return err;
 }
 
-struct playeng    *engine;
-struct wav_dumper  dump_file;
-int                dump_file_open;
-
-static
-unsigned
-engine_callback
-	(void              *userdata
-	,struct dec_state **states
-	,unsigned           sigmask
-	,unsigned           old_flags
-	,unsigned           sampler_time
-	)
+static void pipe_loaded(void *context, struct sample_load_info *sli)
 {
-	struct pipe_executor *pd = userdata;
+	/* dest is the first member of the pipe executor. */
+	struct pipe_executor *pe = (struct pipe_executor *)sli->dest;
+	odatomic_store(&pe->loaded, 1);
+	if (wavldr_query_group(&loader, sli->group) == 0) {
+		if (residency_active)
+			residency_lock_tag(&residency, sli->group);
+		printf("%s ready\n", TEST_ENTRY_LIST[sli->group].directory_name);
+	}
+}
 
-	/* Initialize sample */
-	if (sigmask & 0x1) {
-		pd->data.attack.instantiate(states[0], &pd->data.attack, 0, 0);
-		states[0]->rate = (pd->target_freq * pd->data.sample_rate) * SMPL_POSITION_SCALE / (PLAYBACK_SAMPLE_RATE * pd->data.frequency) + 0.5;
+/* Enable a stop. If it has not been loaded yet, move it to the front of the
+ * load queue. Pipes start sounding as soon as they have been loaded. */
+static void enable_rank(unsigned rank)
+{
+	unsigned k;
+	const char *err;
+	for (k = 0; k < TEST_ENTRY_LIST[rank].nb_pipes; k++)
+		loaded_ranks[rank][k].enabled = 1;
+	if (wavldr_query_group(&loader, rank) != 0)
+		wavldr_request_group(&loader, rank);
+	if ((err = wavldr_query_group_error(&loader, rank)) != NULL)
+		fprintf(stderr, "%s did not load completely: %s\n", TEST_ENTRY_LIST[rank].directory_name, err);
+}
 
-		/* Only state 0 is enabled and there are no termination conditions. */
-		old_flags = PLAYENG_PACK_CALLBACK_STATUS(0, 0x1, 0x0, 0x0);
+/* Get the release of a sounding pipe ready before signalling it to stop. The
+ * stop will be handled lead_frames after the engine position which is read
+ * here, so the staged position is moved on by that much. Loops are not taken
+ * into account - if the attack wraps in that time, the guess is wrong and
+ * the release is simply instantiated in the audio callback.
+ *
+ * The instance pointer belongs to the audio callback. At worst a stale one
+ * gives the position of some other pipe, which is another wrong guess. */
+static void stage_release(struct pipe_executor *pd, unsigned long lead_frames)
+{
+	struct playeng_instance *instance = pd->instance;
+	uint_fast32_t ipos, fpos, rate;
+	if (instance != NULL && playeng_peek_position(instance, 0, &ipos, &fpos, &rate) == 0) {
+		uint_fast64_t adv = fpos + (uint_fast64_t)rate * lead_frames;
+		ipos += (uint_fast32_t)(adv / SMPL_POSITION_SCALE);
+		fpos  = (uint_fast32_t)(adv % SMPL_POSITION_SCALE);
+		relstage_prepare(&pd->release_stage, &pd->data, ipos, fpos, rate);
 	}
+}
 
-	/* End sample */
-	if (sigmask & 0x2) {
-		struct reltable_data rtd;
-		reltable_find(&pd->data.reltable, &rtd, states[0]->ipos, states[0]->fpos);
-
-#if OPENDIAPASON_VERBOSE_DEBUG
-		printf("Release pos=(%u,%u),rgain=%f,xfade=%d,id=%d\n", rtd.pos_int, rtd.pos_frac, rtd.gain, rtd.crossfade, rtd.id);
-#endif
+/* Queue a note to start or stop at the given PortMidi time. note_lock must
+ * be held. */
+static void queue_note(struct pipe_executor *pd, PmTimestamp timestamp, int start)
+{
+	uint32_t head = odatomic_load(&note_queue_head);
+	if (head - odatomic_load(&note_queue_tail) >= NOTE_QUEUE_LENGTH) {
+		odatomic_add(&note_dropped, 1);
+		return;
+	}
+	note_queue[head % NOTE_QUEUE_LENGTH].pipe      = pd;
+	note_queue[head % NOTE_QUEUE_LENGTH].timestamp = timestamp;
+	note_queue[head % NOTE_QUEUE_LENGTH].start     = start;
+	odatomic_store(&note_queue_head, head + 1);
+}
 
-		pd->data.releases[rtd.id].instantiate(states[1], &pd->data.releases[rtd.id], rtd.pos_int, rtd.pos_frac);
-		states[1]->rate = states[0]->rate;
-		states[1]->setfade(states[1], 0, 0.0f);
-		states[1]->setfade(states[1], rtd.crossfade, rtd.gain);
-		states[0]->setfade(states[0], rtd.crossfade, 0.0f);
+/* Number of frames between now and the engine rendering the block which
+ * will be heard midi_delay_ms after timestamp. */
+static unsigned long frames_until_due(PmTimestamp timestamp)
+{
+	double ms = (int32_t)(timestamp - Pt_Time()) + midi_delay_ms - output_latency_ms;
+	return (ms > 0.0) ? (unsigned long)(ms * (PLAYBACK_SAMPLE_RATE / 1000.0)) : 0;
+}
 
-		/* Both state 0 and state 1 are enabled.
-		 * State 0 terminates on fade completion.
-		 * State 1 terminates on entering of loop. */
-		old_flags = PLAYENG_PACK_CALLBACK_STATUS(0, 0x3, 0x1, 0x2);
+/* Stop every sounding pipe of a rank and disable it. note_lock must be
+ * held. */
+static void release_rank(unsigned rank, PmTimestamp timestamp)
+{
+	unsigned k;
+	for (k = 0; k < TEST_ENTRY_LIST[rank].nb_pipes; k++) {
+		struct pipe_executor *pd = &loaded_ranks[rank][k];
+		if (pd->nb_insts) {
+			stage_release(pd, frames_until_due(timestamp));
+			queue_note(pd, timestamp, 0);
+		}
+		pd->nb_insts = 0;
+		pd->enabled  = 0;
 	}
+}
 
-	return old_flags;
+/* Start or stop a pipe at the start of an engine block. Only called by the
+ * audio callback. */
+static void apply_note(struct pipe_executor *pd, int start)
+{
+	if (start) {
+		if (pd->instance == NULL && (pd->instance = playeng_insert(engine, 2, 0x01, engine_callback, pd)) == NULL)
+			odatomic_add(&note_poly_misses, 1);
+	} else if (pd->instance != NULL) {
+		playeng_signal_instance(engine, pd->instance, 0x02);
+		pd->instance = NULL;
+	}
 }
 
 static
@@ -261,10 +283,67 @@ pa_callback
 	,void                           *userData
 	)
 {
+	static const double block_ms = OUTPUT_SAMPLES * 1000.0 / PLAYBACK_SAMPLE_RATE;
 	unsigned long samp;
+	unsigned long done = 0;
 	float *ob = output;
+	PtTimestamp now = Pt_Time();
+
+	/* How long until the first frame of this buffer is heard. */
+	double dac_ms = (timeInfo->outputBufferDacTime > timeInfo->currentTime) ? (timeInfo->outputBufferDacTime - timeInfo->currentTime) * 1000.0 : 0.0;
+
+	/* The engine only picks up new instances and signals at the start of a
+	 * call which begins a new block, so the buffer is split up at the
+	 * blocks where queued notes are due. Times here are in milliseconds
+	 * relative to now. */
+	while (done < frameCount) {
+		unsigned long chunk    = frameCount - done;
+		unsigned long rendered = (OUTPUT_SAMPLES - engine_frames % OUTPUT_SAMPLES) % OUTPUT_SAMPLES;
+
+		if (rendered) {
+			/* The engine already has the rest of its current block. */
+			if (chunk > rendered)
+				chunk = rendered;
+		} else {
+			double   heard_ms = dac_ms + done * 1000.0 / PLAYBACK_SAMPLE_RATE;
+			uint32_t head     = odatomic_load(&note_queue_head);
+			uint32_t tail     = odatomic_load(&note_queue_tail);
+
+			while (tail != head) {
+				const struct note_action *na = &note_queue[tail % NOTE_QUEUE_LENGTH];
+				double event_ms = (int32_t)(na->timestamp - now);
+				double due_ms   = event_ms + midi_delay_ms;
+				uint32_t latency_us;
+
+				if (due_ms >= heard_ms + block_ms) {
+					/* Not due yet. Render up to the block it is due in. */
+					unsigned long blocks = (unsigned long)((due_ms - heard_ms) / block_ms);
+					if (chunk > blocks * OUTPUT_SAMPLES)
+						chunk = blocks * OUTPUT_SAMPLES;
+					break;
+				}
+
+				apply_note(na->pipe, na->start);
 
-	playeng_process(engine, ob, 2, frameCount);
+				latency_us = (heard_ms > event_ms) ? (uint32_t)((heard_ms - event_ms) * 1000.0) : 0;
+				odatomic_add(&note_count, 1);
+				odatomic_add(&note_latency_sum_us, latency_us);
+				if (latency_us > odatomic_load(&note_latency_max_us))
+					odatomic_store(&note_latency_max_us, latency_us);
+				if (due_ms < heard_ms)
+					odatomic_add(&note_late, 1);
+				tail++;
+			}
+
+			odatomic_store(&note_queue_tail, tail);
+		}
+
+		playeng_process(engine, ob + 2 * done, 2, chunk);
+		if (stream_active)
+			smplstream_advance(&stream, (unsigned)((engine_frames + chunk + OUTPUT_SAMPLES - 1) / OUTPUT_SAMPLES - (engine_frames + OUTPUT_SAMPLES - 1) / OUTPUT_SAMPLES));
+		done          += chunk;
+		engine_frames += chunk;
+	}
 
 	for (samp = 0; samp < frameCount; samp++) {
 		ob[2*samp+0] *= 1; /* 0.25 */
@@ -286,56 +365,102 @@ struct midi_stream_data {
 
 #define NEVENTREAD (64)
 
+/* The MIDI thread checks for input this often. PortMidi has no portable way
+ * to block until input arrives, so it polls - but much more often than the
+ * timestamps can resolve. */
+#define MIDI_POLL_US (250)
+
+#ifdef _WIN32
+
+#include <windows.h>
+#include <mmsystem.h>
+
+static void os_midi_thread_begin(void)
+{
+	/* Sleep() only gets close to a millisecond with the timer resolution
+	 * raised. */
+	(void)timeBeginPeriod(1);
+	(void)SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+}
+
+static void os_midi_thread_end(void)
+{
+	(void)timeEndPeriod(1);
+}
+
+static void os_sleep_us(unsigned us)
+{
+	Sleep((us + 999) / 1000);
+}
+
+#else
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+static void os_midi_thread_begin(void)
+{
+	/* This only works with permission to use real-time scheduling. Without
+	 * it, the thread just runs at normal priority. */
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 1;
+	(void)pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+}
+
+static void os_midi_thread_end(void)
+{
+}
+
+static void os_sleep_us(unsigned us)
+{
+	usleep(us);
+}
+
+#endif
+
 static void *midi_thread_proc(void *argument)
 {
 	struct midi_stream_data *msd;
 	PortMidiStream *pms;
 	PmEvent events[NEVENTREAD];
 	int nread = 0;
+	int last_error = 0;
 	int terminated = 0;
 
 	msd = argument;
 	pms = msd->pms;
+	os_midi_thread_begin();
 	do {
-		int note_locked = 0;
-
 		terminated = cop_mutex_trylock(&msd->abort_signal);
 		if (terminated)
 			cop_mutex_unlock(&msd->abort_signal);
 
-		while ((nread = Pm_Read(pms, events, NEVENTREAD)) > 0) {
+		if ((nread = Pm_Read(pms, events, NEVENTREAD)) > 0) {
 			int i;
+			cop_mutex_lock(&note_lock);
 			for (i = 0; i < nread; i++) {
 				unsigned j;
-				long     msg      = events[i].message;
-				unsigned channel  = Pm_MessageStatus(msg) & 0x0F;
-				unsigned evtid    = Pm_MessageStatus(msg) & 0xF0;
-				unsigned idx      = Pm_MessageData1(msg);
-				unsigned velocity = Pm_MessageData2(msg);
+				long        msg       = events[i].message;
+				PmTimestamp timestamp = events[i].timestamp;
+				unsigned    channel   = Pm_MessageStatus(msg) & 0x0F;
+				unsigned    evtid     = Pm_MessageStatus(msg) & 0xF0;
+				unsigned    idx       = Pm_MessageData1(msg);
+				unsigned    velocity  = Pm_MessageData2(msg);
 
 				for (j = 0; j < NUM_TEST_ENTRY_LIST; j++) {
 					unsigned midx = idx;
 
 					if (evtid == 176) {
-						unsigned k;
-
 						if (idx != TEST_ENTRY_LIST[j].midi_shortcut)
 							continue;
 
 						if (velocity == 0 && loaded_ranks[j][0].enabled) {
-							for (k = 0; k < TEST_ENTRY_LIST[j].nb_pipes; k++) {
-								if (loaded_ranks[j][k].nb_insts && loaded_ranks[j][k].instance) {
-									playeng_signal_instance(engine, loaded_ranks[j][k].instance, 0x02);
-								}
-								loaded_ranks[j][k].instance = NULL;
-								loaded_ranks[j][k].nb_insts = 0;
-								loaded_ranks[j][k].enabled = 0;
-							}
+							release_rank(j, timestamp);
 							printf("%s OFF\n", TEST_ENTRY_LIST[j].directory_name);
 						} else if (velocity && !loaded_ranks[j][0].enabled) {
-							for (k = 0; k < TEST_ENTRY_LIST[j].nb_pipes; k++) {
-								loaded_ranks[j][k].enabled = 1;
-							}
+							enable_rank(j);
 							printf("%s ON\n", TEST_ENTRY_LIST[j].directory_name);
 						}
 
@@ -353,54 +478,40 @@ static void *midi_thread_proc(void *argument)
 					if (midx >= TEST_ENTRY_LIST[j].nb_pipes)
 						continue;
 
-					if (!loaded_ranks[j][midx].enabled)
+					if (!loaded_ranks[j][midx].enabled || !odatomic_load(&loaded_ranks[j][midx].loaded))
 						continue;
 
 					if (evtid == 0x80 || (evtid == 0x90 && velocity == 0x00)) {
 						if (loaded_ranks[j][midx].nb_insts < 1)
 							continue;
 
-						loaded_ranks[j][midx].nb_insts--;
-
-						if (loaded_ranks[j][midx].nb_insts != 0 || loaded_ranks[j][midx].instance == NULL)
+						if (--loaded_ranks[j][midx].nb_insts != 0)
 							continue;
 
-						if (!note_locked) {
-							playeng_push_block_insertion(engine);
-							playeng_signal_block(engine, 0x3);
-							note_locked = 1;
-						}
-
-						playeng_signal_instance(engine, loaded_ranks[j][midx].instance, 0x02);
-						loaded_ranks[j][midx].instance = NULL;
+						stage_release(&loaded_ranks[j][midx], frames_until_due(timestamp));
+						queue_note(&loaded_ranks[j][midx], timestamp, 0);
 					} else if (evtid == 0x90) {
-						loaded_ranks[j][midx].nb_insts++;
-
-						if (loaded_ranks[j][midx].instance != NULL)
-							continue;
-
-						if (!note_locked) {
-							playeng_push_block_insertion(engine);
-							playeng_signal_block(engine, 0x3);
-							note_locked = 1;
-						}
-
-						loaded_ranks[j][midx].instance = playeng_insert(engine, 2, 0x01, engine_callback, &(loaded_ranks[j][midx]));
-						if (loaded_ranks[j][midx].instance == NULL)
-							printf("Polyphony exceeded!\n");
+						if (loaded_ranks[j][midx].nb_insts++ == 0)
+							queue_note(&loaded_ranks[j][midx], timestamp, 1);
 					}
 				}
 			}
+			cop_mutex_unlock(&note_lock);
 		}
 
-		if (note_locked) {
-			playeng_signal_unblock(engine, 0x3);
-			playeng_pop_block_insertion(engine);
-		}
+		/* Report a read error once rather than every poll. */
+		if (nread < 0 && nread != last_error)
+			fprintf(stderr, "MIDI read failed: %s\n", Pm_GetErrorText((PmError)nread));
+		last_error = (nread < 0) ? nread : 0;
 
-		Pa_Sleep(10);
-	} while (nread != 0 || !terminated);
+		/* A full read means more events may be waiting. Once termination
+		 * has been requested, keep going until the stream is empty (or
+		 * fails) so no note is left behind. */
+		if (nread < NEVENTREAD)
+			os_sleep_us(MIDI_POLL_US);
+	} while (nread > 0 || !terminated);
 
+	os_midi_thread_end();
 	(void)Pm_Close(pms);
 	free(msd);
 
@@ -423,6 +534,11 @@ static struct midi_stream_data *start_midi(PmDeviceID midi_in_id, void *ud)
 		return NULL;
 	}
 
+	/* Event timestamps are PortTime milliseconds, which the audio callback
+	 * also reads. */
+	if (!Pt_Started())
+		(void)Pt_Start(1, NULL, NULL);
+
 	if ((merr = Pm_OpenInput(&msd->pms, midi_in_id, NULL, 128, NULL, NULL)) != pmNoError) {
 		cop_mutex_destroy(&msd->abort_signal);
 		free(msd);
@@ -472,6 +588,117 @@ static int immediate_getchar()
 
 #endif
 
+static void print_stream_stats(void)
+{
+	static const unsigned edges[SMPLSTREAM_LEAD_BINS-1] = SMPLSTREAM_LEAD_EDGES_MS;
+	struct smplstream_stats stats;
+	unsigned i;
+
+	if (!stream_active) {
+		printf("streaming is not enabled\n");
+		return;
+	}
+
+	smplstream_query_stats(&stream, &stats, 1);
+	printf("stream: %u voices (peak %u), %lu starved, %lu underrun frames in %lu blocks\n", stats.active_voices, stats.peak_voices, stats.starved_voices, stats.underrun_frames, stats.underrun_blocks);
+	printf("stream: %llu KiB resident, %llu KiB in bank, %llu KiB prefetched\n", (unsigned long long)(stats.resident_bytes / 1024), (unsigned long long)(stats.bank_bytes / 1024), (unsigned long long)(stats.prefetched_bytes / 1024));
+	if (stats.min_lead_ms != UINT_MAX)
+		printf("stream: minimum prefetch lead %u ms\n", stats.min_lead_ms);
+	for (i = 0; i < SMPLSTREAM_LEAD_BINS; i++) {
+		if (i < SMPLSTREAM_LEAD_BINS-1)
+			printf("  lead < %3u ms: %lu\n", edges[i], stats.lead_histogram[i]);
+		else
+			printf("  lead >=%3u ms: %lu\n", edges[i-1], stats.lead_histogram[i]);
+	}
+}
+
+static void print_residency(void)
+{
+	struct residency_stats total;
+	unsigned i;
+
+	if (!residency_active) {
+		printf("residency management is not enabled\n");
+		return;
+	}
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < NUM_TEST_ENTRY_LIST; i++) {
+		struct residency_stats stats;
+		int valid = (residency_query(&residency, i, &stats) == 0);
+		if (stats.allocated == 0)
+			continue;
+		if (valid)
+			printf("%-28s %7lu KiB resident, %7lu KiB not resident, %7lu KiB locked%s\n", TEST_ENTRY_LIST[i].directory_name, (unsigned long)(stats.resident / 1024), (unsigned long)(stats.non_resident / 1024), (unsigned long)(stats.locked / 1024), stats.huge_pages ? " (huge)" : "");
+		else
+			printf("%-28s %7lu KiB allocated, %7lu KiB locked%s\n", TEST_ENTRY_LIST[i].directory_name, (unsigned long)(stats.allocated / 1024), (unsigned long)(stats.locked / 1024), stats.huge_pages ? " (huge)" : "");
+		total.allocated    += stats.allocated;
+		total.locked       += stats.locked;
+		total.retouched    += stats.retouched;
+		total.resident     += stats.resident;
+		total.non_resident += stats.non_resident;
+	}
+	printf("total: %lu KiB allocated, %lu KiB resident, %lu KiB not resident, %lu KiB locked, %lu KiB re-touched\n", (unsigned long)(total.allocated / 1024), (unsigned long)(total.resident / 1024), (unsigned long)(total.non_resident / 1024), (unsigned long)(total.locked / 1024), (unsigned long)(total.retouched / 1024));
+}
+
+static void print_load_profile(void)
+{
+	struct wavldr_profile prof;
+	unsigned nb_loaded, nb_shared, i;
+	uint_fast64_t wall_ns, bytes_saved, busy_ns = 0;
+
+	wavldr_query_profile(&loader, &prof, &nb_loaded, &wall_ns);
+	for (i = 0; i < WAVLDR_NB_STAGES; i++)
+		busy_ns += prof.stage_ns[i];
+	printf("loader: %u samples, %llu MiB read in %.2f s (%.2f s of thread time)\n", nb_loaded, (unsigned long long)(prof.bytes_read / (1024*1024)), wall_ns * 1e-9, busy_ns * 1e-9);
+	for (i = 0; i < WAVLDR_NB_STAGES; i++)
+		printf("  %-10s %8.2f s (%5.1f%%)\n", wavldr_stage_name(i), prof.stage_ns[i] * 1e-9, busy_ns ? prof.stage_ns[i] * 100.0 / busy_ns : 0.0);
+	printf("  peak temporary memory per thread: %lu KiB\n", (unsigned long)(prof.peak_arena / 1024));
+	wavldr_query_sharing(&loader, &nb_shared, &bytes_saved);
+	printf("  %llu MiB of sample data, %u samples shared saving %llu MiB\n", (unsigned long long)(prof.data_bytes / (1024*1024)), nb_shared, (unsigned long long)(bytes_saved / (1024*1024)));
+}
+
+static void print_release_stats(void)
+{
+	unsigned long hits = 0, misses = 0;
+	unsigned i, j;
+	for (i = 0; i < NUM_TEST_ENTRY_LIST; i++) {
+		for (j = 0; j < TEST_ENTRY_LIST[i].nb_pipes; j++) {
+			unsigned long h, m;
+			relstage_query(&loaded_ranks[i][j].release_stage, &h, &m);
+			hits   += h;
+			misses += m;
+		}
+	}
+	printf("releases: %lu started from staged decoders, %lu instantiated in the callback\n", hits, misses);
+}
+
+/* Print the MIDI timing counters and start counting again. */
+static void print_midi_stats(void)
+{
+	uint32_t count   = odatomic_load(&note_count);
+	uint32_t late    = odatomic_load(&note_late);
+	uint32_t sum_us  = odatomic_load(&note_latency_sum_us);
+	uint32_t max_us  = odatomic_load(&note_latency_max_us);
+	uint32_t poly    = odatomic_load(&note_poly_misses);
+	uint32_t dropped = odatomic_load(&note_dropped);
+
+	odatomic_add(&note_count, -count);
+	odatomic_add(&note_late, -late);
+	odatomic_add(&note_latency_sum_us, -sum_us);
+	odatomic_store(&note_latency_max_us, 0);
+	odatomic_add(&note_poly_misses, -poly);
+	odatomic_add(&note_dropped, -dropped);
+
+	printf("midi: scheduling %.1f ms after input, %.1f ms output latency\n", midi_delay_ms, output_latency_ms);
+	if (count)
+		printf("midi: %lu notes, input to output latency %.2f ms average, %.2f ms max, %lu late\n", (unsigned long)count, sum_us * 1e-3 / count, max_us * 1e-3, (unsigned long)late);
+	else
+		printf("midi: no notes\n");
+	if (poly || dropped)
+		printf("midi: %lu notes over polyphony, %lu dropped from a full queue\n", (unsigned long)poly, (unsigned long)dropped);
+}
+
 static int setup_sound(PmDeviceID midi_devid)
 {
 	PaHostApiIndex def_api;
@@ -535,10 +762,28 @@ static int setup_sound(PmDeviceID midi_devid)
 	}
 	printf("ok\n");
 
+	/* Leave enough time for the event to be picked up by the MIDI thread and
+	 * for a whole buffer (which is usually about as long as the output
+	 * latency) to go by before the block it is due in starts. */
+	output_latency_ms = Pa_GetStreamInfo(stream)->outputLatency * 1000.0;
+	if (midi_delay_ms < 0.0)
+		midi_delay_ms = ceil(2.0 * output_latency_ms) + 2.0;
+	printf("scheduling midi events %.1f ms after they are received\n", midi_delay_ms);
+
+	if (cop_mutex_create(&note_lock)) {
+		fprintf(stderr, "could not create note lock\n");
+		Pa_CloseStream(stream);
+		return -3;
+	}
+	odatomic_store(&note_queue_head, 0);
+	odatomic_store(&note_queue_tail, 0);
+	engine_frames = 0;
+
 	printf("initializing default midi device... ");
 	struct midi_stream_data *midi_acs = start_midi(midi_devid, NULL);
 	if (midi_acs == NULL) {
 		fprintf(stderr, "Failed to start midi thread.\n");
+		cop_mutex_destroy(&note_lock);
 		Pa_CloseStream(stream);
 		return -3;
 	}
@@ -548,24 +793,26 @@ static int setup_sound(PmDeviceID midi_devid)
 
 	while ((input = immediate_getchar()) != 'q') {
 		unsigned i;
+		if (input == '?')
+			print_stream_stats();
+		if (input == 'm')
+			print_residency();
+		if (input == 'p')
+			print_load_profile();
+		if (input == 'e')
+			print_release_stats();
+		if (input == 'r' && reverb_active)
+			printf("reverb: %lu late blocks\n", convreverb_query_late_blocks(&reverb));
+		if (input == 'l')
+			print_midi_stats();
 		for (i = 0; i < NUM_TEST_ENTRY_LIST; i++) {
 			if (TEST_ENTRY_LIST[i].shortcut == input) {
-				if (loaded_ranks[i][0].enabled) {
-					unsigned j;
-					for (j = 0; j < TEST_ENTRY_LIST[i].nb_pipes; j++) {
-						if (loaded_ranks[i][j].nb_insts && loaded_ranks[i][j].instance) {
-							playeng_signal_instance(engine, loaded_ranks[i][j].instance, 0x02);
-						}
-						loaded_ranks[i][j].instance = NULL;
-						loaded_ranks[i][j].nb_insts = 0;
-						loaded_ranks[i][j].enabled = 0;
-					}
-				} else {
-					unsigned j;
-					for (j = 0; j < TEST_ENTRY_LIST[i].nb_pipes; j++) {
-						loaded_ranks[i][j].enabled = 1;
-					}
-				}
+				cop_mutex_lock(&note_lock);
+				if (loaded_ranks[i][0].enabled)
+					release_rank(i, Pt_Time());
+				else
+					enable_rank(i);
+				cop_mutex_unlock(&note_lock);
 			}
 		}
 	}
@@ -575,6 +822,7 @@ static int setup_sound(PmDeviceID midi_devid)
 	cop_mutex_unlock(&midi_acs->abort_signal);
 	cop_thread_join(midi_acs->th, NULL);
 	cop_mutex_destroy(&midi_acs->abort_signal);
+	cop_mutex_destroy(&note_lock);
 
 	Pa_CloseStream(stream);
 
@@ -628,6 +876,19 @@ static int handle_arguments(int argc, char *argv[], PmDeviceID *devid)
 	argv++;
 
 	dump_file_open = 0;
+	dump_filename  = NULL;
+	dump_bits      = 24;
+	preload_all    = 0;
+	load_profile   = NULL;
+	stream_bank    = NULL;
+	stream_head_ms = 500;
+	residency_active = 0;
+	residency_budget = 0;
+	residency_flags  = RESIDENCY_FLAG_RETOUCH;
+	reverb_file      = NULL;
+	reverb_dry       = 1.0f;
+	reverb_active    = 0;
+	midi_delay_ms    = -1.0;
 
 	while (argc > 0) {
 
@@ -678,42 +939,125 @@ static int handle_arguments(int argc, char *argv[], PmDeviceID *devid)
 				return -1;
 			}
 
-			if (dump_file_open) {
+			if (dump_filename != NULL) {
 				fprintf(stderr, "dump file already open\n");
 				return -1;
 			}
 
 			argc--;
 			argv++;
+			dump_filename = *argv;
+		} else if (!strcmp(*argv, "--dumpformat")) {
+			if (argc <= 1) {
+				fprintf(stderr, "give 16, 24 or float for --dumpformat\n");
+				return -1;
+			}
+
+			argc--;
+			argv++;
+			if (!strcmp(*argv, "16")) {
+				dump_bits = 16;
+			} else if (!strcmp(*argv, "24")) {
+				dump_bits = 24;
+			} else if (!strcmp(*argv, "float")) {
+				dump_bits = 32;
+			} else {
+				fprintf(stderr, "unknown dump format '%s'\n", *argv);
+				return -1;
+			}
+		} else if (!strcmp(*argv, "--preload")) {
+			preload_all = 1;
+		} else if (!strcmp(*argv, "--stream")) {
+			if (argc <= 1) {
+				fprintf(stderr, "give a bank filename for --stream\n");
+				return -1;
+			}
 
-			if (wav_dumper_begin(&dump_file, *argv, 2, 24, PLAYBACK_SAMPLE_RATE, 4, PLAYBACK_SAMPLE_RATE)) {
-				fprintf(stderr, "could not create dump file '%s'\n", *argv);
+			argc--;
+			argv++;
+			stream_bank = *argv;
+		} else if (!strcmp(*argv, "--streamhead")) {
+			if (argc <= 1) {
+				fprintf(stderr, "give a number of milliseconds for --streamhead\n");
 				return -1;
 			}
 
-			dump_file_open = 1;
+			argc--;
+			argv++;
+			stream_head_ms = (unsigned)atoi(*argv);
+		} else if (!strcmp(*argv, "--loadprofile")) {
+			if (argc <= 1) {
+				fprintf(stderr, "give a filename for --loadprofile\n");
+				return -1;
+			}
+
+			argc--;
+			argv++;
+			load_profile = *argv;
+		} else if (!strcmp(*argv, "--lockbudget")) {
+			if (argc <= 1) {
+				fprintf(stderr, "give a number of MiB for --lockbudget\n");
+				return -1;
+			}
+
+			argc--;
+			argv++;
+			residency_budget = (size_t)atoi(*argv) * 1024 * 1024;
+			residency_active = 1;
+		} else if (!strcmp(*argv, "--hugepages")) {
+			residency_flags |= RESIDENCY_FLAG_HUGE_TRANSPARENT;
+			residency_active = 1;
+		} else if (!strcmp(*argv, "--hugetlb")) {
+			residency_flags |= RESIDENCY_FLAG_HUGE_EXPLICIT;
+			residency_active = 1;
+		} else if (!strcmp(*argv, "--reverb")) {
+			if (argc <= 1) {
+				fprintf(stderr, "give an impulse response filename for --reverb\n");
+				return -1;
+			}
+
+			argc--;
+			argv++;
+			reverb_file = *argv;
+		} else if (!strcmp(*argv, "--reverbdry")) {
+			if (argc <= 1) {
+				fprintf(stderr, "give a gain for --reverbdry\n");
+				return -1;
+			}
+
+			argc--;
+			argv++;
+			reverb_dry = (float)atof(*argv);
+		} else if (!strcmp(*argv, "--mididelay")) {
+			if (argc <= 1) {
+				fprintf(stderr, "give a number of milliseconds for --mididelay\n");
+				return -1;
+			}
+
+			argc--;
+			argv++;
+			midi_delay_ms = atof(*argv);
+			if (midi_delay_ms < 0.0)
+				midi_delay_ms = 0.0;
 		}
 
 		argc--;
 		argv++;
 	}
 
+	if (dump_filename != NULL) {
+		if (wav_dumper_begin(&dump_file, dump_filename, 2, dump_bits, PLAYBACK_SAMPLE_RATE, 4, PLAYBACK_SAMPLE_RATE)) {
+			fprintf(stderr, "could not create dump file '%s'\n", dump_filename);
+			return -1;
+		}
+		dump_file_open = 1;
+	}
+
 	*devid = (midi_devid >= 0) ? midi_devid : Pm_GetDefaultInputDeviceID();
 
 	return 0;
 }
 
-static size_t pool_size()
-{
-	size_t sysmem = cop_memory_query_system_memory();
-	if (sysmem > 1024*(size_t)1024*1024) {
-		sysmem -= 256*(size_t)1024*1024;
-	} else {
-		sysmem = 3 * (sysmem / 4);
-	}
-	return sysmem;
-}
-
 int main(int argc, char *argv[])
 {
 	PaError ec;
@@ -776,7 +1120,6 @@ int main(int argc, char *argv[])
 		struct cop_salloc_iface  mem;
 		struct fftset            fftset;
 		struct odfilter          prefilter;
-		struct wavldr            ls;
 		struct strset            ss;
 		size_t                   sysmem;
 		const char              *err;
@@ -791,45 +1134,104 @@ int main(int argc, char *argv[])
 		/* Build the interpolation pre-filter. */
 		(void)odfilter_interp_prefilter_init(&prefilter, &mem, &fftset);
 
+		if (reverb_file != NULL && (err = start_reverb(&(mem.iface), &fftset)) != NULL) {
+			fprintf(stderr, "reverb error: %s\n", err);
+			abort();
+		}
+
+		if (residency_active && residency_init(&residency, residency_budget, residency_flags, RESIDENCY_RETOUCH_MS)) {
+			fprintf(stderr, "could not start the residency manager\n");
+			abort();
+		}
+
 		/* Setup the load list. */
-		(void)wavldr_initialise(&ls);
+		(void)wavldr_initialise(&loader);
+		if (stream_bank != NULL) {
+			if (smplstream_init(&stream, stream_bank, stream_head_ms, STREAM_MAX_VOICES, STREAM_RING_FRAMES)) {
+				fprintf(stderr, "could not create stream bank '%s'\n", stream_bank);
+				abort();
+			}
+			wavldr_set_stream(&loader, &stream);
+			stream_active = 1;
+		}
 		for (i = 0; i < NUM_TEST_ENTRY_LIST; i++) {
-			printf("loading '%s'\n", TEST_ENTRY_LIST[i].directory_name);
-			loaded_ranks[i] = load_executors(TEST_ENTRY_LIST[i].directory_name, TEST_ENTRY_LIST[i].first_midi, TEST_ENTRY_LIST[i].nb_pipes, TEST_ENTRY_LIST[i].harmonic16, &ls, &ss);
+			printf("queueing '%s'\n", TEST_ENTRY_LIST[i].directory_name);
+			loaded_ranks[i] = load_executors(TEST_ENTRY_LIST[i].directory_name, TEST_ENTRY_LIST[i].first_midi, TEST_ENTRY_LIST[i].nb_pipes, TEST_ENTRY_LIST[i].harmonic16, i, &loader, &ss, residency_active ? residency_get_allocator(&residency, i) : NULL);
+			if (loaded_ranks[i] == NULL) {
+				printf("out of memory\n");
+				abort();
+			}
 		}
-		
+
+		/* The stream bank can only be mapped once everything has been
+		 * written to it, so streaming always loads everything before playing.
+		 * Otherwise, start playing immediately and load in the background. */
+		wavldr_set_mode(&loader, (preload_all || stream_active) ? WAVLDR_MODE_ALL : WAVLDR_MODE_ON_DEMAND);
+		wavldr_set_callback(&loader, pipe_loaded, NULL);
+		wavldr_set_split_length(&loader, LOADER_SPLIT_LENGTH);
+		if (load_profile != NULL)
+			wavldr_set_profile_file(&loader, load_profile);
+
 		/* Execute the load list. */
 		err =
 			wavldr_begin_load
-				(&ls
+				(&loader
 				,&(mem.iface)
 				,&fftset
 				,&prefilter
-				,4
+				,stream_active ? LOADER_THREADS : LAZY_LOADER_THREADS
 				);
 		if (err != NULL) {
 			fprintf(stderr, "load start error: %s\n", err);
 			abort();
 		}
 
-		while ((remaining = wavldr_query_progress(&ls, &nb_samples)) != 0) {
-			printf("loading (%0.1f%%)\r", (nb_samples - remaining) * 100.0f / (float)nb_samples);
-			fflush(stdout);
+		if (stream_active) {
+			while ((remaining = wavldr_query_progress(&loader, &nb_samples)) != 0) {
+				printf("loading (%0.1f%%)\r", (nb_samples - remaining) * 100.0f / (float)nb_samples);
+				fflush(stdout);
 #ifdef WIN32
-			Sleep(1000);
+				Sleep(1000);
 #else
-			sleep(1);
+				sleep(1);
 #endif
+			}
+			printf("loading (100.0%%)\n");
+			print_load_profile();
+
+			err = wavldr_finish(&loader);
+			if (err != NULL) {
+				fprintf(stderr, "load error: %s\n", err);
+				abort();
+			}
+
+			err = smplstream_start(&stream);
+			if (err != NULL) {
+				fprintf(stderr, "stream error: %s\n", err);
+				abort();
+			}
+			print_stream_stats();
+
+			rv = setup_sound(midi_devid);
+
+			smplstream_destroy(&stream);
+		} else {
+			rv = setup_sound(midi_devid);
+
+			/* Anything which has not started loading is not needed. */
+			wavldr_cancel(&loader);
+			err = wavldr_finish(&loader);
+			if (err != NULL)
+				fprintf(stderr, "load error: %s\n", err);
 		}
-		printf("loading (100.0%%)\n");
 
-		err = wavldr_finish(&ls);
-		if (err != NULL) {
-			fprintf(stderr, "load error: %s\n", err);
-			abort();
+		if (reverb_active) {
+			playeng_set_output_stage(engine, NULL, NULL);
+			convreverb_destroy(&reverb);
 		}
 
-		rv = setup_sound(midi_devid);
+		if (residency_active)
+			residency_destroy(&residency);
 
 		strset_free(&ss);
 		fftset_destroy(&fftset);
@@ -837,8 +1239,13 @@ int main(int argc, char *argv[])
 	}
 
 	/* Close the dump file. */
-	if (dump_file_open)
-		wav_dumper_end(&dump_file);
+	if (dump_file_open) {
+		unsigned long dropped = wav_dumper_query_overflow(&dump_file);
+		if (dropped)
+			printf("dump: %lu frames were dropped because the writer fell behind\n", dropped);
+		if (wav_dumper_end(&dump_file))
+			fprintf(stderr, "failed to finish the dump file\n");
+	}
 
 	/* Who cares? */
 	playeng_destroy(engine);
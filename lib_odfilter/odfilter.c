@@ -19,7 +19,9 @@
  * DEALINGS IN THE SOFTWARE. */
 
 #include "opendiapason/odfilter.h"
+#include "cop/cop_attributes.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -39,6 +41,7 @@ int odfilter_init_temporaries(struct odfilter_temporaries *tmps, struct cop_allo
 		(   (tmps->tmp1 = cop_alloc(allocobj, sizeof(float) * filter->conv_len, 64)) == NULL
 		||  (tmps->tmp2 = cop_alloc(allocobj, sizeof(float) * filter->conv_len, 64)) == NULL
 		||  (tmps->tmp3 = cop_alloc(allocobj, sizeof(float) * filter->conv_len, 64)) == NULL
+		||  (tmps->tmp4 = cop_alloc(allocobj, sizeof(float) * filter->conv_len, 64)) == NULL
 		);
 }
 
@@ -78,8 +81,247 @@ void odfilter_build_conv(struct odfilter *pf, struct odfilter_temporaries *tmps,
 	fftset_fft_conv_get_kernel(pf->conv, pf->kernel, tmps->tmp1);
 }
 
-/* TODO: Optimize this bastard. Profiling shows that this function takes
- * almost as much processing time as the FFT it calls which is ridiculous. */
+/* Copy count samples of a looped input into dst starting from *input_pos.
+ * Whenever the end of the input is reached, reading continues from
+ * susp_start. */
+static void
+gather_looped
+	(float         *dst
+	,const float   *input
+	,unsigned long  length
+	,unsigned long  susp_start
+	,unsigned long *input_pos
+	,unsigned       count
+	)
+{
+	unsigned long pos = *input_pos;
+	while (count) {
+		unsigned long avail = length - pos;
+		unsigned      n     = (count < avail) ? count : (unsigned)avail;
+		memcpy(dst, input + pos, sizeof(float) * n);
+		dst   += n;
+		count -= n;
+		pos   += n;
+		if (pos == length)
+			pos = susp_start;
+	}
+	*input_pos = pos;
+}
+
+static void add_block(float *COP_ATTR_RESTRICT dst, const float *COP_ATTR_RESTRICT src, unsigned n)
+{
+	unsigned i;
+	for (i = 0; i < n; i++)
+		dst[i] += src[i];
+}
+
+/* State of an overlap-add which is shared between odfilter_run(),
+ * odfilter_run_part() and odfilter_run_multi().
+ *
+ * Each frame reads max_in samples of input into the start of a zero padded
+ * conv_len buffer. The output of frame k starts at k*max_in-pre_read in the
+ * output buffer. Frames only ever move forward in the output, so everything
+ * before the output position of the current frame has been completely
+ * written and everything in [out_start, written) has been partially written
+ * by earlier frames. The rest of the current frame can be stored directly
+ * which means the output never needs to be cleared first.
+ *
+ * When only some of the frames are being processed, anything which lands at
+ * or after limit is summed into tail instead (tail[0] corresponds to
+ * output[limit]). */
+struct overlap_add {
+	const float   *input;
+	unsigned long  length;
+	unsigned long  susp_start;
+	int            is_looped;
+	unsigned       max_in;
+	unsigned       conv_len;
+
+	unsigned long  input_pos;
+	unsigned long  input_read;
+	unsigned long  written;
+	long           frame_pos;
+	unsigned long  end_frame;
+	unsigned long  limit;
+	float         *tail;
+
+	/* Range of the output covered by the current frame. */
+	unsigned long  out_start;
+	unsigned long  out_end;
+};
+
+static
+void
+overlap_add_init
+	(struct overlap_add *oa
+	,const float        *input
+	,int                 add_to_output
+	,unsigned long       susp_start
+	,unsigned long       length
+	,unsigned            pre_read
+	,int                 is_looped
+	,unsigned            kern_len
+	,unsigned            conv_len
+	)
+{
+	oa->input      = input;
+	oa->length     = length;
+	oa->susp_start = susp_start;
+	oa->is_looped  = is_looped;
+	oa->max_in     = conv_len - kern_len + 1;
+	oa->conv_len   = conv_len;
+	oa->input_pos  = 0;
+	oa->input_read = 0;
+	oa->written    = add_to_output ? length : 0;
+	oa->frame_pos  = -(long)pre_read;
+	oa->end_frame  = ULONG_MAX;
+	oa->limit      = length;
+	oa->tail       = NULL;
+}
+
+/* Number of frames needed to produce the whole output. */
+static unsigned long overlap_add_nb_frames(unsigned long length, unsigned pre_read, unsigned max_in)
+{
+	return (length + pre_read + max_in - 1) / max_in;
+}
+
+/* Where the output of the given frame starts (clipped to the output). */
+static unsigned long overlap_add_frame_start(unsigned long frame, unsigned long length, unsigned pre_read, unsigned max_in)
+{
+	unsigned long pos = frame * max_in;
+	if (pos <= pre_read)
+		return 0;
+	pos -= pre_read;
+	return (pos < length) ? pos : length;
+}
+
+/* Restrict the overlap-add to frames [first_frame, end_frame). The output
+ * of the frames is stored (or summed if add_to_output was set) into the
+ * output from the output position of first_frame up to the output position
+ * of end_frame. Everything after that is summed into tail which must be
+ * cleared by the caller. */
+static
+void
+overlap_add_restrict
+	(struct overlap_add *oa
+	,unsigned long       first_frame
+	,unsigned long       end_frame
+	,unsigned            pre_read
+	,float              *tail
+	)
+{
+	unsigned long skip = first_frame * oa->max_in;
+
+	oa->input_read = skip;
+	oa->frame_pos  = (long)skip - (long)pre_read;
+	oa->end_frame  = end_frame - first_frame;
+	oa->limit      = overlap_add_frame_start(end_frame, oa->length, pre_read, oa->max_in);
+	oa->tail       = tail;
+	if (oa->written < oa->length)
+		oa->written = overlap_add_frame_start(first_frame, oa->length, pre_read, oa->max_in);
+
+	/* Find where the looped input of the first frame starts. */
+	if (oa->is_looped && skip >= oa->length) {
+		unsigned long loop_len = oa->length - oa->susp_start;
+		oa->input_pos = oa->susp_start + (skip - oa->length) % loop_len;
+	} else {
+		oa->input_pos = skip;
+	}
+}
+
+/* Set up the next frame. Returns zero if there are no more frames. If the
+ * frame has input, it is written into the first max_in elements of buf and
+ * *silent is set to zero. Otherwise buf is not touched and *silent is set to
+ * one. */
+static int overlap_add_next(struct overlap_add *oa, float *buf, int *silent)
+{
+	long frame_end;
+
+	if (oa->frame_pos >= (long)oa->length || oa->end_frame == 0)
+		return 0;
+
+	frame_end     = oa->frame_pos + (long)oa->conv_len;
+	oa->out_start = (oa->frame_pos < 0) ? 0 : (unsigned long)oa->frame_pos;
+	oa->out_end   = (frame_end < 0) ? 0 : (((unsigned long)frame_end > oa->length) ? oa->length : (unsigned long)frame_end);
+	*silent       = 0;
+
+	if (oa->is_looped) {
+		gather_looped(buf, oa->input, oa->length, oa->susp_start, &(oa->input_pos), oa->max_in);
+	} else if (oa->input_read < oa->length) {
+		unsigned n = (oa->length - oa->input_read < oa->max_in) ? (unsigned)(oa->length - oa->input_read) : oa->max_in;
+		memcpy(buf, oa->input + oa->input_read, sizeof(float) * n);
+		memset(buf + n, 0, sizeof(float) * (oa->max_in - n));
+	} else {
+		/* Everything after the input is zero so this frame contributes
+		 * nothing. */
+		*silent = 1;
+	}
+
+	return 1;
+}
+
+/* Returns non-zero if the current frame lands in the output at all. */
+static int overlap_add_visible(const struct overlap_add *oa)
+{
+	return oa->out_end > oa->out_start;
+}
+
+/* Put the convolved frame (or silence if frame is NULL) into output. */
+static void overlap_add_emit(const struct overlap_add *oa, float *output, const float *frame)
+{
+	unsigned long out_end     = (oa->out_end < oa->limit) ? oa->out_end : oa->limit;
+	unsigned long overlap_end = (oa->written < out_end) ? oa->written : out_end;
+
+	if (frame == NULL) {
+		if (out_end > oa->written)
+			memset(output + oa->written, 0, sizeof(float) * (out_end - oa->written));
+		return;
+	}
+
+	frame += oa->out_start - oa->frame_pos;
+
+	if (overlap_end > oa->out_start)
+		add_block(output + oa->out_start, frame, (unsigned)(overlap_end - oa->out_start));
+	if (out_end > overlap_end)
+		memcpy(output + overlap_end, frame + (overlap_end - oa->out_start), sizeof(float) * (out_end - overlap_end));
+	if (oa->out_end > out_end) {
+		unsigned long tail_start = (oa->out_start > oa->limit) ? oa->out_start : oa->limit;
+		add_block(oa->tail + (tail_start - oa->limit), frame + (tail_start - oa->out_start), (unsigned)(oa->out_end - tail_start));
+	}
+}
+
+static void overlap_add_advance(struct overlap_add *oa)
+{
+	unsigned long out_end = (oa->out_end < oa->limit) ? oa->out_end : oa->limit;
+	if (out_end > oa->written)
+		oa->written = out_end;
+	oa->input_read += oa->max_in;
+	oa->frame_pos  += oa->max_in;
+	oa->end_frame--;
+}
+
+static void run_frames(struct overlap_add *oa, float *output, struct odfilter_temporaries *tmps, const struct odfilter *filter)
+{
+	int    silent;
+	float *sc1 = tmps->tmp1;
+	float *sc2 = tmps->tmp2;
+	float *sc3 = tmps->tmp3;
+
+	/* The end of the buffer is always zero. */
+	memset(sc1 + oa->max_in, 0, sizeof(float) * (filter->conv_len - oa->max_in));
+
+	while (overlap_add_next(oa, sc1, &silent)) {
+		if (overlap_add_visible(oa)) {
+			if (!silent) {
+				/* Convolve! */
+				fftset_fft_conv(filter->conv, sc2, sc1, filter->kernel, sc3);
+			}
+			overlap_add_emit(oa, output, silent ? NULL : sc2);
+		}
+		overlap_add_advance(oa);
+	}
+}
+
 void odfilter_run
 	(const float                 *input
 	,float                       *output
@@ -92,78 +334,284 @@ void odfilter_run
 	,const struct odfilter       *filter
 	)
 {
-	const unsigned max_in = filter->conv_len - filter->kern_len + 1;
-	unsigned input_read;
-	unsigned input_pos;
-	float *sc1 = tmps->tmp1;
-	float *sc2 = tmps->tmp2;
-	float *sc3 = tmps->tmp3;
+	struct overlap_add oa;
+	overlap_add_init(&oa, input, add_to_output, susp_start, length, pre_read, is_looped, filter->kern_len, filter->conv_len);
+	run_frames(&oa, output, tmps, filter);
+}
+
+void odfilter_run_part
+	(const float                 *input
+	,float                       *output
+	,int                          add_to_output
+	,unsigned long                susp_start
+	,unsigned long                length
+	,unsigned                     pre_read
+	,int                          is_looped
+	,struct odfilter_temporaries *tmps
+	,const struct odfilter       *filter
+	,unsigned                     part
+	,unsigned                     nb_parts
+	,float                       *tail
+	)
+{
+	struct overlap_add oa;
+	unsigned long      nb_frames;
 
-	/* Zero output buffer. */
-	if (!add_to_output) {
-		memset(output, 0, sizeof(float) * length);
+	assert(part < nb_parts);
+
+	overlap_add_init(&oa, input, add_to_output, susp_start, length, pre_read, is_looped, filter->kern_len, filter->conv_len);
+	nb_frames = overlap_add_nb_frames(length, pre_read, oa.max_in);
+	if (tail != NULL)
+		memset(tail, 0, sizeof(float) * (filter->kern_len - 1));
+	overlap_add_restrict
+		(&oa
+		,(unsigned long)(((unsigned long long)nb_frames * part) / nb_parts)
+		,(unsigned long)(((unsigned long long)nb_frames * (part + 1)) / nb_parts)
+		,pre_read
+		,tail
+		);
+	assert(tail != NULL || oa.limit == length);
+	run_frames(&oa, output, tmps, filter);
+}
+
+void odfilter_run_part_tail
+	(float                       *output
+	,unsigned long                length
+	,unsigned                     pre_read
+	,const struct odfilter       *filter
+	,unsigned                     part
+	,unsigned                     nb_parts
+	,const float                 *tail
+	)
+{
+	unsigned      max_in    = filter->conv_len - filter->kern_len + 1;
+	unsigned long nb_frames = overlap_add_nb_frames(length, pre_read, max_in);
+	unsigned long start     = overlap_add_frame_start((unsigned long)(((unsigned long long)nb_frames * (part + 1)) / nb_parts), length, pre_read, max_in);
+	unsigned long n         = length - start;
+	if (n > filter->kern_len - 1)
+		n = filter->kern_len - 1;
+	add_block(output + start, tail, (unsigned)n);
+}
+
+int odfilter_multi_init(struct odfilter_multi *mf, struct cop_alloc_iface *allocobj, struct fftset *fftset, unsigned length, unsigned nb_kernels)
+{
+	mf->kern_len   = length;
+	mf->conv_len   = fftset_recommend_conv_length(length, 512) * 2;
+	mf->nb_kernels = nb_kernels;
+	mf->spectra    = NULL;
+	return
+		(   (mf->fft = fftset_create_fft(fftset, FFTSET_MODULATION_FREQ_OFFSET_REAL, mf->conv_len / 2)) == NULL
+		||  (nb_kernels && (mf->spectra = cop_alloc(allocobj, sizeof(float) * mf->conv_len * nb_kernels, 64)) == NULL)
+		);
+}
+
+float odfilter_multi_build_xcorr(struct odfilter_multi *mf, struct odfilter_temporaries *tmps, unsigned kernel, unsigned length, const float *buffer, float scale)
+{
+	unsigned i;
+	float psum = 0.0f;
+	assert(length < mf->conv_len);
+	assert(kernel < mf->nb_kernels);
+	scale *= 2.0f / mf->conv_len;
+	for (i = 0; i < length; i++) {
+		float s = buffer[length - 1 - i];
+		tmps->tmp1[i] = s * scale;
+		psum += s * s;
+	}
+	for (; i < mf->conv_len; i++) tmps->tmp1[i] = 0.0f;
+	fftset_fft_forward(mf->fft, mf->spectra + kernel * mf->conv_len, tmps->tmp1, tmps->tmp2);
+	return psum;
+}
+
+void odfilter_multi_build_conv(struct odfilter_multi *mf, struct odfilter_temporaries *tmps, unsigned kernel, unsigned length, const float *buffer, float scale)
+{
+	unsigned i;
+	assert(length < mf->conv_len);
+	assert(kernel < mf->nb_kernels);
+	scale *= 2.0f / mf->conv_len;
+	for (i = 0; i < length;  i++)      tmps->tmp1[i] = buffer[i] * scale;
+	for (     ; i < mf->conv_len; i++) tmps->tmp1[i] = 0.0f;
+	fftset_fft_forward(mf->fft, mf->spectra + kernel * mf->conv_len, tmps->tmp1, tmps->tmp2);
+}
+
+static void complex_multiply(float *COP_ATTR_RESTRICT dst, const float *COP_ATTR_RESTRICT a, const float *COP_ATTR_RESTRICT b, unsigned nb_complex)
+{
+	unsigned i;
+	for (i = 0; i < nb_complex; i++) {
+		float ar = a[2*i+0];
+		float ai = a[2*i+1];
+		float br = b[2*i+0];
+		float bi = b[2*i+1];
+		dst[2*i+0] = ar * br - ai * bi;
+		dst[2*i+1] = ar * bi + ai * br;
 	}
+}
 
-	/* Run trivial overlap add convolution */
-	input_read = 0;
-	input_pos = 0;
-	while (1) {
-		unsigned j = 0;
-		int output_pos = (int)input_read-(int)pre_read;
-
-		/* Build input buffer */
-		if (is_looped) {
-			unsigned op = 0;
-			while (op < max_in) {
-				unsigned max_read;
-				unsigned desire_read;
-				/* How much can we read before we hit the end of the buffer? */
-				max_read    = length - input_pos;
-				desire_read = max_in - op;
-
-				/* How much SHOULD we read? */
-				if (desire_read > max_read)
-					desire_read = max_read;
-
-				/* Read it. */
-				for (j = 0; j < desire_read; j++)
-					sc1[j + op] = input[j + input_pos];
-
-				/* Increment offsets. */
-				input_pos += desire_read;
-				op        += desire_read;
-
-				/* If we read to the end of the buffer, move to the sustain
-				 * start. */
-				if (input_pos == length)
-					input_pos = susp_start;
+void odfilter_run_multi
+	(const float                 *input
+	,float                *const *outputs
+	,int                          add_to_output
+	,unsigned long                susp_start
+	,unsigned long                length
+	,unsigned                     pre_read
+	,int                          is_looped
+	,struct odfilter_temporaries *tmps
+	,const struct odfilter_multi *filter
+	)
+{
+	struct overlap_add oa;
+	int                silent;
+	unsigned           k;
+	float             *sc1 = tmps->tmp1;
+	float             *sc2 = tmps->tmp2;
+	float             *sc3 = tmps->tmp3;
+	float             *sc4 = tmps->tmp4;
+
+	if (filter->nb_kernels == 0)
+		return;
+
+	overlap_add_init(&oa, input, add_to_output, susp_start, length, pre_read, is_looped, filter->kern_len, filter->conv_len);
+
+	while (overlap_add_next(&oa, sc1, &silent)) {
+		if (overlap_add_visible(&oa)) {
+			if (!silent) {
+				/* sc1 is used as the work buffer of the inverse transforms so
+				 * the padding needs to be restored every time. */
+				memset(sc1 + oa.max_in, 0, sizeof(float) * (filter->conv_len - oa.max_in));
+				fftset_fft_forward(filter->fft, sc2, sc1, sc3);
+				for (k = 0; k < filter->nb_kernels; k++) {
+					complex_multiply(sc3, sc2, filter->spectra + k * filter->conv_len, filter->conv_len / 2);
+					fftset_fft_inverse(filter->fft, sc4, sc3, sc1);
+					overlap_add_emit(&oa, outputs[k], sc4);
+				}
+			} else {
+				for (k = 0; k < filter->nb_kernels; k++)
+					overlap_add_emit(&oa, outputs[k], NULL);
 			}
-			for (; op < filter->conv_len; op++)
-				sc1[op] = 0.0f;
-		} else {
-			for (j = 0; j < max_in && input_read+j < length; j++) sc1[j] = input[input_read+j];
-			for (; j < filter->conv_len;            j++)      sc1[j] = 0.0f;
 		}
+		overlap_add_advance(&oa);
+	}
+}
 
-		/* Convolve! */
-		fftset_fft_conv(filter->conv, sc2, sc1, filter->kernel, sc3);
-
-		/* Sc2 contains the convolved buffer. */
-		for (j = 0; j < filter->conv_len; j++) {
-			int x = output_pos+(int)j;
-			if (x < 0)
-				continue;
-			/* Cast is safe because we check earlier for negative. */
-			if ((unsigned)x >= length)
-				break;
-			output[x] += sc2[j];
-		}
+int odfilter_stream_init(struct odfilter_stream *st, struct cop_alloc_iface *allocobj, struct fftset *fftset, unsigned block_len, unsigned max_kernel_len)
+{
+	const unsigned spec_len = 2 * block_len;
+	st->block_len = block_len;
+	st->max_parts = (max_kernel_len + block_len - 1) / block_len;
+	if (st->max_parts == 0)
+		st->max_parts = 1;
+	if  (   (st->fft = fftset_create_fft(fftset, FFTSET_MODULATION_FREQ_OFFSET_REAL, block_len)) == NULL
+	    ||  (st->parts = cop_alloc(allocobj, sizeof(float) * spec_len * st->max_parts, 64)) == NULL
+	    ||  (st->fdl = cop_alloc(allocobj, sizeof(float) * spec_len * st->max_parts, 64)) == NULL
+	    ||  (st->in_buf = cop_alloc(allocobj, sizeof(float) * spec_len, 64)) == NULL
+	    ||  (st->out_buf = cop_alloc(allocobj, sizeof(float) * block_len, 64)) == NULL
+	    ||  (st->acc = cop_alloc(allocobj, sizeof(float) * spec_len, 64)) == NULL
+	    ||  (st->tmp = cop_alloc(allocobj, sizeof(float) * spec_len, 64)) == NULL
+	    ||  (st->work = cop_alloc(allocobj, sizeof(float) * spec_len, 64)) == NULL
+	    )
+		return -1;
+	st->nb_parts = 0;
+	odfilter_stream_reset(st);
+	return 0;
+}
+
+void odfilter_stream_set_kernel(struct odfilter_stream *st, const float *kernel, unsigned length, float scale)
+{
+	const unsigned spec_len = 2 * st->block_len;
+	unsigned p;
+
+	assert(length <= st->max_parts * st->block_len);
 
-		/* added nothing to output buffer! */
-		if (j == 0)
-			break;
+	/* The same scaling as the other kernels to undo the gain of the forward
+	 * and inverse transforms. */
+	scale *= 2.0f / spec_len;
 
-		input_read += max_in;
+	st->nb_parts = (length + st->block_len - 1) / st->block_len;
+	for (p = 0; p < st->nb_parts; p++) {
+		unsigned i;
+		unsigned n = length - p * st->block_len;
+		if (n > st->block_len)
+			n = st->block_len;
+		for (i = 0; i < n; i++)
+			st->acc[i] = kernel[p * st->block_len + i] * scale;
+		for (; i < spec_len; i++)
+			st->acc[i] = 0.0f;
+		fftset_fft_forward(st->fft, st->parts + p * spec_len, st->acc, st->work);
 	}
 }
 
+void odfilter_stream_reset(struct odfilter_stream *st)
+{
+	const unsigned spec_len = 2 * st->block_len;
+	memset(st->fdl, 0, sizeof(float) * spec_len * st->max_parts);
+	memset(st->in_buf, 0, sizeof(float) * spec_len);
+	memset(st->out_buf, 0, sizeof(float) * st->block_len);
+	st->fdl_pos = 0;
+	st->fill    = 0;
+}
+
+static void complex_multiply_add(float *COP_ATTR_RESTRICT dst, const float *COP_ATTR_RESTRICT a, const float *COP_ATTR_RESTRICT b, unsigned nb_complex)
+{
+	unsigned i;
+	for (i = 0; i < nb_complex; i++) {
+		float ar = a[2*i+0];
+		float ai = a[2*i+1];
+		float br = b[2*i+0];
+		float bi = b[2*i+1];
+		dst[2*i+0] += ar * br - ai * bi;
+		dst[2*i+1] += ar * bi + ai * br;
+	}
+}
+
+/* Process the block which has just been completed in the second half of
+ * in_buf. The transform has a half-bin offset which makes the products
+ * negacyclic rather than circular convolutions - this only changes the sign
+ * of the wrapped part which overlap-save throws away anyway. */
+static void stream_block(struct odfilter_stream *st)
+{
+	const unsigned spec_len = 2 * st->block_len;
+	unsigned p;
+
+	st->fdl_pos = (st->fdl_pos + 1) % st->max_parts;
+	fftset_fft_forward(st->fft, st->fdl + st->fdl_pos * spec_len, st->in_buf, st->work);
+
+	memset(st->acc, 0, sizeof(float) * spec_len);
+	for (p = 0; p < st->nb_parts; p++) {
+		unsigned slot = (st->fdl_pos + st->max_parts - p) % st->max_parts;
+		complex_multiply_add(st->acc, st->fdl + slot * spec_len, st->parts + p * spec_len, st->block_len);
+	}
+
+	fftset_fft_inverse(st->fft, st->tmp, st->acc, st->work);
+
+	/* Only the second half is free of wrapped around samples. */
+	memcpy(st->out_buf, st->tmp + st->block_len, sizeof(float) * st->block_len);
+
+	/* The current block becomes the previous block. */
+	memcpy(st->in_buf, st->in_buf + st->block_len, sizeof(float) * st->block_len);
+}
+
+void odfilter_stream_process(struct odfilter_stream *st, float *output, const float *input, unsigned nb_samples, int add_to_output)
+{
+	while (nb_samples) {
+		unsigned n = st->block_len - st->fill;
+		if (n > nb_samples)
+			n = nb_samples;
+
+		/* Take the input before writing the output in case they are the
+		 * same buffer. */
+		memcpy(st->in_buf + st->block_len + st->fill, input, sizeof(float) * n);
+		if (add_to_output)
+			add_block(output, st->out_buf + st->fill, n);
+		else
+			memcpy(output, st->out_buf + st->fill, sizeof(float) * n);
+
+		st->fill   += n;
+		input      += n;
+		output     += n;
+		nb_samples -= n;
+
+		if (st->fill == st->block_len) {
+			stream_block(st);
+			st->fill = 0;
+		}
+	}
+}
@@ -57,14 +57,35 @@ struct odfilter {
  * these are not incorporated into odfilter is to enable one odfilter kernel
  * to be shared between multiple threads. If this is occuring, each thread
  * must have its own odfilter_temporaries structure. You can set this
- * structure up yourself by setting tmp1, tmp2 and tmp3 to all be properly
- * aligned pointers to conv_len elements for the filter which this will be
- * used with - or you can use odfilter_init_temporaries() to set up the
- * structure appropriately with buffers big enough for the given filter. */
+ * structure up yourself by setting tmp1, tmp2, tmp3 and tmp4 to all be
+ * properly aligned pointers to conv_len elements for the filter which this
+ * will be used with - or you can use odfilter_init_temporaries() to set up
+ * the structure appropriately with buffers big enough for the given filter.
+ * tmp4 is only used by odfilter_run_multi(). */
 struct odfilter_temporaries {
 	float *tmp1;
 	float *tmp2;
 	float *tmp3;
+	float *tmp4;
+};
+
+/* An odfilter_multi structure holds several kernels of the same length which
+ * are all applied to the same input by odfilter_run_multi(). Each block of
+ * input is only transformed once no matter how many kernels there are.
+ *
+ * The kernels are stored as the output of fftset_fft_forward() (not in the
+ * format given by fftset_fft_conv_get_kernel()) and are pre-scaled by
+ * 2/conv_len. They are stored one after the other with a stride of conv_len
+ * elements. */
+struct odfilter_multi {
+	unsigned                 kern_len;
+	unsigned                 conv_len;
+	unsigned                 nb_kernels;
+
+	/* A FFTSET_MODULATION_FREQ_OFFSET_REAL transform of length conv_len. */
+	const struct fftset_fft *fft;
+
+	float                   *spectra;
 };
 
 /* Initialise a filter which is designed for a kernel of the given length. The
@@ -125,4 +146,132 @@ void odfilter_run
 	,const struct odfilter       *filter
 	);
 
+/* Perform part of the same filtering operation as odfilter_run() so that a
+ * long input can be filtered by several threads at once (each with their own
+ * temporaries). The frames of the convolution are divided into nb_parts
+ * consecutive ranges and this processes range number part. Every part
+ * writes a different region of the output except for the last kern_len-1
+ * samples of each part which overlap the start of the next part. Those are
+ * written into tail (which must have kern_len-1 elements) and must be summed
+ * into the output using odfilter_run_part_tail() once the next part has been
+ * run. tail may be NULL for the final part. The results are the same as
+ * odfilter_run() apart from the order in which overlapping samples are
+ * summed. */
+void odfilter_run_part
+	(const float                 *input
+	,float                       *output
+	,int                          add_to_output
+	,unsigned long                susp_start
+	,unsigned long                length
+	,unsigned                     pre_read
+	,int                          is_looped
+	,struct odfilter_temporaries *tmps
+	,const struct odfilter       *filter
+	,unsigned                     part
+	,unsigned                     nb_parts
+	,float                       *tail
+	);
+
+/* Sum the tail of a part produced by odfilter_run_part() into the output.
+ * length, pre_read and nb_parts must be the same as were given to
+ * odfilter_run_part(). */
+void odfilter_run_part_tail
+	(float                       *output
+	,unsigned long                length
+	,unsigned                     pre_read
+	,const struct odfilter       *filter
+	,unsigned                     part
+	,unsigned                     nb_parts
+	,const float                 *tail
+	);
+
+/* Initialise a multi-kernel filter for nb_kernels kernels of the given
+ * length. conv_len is picked in the same way as odfilter_init_filter() so
+ * temporaries created for an odfilter of the same length can be used with
+ * it. The kernels must be configured using the odfilter_multi_build_*()
+ * functions. Nothing is allocated if nb_kernels is zero (odfilter_run_multi()
+ * then does nothing). Returns zero on success. */
+int odfilter_multi_init(struct odfilter_multi *mf, struct cop_alloc_iface *allocobj, struct fftset *fftset, unsigned length, unsigned nb_kernels);
+
+/* The same as odfilter_build_xcorr() and odfilter_build_conv() but for one of
+ * the kernels of a multi-kernel filter. */
+float odfilter_multi_build_xcorr(struct odfilter_multi *mf, struct odfilter_temporaries *tmps, unsigned kernel, unsigned length, const float *buffer, float scale);
+void odfilter_multi_build_conv(struct odfilter_multi *mf, struct odfilter_temporaries *tmps, unsigned kernel, unsigned length, const float *buffer, float scale);
+
+/* The same as odfilter_run() but the input is filtered by every kernel of
+ * the multi-kernel filter. outputs must contain nb_kernels pointers to
+ * output buffers which receive the results of the corresponding kernels.
+ * tmps must have been created for a filter with the same conv_len. */
+void odfilter_run_multi
+	(const float                 *input
+	,float                *const *outputs
+	,int                          add_to_output
+	,unsigned long                susp_start
+	,unsigned long                length
+	,unsigned                     pre_read
+	,int                          is_looped
+	,struct odfilter_temporaries *tmps
+	,const struct odfilter_multi *filter
+	);
+
+/* An odfilter_stream is a convolver for real-time use. Input can be given
+ * in blocks of any size and the overlap state is kept between calls. The
+ * kernel is split into partitions of block_len samples which are applied
+ * in the frequency domain (uniformly partitioned overlap-save) so the
+ * latency is always block_len samples regardless of the kernel length and
+ * the cost per sample only grows with the number of partitions.
+ *
+ * Nothing is allocated after odfilter_stream_init(). One stream can only be
+ * used by one thread at a time. */
+struct odfilter_stream {
+	unsigned                 block_len;
+	unsigned                 max_parts;
+	unsigned                 nb_parts;
+
+	/* A FFTSET_MODULATION_FREQ_OFFSET_REAL transform with complex_len set to
+	 * block_len (i.e. real length 2*block_len). */
+	const struct fftset_fft *fft;
+
+	/* max_parts kernel partition spectra and the same number of input
+	 * spectra (a ring where fdl_pos is the most recent). Each is
+	 * 2*block_len elements. */
+	float                   *parts;
+	float                   *fdl;
+	unsigned                 fdl_pos;
+
+	/* The previous and current block of input (2*block_len elements), the
+	 * output of the previous block (block_len elements) and how many
+	 * samples of the current block have been received. */
+	float                   *in_buf;
+	float                   *out_buf;
+	unsigned                 fill;
+
+	/* Scratch (2*block_len elements each). */
+	float                   *acc;
+	float                   *tmp;
+	float                   *work;
+};
+
+/* Initialise a streaming convolver with the given block length which can
+ * hold kernels of up to max_kernel_len samples. block_len must be a length
+ * which fftset can create a FFTSET_MODULATION_FREQ_OFFSET_REAL transform of
+ * with that complex length (powers of two are always fine). The kernel is
+ * initially empty (i.e. the output is silence). Returns zero on success. */
+int odfilter_stream_init(struct odfilter_stream *st, struct cop_alloc_iface *allocobj, struct fftset *fftset, unsigned block_len, unsigned max_kernel_len);
+
+/* Set the kernel of the convolver. length must be less than or equal to the
+ * max_kernel_len given to odfilter_stream_init(). Each element of the kernel
+ * is multiplied by scale. This does not reset the overlap state. */
+void odfilter_stream_set_kernel(struct odfilter_stream *st, const float *kernel, unsigned length, float scale);
+
+/* Clear the overlap state as if the convolver had only ever received
+ * silence. */
+void odfilter_stream_reset(struct odfilter_stream *st);
+
+/* Convolve nb_samples of input. The output is delayed by block_len samples
+ * relative to the input. If add_to_output is non-zero, the results are
+ * summed into output rather than stored. input and output may be the same
+ * buffer if add_to_output is zero. */
+void odfilter_stream_process(struct odfilter_stream *st, float *output, const float *input, unsigned nb_samples, int add_to_output);
+
 #endif /* ODFILTER_H */
@@ -0,0 +1,387 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#include <string.h>
+#include <assert.h>
+#include "convreverb.h"
+#include "decode_types.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+/* Segment block lengths grow by this factor and stop growing once they reach
+ * CONVREVERB_MAX_TAIL_BLOCK (the last segment then takes the rest of the
+ * response). */
+#define CONVREVERB_GROWTH         (4)
+#define CONVREVERB_MAX_TAIL_BLOCK (65536)
+
+/* Timing of a tail segment with block length B when the wet output is
+ * delayed by L (the caller block length):
+ *
+ * The streaming convolver of the segment delays its output by B, and the
+ * worker can only process a block once all B samples of it have been
+ * collected. If the segment starts at offset 3*B-L in the response, the
+ * output of the block collected during [jB, (j+1)B) is needed from (j+2)B
+ * onwards - i.e. the worker has a whole block period to compute it and the
+ * caller always reads the block before last. */
+static unsigned long segment_offset(unsigned block_len, unsigned caller_block_len)
+{
+	return 3ul * block_len - caller_block_len;
+}
+
+/* Lower the priority of the calling worker thread according to the index of
+ * its segment. The worker of the shortest segment keeps the priority it was
+ * created with. */
+#ifdef _WIN32
+static void os_set_worker_priority(unsigned index)
+{
+	(void)SetThreadPriority(GetCurrentThread(), (index == 0) ? THREAD_PRIORITY_NORMAL : (index == 1) ? THREAD_PRIORITY_BELOW_NORMAL : THREAD_PRIORITY_LOWEST);
+}
+#else
+static void os_set_worker_priority(unsigned index)
+{
+#if defined(__linux__)
+	/* On Linux, the nice value is per-thread. */
+	id_t tid   = (id_t)syscall(SYS_gettid);
+	int  level = getpriority(PRIO_PROCESS, tid) + 2 * (int)index;
+	if (index)
+		(void)setpriority(PRIO_PROCESS, tid, (level < 19) ? level : 19);
+#else
+	(void)index;
+#endif
+}
+#endif
+
+/* Wake the worker thread of a segment. Called from the audio thread so it
+ * must never block, so the lock is only tried. The worker holds the lock
+ * between finding kick_pending clear and going to sleep, and a kick which
+ * fails to get the lock in that window is not signalled. kick_pending stays
+ * set until the worker has woken up and cleared it, and segment_process()
+ * kicks again on every call while it is set, so such a kick is delivered one
+ * call late rather than lost. */
+static void convreverb_kick(struct convreverb_segment *seg)
+{
+	odatomic_store(&seg->kick_pending, 1);
+	if (cop_mutex_trylock(&seg->thread_lock)) {
+		cop_cond_signal(&seg->thread_cond);
+		cop_mutex_unlock(&seg->thread_lock);
+	}
+}
+
+/* Process one block of a segment if there is one waiting. Returns non-zero
+ * if something was done. */
+static int service_segment(struct convreverb *cr, struct convreverb_segment *seg)
+{
+	const unsigned B      = seg->block_len;
+	uint32_t       posted = odatomic_load(&seg->posted);
+	unsigned       slot;
+	unsigned       c;
+
+	if (posted == seg->next)
+		return 0;
+
+	/* If we have fallen so far behind that the caller could be writing over
+	 * the input we are about to read, throw away everything except the most
+	 * recent block. The skipped blocks never get tagged so the caller will
+	 * count them as late. */
+	if (posted - seg->next >= CONVREVERB_RING_BLOCKS - 1) {
+		for (c = 0; c < cr->nb_channels; c++)
+			odfilter_stream_reset(&seg->streams[c]);
+		seg->next = posted - 1;
+	}
+
+	slot = seg->next % CONVREVERB_RING_BLOCKS;
+	odatomic_store(&seg->out_tags[slot], 0);
+	for (c = 0; c < cr->nb_channels; c++) {
+		size_t offset = ((size_t)slot * cr->nb_channels + c) * B;
+		odfilter_stream_process(&seg->streams[c], seg->out_ring + offset, seg->in_ring + offset, B, 0);
+	}
+	seg->next++;
+	odatomic_store(&seg->out_tags[slot], seg->next);
+
+	return 1;
+}
+
+static void *convreverb_thread_proc(void *argument)
+{
+	struct convreverb_segment *seg = argument;
+
+	os_set_worker_priority(seg->index);
+
+	cop_mutex_lock(&seg->thread_lock);
+	while (!seg->thread_quit) {
+		odatomic_store(&seg->kick_pending, 0);
+		cop_mutex_unlock(&seg->thread_lock);
+
+		while (service_segment(seg->owner, seg));
+
+		cop_mutex_lock(&seg->thread_lock);
+		if (!seg->thread_quit && !odatomic_load(&seg->kick_pending))
+			cop_cond_wait(&seg->thread_cond, &seg->thread_lock);
+	}
+	cop_mutex_unlock(&seg->thread_lock);
+
+	return NULL;
+}
+
+static int start_worker(struct convreverb_segment *seg)
+{
+	seg->thread_quit = 0;
+	odatomic_store(&seg->kick_pending, 0);
+	if (cop_mutex_create(&seg->thread_lock))
+		return -1;
+	if (cop_cond_create(&seg->thread_cond)) {
+		cop_mutex_destroy(&seg->thread_lock);
+		return -1;
+	}
+	if (cop_thread_create(&seg->thread, convreverb_thread_proc, seg, 0, 0)) {
+		cop_cond_destroy(&seg->thread_cond);
+		cop_mutex_destroy(&seg->thread_lock);
+		return -1;
+	}
+	seg->thread_running = 1;
+	return 0;
+}
+
+static void stop_worker(struct convreverb_segment *seg)
+{
+	if (seg->thread_running) {
+		cop_mutex_lock(&seg->thread_lock);
+		seg->thread_quit = 1;
+		cop_cond_signal(&seg->thread_cond);
+		cop_mutex_unlock(&seg->thread_lock);
+		cop_thread_join(seg->thread, NULL);
+		cop_cond_destroy(&seg->thread_cond);
+		cop_mutex_destroy(&seg->thread_lock);
+		seg->thread_running = 0;
+	}
+}
+
+static
+int
+init_streams
+	(struct odfilter_stream **streams
+	,struct cop_alloc_iface  *allocobj
+	,struct fftset           *fftset
+	,unsigned                 block_len
+	,unsigned                 nb_channels
+	,const float *const      *irs
+	,unsigned long            offset
+	,unsigned long            length
+	)
+{
+	unsigned c;
+	if ((*streams = cop_alloc(allocobj, sizeof(struct odfilter_stream) * nb_channels, 0)) == NULL)
+		return -1;
+	for (c = 0; c < nb_channels; c++) {
+		if (odfilter_stream_init(&((*streams)[c]), allocobj, fftset, block_len, length))
+			return -1;
+		odfilter_stream_set_kernel(&((*streams)[c]), irs[c] + offset, length, 1.0f);
+	}
+	return 0;
+}
+
+int
+convreverb_init
+	(struct convreverb      *cr
+	,struct cop_alloc_iface *allocobj
+	,struct fftset          *fftset
+	,unsigned                block_len
+	,unsigned                nb_channels
+	,const float *const     *irs
+	,unsigned long           ir_len
+	,float                   dry
+	,float                   wet
+	)
+{
+	unsigned      seg_len  = block_len * CONVREVERB_GROWTH;
+	unsigned long seg_pos  = segment_offset(seg_len, block_len);
+	unsigned long head_len = (ir_len < seg_pos) ? ir_len : seg_pos;
+	unsigned      s;
+
+	cr->block_len      = block_len;
+	cr->nb_channels    = nb_channels;
+	cr->dry            = dry;
+	cr->wet            = wet;
+	cr->nb_segments    = 0;
+	odatomic_store(&cr->late_blocks, 0);
+
+	if (init_streams(&cr->head, allocobj, fftset, block_len, nb_channels, irs, 0, head_len))
+		return -1;
+	if ((cr->scratch = cop_alloc(allocobj, sizeof(float) * block_len * nb_channels, 64)) == NULL)
+		return -1;
+
+	while (seg_pos < ir_len) {
+		struct convreverb_segment *seg = &cr->segments[cr->nb_segments];
+		unsigned                   next_len = seg_len * CONVREVERB_GROWTH;
+		unsigned long              seg_end  = ir_len;
+		size_t                     ring_len = (size_t)seg_len * nb_channels * CONVREVERB_RING_BLOCKS;
+		unsigned                   i;
+
+		if (next_len <= CONVREVERB_MAX_TAIL_BLOCK && cr->nb_segments + 1 < CONVREVERB_MAX_SEGMENTS) {
+			unsigned long next_pos = segment_offset(next_len, block_len);
+			if (next_pos < seg_end)
+				seg_end = next_pos;
+		}
+
+		seg->owner          = cr;
+		seg->index          = cr->nb_segments;
+		seg->block_len      = seg_len;
+		seg->block          = 0;
+		seg->pos            = 0;
+		seg->primed         = 0;
+		seg->out_ready      = 0;
+		seg->next           = 0;
+		seg->thread_running = 0;
+		odatomic_store(&seg->posted, 0);
+		for (i = 0; i < CONVREVERB_RING_BLOCKS; i++)
+			odatomic_store(&seg->out_tags[i], 0);
+
+		if  (   init_streams(&seg->streams, allocobj, fftset, seg_len, nb_channels, irs, seg_pos, seg_end - seg_pos)
+		    ||  (seg->in_ring = cop_alloc(allocobj, sizeof(float) * ring_len, 64)) == NULL
+		    ||  (seg->out_ring = cop_alloc(allocobj, sizeof(float) * ring_len, 64)) == NULL
+		    )
+			return -1;
+		memset(seg->in_ring, 0, sizeof(float) * ring_len);
+
+		cr->nb_segments++;
+		seg_pos = seg_end;
+		seg_len = next_len;
+	}
+
+	for (s = 0; s < cr->nb_segments; s++) {
+		if (start_worker(&cr->segments[s])) {
+			convreverb_destroy(cr);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void convreverb_destroy(struct convreverb *cr)
+{
+	unsigned s;
+	for (s = 0; s < cr->nb_segments; s++)
+		stop_worker(&cr->segments[s]);
+}
+
+/* Collect nb_samples of input for a segment and add the output which was
+ * computed for the block before last into the wet buffers. */
+static
+void
+segment_process
+	(struct convreverb         *cr
+	,struct convreverb_segment *seg
+	,float  *COP_ATTR_RESTRICT *buffers
+	,unsigned                   nb_samples
+	)
+{
+	const unsigned B     = seg->block_len;
+	const unsigned nb_ch = cr->nb_channels;
+	unsigned       done  = 0;
+
+	/* Deliver a kick which may not have been signalled. */
+	if (odatomic_load(&seg->kick_pending))
+		convreverb_kick(seg);
+
+	while (done < nb_samples) {
+		unsigned in_slot  = seg->block % CONVREVERB_RING_BLOCKS;
+		unsigned out_slot = (seg->block - 2) % CONVREVERB_RING_BLOCKS;
+		unsigned n        = B - seg->pos;
+		unsigned c;
+
+		if (n > nb_samples - done)
+			n = nb_samples - done;
+
+		/* Decide whether the output block can be used when starting it so a
+		 * block which completes half way through is not played from the
+		 * middle. Nothing is expected for the first two blocks. */
+		if (seg->pos == 0) {
+			if (seg->primed >= 2) {
+				seg->out_ready = odatomic_load(&seg->out_tags[out_slot]) == seg->block - 1;
+				if (!seg->out_ready)
+					odatomic_add(&cr->late_blocks, 1);
+			} else {
+				seg->out_ready = 0;
+				seg->primed++;
+			}
+		}
+
+		for (c = 0; c < nb_ch; c++) {
+			memcpy(seg->in_ring + ((size_t)in_slot * nb_ch + c) * B + seg->pos, buffers[c] + done, sizeof(float) * n);
+			if (seg->out_ready) {
+				const float *src = seg->out_ring + ((size_t)out_slot * nb_ch + c) * B + seg->pos;
+				float       *dst = cr->scratch + (size_t)c * cr->block_len + done;
+				unsigned     i;
+				for (i = 0; i < n; i++)
+					dst[i] += src[i];
+			}
+		}
+
+		seg->pos += n;
+		done     += n;
+
+		if (seg->pos == B) {
+			seg->pos = 0;
+			seg->block++;
+			odatomic_store(&seg->posted, seg->block);
+			convreverb_kick(seg);
+		}
+	}
+}
+
+void convreverb_process(struct convreverb *cr, float *COP_ATTR_RESTRICT *buffers, unsigned nb_channels, unsigned nb_samples)
+{
+	unsigned c, s;
+
+	assert(nb_channels >= cr->nb_channels);
+	assert(nb_samples <= cr->block_len);
+	(void)nb_channels;
+
+	for (c = 0; c < cr->nb_channels; c++)
+		odfilter_stream_process(&cr->head[c], cr->scratch + (size_t)c * cr->block_len, buffers[c], nb_samples, 0);
+
+	for (s = 0; s < cr->nb_segments; s++)
+		segment_process(cr, &cr->segments[s], buffers, nb_samples);
+
+	for (c = 0; c < cr->nb_channels; c++) {
+		const float *wet = cr->scratch + (size_t)c * cr->block_len;
+		float       *out = buffers[c];
+		unsigned     i;
+		for (i = 0; i < nb_samples; i++)
+			out[i] = out[i] * cr->dry + wet[i] * cr->wet;
+	}
+}
+
+void convreverb_output_stage(void *context, float *COP_ATTR_RESTRICT *buffers, unsigned nb_channels)
+{
+	convreverb_process(context, buffers, nb_channels, OUTPUT_SAMPLES);
+}
+
+unsigned long convreverb_query_late_blocks(struct convreverb *cr)
+{
+	return odatomic_load(&cr->late_blocks);
+}
@@ -0,0 +1,160 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#ifndef CONVREVERB_H
+#define CONVREVERB_H
+
+#include "odatomic.h"
+#include "cop/cop_alloc.h"
+#include "cop/cop_thread.h"
+#include "cop/cop_attributes.h"
+#include "fftset/fftset.h"
+#include "opendiapason/odfilter.h"
+
+/* The convreverb module convolves the output of the engine with a long
+ * impulse response (i.e. the sound of the building) using non-uniformly
+ * partitioned convolution.
+ *
+ * The start of the impulse response (the "head") is processed in the calling
+ * thread using a streaming convolver with the same block length as the
+ * caller. This is the only thing which sets the latency: the wet signal
+ * comes out exactly one block late.
+ *
+ * The rest of the response is split into segments which use block lengths
+ * growing by a factor of four. Each segment starts late enough in the
+ * response that its output is not needed until one full block after its
+ * input has been collected. Every segment is computed by its own worker
+ * thread during that time, so the caller only ever copies samples in and out
+ * of rings and a long segment can never hold up a short one. Workers of
+ * longer segments run at lower priorities, as their deadlines are further
+ * away. If a worker does not make it in time, that segment is left out of
+ * the block and the miss is counted. */
+struct convreverb;
+
+/* Initialise the reverb.
+ *
+ * block_len is the number of samples which will be given to every call of
+ * convreverb_process() (at most). It must be a power of two.
+ *
+ * irs points to nb_channels impulse responses of ir_len samples. The same
+ * pointer can be given for every channel to use a mono response. The
+ * responses are not needed after this function returns.
+ *
+ * dry and wet are the gains applied to the input and the reverberated
+ * signal when they are mixed into the output.
+ *
+ * Everything is allocated from allocobj. Returns zero on success. */
+int
+convreverb_init
+	(struct convreverb      *cr
+	,struct cop_alloc_iface *allocobj
+	,struct fftset          *fftset
+	,unsigned                block_len
+	,unsigned                nb_channels
+	,const float *const     *irs
+	,unsigned long           ir_len
+	,float                   dry
+	,float                   wet
+	);
+
+/* Stop the worker threads. The memory belongs to the allocator given to
+ * convreverb_init(). */
+void convreverb_destroy(struct convreverb *cr);
+
+/* Run nb_samples (at most the block_len given to convreverb_init()) of every
+ * channel through the reverb in place. Channels past the number the reverb
+ * was created with are left alone. This never blocks. */
+void convreverb_process(struct convreverb *cr, float *COP_ATTR_RESTRICT *buffers, unsigned nb_channels, unsigned nb_samples);
+
+/* A playeng_output_stage which runs convreverb_process() on a full engine
+ * block. context must point to the convreverb. */
+void convreverb_output_stage(void *context, float *COP_ATTR_RESTRICT *buffers, unsigned nb_channels);
+
+/* Number of tail blocks which were not ready in time since the reverb was
+ * created. Can be called from any thread. */
+unsigned long convreverb_query_late_blocks(struct convreverb *cr);
+
+/* Private Parts
+ * ---------------------------------------------------------------------------
+ * Don't touch them. Only defined so you can bung them on the stack. */
+
+#define CONVREVERB_MAX_SEGMENTS (8)
+#define CONVREVERB_RING_BLOCKS  (4)
+
+struct convreverb;
+
+struct convreverb_segment {
+	struct convreverb      *owner;
+	unsigned                index;
+	unsigned                block_len;
+
+	/* One convolver per channel. */
+	struct odfilter_stream *streams;
+
+	/* CONVREVERB_RING_BLOCKS blocks of input and output for every channel.
+	 * Block i of channel c is at ((i % CONVREVERB_RING_BLOCKS) * nb_channels
+	 * + c) * block_len. */
+	float                  *in_ring;
+	float                  *out_ring;
+
+	/* Owned by the calling thread: the index of the block being collected,
+	 * how many samples of it have been collected, how many blocks have been
+	 * started (stops counting at 2) and whether the output block being
+	 * played back was ready when it was started. */
+	uint32_t                block;
+	unsigned                pos;
+	unsigned                primed;
+	int                     out_ready;
+
+	/* Number of blocks which have been handed to the worker and, for each
+	 * output slot, one more than the index of the block it holds (zero
+	 * while it is being written). */
+	odatomic_u32            posted;
+	odatomic_u32            out_tags[CONVREVERB_RING_BLOCKS];
+
+	/* Owned by the worker: the next block to process. */
+	uint32_t                next;
+
+	/* Worker thread. kick_pending stays set from a kick until the worker
+	 * has woken up and cleared it. */
+	int                     thread_running;
+	int                     thread_quit;
+	odatomic_u32            kick_pending;
+	cop_thread              thread;
+	cop_mutex               thread_lock;
+	cop_cond                thread_cond;
+};
+
+struct convreverb {
+	unsigned                  block_len;
+	unsigned                  nb_channels;
+	float                     dry;
+	float                     wet;
+
+	struct odfilter_stream   *head;
+	float                    *scratch;
+
+	unsigned                  nb_segments;
+	struct convreverb_segment segments[CONVREVERB_MAX_SEGMENTS];
+
+	odatomic_u32              late_blocks;
+};
+
+#endif /* CONVREVERB_H */
@@ -114,7 +114,7 @@ static void COP_ATTR_ALWAYSINLINE encode2x12(void *buf, int a, int b)
 	cop_st_ule24(buf, ((au & 0xFFF) << 12) | (bu & 0xFFF));
 }
 
-unsigned u16c2_dec(struct dec_state *state, float *COP_ATTR_RESTRICT *buf)
+static unsigned u16c2_dec(struct dec_state *state, float *COP_ATTR_RESTRICT *buf)
 {
 	float VEC_ALIGN_BEST tmp[128];
 	unsigned flags;
@@ -204,7 +204,7 @@ unsigned u16c2_dec(struct dec_state *state, float *COP_ATTR_RESTRICT *buf)
 	return flags;
 }
 
-unsigned u12c2_dec(struct dec_state *state, float *COP_ATTR_RESTRICT *buf)
+static unsigned u12c2_dec(struct dec_state *state, float *COP_ATTR_RESTRICT *buf)
 {
 	float VEC_ALIGN_BEST tmp[128];
 	unsigned flags;
@@ -83,6 +83,7 @@ static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE uint_fast32_t update_rnd(uint_fast3
 }
 
 struct dec_state;
+struct smplstream_voice;
 
 struct dec_loop_def {
 	uint_fast32_t start_smpl;
@@ -140,6 +141,15 @@ struct dec_state {
 			struct dec_loop_end   loopend;
 			uint_fast32_t         rndstate;
 		} uncms;
+		struct {
+			struct filter_state      resamp[2]; /* left/right */
+			struct fade_state        fade;
+			const void              *data;
+			struct dec_loop_end      loopend;
+			uint_fast32_t            rndstate;
+			struct smplstream_voice *voice;
+			uint_fast32_t            generation;
+		} strm;
 	} s;
 
 	/* This is a reference to the sample. It is undefined for the sample to be
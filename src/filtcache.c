@@ -0,0 +1,216 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+#include <assert.h>
+#include "filtcache.h"
+
+#define FILTCACHE_TYPE_PLAN (0)
+#define FILTCACHE_TYPE_RECT (1)
+
+/* The block size given to fftset_recommend_conv_length(). This must match
+ * what odfilter_init_filter() and odfilter_multi_init() use so that cached
+ * filters behave in exactly the same way as ones created directly. */
+#define FILTCACHE_MAX_BLOCK (512)
+
+static unsigned conv_length(unsigned length)
+{
+	return fftset_recommend_conv_length(length, FILTCACHE_MAX_BLOCK) * 2;
+}
+
+static struct filtcache_entry **bucket(struct filtcache *fc, unsigned type, unsigned length, unsigned conv_len)
+{
+	return &(fc->buckets[(type * 31u + length * 7u + conv_len) % FILTCACHE_NB_BUCKETS]);
+}
+
+static struct filtcache_entry *find(struct filtcache *fc, unsigned type, unsigned length, float scale, unsigned conv_len)
+{
+	struct filtcache_entry *e = *bucket(fc, type, length, conv_len);
+	while (e != NULL) {
+		if  (   e->type == type
+		    &&  e->length == length
+		    &&  e->scale == scale
+		    &&  e->filter.conv_len == conv_len
+		    )
+			return e;
+		e = e->next;
+	}
+	return NULL;
+}
+
+/* The kernel of an entry is allocated along with the entry itself. The
+ * allocator cannot give memory back, so this means nothing is stranded if
+ * building an entry fails. */
+#define FILTCACHE_ENTRY_SIZE ((sizeof(struct filtcache_entry) + 63u) & ~(size_t)63u)
+
+/* Allocate an entry with room for a kernel of kernel_len elements (which may
+ * be zero). The entry is not visible to find() until it is linked. */
+static struct filtcache_entry *new_entry(struct filtcache *fc, unsigned type, unsigned length, float scale, unsigned conv_len, unsigned kernel_len)
+{
+	unsigned char *mem = cop_alloc(fc->allocator, FILTCACHE_ENTRY_SIZE + sizeof(float) * kernel_len, 64);
+	struct filtcache_entry *e = (struct filtcache_entry *)mem;
+	if (e != NULL) {
+		e->type            = type;
+		e->length          = length;
+		e->scale           = scale;
+		e->filter.kern_len = length;
+		e->filter.conv_len = conv_len;
+		e->filter.conv     = NULL;
+		e->filter.kernel   = (kernel_len) ? (float *)(mem + FILTCACHE_ENTRY_SIZE) : NULL;
+		e->next            = NULL;
+	}
+	return e;
+}
+
+static void link_entry(struct filtcache *fc, struct filtcache_entry *e)
+{
+	struct filtcache_entry **b = bucket(fc, e->type, e->length, e->filter.conv_len);
+	e->next = *b;
+	*b      = e;
+}
+
+/* Must be called with the lock held. */
+static const struct fftset_fft *get_plan(struct filtcache *fc, unsigned conv_len)
+{
+	struct filtcache_entry *e = find(fc, FILTCACHE_TYPE_PLAN, 0, 0.0f, conv_len);
+	const struct fftset_fft *fft;
+
+	if (e != NULL)
+		return e->filter.conv;
+
+	if ((fft = fftset_create_fft(fc->fftset, FFTSET_MODULATION_FREQ_OFFSET_REAL, conv_len / 2)) == NULL)
+		return NULL;
+	if ((e = new_entry(fc, FILTCACHE_TYPE_PLAN, 0, 0.0f, conv_len, 0)) == NULL)
+		return NULL;
+
+	e->filter.conv = fft;
+	link_entry(fc, e);
+	return fft;
+}
+
+int filtcache_init(struct filtcache *fc, struct cop_alloc_iface *allocator, struct fftset *fftset)
+{
+	unsigned i;
+	fc->allocator           = allocator;
+	fc->fftset              = fftset;
+	fc->build_tmps.conv_len = 0;
+	fc->hits                = 0;
+	fc->misses              = 0;
+	for (i = 0; i < FILTCACHE_NB_BUCKETS; i++)
+		fc->buckets[i] = NULL;
+	return cop_mutex_create(&(fc->lock));
+}
+
+void filtcache_destroy(struct filtcache *fc)
+{
+	cop_mutex_destroy(&(fc->lock));
+}
+
+const struct odfilter *filtcache_get_rect(struct filtcache *fc, unsigned length, float scale)
+{
+	unsigned conv_len = conv_length(length);
+	struct filtcache_entry *e;
+
+	cop_mutex_lock(&(fc->lock));
+
+	if ((e = find(fc, FILTCACHE_TYPE_RECT, length, scale, conv_len)) != NULL) {
+		fc->hits++;
+		cop_mutex_unlock(&(fc->lock));
+		return &(e->filter);
+	}
+
+	fc->misses++;
+
+	{
+		const struct fftset_fft *fft;
+
+		/* The entry is only linked once the kernel has been built so that a
+		 * failure part way through does not leave a broken entry behind for
+		 * the next lookup. The temporaries are reserved first as the entry
+		 * could not be given back if that failed. */
+		if  (   (fft = get_plan(fc, conv_len)) == NULL
+		    ||  filtcache_reserve_temps(fc, &(fc->build_tmps), conv_len)
+		    ||  (e = new_entry(fc, FILTCACHE_TYPE_RECT, length, scale, conv_len, conv_len)) == NULL
+		    ) {
+			cop_mutex_unlock(&(fc->lock));
+			return NULL;
+		}
+
+		e->filter.conv = fft;
+		odfilter_build_rect(&(e->filter), &(fc->build_tmps.tmps), length, scale);
+		link_entry(fc, e);
+	}
+
+	cop_mutex_unlock(&(fc->lock));
+	return &(e->filter);
+}
+
+int
+filtcache_multi_init
+	(struct filtcache       *fc
+	,struct odfilter_multi  *mf
+	,struct cop_alloc_iface *allocobj
+	,unsigned                length
+	,unsigned                nb_kernels
+	)
+{
+	mf->kern_len   = length;
+	mf->conv_len   = conv_length(length);
+	mf->nb_kernels = nb_kernels;
+	mf->spectra    = NULL;
+
+	cop_mutex_lock(&(fc->lock));
+	mf->fft = get_plan(fc, mf->conv_len);
+	cop_mutex_unlock(&(fc->lock));
+
+	return
+		(   mf->fft == NULL
+		||  (nb_kernels && (mf->spectra = cop_alloc(allocobj, sizeof(float) * mf->conv_len * nb_kernels, 64)) == NULL)
+		);
+}
+
+int filtcache_reserve_temps(struct filtcache *fc, struct filtcache_temps *t, unsigned conv_len)
+{
+	struct odfilter_temporaries tmps;
+
+	if (t->conv_len >= conv_len)
+		return 0;
+
+	/* The old buffers (if any) stay with the allocator. There are only a few
+	 * distinct convolution lengths, so this does not happen often. */
+	if  (   (tmps.tmp1 = cop_alloc(fc->allocator, sizeof(float) * conv_len, 64)) == NULL
+	    ||  (tmps.tmp2 = cop_alloc(fc->allocator, sizeof(float) * conv_len, 64)) == NULL
+	    ||  (tmps.tmp3 = cop_alloc(fc->allocator, sizeof(float) * conv_len, 64)) == NULL
+	    ||  (tmps.tmp4 = cop_alloc(fc->allocator, sizeof(float) * conv_len, 64)) == NULL
+	    )
+		return -1;
+
+	t->tmps     = tmps;
+	t->conv_len = conv_len;
+	return 0;
+}
+
+void filtcache_query(struct filtcache *fc, unsigned long *hits, unsigned long *misses)
+{
+	cop_mutex_lock(&(fc->lock));
+	*hits   = fc->hits;
+	*misses = fc->misses;
+	cop_mutex_unlock(&(fc->lock));
+}
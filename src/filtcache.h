@@ -0,0 +1,118 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef FILTCACHE_H
+#define FILTCACHE_H
+
+#include "cop/cop_alloc.h"
+#include "cop/cop_thread.h"
+#include "fftset/fftset.h"
+#include "opendiapason/odfilter.h"
+
+/* The filtcache module holds filter kernels and FFT plans which are used
+ * over and over again while loading samples. Many pipes have the same
+ * period (e.g. the same note on different ranks) and so need exactly the
+ * same envelope kernel. Many more end up with the same convolution length.
+ *
+ * Kernels are built the first time they are asked for and then handed out
+ * read-only to every thread which needs them. FFT plans are created under the
+ * cache lock, so nothing else needs to serialise access to the fftset while
+ * the cache is in use. The lock is only held for a short table lookup
+ * unless something needs to be built. */
+struct filtcache;
+
+/* Initialise the cache. allocator must be thread-safe and is used for every
+ * kernel, plan entry and temporary buffer owned by the cache - they remain
+ * valid until the memory of the allocator is released. fftset must not be
+ * used by anything else while the cache is in use. Returns zero on
+ * success. */
+int filtcache_init(struct filtcache *fc, struct cop_alloc_iface *allocator, struct fftset *fftset);
+
+/* Destroy the lock. The memory belongs to the allocator. */
+void filtcache_destroy(struct filtcache *fc);
+
+/* Get a filter with a rectangular kernel of length elements which are all
+ * scale (see odfilter_build_rect()). The filter must not be modified.
+ * Returns NULL if out of memory. */
+const struct odfilter *filtcache_get_rect(struct filtcache *fc, unsigned length, float scale);
+
+/* Initialise mf in the same way as odfilter_multi_init() but using a cached
+ * FFT plan. The spectra are allocated from allocobj as they belong to the
+ * caller. Returns zero on success. */
+int
+filtcache_multi_init
+	(struct filtcache       *fc
+	,struct odfilter_multi  *mf
+	,struct cop_alloc_iface *allocobj
+	,unsigned                length
+	,unsigned                nb_kernels
+	);
+
+/* Temporaries which are owned by a single thread but can be grown to suit
+ * any filter given out by the cache. Initialise with conv_len set to zero. */
+struct filtcache_temps {
+	struct odfilter_temporaries tmps;
+	unsigned                    conv_len;
+};
+
+/* Make sure that the temporaries can be used with a filter which has the
+ * given convolution length. Only the thread which owns the temporaries may
+ * call this. Returns zero on success. */
+int filtcache_reserve_temps(struct filtcache *fc, struct filtcache_temps *t, unsigned conv_len);
+
+/* Number of lookups which found an existing entry and number which had to
+ * build one. */
+void filtcache_query(struct filtcache *fc, unsigned long *hits, unsigned long *misses);
+
+/* Private Parts
+ * ---------------------------------------------------------------------------
+ * Don't touch them. Only defined so you can bung them on the stack. */
+
+#define FILTCACHE_NB_BUCKETS (64)
+
+struct filtcache_entry {
+	/* One of the FILTCACHE_TYPE_* values in filtcache.c, the kernel length
+	 * (zero for plans) and the scale of the kernel. */
+	unsigned                type;
+	unsigned                length;
+	float                   scale;
+
+	/* For plans, only conv_len and conv of the filter are used. */
+	struct odfilter         filter;
+
+	struct filtcache_entry *next;
+};
+
+struct filtcache {
+	struct cop_alloc_iface *allocator;
+	struct fftset          *fftset;
+
+	cop_mutex               lock;
+	struct filtcache_entry *buckets[FILTCACHE_NB_BUCKETS];
+
+	/* Used to build kernels. Protected by the lock. */
+	struct filtcache_temps  build_tmps;
+
+	unsigned long           hits;
+	unsigned long           misses;
+};
+
+#endif /* FILTCACHE_H */
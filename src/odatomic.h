@@ -0,0 +1,93 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#ifndef ODATOMIC_H
+#define ODATOMIC_H
+
+#include <stdint.h>
+#include "cop/cop_attributes.h"
+
+/* A very small set of 32-bit atomic operations. These exist for the few
+ * places where the audio thread must communicate with another thread without
+ * ever taking a lock (i.e. single-producer/single-consumer indices and
+ * statistics counters). Loads have acquire semantics and stores have release
+ * semantics. Nothing else is promised. */
+
+typedef volatile uint32_t odatomic_u32;
+
+#if defined(__GNUC__) || defined(__clang__)
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE uint32_t odatomic_load(const odatomic_u32 *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE void odatomic_store(odatomic_u32 *p, uint32_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+/* Returns the value prior to the addition. */
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE uint32_t odatomic_add(odatomic_u32 *p, uint32_t v)
+{
+	return __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL);
+}
+
+/* Returns non-zero if *p was equal to expected and has been replaced with
+ * desired. */
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE int odatomic_cas(odatomic_u32 *p, uint32_t expected, uint32_t desired)
+{
+	return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+#elif defined(_MSC_VER)
+
+#include <intrin.h>
+
+/* MSVC volatile accesses have acquire/release semantics on the targets we
+ * care about. The barriers stop the compiler from moving things around. */
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE uint32_t odatomic_load(const odatomic_u32 *p)
+{
+	uint32_t v = *p;
+	_ReadWriteBarrier();
+	return v;
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE void odatomic_store(odatomic_u32 *p, uint32_t v)
+{
+	_ReadWriteBarrier();
+	*p = v;
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE uint32_t odatomic_add(odatomic_u32 *p, uint32_t v)
+{
+	return (uint32_t)_InterlockedExchangeAdd((volatile long *)p, (long)v);
+}
+
+static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE int odatomic_cas(odatomic_u32 *p, uint32_t expected, uint32_t desired)
+{
+	return (uint32_t)_InterlockedCompareExchange((volatile long *)p, (long)desired, (long)expected) == expected;
+}
+
+#else
+#error "odatomic.h does not know how to do atomic operations with this compiler"
+#endif
+
+#endif /* ODATOMIC_H */
@@ -56,8 +56,10 @@ struct playeng_thread_data {
 	unsigned                    permitted_signal_mask;
 
 	/* Not to be touched or viewed by threads! Only used by the engine calling
-	 * thread. */
+	 * thread. scheduled is set while the data has been handed to a worker
+	 * for the current block. */
 	struct playeng_thread_data *next;
+	int                         scheduled;
 	cop_thread                  thread;
 };
 
@@ -88,6 +90,10 @@ struct playeng {
 
 	struct playeng_payloads       payloads;
 
+	/* Optional processing of the mixed output. */
+	playeng_output_stage          output_stage;
+	void                         *output_stage_context;
+
 	/* Memory allocator for everything in engine. */
 	struct cop_alloc_virtual      allocator;
 };
@@ -169,6 +175,8 @@ struct playeng *playeng_init(unsigned max_poly, unsigned nb_channels, unsigned n
 		return NULL;
 	}
 
+	pe->output_stage                 = NULL;
+	pe->output_stage_context         = NULL;
 	pe->reblock_length               = 0;
 	pe->reblock_start                = 0;
 	pe->ready_list                   = NULL;
@@ -187,6 +195,7 @@ struct playeng *playeng_init(unsigned max_poly, unsigned nb_channels, unsigned n
 		pe->threads[i].zombie                = NULL;
 		pe->threads[i].permitted_signal_mask = pe->locked_permitted_signal_mask;
 		pe->threads[i].current_time          = 0;
+		pe->threads[i].scheduled             = 0;
 		cop_thread_create(&(pe->threads[i].thread), playeng_thread_proc, &(pe->payloads), 0, 0);
 	}
 
@@ -499,6 +508,7 @@ void playeng_process(struct playeng *eng, float *buffers, unsigned nb_channels,
 					thisthread = &(eng->threads[i]);
 				} else {
 					eng->threads[i].next = otherthreads;
+					eng->threads[i].scheduled = 1;
 					otherthreads = &(eng->threads[i]);
 					nb_other++;
 				}
@@ -506,6 +516,12 @@ void playeng_process(struct playeng *eng, float *buffers, unsigned nb_channels,
 			}
 		}
 
+		/* An output stage needs to see silent blocks as well (e.g. so a
+		 * reverb keeps ringing after the last note has finished). Run the
+		 * first thread with an empty active list to get a zeroed buffer. */
+		if (thisthread == NULL && eng->output_stage != NULL)
+			thisthread = &(eng->threads[0]);
+
 		if (thisthread != NULL) {
 			unsigned j;
 
@@ -542,30 +558,41 @@ void playeng_process(struct playeng *eng, float *buffers, unsigned nb_channels,
 			/* Run this thread into the user supplied output buffer. */
 			playeng_thread_data_execute(thisthread);
 
-			/* Run all other threads and sum the output into the buffer
-			 * produced by the calling thread. */
+			/* Wait for all other threads and sum the output into the buffer
+			 * produced by the calling thread. The buffers are summed in
+			 * thread order rather than completion order so that the output
+			 * does not depend on scheduling (floating point addition is not
+			 * associative). */
 			if (otherthreads != NULL) {
 				while (nb_other) {
-					unsigned j;
 					while (eng->payloads.done == NULL)
 						cop_cond_wait((&eng->payloads.consumer_cond), &(eng->payloads.consumer_lock));
 
 					assert(eng->payloads.done != NULL);
 					do {
 						assert(nb_other);
+						nb_other--;
+						eng->payloads.done = eng->payloads.done->next;
+					} while (eng->payloads.done != NULL);
+				}
+				cop_mutex_unlock(&(eng->payloads.consumer_lock));
+
+				for (i = 0; i < eng->nb_threads; i++) {
+					if (eng->threads[i].scheduled) {
 						for (j = 0; j < nb_channels; j++) {
 							unsigned k;
 							for (k = 0; k < OUTPUT_SAMPLES; k++) {
-								thisthread->buffers[j][k] += eng->payloads.done->buffers[j][k];
+								thisthread->buffers[j][k] += eng->threads[i].buffers[j][k];
 							}
 						}
-						nb_other--;
-						eng->payloads.done = eng->payloads.done->next;
-					} while (eng->payloads.done != NULL);
+						eng->threads[i].scheduled = 0;
+					}
 				}
-				cop_mutex_unlock(&(eng->payloads.consumer_lock));
 			}
 
+			if (eng->output_stage != NULL)
+				eng->output_stage(eng->output_stage_context, thisthread->buffers, nb_channels);
+
 			/* At this point, thisthread's buffer contains all of the output
 			 * samples produced by all of the playback instances. Some of
 			 * those samples need to be written into the output buffer, and
@@ -658,6 +685,13 @@ void playeng_process(struct playeng *eng, float *buffers, unsigned nb_channels,
 	}
 }
 
+void playeng_set_output_stage(struct playeng *eng, playeng_output_stage stage, void *context)
+{
+	assert(eng != NULL);
+	eng->output_stage         = stage;
+	eng->output_stage_context = context;
+}
+
 void playeng_signal_block(struct playeng *eng, unsigned sigmask)
 {
 	assert(eng != NULL);
@@ -685,5 +719,22 @@ void playeng_signal_instance(struct playeng *eng, struct playeng_instance *inst,
 	cop_mutex_unlock(&eng->signal_lock);
 }
 
-
-
+int
+playeng_peek_position
+	(struct playeng_instance *inst
+	,unsigned                 decoder
+	,uint_fast32_t           *ipos
+	,uint_fast32_t           *fpos
+	,uint_fast32_t           *rate
+	)
+{
+	const volatile struct dec_state *ds;
+	assert(inst != NULL);
+	if (decoder >= inst->nb_states)
+		return 1;
+	ds    = inst->states[decoder];
+	*rate = ds->rate;
+	*ipos = ds->ipos;
+	*fpos = ds->fpos;
+	return *rate == 0;
+}
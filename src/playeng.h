@@ -82,12 +82,38 @@ struct playeng_instance *playeng_insert(struct playeng *eng, unsigned ndec, unsi
 /* Create a single output block of audio. */
 void playeng_process(struct playeng *eng, float *buffers, unsigned nb_channels, unsigned nb_samples);
 
+/* An output stage is given every block of OUTPUT_SAMPLES which the engine
+ * produces (including silent blocks) before it is written to the output of
+ * playeng_process(). buffers contains nb_channels pointers to the samples of
+ * each channel which can be modified in place. It is called from the thread
+ * which called playeng_process() and must not block. */
+typedef void (*playeng_output_stage)(void *context, float *COP_ATTR_RESTRICT *buffers, unsigned nb_channels);
+
+/* Set (or clear by passing NULL) the output stage. This must not be called
+ * while playeng_process() is running. */
+void playeng_set_output_stage(struct playeng *eng, playeng_output_stage stage, void *context);
+
 /* Set the given signal mask bits. If the bits are set and are not blocked (
  * using playeng_signal_block), a callback will be triggered from the audio
  * thread specifying the triggering bits. They will be cleared immediately
  * after the callback has been triggered. */
 void playeng_signal_instance(struct playeng *eng, struct playeng_instance *inst, unsigned sigmask);
 
+/* Read the playback position and rate of one of the decoders of an instance
+ * from a control thread. The audio thread may be changing them at the same
+ * time, so the values can be stale or inconsistent with each other and must
+ * only be used as a hint (e.g. for relstage_prepare()). Returns non-zero if
+ * the instance does not have that many decoders or the decoder has not been
+ * given a rate yet. */
+int
+playeng_peek_position
+	(struct playeng_instance *inst
+	,unsigned                 decoder
+	,uint_fast32_t           *ipos
+	,uint_fast32_t           *fpos
+	,uint_fast32_t           *rate
+	);
+
 /* Engine synchronisation primitives.
  *
  * These (if used correctly), have no effect on the playback engine if it is
@@ -0,0 +1,128 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+#include "relstage.h"
+#include "smplstream.h"
+
+#define RELSTAGE_EMPTY (0u)
+#define RELSTAGE_BUSY  (1u)
+#define RELSTAGE_READY (2u)
+
+void relstage_init(struct relstage *rs)
+{
+	unsigned i;
+	odatomic_store(&rs->state, RELSTAGE_EMPTY);
+	odatomic_store(&rs->hits, 0);
+	odatomic_store(&rs->misses, 0);
+	for (i = 0; i < RELSTAGE_CANDIDATES; i++)
+		rs->candidates[i].valid = 0;
+}
+
+void
+relstage_prepare
+	(struct relstage       *rs
+	,const struct pipe_v1  *pipe
+	,uint_fast32_t          ipos
+	,uint_fast32_t          fpos
+	,uint_fast32_t          rate
+	)
+{
+	uint_fast64_t pos = (uint_fast64_t)ipos * SMPL_POSITION_SCALE + fpos;
+	unsigned i;
+
+	if  (   !odatomic_cas(&rs->state, RELSTAGE_EMPTY, RELSTAGE_BUSY)
+	    &&  !odatomic_cas(&rs->state, RELSTAGE_READY, RELSTAGE_BUSY)
+	    )
+		return;
+
+	/* The decoders advance by exactly rate every output sample, so these
+	 * are the positions the attack will be at unless it jumps back to a loop
+	 * start in the meantime. */
+	for (i = 0; i < RELSTAGE_CANDIDATES; i++, pos += (uint_fast64_t)rate * OUTPUT_SAMPLES) {
+		struct relstage_candidate *c = &rs->candidates[i];
+		unsigned j;
+
+		reltable_find(&pipe->reltable, &c->rtd, (unsigned)(pos / SMPL_POSITION_SCALE), (unsigned)(pos % SMPL_POSITION_SCALE));
+
+		/* At low rates, both blocks can land on the same release sample. */
+		for (j = 0; j < i; j++)
+			if (rs->candidates[j].valid && rs->candidates[j].rtd.id == c->rtd.id && rs->candidates[j].rtd.pos_int == c->rtd.pos_int)
+				break;
+
+		/* Streamed releases are left to the audio thread. Instantiating one
+		 * claims a voice ring which a candidate that is never used would
+		 * hold on to. */
+		c->valid = (j == i) && !smplstream_is_streamed(&pipe->releases[c->rtd.id]);
+		if (c->valid)
+			pipe->releases[c->rtd.id].instantiate(&c->dec, &pipe->releases[c->rtd.id], c->rtd.pos_int, c->rtd.pos_frac);
+	}
+
+	odatomic_store(&rs->state, RELSTAGE_READY);
+}
+
+int
+relstage_start
+	(struct relstage        *rs
+	,const struct pipe_v1   *pipe
+	,struct dec_state       *release
+	,const struct dec_state *attack
+	,struct reltable_data   *rtd
+	)
+{
+	int hit = 0;
+
+	reltable_find(&pipe->reltable, rtd, attack->ipos, attack->fpos);
+
+	if (odatomic_cas(&rs->state, RELSTAGE_READY, RELSTAGE_BUSY)) {
+		unsigned i;
+		for (i = 0; i < RELSTAGE_CANDIDATES; i++) {
+			const struct relstage_candidate *c = &rs->candidates[i];
+			if (c->valid && c->rtd.id == rtd->id && c->rtd.pos_int == rtd->pos_int) {
+				/* Nothing in the staged decoder depends on the fractional
+				 * start position other than the position itself. */
+				*release      = c->dec;
+				release->fpos = rtd->pos_frac;
+				hit           = 1;
+				break;
+			}
+		}
+
+		/* Candidates are only ever good for one release. */
+		odatomic_store(&rs->state, RELSTAGE_EMPTY);
+	}
+
+	if (!hit)
+		pipe->releases[rtd->id].instantiate(release, &pipe->releases[rtd->id], rtd->pos_int, rtd->pos_frac);
+
+	/* The gain is interpolated from the exact attack position, so the fade is
+	 * always set up here. */
+	release->setfade(release, 0, 0.0f);
+	release->setfade(release, rtd->crossfade, rtd->gain);
+
+	odatomic_add(hit ? &rs->hits : &rs->misses, 1);
+	return hit;
+}
+
+void relstage_query(struct relstage *rs, unsigned long *hits, unsigned long *misses)
+{
+	*hits   = odatomic_load(&rs->hits);
+	*misses = odatomic_load(&rs->misses);
+}
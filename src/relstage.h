@@ -0,0 +1,114 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef RELSTAGE_H
+#define RELSTAGE_H
+
+#include "odatomic.h"
+#include "decode_types.h"
+#include "reltable.h"
+#include "wavldr.h"
+
+/* The relstage module moves the work of starting a release off the audio
+ * thread. Starting a release means finding it in the release table, clearing
+ * a decoder state and filling its interpolation filter with the samples
+ * before the start position. None of that is expensive on its own, but when
+ * a whole chord (or a whole division) is released in the same block it all
+ * lands on one callback.
+ *
+ * A control thread calls relstage_prepare() just before it signals the end of
+ * a note. It takes a guess at where the attack will be when the signal is
+ * handled and builds complete release decoders for a couple of candidate
+ * positions. The audio thread then calls relstage_start() in place of
+ * instantiating the release itself. That still looks up the release table
+ * using the real position (which is cheap), but if one of the candidates has
+ * the same release and integer start position, the decoder is copied and
+ * only its fractional position is corrected.
+ *
+ * A staged decoder of an in-memory release depends on nothing but the
+ * release and its start position, so a guess which turns out to be wrong
+ * (or stale, or torn by the audio thread moving underneath it) only means
+ * the release is instantiated on the audio thread in the same way as it
+ * always was. Releases which are streamed by smplstream are never staged:
+ * instantiating one claims a voice ring, and a candidate which was not used
+ * would keep its ring until the stream reclaimed it. */
+struct relstage;
+
+/* Initialise an empty stage. */
+void relstage_init(struct relstage *rs);
+
+/* Build release decoders for the attack of pipe being at (ipos, fpos) and at
+ * each of the following RELSTAGE_CANDIDATES-1 output blocks when played back
+ * at rate. This is called from a control thread. If the audio thread is
+ * using the stage at that moment, nothing is done. */
+void
+relstage_prepare
+	(struct relstage       *rs
+	,const struct pipe_v1  *pipe
+	,uint_fast32_t          ipos
+	,uint_fast32_t          fpos
+	,uint_fast32_t          rate
+	);
+
+/* Start the release for the attack decoder attack in the decoder release.
+ * The release is left fading in over the crossfade given by the release
+ * table, which is returned in rtd so that the caller can fade the attack
+ * out. This is called from the audio thread. Returns non-zero if a staged
+ * decoder was used. */
+int
+relstage_start
+	(struct relstage        *rs
+	,const struct pipe_v1   *pipe
+	,struct dec_state       *release
+	,const struct dec_state *attack
+	,struct reltable_data   *rtd
+	);
+
+/* Number of releases which were and were not started from a staged decoder.
+ * Can be called from any thread. */
+void relstage_query(struct relstage *rs, unsigned long *hits, unsigned long *misses);
+
+/* Private Parts
+ * ---------------------------------------------------------------------------
+ * Don't touch them. Only defined so you can bung them on the stack. */
+
+/* The signal which ends a note is handled at the start of the next block the
+ * engine processes after it has been sent, but the control thread does not
+ * know whether the position it read was from before or after the block which
+ * was being processed at the time. */
+#define RELSTAGE_CANDIDATES (2)
+
+struct relstage_candidate {
+	struct dec_state     dec;
+	struct reltable_data rtd;
+	int                  valid;
+};
+
+struct relstage {
+	/* One of RELSTAGE_EMPTY, RELSTAGE_BUSY or RELSTAGE_READY. Whoever moves
+	 * it to BUSY owns the candidates until they move it back. */
+	odatomic_u32              state;
+	odatomic_u32              hits;
+	odatomic_u32              misses;
+	struct relstage_candidate candidates[RELSTAGE_CANDIDATES];
+};
+
+#endif /* RELSTAGE_H */
@@ -21,6 +21,7 @@
 #include "reltable.h"
 #include "interpdata.h"
 #include "wav_dumper.h"
+#include <stdint.h>
 #include <stddef.h>
 #include <math.h>
 #include <assert.h>
@@ -58,6 +59,98 @@ struct relnode {
 	struct relnode  *right;
 };
 
+/* Splits m (multiplied by 2^27+1) so that the high part has at most 26
+ * significant bits. See Veltkamp/Dekker splitting. */
+#define RELTABLE_SPLIT_FACTOR (134217729.0)
+
+/* The most multiples of m which can be subtracted exactly. */
+#define RELTABLE_MAX_MULTIPLE (134217728.0)
+
+/* The entry which is used for every position in (x - 1, x]. */
+static unsigned reltable_entry_at(const struct reltable *reltable, uint_fast64_t x)
+{
+	unsigned i;
+	unsigned last_idx = (reltable->nb_entry > 0) ? reltable->nb_entry - 1 : 0;
+	for (i = 0; i < last_idx && reltable->entry[i].last_sample < x; i++);
+	return i;
+}
+
+void reltable_compile(struct reltable *reltable)
+{
+	unsigned i, k;
+	unsigned last_idx = (reltable->nb_entry > 0) ? reltable->nb_entry - 1 : 0;
+	uint_fast64_t max_last = 0;
+	uint_fast64_t scale;
+
+	/* Any position past the end of all but the last entry uses the last
+	 * entry, so the buckets only need to cover up to there. */
+	for (i = 0; i < last_idx; i++)
+		if (reltable->entry[i].last_sample > max_last)
+			max_last = reltable->entry[i].last_sample;
+
+	scale = ((uint_fast64_t)RELTABLE_INDEX_SIZE << 32) / (max_last + 1);
+	reltable->index_scale = (uint32_t)((scale > 0xFFFFFFFFu) ? 0xFFFFFFFFu : scale);
+
+	/* Bucket k holds the positions from the smallest x with
+	 * (x * index_scale) >> 32 == k up to the start of the next bucket. The
+	 * last bucket goes on forever. Entries are not necessarily in order, so
+	 * the entry at a position is always found in the same way as the
+	 * original linear search did. */
+	for (k = 0; k < RELTABLE_INDEX_SIZE; k++) {
+		uint_fast64_t start = (((uint_fast64_t)k << 32) + reltable->index_scale - 1) / reltable->index_scale;
+		uint_fast64_t next  = (((uint_fast64_t)(k + 1) << 32) + reltable->index_scale - 1) / reltable->index_scale;
+		reltable->index_lo[k] = (unsigned char)reltable_entry_at(reltable, start);
+		reltable->index_hi[k] = (unsigned char)((k + 1 < RELTABLE_INDEX_SIZE) ? reltable_entry_at(reltable, next) : last_idx);
+	}
+
+	for (i = 0; i < reltable->nb_entry; i++) {
+		double m = reltable->entry[i].m;
+		if (m > 0.0 && m < HUGE_VAL) {
+			double c = RELTABLE_SPLIT_FACTOR * m;
+			reltable->phase[i].m_hi  = c - (c - m);
+			reltable->phase[i].m_lo  = m - reltable->phase[i].m_hi;
+			reltable->phase[i].inv_m = 1.0 / m;
+		} else {
+			reltable->phase[i].m_hi  = 0.0;
+			reltable->phase[i].m_lo  = 0.0;
+			reltable->phase[i].inv_m = 0.0;
+		}
+	}
+}
+
+/* Returns exactly fmod(x, m) for the entry where x is non-negative and has
+ * the precision of a float.
+ *
+ * x has at most 24 significant bits and the high part of m has at most 26.
+ * As long as fewer than 2^27 multiples are removed, n*m_hi and n*m_lo are
+ * both exact. x - n*m_hi is also exact because it needs no more than 53
+ * bits. The result of fmod() is always representable so the final
+ * subtraction is also exact when n is right. The estimate of n can only be
+ * out by one and the sign of the result shows which way. */
+static double reltable_fmod(const struct reltable *reltable, unsigned i, double x)
+{
+	double m = reltable->entry[i].m;
+	double n, r;
+
+	if (x < m)
+		return x;
+
+	n = floor(x * reltable->phase[i].inv_m);
+	if (reltable->phase[i].inv_m == 0.0 || n >= RELTABLE_MAX_MULTIPLE)
+		return fmod(x, m);
+
+	r = (x - n * reltable->phase[i].m_hi) - n * reltable->phase[i].m_lo;
+	if (r < 0.0) {
+		n -= 1.0;
+		r  = (x - n * reltable->phase[i].m_hi) - n * reltable->phase[i].m_lo;
+	} else if (r >= m) {
+		n += 1.0;
+		r  = (x - n * reltable->phase[i].m_hi) - n * reltable->phase[i].m_lo;
+	}
+
+	return r;
+}
+
 void
 reltable_find
 	(const struct reltable *reltable
@@ -67,6 +160,7 @@ reltable_find
 	)
 {
 	unsigned i;
+	unsigned bucket;
 	float    tmp;
 	float    gain;
 	double   sample = sus_pos_int + sus_pos_frac * (1.0 / SMPL_POSITION_SCALE);
@@ -75,10 +169,10 @@ reltable_find
 	assert(reltable->nb_entry);
 	assert(reldata);
 
-	for (i = 0; i < reltable->nb_entry-1; i++) {
-		if (sample <= reltable->entry[i].last_sample)
-			break;
-	}
+	bucket = (unsigned)(((uint_fast64_t)sus_pos_int * reltable->index_scale) >> 32);
+	bucket = (bucket < RELTABLE_INDEX_SIZE) ? bucket : RELTABLE_INDEX_SIZE - 1;
+	i      = reltable->index_lo[bucket];
+	i      = (sample <= reltable->entry[i].last_sample) ? i : reltable->index_hi[bucket];
 
 	if (i == 0) {
 		gain        = reltable->entry[i].gain;
@@ -114,9 +208,12 @@ reltable_find
 	 * when we instantiate the release (otherwise we may produce some unwanted
 	 * samples at the beginning of the release). */
 	tmp = sample - reltable->entry[i].b - (double)SMPL_INTERP_TAPS;
-	while (tmp < 0.0)
-		tmp += reltable->entry[i].m;
-	tmp = (double)SMPL_INTERP_TAPS + fmod(tmp, reltable->entry[i].m);
+	if (tmp < 0.0) {
+		double r = reltable_fmod(reltable, i, -tmp);
+		tmp = (double)SMPL_INTERP_TAPS + ((r > 0.0) ? reltable->entry[i].m - r : 0.0);
+	} else {
+		tmp = (double)SMPL_INTERP_TAPS + reltable_fmod(reltable, i, tmp);
+	}
 
 	reldata->pos_int  = (unsigned)floor(tmp);
 	reldata->pos_frac = (unsigned)((tmp - reldata->pos_int) * SMPL_POSITION_SCALE);
@@ -130,18 +227,21 @@ reltable_find
 static
 void
 build_relnode
-	(struct relnode *rn
-	,const unsigned *sync_positions
-	,const float    *gain_vec
-	,const float    *shape_error_vec
-	,unsigned        start_position
-	,unsigned        end_position
-	,unsigned        error_vec_len
+	(struct relnode      *rn
+	,const unsigned      *sync_positions
+	,const uint_fast64_t *sync_sums
+	,const uint_fast64_t *sync_isums
+	,const float         *gain_vec
+	,const float         *shape_error_vec
+	,unsigned             start_position
+	,unsigned             end_position
+	,unsigned             error_vec_len
 	)
 {
 	unsigned i;
-	double mean_y = 0.0;
-	double mean_x = 0.0;
+	uint_fast64_t n, sy, sjy;
+	double mean_y;
+	double mean_x;
 	double sum_n, sum_d;
 
 	assert(end_position > start_position);
@@ -150,24 +250,24 @@ build_relnode
 	rn->startidx           = start_position;
 	rn->endidx             = end_position;
 
-	for (i = start_position; i <= end_position; i++) {
-		unsigned sp   = sync_positions[i];
-		mean_y       += sp;
-		mean_x       += i;
-	}
-
 	/* Compute modfac and b as the least-squares line fit through all of the
 	 * sync positions. So the position we jump to inside the release will be
 	 *        (current_position + b) % modfac
-	 */
-	mean_y                /= rn->nb_sync_positions;
-	mean_x                /= rn->nb_sync_positions;
-	sum_n                  = 0.0;
-	sum_d                  = 0.0;
-	for (i = start_position; i <= end_position; i++) {
-		sum_n += (i - mean_x) * (sync_positions[i] - mean_y);
-		sum_d += (i - mean_x) * (i - mean_x);
-	}
+	 *
+	 * sync_sums[k] is the sum of the first k sync positions and sync_isums[k]
+	 * is the sum of the first k sync positions each multiplied by its index.
+	 * With j = i - start_position, the sum of (i - mean_x)(y_i - mean_y) is
+	 * the sum of j*y_i less (n-1)/2 times the sum of y_i. Twice that is an
+	 * integer which is far smaller than 2^63, so it comes out exactly from
+	 * the prefix sums even though they may have wrapped. The sums of the
+	 * indices and of squared index deviations have closed forms. */
+	n      = rn->nb_sync_positions;
+	sy     = sync_sums[end_position+1] - sync_sums[start_position];
+	sjy    = (sync_isums[end_position+1] - sync_isums[start_position]) - start_position * sy;
+	mean_y = (double)sy / rn->nb_sync_positions;
+	mean_x = (double)(((uint_fast64_t)start_position + end_position) * n / 2) / rn->nb_sync_positions;
+	sum_d  = (double)(n * (n * n - 1)) / 12.0;
+	sum_n  = (double)(int_fast64_t)(2 * sjy - (n - 1) * sy) / 2.0;
 	rn->modfac = sum_n / sum_d;
 	rn->b      = mean_y - rn->modfac * mean_x;
 	rn->b      = rn->modfac * start_position + rn->b;
@@ -282,7 +382,7 @@ recursive_construct_table
 /* Build an unbalanced tree of release nodes. The worst leaf node is
  * searched for and split until the buffer of nodes is exhausted. */
 static
-void
+int
 reltable_int
 	(struct reltable *reltable
 	,const unsigned  *sync_positions
@@ -295,14 +395,29 @@ reltable_int
 	struct relnode root;
 	struct relnode nodebuf[160];
 	unsigned nbuf = 160;
+	uint_fast64_t *sync_sums = malloc(sizeof(sync_sums[0]) * 2 * (nb_sync_positions + 1));
+	uint_fast64_t *sync_isums;
+	unsigned i;
 
 	assert(nb_sync_positions);
 
-	build_relnode(&root, sync_positions, gain_vec, shape_error_vec, 0, nb_sync_positions-1, error_vec_len);
+	if (sync_sums == NULL)
+		return -1;
+
+	/* Built once so that the line fit of every node can be found from the
+	 * sums at either end of it. */
+	sync_isums    = sync_sums + nb_sync_positions + 1;
+	sync_sums[0]  = 0;
+	sync_isums[0] = 0;
+	for (i = 0; i < nb_sync_positions; i++) {
+		sync_sums[i+1]  = sync_sums[i] + sync_positions[i];
+		sync_isums[i+1] = sync_isums[i] + (uint_fast64_t)i * sync_positions[i];
+	}
+
+	build_relnode(&root, sync_positions, sync_sums, sync_isums, gain_vec, shape_error_vec, 0, nb_sync_positions-1, error_vec_len);
 
 	while (nbuf > 2) {
 		struct relnode *w = find_worst_node(&root);
-		unsigned i;
 		double eh;
 
 		double gain_min = 0.0f;
@@ -365,16 +480,20 @@ reltable_int
 		w->left = &(nodebuf[--nbuf]);
 		w->right = &(nodebuf[--nbuf]);
 
-		build_relnode(w->left, sync_positions, gain_vec, shape_error_vec, w->startidx, stop1, error_vec_len);
-		build_relnode(w->right, sync_positions, gain_vec, shape_error_vec, start2, w->endidx, error_vec_len);
+		build_relnode(w->left, sync_positions, sync_sums, sync_isums, gain_vec, shape_error_vec, w->startidx, stop1, error_vec_len);
+		build_relnode(w->right, sync_positions, sync_sums, sync_isums, gain_vec, shape_error_vec, start2, w->endidx, error_vec_len);
 	}
 
+	free(sync_sums);
+
 	reltable->nb_entry = 0;
 	recursive_construct_table
 		(&root
 		,reltable
 		,sync_positions
 		);
+
+	return 0;
 }
 
 /* TODO: This algorithm is garbage. */
@@ -446,7 +565,81 @@ merge_reltables
 	}
 }
 
-void
+/* Everything needed to analyse one release against the attack. The
+ * releases do not depend on each other until their tables are merged. They
+ * are analysed one after the other on the calling thread - it is already one
+ * of the loader threads, which keep every core busy with other samples. */
+struct relanalysis {
+	const float     *envelope_buf;
+	const float     *corrbuf;
+	float            rel_power;
+	unsigned         error_vec_len;
+	float            period;
+
+	float           *ms_error;
+	float           *shape_error;
+	unsigned        *epos;
+	unsigned         nb_syncs;
+	struct reltable *table;
+};
+
+/* Returns non-zero if out of memory. */
+static int analyse_release(struct relanalysis *ra)
+{
+	float        clipmax   = powf(10.0f, 2.0f / 20.0f);
+	float        clipmin   = powf(10.0f, -2.0f / 20.0f);
+	float        rel_power = ra->rel_power;
+	float        rel_scale = 1.0f / rel_power;
+	const float *corrbuf   = ra->corrbuf;
+	float       *egain     = malloc(ra->error_vec_len * sizeof(float));
+	unsigned     i;
+	int          err;
+
+	if (egain == NULL)
+		return -1;
+
+	for (i = 0; i < ra->error_vec_len; i++) {
+		float scale = rel_power + ra->envelope_buf[i];
+		float f     = scale - 2.0f * corrbuf[i];
+
+		/* This is new...
+		 * We are working out the MS error if we crossfade into the
+		 * release at the best gain. But the best gain might be zero.
+		 * It also might be very large. We hack it by limiting the
+		 * gain range. This is great, but when multiple releases have
+		 * similar levels, the gain is similar - but one release is
+		 * clearly going to be the winner; so we use a power to bring
+		 * the resultant gain closer and closer to 1. */
+		float g = corrbuf[i] / rel_power;
+		if (g > clipmax) g = clipmax;
+		else if (g < clipmin) g = clipmin;
+		g = (g - 1.0f) * 0.25f + 1.0f;
+//		g = powf(g, 1.0 / 6.0);
+
+		/* TODO: WE ARE USING MS ERROR AGAIN TO BUILD TABLES - THIS
+		 * GIVES THE BEST RESULT WHEN USING MULTIPLE RELEASES...
+		 * CLEAN UP THE MESS! */
+		ra->shape_error[i] = f;
+		ra->ms_error[i]    = (g * g * rel_power + ra->envelope_buf[i] - g * 2.0f * corrbuf[i]);
+		egain[i]           = corrbuf[i] * rel_scale;
+	}
+
+	ra->nb_syncs = reltable_find_correlation_peaks(corrbuf, ra->ms_error, ra->epos, ra->error_vec_len, (unsigned)(ra->period + 0.5));
+
+	err = reltable_int
+		(ra->table
+		,ra->epos
+		,ra->nb_syncs
+		,egain
+		,ra->shape_error
+		,ra->error_vec_len
+		);
+
+	free(egain);
+	return err;
+}
+
+int
 reltable_build
 	(struct reltable *reltable
 	,const float     *envelope_buf
@@ -459,165 +652,130 @@ reltable_build
 	,const char      *debug_prefix
 	)
 {
-	unsigned i;
 	unsigned rel_idx;
+	int       err = 0;
 	unsigned *error_positions = malloc(rel_stride * nb_rels * sizeof(unsigned));
 	float    *shape_errors    = malloc(rel_stride * nb_rels * sizeof(float));
-	unsigned *nb_syncs        = malloc(nb_rels * sizeof(unsigned));
+	float    *ms_errors       = malloc(rel_stride * nb_rels * sizeof(float));
+	struct relanalysis *tasks = malloc(nb_rels * sizeof(tasks[0]));
+	struct reltable    *tmps  = malloc(nb_rels * sizeof(tmps[0]));
 	(void)debug_prefix;
-	float clipmax = powf(10.0f, 2.0f / 20.0f);
-	float clipmin = powf(10.0f, -2.0f / 20.0f);
 
-	{
-		float          *ms_errors = malloc(rel_stride * nb_rels * sizeof(float));
+	if (error_positions == NULL || shape_errors == NULL || ms_errors == NULL || tasks == NULL || tmps == NULL) {
+		free(tmps);
+		free(tasks);
+		free(ms_errors);
+		free(shape_errors);
+		free(error_positions);
+		return -1;
+	}
 
-		for (rel_idx = 0; rel_idx < nb_rels; rel_idx++) {
-			float        rel_power   = rel_powers[rel_idx];
-			float       *ms_error    = ms_errors        + rel_idx * rel_stride;
-			float       *shape_error = shape_errors     + rel_idx * rel_stride;
-			const float *corrbuf     = correlation_bufs + rel_idx * rel_stride;
-			unsigned    *epos        = error_positions  + rel_idx * rel_stride;
-			unsigned     errpos;
-			float        err;
-
-			/* Find best release alignment position. */
-			for (i = 0, err = rel_power, errpos = 0; i < error_vec_len; i++) {
-				float scale = rel_power + envelope_buf[i];
-				float f     = scale - 2.0f * corrbuf[i];
-
-				/* This is new...
-				 * We are working out the MS error if we crossfade into the
-				 * release at the best gain. But the best gain might be zero.
-				 * It also might be very large. We hack it by limiting the
-				 * gain range. This is great, but when multiple releases have
-				 * similar levels, the gain is similar - but one release is
-				 * clearly going to be the winner; so we use a power to bring
-				 * the resultant gain closer and closer to 1. */
-				float g = corrbuf[i] / rel_power;
-				if (g > clipmax) g = clipmax;
-				else if (g < clipmin) g = clipmin;
-				g = (g - 1.0f) * 0.25f + 1.0f;
-//				g = powf(g, 1.0 / 6.0);
-
-				/* TODO: WE ARE USING MS ERROR AGAIN TO BUILD TABLES - THIS
-				 * GIVES THE BEST RESULT WHEN USING MULTIPLE RELEASES...
-				 * CLEAN UP THE MESS! */
-				shape_error[i] = f;
-				ms_error[i]    = (g * g * rel_power + envelope_buf[i] - g * 2.0f * corrbuf[i]);
-			}
+	for (rel_idx = 0; rel_idx < nb_rels; rel_idx++) {
+		struct relanalysis *ra = &tasks[rel_idx];
+		ra->envelope_buf  = envelope_buf;
+		ra->corrbuf       = correlation_bufs + rel_idx * rel_stride;
+		ra->rel_power     = rel_powers[rel_idx];
+		ra->error_vec_len = error_vec_len;
+		ra->period        = period;
+		ra->ms_error      = ms_errors + rel_idx * rel_stride;
+		ra->shape_error   = shape_errors + rel_idx * rel_stride;
+		ra->epos          = error_positions + rel_idx * rel_stride;
+		ra->table         = (rel_idx == 0) ? reltable : &tmps[rel_idx];
+		ra->nb_syncs      = 0;
+	}
 
-			nb_syncs[rel_idx] = reltable_find_correlation_peaks(corrbuf, ms_error, epos, error_vec_len, (unsigned)(period + 0.5));
-		}
+	for (rel_idx = 0; rel_idx < nb_rels && !err; rel_idx++)
+		err = analyse_release(&tasks[rel_idx]);
 
 #ifdef OPENDIAPASON_VERBOSE_DEBUG
-		{
-			struct svgplot plot;
-			double *xs, *ys;
-			struct svgplot_gridinfo gi;
-			char   namebuf[1024];
-			FILE  *fo;
-
-			gi.x.is_visible     = 1;
-			gi.x.major_interval = 50000;
-			gi.x.sub_divisions  = 10;
-			gi.x.show_text      = 1;
-			gi.x.is_log         = 0;
-			gi.x.auto_size      = 1;
-			gi.x.start          = 0;
-			gi.x.end            = 0;
-
-			gi.y.is_visible     = 1;
-			gi.y.major_interval = 10;
-			gi.y.sub_divisions  = 10;
-			gi.y.show_text      = 1;
-			gi.y.is_log         = 1;
-			gi.y.auto_size      = 1;
-			gi.y.start          = 0;
-			gi.y.end            = 0;
-
-			svgplot_create(&plot);
-			for (rel_idx = 0; rel_idx < nb_rels; rel_idx++) {
-				unsigned i;
-				xs = malloc(sizeof(double) * nb_syncs[rel_idx]);
-				ys = malloc(sizeof(double) * nb_syncs[rel_idx]);
-				for (i = 0; i < nb_syncs[rel_idx]; i++) {
-					xs[i] = error_positions[rel_idx * rel_stride + i];
-					ys[i] = ms_errors[rel_idx * rel_stride + error_positions[rel_idx * rel_stride + i]];
-				}
-				svgplot_add_data(&plot, xs, ys, nb_syncs[rel_idx]);
-			}
-
-			sprintf(namebuf, "%s_reltable_mses.svg", debug_prefix);
-			fo = fopen(namebuf, "w");
-			svgplot_finalise(&plot, &gi, 16, 12, 1, fo);
-			fclose(fo);
-		}
-
-		if (strlen(debug_prefix) < 1024 - 50) {
-			char      namebuf[1024];
-			struct wav_dumper dump;
-			sprintf(namebuf, "%s_reltable_mses.wav", debug_prefix);
-			if (wav_dumper_begin(&dump, namebuf, nb_rels, 24, 44100, 1, 44100) == 0) {
-				(void)wav_dumper_write_from_floats(&dump, ms_errors, error_vec_len, 1, rel_stride);
-				wav_dumper_end(&dump);
+	{
+		struct svgplot plot;
+		double *xs, *ys;
+		struct svgplot_gridinfo gi;
+		char   namebuf[1024];
+		FILE  *fo;
+
+		gi.x.is_visible     = 1;
+		gi.x.major_interval = 50000;
+		gi.x.sub_divisions  = 10;
+		gi.x.show_text      = 1;
+		gi.x.is_log         = 0;
+		gi.x.auto_size      = 1;
+		gi.x.start          = 0;
+		gi.x.end            = 0;
+
+		gi.y.is_visible     = 1;
+		gi.y.major_interval = 10;
+		gi.y.sub_divisions  = 10;
+		gi.y.show_text      = 1;
+		gi.y.is_log         = 1;
+		gi.y.auto_size      = 1;
+		gi.y.start          = 0;
+		gi.y.end            = 0;
+
+		svgplot_create(&plot);
+		for (rel_idx = 0; rel_idx < nb_rels; rel_idx++) {
+			unsigned i;
+			xs = malloc(sizeof(double) * tasks[rel_idx].nb_syncs);
+			ys = malloc(sizeof(double) * tasks[rel_idx].nb_syncs);
+			for (i = 0; i < tasks[rel_idx].nb_syncs; i++) {
+				xs[i] = error_positions[rel_idx * rel_stride + i];
+				ys[i] = ms_errors[rel_idx * rel_stride + error_positions[rel_idx * rel_stride + i]];
 			}
+			svgplot_add_data(&plot, xs, ys, tasks[rel_idx].nb_syncs);
 		}
-#endif
-
-		free(ms_errors);
 
-#ifdef OPENDIAPASON_VERBOSE_DEBUG
-		printf("period: %f\n", period);
-#endif
+		sprintf(namebuf, "%s_reltable_mses.svg", debug_prefix);
+		fo = fopen(namebuf, "w");
+		svgplot_finalise(&plot, &gi, 16, 12, 1, fo);
+		fclose(fo);
 	}
 
-	for (rel_idx = 0; rel_idx < nb_rels; rel_idx++) {
-		struct reltable tmp;
-		float           rel_scale = 1.0f / rel_powers[rel_idx];
-		float          *egain     = malloc(error_vec_len * sizeof(float));
-		const float    *ecorr     = correlation_bufs + rel_idx * rel_stride;
-		unsigned       *epos      = error_positions + rel_idx * rel_stride;
-
-		for (i = 0; i < error_vec_len; i++) {
-			egain[i] = ecorr[i] * rel_scale;
+	if (strlen(debug_prefix) < 1024 - 50) {
+		char      namebuf[1024];
+		struct wav_dumper dump;
+		sprintf(namebuf, "%s_reltable_mses.wav", debug_prefix);
+		if (wav_dumper_begin(&dump, namebuf, nb_rels, 24, 44100, 1, 44100) == 0) {
+			(void)wav_dumper_write_from_floats(&dump, ms_errors, error_vec_len, 1, rel_stride);
+			wav_dumper_end(&dump);
 		}
+	}
 
-		reltable_int
-			((rel_idx == 0) ? reltable : &tmp
-			,epos
-			,nb_syncs[rel_idx]
-			,egain
-			,shape_errors + rel_idx * rel_stride
-			,error_vec_len
-			);
+	printf("period: %f\n", period);
+#endif
 
-		if (rel_idx != 0) {
+	for (rel_idx = 1; rel_idx < nb_rels && !err; rel_idx++) {
 #ifdef OPENDIAPASON_VERBOSE_DEBUG
-			for (i = 0; i < tmp.nb_entry; i++) {
-				printf("%u) %f,%f,%f,%f\n", tmp.entry[i].last_sample, tmp.entry[i].m, tmp.entry[i].b, tmp.entry[i].gain, tmp.entry[i].avgerr);
-			}
-#endif
-			merge_reltables
-				(reltable
-				,&tmp
-				,rel_idx
-				);
+		unsigned i;
+		for (i = 0; i < tmps[rel_idx].nb_entry; i++) {
+			printf("%u) %f,%f,%f,%f\n", tmps[rel_idx].entry[i].last_sample, tmps[rel_idx].entry[i].m, tmps[rel_idx].entry[i].b, tmps[rel_idx].entry[i].gain, tmps[rel_idx].entry[i].avgerr);
 		}
-
-		free(egain);
+#endif
+		merge_reltables
+			(reltable
+			,&tmps[rel_idx]
+			,rel_idx
+			);
 	}
 
-	free(nb_syncs);
+	free(tmps);
+	free(tasks);
+	free(ms_errors);
 	free(error_positions);
 	free(shape_errors);
 
 #ifdef OPENDIAPASON_VERBOSE_DEBUG
-	for (i = 0; i < reltable->nb_entry; i++) {
-		printf("%u) %f,%f,%f,%f,%d\n", reltable->entry[i].last_sample, reltable->entry[i].m, reltable->entry[i].b, reltable->entry[i].gain, reltable->entry[i].avgerr, reltable->entry[i].rel_id);
+	{
+		unsigned i;
+		for (i = 0; i < reltable->nb_entry; i++) {
+			printf("%u) %f,%f,%f,%f,%d\n", reltable->entry[i].last_sample, reltable->entry[i].m, reltable->entry[i].b, reltable->entry[i].gain, reltable->entry[i].avgerr, reltable->entry[i].rel_id);
+		}
 	}
 #endif
-}
-
-
 
+	if (err)
+		return err;
 
+	reltable_compile(reltable);
+	return 0;
+}
@@ -22,8 +22,10 @@
 #define RELTABLE_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define RELTABLE_MAX_ENTRIES (128)
+#define RELTABLE_INDEX_SIZE  (1024)
 
 struct reltable {
 	unsigned nb_entry;
@@ -35,6 +37,28 @@ struct reltable {
 		float    gain;
 		float    avgerr;
 	} entry[RELTABLE_MAX_ENTRIES];
+
+	/* The compiled form of the table which is built by reltable_compile().
+	 *
+	 * A sample position p falls in bucket k = min((p * index_scale) >> 32,
+	 * RELTABLE_INDEX_SIZE - 1). index_lo[k] is the entry used at the start
+	 * of the bucket and index_hi[k] is the one used at the end of it. A
+	 * position uses index_lo[k] if it is not past the last_sample of that
+	 * entry and index_hi[k] otherwise. This is exact unless more than one
+	 * entry ends inside the bucket, in which case the entries in between are
+	 * skipped over.
+	 *
+	 * m_hi and m_lo split m so that multiples of it can be subtracted from a
+	 * position exactly (giving the same result as fmod()) and inv_m is one
+	 * over m. inv_m is zero if m cannot be handled this way. */
+	uint32_t      index_scale;
+	unsigned char index_lo[RELTABLE_INDEX_SIZE];
+	unsigned char index_hi[RELTABLE_INDEX_SIZE];
+	struct {
+		double    m_hi;
+		double    m_lo;
+		double    inv_m;
+	} phase[RELTABLE_MAX_ENTRIES];
 };
 
 struct reltable_data {
@@ -45,6 +69,10 @@ struct reltable_data {
 	float     gain;
 };
 
+/* Find the release to use and where to start it when the attack/sustain is
+ * at the given position. This is called on the audio thread. It only uses the
+ * compiled form of the table so the cost does not depend on the number of
+ * entries. */
 void
 reltable_find
 	(const struct reltable *reltable
@@ -53,6 +81,11 @@ reltable_find
 	,unsigned               sus_pos_frac
 	);
 
+/* Build the compiled form of the table from the entries. reltable_build()
+ * does this already - it only needs to be called if the entries are changed
+ * by some other means. */
+void reltable_compile(struct reltable *reltable);
+
 /* Creates a release alignment table for aligning a release with an
  * attack/sustain segment.
  *
@@ -97,8 +130,10 @@ reltable_find
  *
  * - debug_prefix is a file-name or path which will be used as a prefix to
  *   debug dump files. They will all begin with "reltable". If this is NULL,
- *   no debug files will be dumped. */
-void
+ *   no debug files will be dumped.
+ *
+ * Returns non-zero if out of memory. */
+int
 reltable_build
 	(struct reltable *reltable
 	,const float     *envelope_buf
@@ -0,0 +1,545 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "residency.h"
+#include "cop/cop_alloc.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+/* Size of the chunks requested from the operating system. Allocations
+ * larger than this get a chunk to themselves. This is a multiple of every
+ * huge page size we are likely to see. */
+#define RESIDENCY_CHUNK_SIZE     ((size_t)32*1024*1024)
+#define RESIDENCY_HUGE_PAGE_SIZE ((size_t)2*1024*1024)
+
+/* Granularity of the re-touch thread sleeps. This determines how long
+ * residency_destroy() may take to stop the thread. */
+#define RESIDENCY_SLEEP_STEP_MS  (100)
+
+static size_t round_up(size_t x, size_t align)
+{
+	return ((x + align - 1) / align) * align;
+}
+
+/* Operating system specific parts
+ * ------------------------------------------------------------------------ */
+
+#ifdef _WIN32
+
+static void *os_chunk_alloc(size_t size, unsigned flags, int *huge)
+{
+	void *p = NULL;
+	*huge = 0;
+	if (flags & RESIDENCY_FLAG_HUGE_EXPLICIT) {
+		SIZE_T lpsz = GetLargePageMinimum();
+		if (lpsz != 0 && (size % lpsz) == 0) {
+			p = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			*huge = (p != NULL);
+		}
+	}
+	if (p == NULL)
+		p = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	return p;
+}
+
+static void os_chunk_free(void *p, size_t size)
+{
+	(void)size;
+	VirtualFree(p, 0, MEM_RELEASE);
+}
+
+static int os_lock(void *p, size_t size)
+{
+	return !VirtualLock(p, size);
+}
+
+static void os_unlock(void *p, size_t size)
+{
+	(void)VirtualUnlock(p, size);
+}
+
+static int os_grow_lock_limit(size_t budget)
+{
+	SIZE_T wmin, wmax;
+	HANDLE proc = GetCurrentProcess();
+	if (!GetProcessWorkingSetSize(proc, &wmin, &wmax))
+		return -1;
+	return !SetProcessWorkingSetSize(proc, wmin + budget, wmax + budget);
+}
+
+static int os_query_resident(const unsigned char *base, size_t size, size_t page_size, size_t *resident)
+{
+	size_t nb_pages = size / page_size;
+	size_t i, count = 0;
+	PSAPI_WORKING_SET_EX_INFORMATION *info = malloc(sizeof(*info) * (nb_pages ? nb_pages : 1));
+	if (info == NULL)
+		return -1;
+	for (i = 0; i < nb_pages; i++)
+		info[i].VirtualAddress = (PVOID)(base + i * page_size);
+	if (!QueryWorkingSetEx(GetCurrentProcess(), info, (DWORD)(sizeof(*info) * nb_pages))) {
+		free(info);
+		return -1;
+	}
+	for (i = 0; i < nb_pages; i++)
+		count += info[i].VirtualAttributes.Valid ? 1 : 0;
+	free(info);
+	*resident = count * page_size;
+	return 0;
+}
+
+static void os_lower_thread_priority(void)
+{
+	(void)SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+}
+
+static void os_sleep_ms(unsigned ms)
+{
+	Sleep(ms);
+}
+
+#else
+
+static void *os_chunk_alloc(size_t size, unsigned flags, int *huge)
+{
+	void *p = MAP_FAILED;
+	*huge = 0;
+
+#if defined(MAP_HUGETLB)
+	if (flags & RESIDENCY_FLAG_HUGE_EXPLICIT) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		*huge = (p != MAP_FAILED);
+	}
+#endif
+
+#if defined(MADV_HUGEPAGE)
+	if (p == MAP_FAILED && (flags & (RESIDENCY_FLAG_HUGE_TRANSPARENT | RESIDENCY_FLAG_HUGE_EXPLICIT))) {
+		/* Transparent huge pages only get used for aligned ranges, so map a
+		 * bit more than we need and trim the ends off. */
+		unsigned char *raw = mmap(NULL, size + RESIDENCY_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (raw != MAP_FAILED) {
+			unsigned char *aligned = (unsigned char *)round_up((size_t)(uintptr_t)raw, RESIDENCY_HUGE_PAGE_SIZE);
+			size_t         head    = aligned - raw;
+			if (head)
+				munmap(raw, head);
+			if (RESIDENCY_HUGE_PAGE_SIZE - head)
+				munmap(aligned + size, RESIDENCY_HUGE_PAGE_SIZE - head);
+			p     = aligned;
+			*huge = (madvise(p, size, MADV_HUGEPAGE) == 0);
+		}
+	}
+#endif
+
+	if (p == MAP_FAILED)
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+static void os_chunk_free(void *p, size_t size)
+{
+	munmap(p, size);
+}
+
+static int os_lock(void *p, size_t size)
+{
+	return mlock(p, size);
+}
+
+static void os_unlock(void *p, size_t size)
+{
+	(void)munlock(p, size);
+}
+
+static int os_grow_lock_limit(size_t budget)
+{
+	(void)budget;
+	return 0;
+}
+
+static int os_query_resident(const unsigned char *base, size_t size, size_t page_size, size_t *resident)
+{
+	size_t nb_pages = size / page_size;
+	size_t i, count = 0;
+#if defined(__APPLE__)
+	char *vec = malloc(nb_pages ? nb_pages : 1);
+#else
+	unsigned char *vec = malloc(nb_pages ? nb_pages : 1);
+#endif
+	if (vec == NULL)
+		return -1;
+	if (mincore((void *)base, size, vec)) {
+		free(vec);
+		return -1;
+	}
+	for (i = 0; i < nb_pages; i++)
+		count += (vec[i] & 1) ? 1 : 0;
+	free(vec);
+	*resident = count * page_size;
+	return 0;
+}
+
+static void os_lower_thread_priority(void)
+{
+#if defined(__linux__)
+	/* On Linux, the nice value is per-thread. */
+	(void)setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+#endif
+}
+
+static void os_sleep_ms(unsigned ms)
+{
+	usleep(ms * 1000u);
+}
+
+#endif
+
+/* Allocator
+ * ------------------------------------------------------------------------ */
+
+static struct residency_chunk *new_chunk(struct residency *r, size_t min_size)
+{
+	struct residency_chunk *c = malloc(sizeof(*c));
+	size_t sz = round_up(min_size, RESIDENCY_HUGE_PAGE_SIZE);
+	if (sz < r->chunk_size)
+		sz = r->chunk_size;
+	if (c == NULL)
+		return NULL;
+	c->base = os_chunk_alloc(sz, r->flags, &c->huge);
+	if (c->base == NULL) {
+		free(c);
+		return NULL;
+	}
+	c->size          = sz;
+	c->used          = 0;
+	c->lock_pos      = 0;
+	c->locked        = 0;
+	c->retouch_start = 0;
+	c->retouch_end   = 0;
+	c->claim_len     = 0;
+	c->next          = NULL;
+	return c;
+}
+
+static void *residency_alloc(struct cop_alloc_iface *a, size_t size, size_t align)
+{
+	struct residency_tag   *t = a->ctx;
+	struct residency       *r = t->owner;
+	struct residency_chunk *c;
+	void                   *ret = NULL;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+
+	cop_mutex_lock(&r->lock);
+
+	/* Only the most recent chunk is ever allocated from. The tail of older
+	 * chunks is wasted, but sample allocations are large so this is not a
+	 * big deal. */
+	c = t->chunks;
+	if (c == NULL || round_up(c->used, align) + size > c->size) {
+		struct residency_chunk *nc = new_chunk(r, size + align);
+		if (nc != NULL) {
+			nc->next  = t->chunks;
+			t->chunks = nc;
+		}
+		c = nc;
+	}
+
+	if (c != NULL) {
+		size_t pos = round_up(c->used, align);
+		ret        = c->base + pos;
+		c->used    = pos + size;
+	}
+
+	cop_mutex_unlock(&r->lock);
+
+	return ret;
+}
+
+struct cop_alloc_iface *residency_get_allocator(struct residency *r, unsigned tag)
+{
+	struct residency_tag *t = NULL;
+
+	cop_mutex_lock(&r->lock);
+	if (tag >= r->nb_tags) {
+		struct residency_tag **nt = realloc(r->tags, sizeof(r->tags[0]) * (tag + 1));
+		if (nt != NULL) {
+			memset(nt + r->nb_tags, 0, sizeof(nt[0]) * (tag + 1 - r->nb_tags));
+			r->tags    = nt;
+			r->nb_tags = tag + 1;
+		}
+	}
+	if (tag < r->nb_tags) {
+		t = r->tags[tag];
+		if (t == NULL && (t = malloc(sizeof(*t))) != NULL) {
+			t->iface.ctx   = t;
+			t->iface.alloc = residency_alloc;
+			t->owner       = r;
+			t->tag         = tag;
+			t->chunks      = NULL;
+			r->tags[tag]   = t;
+		}
+	}
+	cop_mutex_unlock(&r->lock);
+
+	return (t != NULL) ? &(t->iface) : NULL;
+}
+
+/* Locking and re-touching
+ * ------------------------------------------------------------------------ */
+
+static void touch_pages(const unsigned char *p, size_t size, size_t page_size)
+{
+	const volatile unsigned char *vp = p;
+	size_t i;
+	for (i = 0; i < size; i += page_size)
+		(void)vp[i];
+}
+
+void residency_lock_tag(struct residency *r, unsigned tag)
+{
+	struct residency_chunk  *c;
+	struct residency_chunk  *claimed = NULL;
+	struct residency_chunk **tail    = &claimed;
+	size_t                   unused  = 0;
+	int                      refused = 0;
+
+	/* Claim the ranges which have not been through here yet and reserve
+	 * the budget to lock them. Nothing slow happens with the lock held as
+	 * the retouch thread and the other loader threads need it. */
+	cop_mutex_lock(&r->lock);
+	c = (tag < r->nb_tags && r->tags[tag] != NULL) ? r->tags[tag]->chunks : NULL;
+	for (; c != NULL; c = c->next) {
+		size_t start = c->lock_pos;
+		size_t end   = round_up(c->used, r->page_size);
+		size_t can_lock;
+
+		/* A chunk which another call is still working on is left for
+		 * whichever call comes next. */
+		if (end <= start || c->claim_len)
+			continue;
+
+		can_lock = (r->lock_budget > r->locked) ? (r->lock_budget - r->locked) : 0;
+		can_lock = (can_lock / r->page_size) * r->page_size;
+		if (can_lock > end - start)
+			can_lock = end - start;
+
+		r->locked     += can_lock;
+		c->lock_pos    = end;
+		c->claim_start = start;
+		c->claim_len   = end - start;
+		c->claim_lock  = can_lock;
+		c->claim_next  = NULL;
+		*tail          = c;
+		tail           = &(c->claim_next);
+	}
+	cop_mutex_unlock(&r->lock);
+
+	/* Fault everything in before locking it so we do not take the page
+	 * faults later on the audio thread. If the system will not let us lock
+	 * something, don't bother trying to lock anything else. */
+	for (c = claimed; c != NULL; c = c->claim_next) {
+		touch_pages(c->base + c->claim_start, c->claim_len, r->page_size);
+		if (c->claim_lock && (refused || os_lock(c->base + c->claim_start, c->claim_lock) != 0)) {
+			refused       = 1;
+			unused       += c->claim_lock;
+			c->claim_lock = 0;
+		}
+	}
+
+	/* Give back the reservations which were not used and have the retouch
+	 * thread look after whatever is not locked. */
+	cop_mutex_lock(&r->lock);
+	r->locked -= unused;
+	if (refused)
+		r->lock_budget = r->locked;
+	for (c = claimed; c != NULL; c = c->claim_next) {
+		size_t end = c->claim_start + c->claim_len;
+
+		c->locked += c->claim_lock;
+
+		if (c->claim_lock < c->claim_len) {
+			if (c->retouch_end == c->retouch_start)
+				c->retouch_start = c->claim_start + c->claim_lock;
+			c->retouch_end = end;
+		}
+
+		c->claim_len = 0;
+	}
+	cop_mutex_unlock(&r->lock);
+}
+
+static void *retouch_thread_proc(void *argument)
+{
+	struct residency *r = argument;
+
+	os_lower_thread_priority();
+
+	while (!odatomic_load(&r->thread_quit)) {
+		unsigned i, slept;
+
+		for (i = 0; !odatomic_load(&r->thread_quit); i++) {
+			struct residency_chunk *c;
+
+			cop_mutex_lock(&r->lock);
+			c = (i < r->nb_tags && r->tags[i] != NULL) ? r->tags[i]->chunks : NULL;
+			if (i >= r->nb_tags) {
+				cop_mutex_unlock(&r->lock);
+				break;
+			}
+			cop_mutex_unlock(&r->lock);
+
+			/* Chunks are never removed and their next pointers never change
+			 * so we only need the lock to read the ranges. */
+			for (; c != NULL && !odatomic_load(&r->thread_quit); c = c->next) {
+				size_t start, end;
+				cop_mutex_lock(&r->lock);
+				start = c->retouch_start;
+				end   = c->retouch_end;
+				cop_mutex_unlock(&r->lock);
+				if (end > start)
+					touch_pages(c->base + start, end - start, r->page_size);
+			}
+		}
+
+		for (slept = 0; slept < r->retouch_ms && !odatomic_load(&r->thread_quit); slept += RESIDENCY_SLEEP_STEP_MS)
+			os_sleep_ms(RESIDENCY_SLEEP_STEP_MS);
+	}
+
+	return NULL;
+}
+
+/* Everything else
+ * ------------------------------------------------------------------------ */
+
+int
+residency_init
+	(struct residency *r
+	,size_t            lock_budget
+	,unsigned          flags
+	,unsigned          retouch_ms
+	)
+{
+	size_t lockable = cop_memory_query_current_lockable();
+
+	r->page_size      = cop_memory_query_page_size();
+	r->chunk_size     = RESIDENCY_CHUNK_SIZE;
+	r->lock_budget    = (lock_budget < lockable) ? lock_budget : lockable;
+	r->locked         = 0;
+	r->flags          = flags;
+	r->retouch_ms     = retouch_ms;
+	r->tags           = NULL;
+	r->nb_tags        = 0;
+	r->thread_running = 0;
+	r->thread_quit    = 0;
+
+	if (r->lock_budget && os_grow_lock_limit(r->lock_budget))
+		r->lock_budget = 0;
+
+	if (cop_mutex_create(&r->lock))
+		return -1;
+
+	if (flags & RESIDENCY_FLAG_RETOUCH) {
+		if (cop_thread_create(&r->thread, retouch_thread_proc, r, 0, 0)) {
+			cop_mutex_destroy(&r->lock);
+			return -1;
+		}
+		r->thread_running = 1;
+	}
+
+	return 0;
+}
+
+void residency_destroy(struct residency *r)
+{
+	unsigned i;
+
+	if (r->thread_running) {
+		odatomic_store(&r->thread_quit, 1);
+		cop_thread_join(r->thread, NULL);
+	}
+
+	for (i = 0; i < r->nb_tags; i++) {
+		struct residency_tag *t = r->tags[i];
+		if (t == NULL)
+			continue;
+		while (t->chunks != NULL) {
+			struct residency_chunk *c = t->chunks;
+			t->chunks = c->next;
+			if (c->locked)
+				os_unlock(c->base, c->lock_pos);
+			os_chunk_free(c->base, c->size);
+			free(c);
+		}
+		free(t);
+	}
+
+	free(r->tags);
+	cop_mutex_destroy(&r->lock);
+}
+
+int residency_query(struct residency *r, unsigned tag, struct residency_stats *stats)
+{
+	struct residency_chunk *c;
+	int err = 0;
+
+	memset(stats, 0, sizeof(*stats));
+
+	cop_mutex_lock(&r->lock);
+	c = (tag < r->nb_tags && r->tags[tag] != NULL) ? r->tags[tag]->chunks : NULL;
+	for (; c != NULL; c = c->next) {
+		size_t used = round_up(c->used, r->page_size);
+		size_t res;
+		stats->allocated  += used;
+		stats->reserved   += c->size;
+		stats->locked     += c->locked;
+		stats->retouched  += c->retouch_end - c->retouch_start;
+		stats->huge_pages |= c->huge;
+		if (!err && used) {
+			if (os_query_resident(c->base, used, r->page_size, &res) == 0) {
+				stats->resident     += res;
+				stats->non_resident += used - res;
+			} else {
+				err = -1;
+			}
+		}
+	}
+	cop_mutex_unlock(&r->lock);
+
+	if (err) {
+		stats->resident     = 0;
+		stats->non_resident = 0;
+	}
+
+	return err;
+}
@@ -0,0 +1,165 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#ifndef RESIDENCY_H
+#define RESIDENCY_H
+
+#include <stddef.h>
+#include "odatomic.h"
+#include "cop/cop_alloc.h"
+#include "cop/cop_thread.h"
+
+/* The residency module is an allocator for sample data which tries very hard
+ * to keep that data in physical memory. Operating systems are quite happy to
+ * page out (or compress) memory which has not been touched for a long time.
+ * For a sampler, this means the first notes played after a long idle period
+ * glitch horribly.
+ *
+ * Memory is allocated in large chunks directly from the operating system. It
+ * can be backed with huge pages. Allocations are tagged (e.g. with the index
+ * of the rank they belong to) so that each tag can be locked once it has
+ * been loaded and so that residency can be reported per tag.
+ *
+ * residency_lock_tag() prefaults everything allocated under a tag and then
+ * locks it into memory as long as doing so does not exceed the lock budget.
+ * Anything which could not be locked is periodically re-touched by a low
+ * priority thread which keeps it looking "recently used" to the operating
+ * system. */
+struct residency;
+
+/* Flags for residency_init(). */
+
+/* Use transparent huge pages where the operating system supports them (i.e.
+ * madvise(MADV_HUGEPAGE) on Linux). */
+#define RESIDENCY_FLAG_HUGE_TRANSPARENT (1u)
+
+/* Try to get explicit huge pages (MAP_HUGETLB on Linux or MEM_LARGE_PAGES on
+ * Windows). If they cannot be obtained, normal pages are used. */
+#define RESIDENCY_FLAG_HUGE_EXPLICIT    (2u)
+
+/* Start the re-touch thread. */
+#define RESIDENCY_FLAG_RETOUCH          (4u)
+
+/* Initialise the residency manager. lock_budget is the maximum number of
+ * bytes which will be locked (it is further limited by what the operating
+ * system says can be locked). retouch_ms is the interval between re-touch
+ * passes. Returns zero on success. */
+int
+residency_init
+	(struct residency *r
+	,size_t            lock_budget
+	,unsigned          flags
+	,unsigned          retouch_ms
+	);
+
+/* Stop the re-touch thread, unlock and release all memory. */
+void residency_destroy(struct residency *r);
+
+/* Get an allocator which allocates memory with the given tag. The returned
+ * allocator is thread-safe and remains valid until residency_destroy() is
+ * called. Returns NULL if out of memory. */
+struct cop_alloc_iface *residency_get_allocator(struct residency *r, unsigned tag);
+
+/* Prefault and lock everything which has been allocated with the given tag
+ * so far. Anything which does not fit in the lock budget is handed to the
+ * re-touch thread. Can be called multiple times for the same tag - only new
+ * allocations are processed. */
+void residency_lock_tag(struct residency *r, unsigned tag);
+
+struct residency_stats {
+	/* Bytes handed out by the allocator (rounded to pages) and bytes of
+	 * address space obtained from the system. */
+	size_t allocated;
+	size_t reserved;
+
+	/* Bytes which were successfully locked and bytes handed to the
+	 * re-touch thread. */
+	size_t locked;
+	size_t retouched;
+
+	/* Bytes which the operating system says are in physical memory or not.
+	 * If the operating system cannot tell us, both are zero and
+	 * residency_query() returns non-zero. */
+	size_t resident;
+	size_t non_resident;
+
+	/* True if explicit or transparent huge pages were requested and the
+	 * chunks were obtained with them. */
+	int    huge_pages;
+};
+
+/* Get statistics for a tag. Returns zero if resident/non_resident are
+ * valid. */
+int residency_query(struct residency *r, unsigned tag, struct residency_stats *stats);
+
+/* Private Parts
+ * ---------------------------------------------------------------------------
+ * Don't touch them. Only defined so you can bung them on the stack. */
+
+struct residency_chunk {
+	unsigned char          *base;
+	size_t                  size;
+	size_t                  used;
+
+	/* Number of bytes from the start of the chunk which have been through
+	 * residency_lock_tag(). Everything from lock_pos to retouch_end needs
+	 * re-touching. */
+	size_t                  lock_pos;
+	size_t                  locked;
+	size_t                  retouch_start;
+	size_t                  retouch_end;
+	int                     huge;
+
+	/* The range claimed by residency_lock_tag() and how much of the lock
+	 * budget was reserved for it. Chunks are put on a list with these
+	 * while the lock is held and then faulted in and locked without it. */
+	size_t                  claim_start;
+	size_t                  claim_len;
+	size_t                  claim_lock;
+	struct residency_chunk *claim_next;
+
+	struct residency_chunk *next;
+};
+
+struct residency_tag {
+	struct cop_alloc_iface  iface;
+	struct residency       *owner;
+	unsigned                tag;
+	struct residency_chunk *chunks;
+};
+
+struct residency {
+	size_t                  lock_budget;
+	size_t                  locked;
+	size_t                  page_size;
+	size_t                  chunk_size;
+	unsigned                flags;
+	unsigned                retouch_ms;
+
+	cop_mutex               lock;
+	struct residency_tag  **tags;
+	unsigned                nb_tags;
+
+	cop_thread              thread;
+	int                     thread_running;
+	odatomic_u32            thread_quit;
+};
+
+#endif /* RESIDENCY_H */
@@ -0,0 +1,634 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <assert.h>
+#include "smplstream.h"
+#include "decode_least16x2.h"
+
+#define SMPLSTREAM_VOICE_FREE    (0)
+#define SMPLSTREAM_VOICE_CLAIMED (1)
+#define SMPLSTREAM_VOICE_ACTIVE  (2)
+#define SMPLSTREAM_VOICE_DONE    (3)
+
+/* If there is less than this many frames between the end of the head and the
+ * start of the loop region, the sample is not worth streaming. */
+#define SMPLSTREAM_MIN_STREAM_FRAMES (4096)
+
+/* A voice which has not been decoded while the stream tick advanced by this
+ * many engine blocks is assumed to have been dropped by the engine. Every
+ * live voice is decoded once per block, so a live voice can only fall behind
+ * the tick by the number of blocks passed to one smplstream_advance() call. */
+#define SMPLSTREAM_STALE_BLOCKS (256)
+
+static const int_least16_t SMPLSTREAM_ZERO_FRAME[2] = {0, 0};
+
+/* Wake the prefetch thread. This is called from the audio thread so it must
+ * never block. If the lock cannot be taken, the prefetch thread is awake
+ * and will see kick_pending before it goes back to sleep - or in the worst
+ * case, the next block will kick it again. */
+static void smplstream_kick(struct smplstream *stream)
+{
+	odatomic_store(&stream->kick_pending, 1);
+	if (cop_mutex_trylock(&stream->thread_lock)) {
+		cop_cond_signal(&stream->thread_cond);
+		cop_mutex_unlock(&stream->thread_lock);
+	}
+}
+
+static void smplstream_record_lead(struct smplstream *stream, uint_fast32_t lead_frames, unsigned long sample_rate)
+{
+	static const unsigned edges[SMPLSTREAM_LEAD_BINS-1] = SMPLSTREAM_LEAD_EDGES_MS;
+	uint32_t lead_ms = (uint32_t)((lead_frames * (uint_fast64_t)1000) / sample_rate);
+	uint32_t old_min;
+	unsigned bin;
+
+	for (bin = 0; bin < SMPLSTREAM_LEAD_BINS-1 && lead_ms >= edges[bin]; bin++);
+	odatomic_add(&stream->lead_histogram[bin], 1);
+
+	do {
+		old_min = odatomic_load(&stream->min_lead_ms);
+	} while (lead_ms < old_min && !odatomic_cas(&stream->min_lead_ms, old_min, lead_ms));
+}
+
+static void smplstream_record_active(struct smplstream *stream)
+{
+	uint32_t active = odatomic_add(&stream->active_voices, 1) + 1;
+	uint32_t peak;
+	do {
+		peak = odatomic_load(&stream->peak_voices);
+	} while (active > peak && !odatomic_cas(&stream->peak_voices, peak, active));
+}
+
+/* This is the same decoder as u16c2_dec with the sample read replaced by a
+ * lookup into the head, the ring or the loop region. */
+static unsigned smplstream_dec(struct dec_state *state, float *COP_ATTR_RESTRICT *buf)
+{
+	float VEC_ALIGN_BEST tmp[128];
+	unsigned flags;
+	const struct smplstream_smpl *ss = state->s.strm.data;
+	struct smplstream *stream = ss->stream;
+	struct smplstream_voice *voice = state->s.strm.voice;
+	const int_least16_t *resident = ss->resident;
+	const int_least16_t *ring = NULL;
+	uint_fast32_t head = ss->head_frames;
+	uint_fast32_t loop_first = ss->loop_first;
+	uint_fast32_t ring_mask = stream->ring_frames - 1;
+	uint_fast32_t avail = 0;
+	unsigned long underruns = 0;
+	uint_fast32_t rndstate;
+	struct filter_state s0;
+	struct filter_state s1;
+	unsigned ipos, fpos, i;
+	unsigned rate = state->rate;
+
+	if (voice != NULL && odatomic_load(&voice->generation) == state->s.strm.generation) {
+		odatomic_store(&voice->last_tick, odatomic_load(&stream->tick));
+		ring  = voice->ring;
+		avail = odatomic_load(&voice->write_frame);
+	} else {
+		voice = NULL;
+	}
+
+	rndstate = state->s.strm.rndstate;
+	ipos     = state->ipos;
+	fpos     = state->fpos;
+	s0       = state->s.strm.resamp[0];
+	s1       = state->s.strm.resamp[1];
+
+	if (voice != NULL && ipos >= head && ipos < loop_first)
+		smplstream_record_lead(stream, (avail > ipos - head) ? (avail - (ipos - head)) : 0, ss->sample_rate);
+
+	for (i = 0; i < 2*OUTPUT_SAMPLES; i += 2*FADE_VEC_LEN) {
+
+#define BUILD_SMPL_STEREO(OL_, OR_) \
+		do { \
+			const float * COP_ATTR_RESTRICT coefs_ = SMPL_INTERP[fpos]; \
+			fpos += rate; \
+			ACCUM_DUAL(s0, s1, coefs_, OL_, OR_); \
+			while (fpos >= SMPL_POSITION_SCALE) { \
+				const int_least16_t *fr_; \
+				float tf1_, tf2_; \
+				if (ipos < head) { \
+					fr_ = resident + 2*ipos; \
+				} else if (ipos >= loop_first) { \
+					fr_ = resident + 2*(head + (ipos - loop_first)); \
+				} else if (COP_HINT_FALSE(ipos - head >= avail)) { \
+					fr_ = SMPLSTREAM_ZERO_FRAME; \
+					underruns++; \
+				} else { \
+					fr_ = ring + 2*((ipos - head) & ring_mask); \
+				} \
+				tf1_ = fr_[0]; \
+				tf2_ = fr_[1]; \
+				INSERT_DUAL(s0, s1, &tf1_, &tf2_); \
+				fpos -= SMPL_POSITION_SCALE; \
+				ipos++; \
+				if (COP_HINT_FALSE(ipos > state->s.strm.loopend.end_smpl)) { \
+					const struct dec_loop_def *pdef = state->smpl->starts + state->s.strm.loopend.start_idx; \
+					ipos = pdef->start_smpl; \
+					rndstate = update_rnd(rndstate); \
+					state->s.strm.loopend = state->smpl->ends[pdef->first_valid_end + rndstate % (state->smpl->nloop - pdef->first_valid_end)]; \
+				} \
+			} \
+		} while (0)
+
+		{
+			v4f s0l, s0r, s1l, s1r, s2l, s2r, s3l, s3r;
+			v4f ox1, ox2, ox3, ox4, ox5, ox6, ox7, ox8;
+
+			BUILD_SMPL_STEREO(s0l, s0r);
+			V4F_INTERLEAVE(ox5, ox6, s0l, s0r);
+			BUILD_SMPL_STEREO(s1l, s1r);
+			V4F_INTERLEAVE(ox7, ox8, s1l, s1r);
+			ox1 = v4f_add(ox5, ox6);
+			ox2 = v4f_add(ox7, ox8);
+
+			BUILD_SMPL_STEREO(s2l, s2r);
+			V4F_INTERLEAVE(ox5, ox6, s2l, s2r);
+			BUILD_SMPL_STEREO(s3l, s3r);
+			V4F_INTERLEAVE(ox7, ox8, s3l, s3r);
+			ox3 = v4f_add(ox5, ox6);
+			ox4 = v4f_add(ox7, ox8);
+#undef BUILD_SMPL_STEREO
+
+			V4F_INTERLEAVE(ox5, ox6, ox1, ox3);
+			V4F_INTERLEAVE(ox7, ox8, ox2, ox4);
+			ox1 = v4f_add(ox5, ox6);
+			ox2 = v4f_add(ox7, ox8);
+
+			V4F_ST2INT(tmp + i, ox1, ox2);
+		}
+	}
+
+	state->s.strm.rndstate  = rndstate;
+	state->ipos             = ipos;
+	state->fpos             = fpos;
+	state->s.strm.resamp[0] = s0;
+	state->s.strm.resamp[1] = s1;
+
+	if (COP_HINT_FALSE(underruns)) {
+		odatomic_add(&stream->underrun_frames, (uint32_t)underruns);
+		odatomic_add(&stream->underrun_blocks, 1);
+	}
+
+	/* Tell the prefetch thread where we are up to. Once the voice has made it
+	 * into the loop region, it will never read from the ring again so the
+	 * ring can be handed to somebody else. */
+	if (voice != NULL) {
+		if (ipos >= loop_first) {
+			state->s.strm.voice = NULL;
+			odatomic_store(&voice->read_frame, loop_first - head);
+			odatomic_store(&voice->state, SMPLSTREAM_VOICE_DONE);
+			smplstream_kick(stream);
+		} else {
+			uint_fast32_t rd = (ipos > head) ? (ipos - head) : 0;
+			odatomic_store(&voice->read_frame, rd);
+			if (avail < loop_first - head && avail - rd <= stream->ring_frames - stream->ring_frames / 4)
+				smplstream_kick(stream);
+		}
+	}
+
+	flags = 0;
+	if (state->ipos >= state->smpl->starts[state->s.strm.loopend.start_idx].start_smpl) {
+		flags |= DEC_IS_LOOPING;
+	}
+	if (fade_process2(&state->s.strm.fade, buf, tmp) > 0) {
+		flags |= DEC_IS_FADING;
+	}
+	return flags;
+}
+
+static void smplstream_setfade(struct dec_state *state, unsigned target_samples, float gain)
+{
+	fade_configure(&state->s.strm.fade, target_samples, state->smpl->gain * gain);
+}
+
+/* Find a free voice ring. This is called from the audio thread. */
+static struct smplstream_voice *smplstream_claim(struct smplstream *stream, const struct smplstream_smpl *ss, uint_fast32_t *generation)
+{
+	unsigned i;
+	for (i = 0; i < stream->max_voices; i++) {
+		struct smplstream_voice *v = stream->voices + i;
+		if (odatomic_load(&v->state) == SMPLSTREAM_VOICE_FREE && odatomic_cas(&v->state, SMPLSTREAM_VOICE_FREE, SMPLSTREAM_VOICE_CLAIMED)) {
+			*generation = odatomic_load(&v->generation) + 1;
+			v->smpl     = ss;
+			odatomic_store(&v->read_frame, 0);
+			odatomic_store(&v->write_frame, 0);
+			odatomic_store(&v->last_tick, odatomic_load(&stream->tick));
+			odatomic_store(&v->generation, (uint32_t)*generation);
+			odatomic_store(&v->state, SMPLSTREAM_VOICE_ACTIVE);
+			smplstream_record_active(stream);
+			return v;
+		}
+	}
+	return NULL;
+}
+
+static void smplstream_instantiate(struct dec_state *instance, const struct dec_smpl *sample, uint_fast32_t ipos, uint_fast32_t fpos)
+{
+	const struct smplstream_smpl *ss = sample->data;
+	struct smplstream *stream = ss->stream;
+	struct filter_state s0;
+	struct filter_state s1;
+	unsigned first = (ipos > SMPL_INTERP_TAPS) ? (ipos - SMPL_INTERP_TAPS) : 0;
+	unsigned i;
+
+	memset(instance, 0, sizeof(*instance));
+	memset(&s0, 0, sizeof(s0));
+	memset(&s1, 0, sizeof(s1));
+
+	instance->smpl = sample;
+	instance->fpos = fpos;
+	instance->ipos = ipos;
+	fade_configure(&instance->s.strm.fade, 0, sample->gain);
+	instance->s.strm.data    = ss;
+	instance->s.strm.loopend = sample->ends[0];
+	instance->s.strm.voice   = NULL;
+
+	/* Only ask for a ring if this voice is going to play through the streamed
+	 * part of the sample. */
+	if (ipos < ss->loop_first) {
+		instance->s.strm.voice = smplstream_claim(stream, ss, &instance->s.strm.generation);
+		if (instance->s.strm.voice == NULL)
+			odatomic_add(&stream->starved_voices, 1);
+		smplstream_kick(stream);
+	}
+
+	/* The ring is empty at this point so anything required to fill the
+	 * filter from the streamed region is zero. This should only happen if
+	 * the head is shorter than the release alignment offsets. */
+	for (i = first; i < ipos; i++) {
+		const int_least16_t *fr;
+		float tf1, tf2;
+		if (i < ss->head_frames)
+			fr = ss->resident + 2*i;
+		else if (i >= ss->loop_first)
+			fr = ss->resident + 2*(ss->head_frames + (i - ss->loop_first));
+		else
+			fr = SMPLSTREAM_ZERO_FRAME;
+		tf1 = fr[0];
+		tf2 = fr[1];
+		INSERT_DUAL(s0, s1, &tf1, &tf2);
+	}
+
+	instance->s.strm.resamp[0] = s0;
+	instance->s.strm.resamp[1] = s1;
+	instance->setfade          = smplstream_setfade;
+	instance->decode           = smplstream_dec;
+}
+
+int smplstream_is_streamed(const struct dec_smpl *smpl)
+{
+	return smpl->instantiate == smplstream_instantiate;
+}
+
+static void expand_frames(int_least16_t *dest, const void *src, uint_fast32_t first, uint_fast32_t nb_frames, unsigned bits)
+{
+	uint_fast32_t i;
+	if (bits == 16) {
+		memcpy(dest, ((const int_least16_t *)src) + 2*first, sizeof(int_least16_t) * 2 * nb_frames);
+	} else {
+		const unsigned char *s = ((const unsigned char *)src) + 3*first;
+		assert(bits == 12);
+		for (i = 0; i < nb_frames; i++) {
+			float a, b;
+			decode2x12(s + 3*i, &a, &b);
+			dest[2*i+0] = (int_least16_t)a;
+			dest[2*i+1] = (int_least16_t)b;
+		}
+	}
+}
+
+const char *
+smplstream_add
+	(struct smplstream      *stream
+	,struct dec_smpl        *smpl
+	,const void             *frames
+	,uint_fast32_t           nb_frames
+	,uint_fast32_t           loop_first
+	,unsigned                bits
+	,unsigned long           sample_rate
+	,struct cop_alloc_iface *allocator
+	)
+{
+	uint_fast32_t           head = (uint_fast32_t)((stream->head_ms * (uint_fast64_t)sample_rate) / 1000u);
+	uint_fast32_t           nb_resident;
+	uint_fast32_t           nb_streamed;
+	struct smplstream_smpl *ss;
+	int_least16_t          *resident;
+	int_least16_t          *bank_tmp;
+	const char             *err = NULL;
+
+	assert(bits == 12 || bits == 16);
+	assert(loop_first < nb_frames);
+
+	/* Too short to bother. Keep the whole thing in memory in its original
+	 * format. */
+	if (head >= loop_first || loop_first - head < SMPLSTREAM_MIN_STREAM_FRAMES) {
+		size_t sz = (bits == 16) ? (sizeof(int_least16_t) * 2 * nb_frames) : (3 * nb_frames);
+		void *buf = cop_alloc(allocator, sz, 0);
+		if (buf == NULL)
+			return "out of memory";
+		memcpy(buf, frames, sz);
+		smpl->data        = buf;
+		smpl->instantiate = (bits == 16) ? u16c2_instantiate : u12c2_instantiate;
+		cop_mutex_lock(&stream->bank_lock);
+		stream->resident_bytes += sz;
+		cop_mutex_unlock(&stream->bank_lock);
+		return NULL;
+	}
+
+	nb_streamed = loop_first - head;
+	nb_resident = head + (nb_frames - loop_first);
+
+	ss       = cop_alloc(allocator, sizeof(*ss), 0);
+	resident = cop_alloc(allocator, sizeof(int_least16_t) * 2 * nb_resident, 0);
+	bank_tmp = malloc(sizeof(int_least16_t) * 2 * nb_streamed);
+	if (ss == NULL || resident == NULL || bank_tmp == NULL) {
+		free(bank_tmp);
+		return "out of memory";
+	}
+
+	expand_frames(resident, frames, 0, head, bits);
+	expand_frames(resident + 2*head, frames, loop_first, nb_frames - loop_first, bits);
+	expand_frames(bank_tmp, frames, head, nb_streamed, bits);
+
+	ss->stream      = stream;
+	ss->resident    = resident;
+	ss->head_frames = head;
+	ss->loop_first  = loop_first;
+	ss->sample_rate = sample_rate;
+
+	cop_mutex_lock(&stream->bank_lock);
+	if (stream->bank_error != NULL) {
+		err = stream->bank_error;
+	} else if (fwrite(bank_tmp, sizeof(int_least16_t) * 2, nb_streamed, stream->bank_file) != nb_streamed) {
+		err = stream->bank_error = "failed to write to the stream bank";
+	} else {
+		ss->bank_frame             = stream->bank_frames;
+		stream->bank_frames       += nb_streamed;
+		stream->resident_bytes    += sizeof(*ss) + sizeof(int_least16_t) * 2 * nb_resident;
+	}
+	cop_mutex_unlock(&stream->bank_lock);
+
+	free(bank_tmp);
+
+	if (err == NULL) {
+		smpl->data        = ss;
+		smpl->instantiate = smplstream_instantiate;
+	}
+
+	return err;
+}
+
+/* Release rings which are no longer needed and top up everything else. */
+static void smplstream_service(struct smplstream *stream, uint_fast64_t *nb_copied)
+{
+	uint32_t tick = odatomic_load(&stream->tick);
+	uint_fast32_t ring_mask = stream->ring_frames - 1;
+	unsigned i;
+
+	for (i = 0; i < stream->max_voices; i++) {
+		struct smplstream_voice *v = stream->voices + i;
+		uint32_t state = odatomic_load(&v->state);
+		const struct smplstream_smpl *ss;
+		uint_fast32_t rd, wr, target, total;
+
+		if (state == SMPLSTREAM_VOICE_DONE || (state == SMPLSTREAM_VOICE_ACTIVE && (uint32_t)(tick - odatomic_load(&v->last_tick)) > SMPLSTREAM_STALE_BLOCKS)) {
+			odatomic_store(&v->state, SMPLSTREAM_VOICE_FREE);
+			odatomic_add(&stream->active_voices, (uint32_t)-1);
+			continue;
+		}
+
+		if (state != SMPLSTREAM_VOICE_ACTIVE)
+			continue;
+
+		ss     = v->smpl;
+		total  = ss->loop_first - ss->head_frames;
+		rd     = odatomic_load(&v->read_frame);
+		wr     = odatomic_load(&v->write_frame);
+		target = rd + stream->ring_frames;
+		if (target > total)
+			target = total;
+
+		while (wr < target) {
+			uint_fast32_t ring_pos = wr & ring_mask;
+			uint_fast32_t n        = target - wr;
+			if (n > stream->ring_frames - ring_pos)
+				n = stream->ring_frames - ring_pos;
+			memcpy(v->ring + 2*ring_pos, stream->bank + 2*(ss->bank_frame + wr), sizeof(int_least16_t) * 2 * n);
+			wr         += n;
+			*nb_copied += n;
+			odatomic_store(&v->write_frame, wr);
+		}
+	}
+}
+
+static void *smplstream_thread_proc(void *argument)
+{
+	struct smplstream *stream = argument;
+	uint_fast64_t      copied = 0;
+
+	cop_mutex_lock(&stream->thread_lock);
+	while (!stream->thread_quit) {
+		odatomic_store(&stream->kick_pending, 0);
+		stream->prefetched_frames += copied;
+		copied = 0;
+		cop_mutex_unlock(&stream->thread_lock);
+
+		smplstream_service(stream, &copied);
+
+		cop_mutex_lock(&stream->thread_lock);
+		if (!stream->thread_quit && !odatomic_load(&stream->kick_pending))
+			cop_cond_wait(&stream->thread_cond, &stream->thread_lock);
+	}
+	stream->prefetched_frames += copied;
+	cop_mutex_unlock(&stream->thread_lock);
+
+	return NULL;
+}
+
+int
+smplstream_init
+	(struct smplstream *stream
+	,const char        *bank_filename
+	,unsigned           head_ms
+	,unsigned           max_voices
+	,unsigned           ring_frames
+	)
+{
+	unsigned i;
+
+	assert(ring_frames && (ring_frames & (ring_frames - 1)) == 0);
+	assert(max_voices);
+
+	memset(stream, 0, sizeof(*stream));
+	stream->head_ms     = head_ms;
+	stream->max_voices  = max_voices;
+	stream->ring_frames = ring_frames;
+	stream->min_lead_ms = 0xFFFFFFFFu;
+
+	if ((stream->bank_filename = malloc(strlen(bank_filename) + 1)) == NULL)
+		return -1;
+	strcpy(stream->bank_filename, bank_filename);
+
+	if ((stream->voices = calloc(max_voices, sizeof(stream->voices[0]))) == NULL) {
+		free(stream->bank_filename);
+		return -1;
+	}
+
+	for (i = 0; i < max_voices; i++) {
+		if ((stream->voices[i].ring = malloc(sizeof(int_least16_t) * 2 * ring_frames)) == NULL)
+			break;
+	}
+
+	if (i != max_voices) {
+		while (i--)
+			free(stream->voices[i].ring);
+		free(stream->voices);
+		free(stream->bank_filename);
+		return -1;
+	}
+
+	if (cop_mutex_create(&stream->bank_lock))
+		goto fail_voices;
+	if (cop_mutex_create(&stream->thread_lock))
+		goto fail_bank_lock;
+	if (cop_cond_create(&stream->thread_cond))
+		goto fail_thread_lock;
+	if ((stream->bank_file = fopen(bank_filename, "wb")) == NULL)
+		goto fail_cond;
+
+	return 0;
+
+fail_cond:
+	cop_cond_destroy(&stream->thread_cond);
+fail_thread_lock:
+	cop_mutex_destroy(&stream->thread_lock);
+fail_bank_lock:
+	cop_mutex_destroy(&stream->bank_lock);
+fail_voices:
+	for (i = 0; i < max_voices; i++)
+		free(stream->voices[i].ring);
+	free(stream->voices);
+	free(stream->bank_filename);
+	return -1;
+}
+
+const char *smplstream_start(struct smplstream *stream)
+{
+	int ferr;
+
+	assert(stream->bank_file != NULL);
+
+	ferr = fclose(stream->bank_file);
+	stream->bank_file = NULL;
+
+	if (stream->bank_error != NULL)
+		return stream->bank_error;
+	if (ferr)
+		return "failed to close the stream bank";
+
+	/* Nothing was long enough to stream. */
+	if (stream->bank_frames == 0)
+		return NULL;
+
+	if (cop_filemap_open(&stream->bank_map, stream->bank_filename, COP_FILEMAP_FLAG_R))
+		return "failed to map the stream bank";
+	stream->bank_mapped = 1;
+	stream->bank        = stream->bank_map.ptr;
+
+	if (cop_thread_create(&stream->thread, smplstream_thread_proc, stream, 0, 0))
+		return "failed to start the prefetch thread";
+	stream->thread_running = 1;
+
+	return NULL;
+}
+
+void smplstream_destroy(struct smplstream *stream)
+{
+	unsigned i;
+
+	if (stream->thread_running) {
+		cop_mutex_lock(&stream->thread_lock);
+		stream->thread_quit = 1;
+		cop_cond_signal(&stream->thread_cond);
+		cop_mutex_unlock(&stream->thread_lock);
+		cop_thread_join(stream->thread, NULL);
+	}
+
+	if (stream->bank_file != NULL)
+		fclose(stream->bank_file);
+	if (stream->bank_mapped)
+		cop_filemap_close(&stream->bank_map);
+	(void)remove(stream->bank_filename);
+
+	cop_cond_destroy(&stream->thread_cond);
+	cop_mutex_destroy(&stream->thread_lock);
+	cop_mutex_destroy(&stream->bank_lock);
+
+	for (i = 0; i < stream->max_voices; i++)
+		free(stream->voices[i].ring);
+	free(stream->voices);
+	free(stream->bank_filename);
+}
+
+void smplstream_advance(struct smplstream *stream, unsigned nb_blocks)
+{
+	odatomic_add(&stream->tick, (uint32_t)nb_blocks);
+}
+
+void smplstream_query_stats(struct smplstream *stream, struct smplstream_stats *stats, int reset)
+{
+	unsigned i;
+	uint32_t min_lead;
+
+	stats->underrun_frames = odatomic_load(&stream->underrun_frames);
+	stats->underrun_blocks = odatomic_load(&stream->underrun_blocks);
+	stats->starved_voices  = odatomic_load(&stream->starved_voices);
+	stats->active_voices   = odatomic_load(&stream->active_voices);
+	stats->peak_voices     = odatomic_load(&stream->peak_voices);
+	min_lead               = odatomic_load(&stream->min_lead_ms);
+	stats->min_lead_ms     = (min_lead == 0xFFFFFFFFu) ? UINT_MAX : min_lead;
+	for (i = 0; i < SMPLSTREAM_LEAD_BINS; i++)
+		stats->lead_histogram[i] = odatomic_load(&stream->lead_histogram[i]);
+
+	cop_mutex_lock(&stream->bank_lock);
+	stats->resident_bytes = stream->resident_bytes;
+	stats->bank_bytes     = stream->bank_frames * 2 * sizeof(int_least16_t);
+	cop_mutex_unlock(&stream->bank_lock);
+
+	cop_mutex_lock(&stream->thread_lock);
+	stats->prefetched_bytes = stream->prefetched_frames * 2 * sizeof(int_least16_t);
+	cop_mutex_unlock(&stream->thread_lock);
+
+	if (reset) {
+		odatomic_add(&stream->underrun_frames, (uint32_t)(0u - stats->underrun_frames));
+		odatomic_add(&stream->underrun_blocks, (uint32_t)(0u - stats->underrun_blocks));
+		odatomic_add(&stream->starved_voices, (uint32_t)(0u - stats->starved_voices));
+		odatomic_store(&stream->peak_voices, stats->active_voices);
+		odatomic_store(&stream->min_lead_ms, 0xFFFFFFFFu);
+		for (i = 0; i < SMPLSTREAM_LEAD_BINS; i++)
+			odatomic_add(&stream->lead_histogram[i], (uint32_t)(0u - stats->lead_histogram[i]));
+	}
+}
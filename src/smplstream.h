@@ -0,0 +1,254 @@
+/* Copyright (c) 2016 Nick Appleton
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE. */
+
+#ifndef SMPLSTREAM_H
+#define SMPLSTREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "decode_types.h"
+#include "odatomic.h"
+#include "cop/cop_alloc.h"
+#include "cop/cop_thread.h"
+#include "cop/cop_filemap.h"
+
+/* The smplstream module provides a dec_smpl backend which does not need the
+ * entire sample to be resident in memory. Only the first few milliseconds of
+ * the sample (the "head") and the region which contains every loop are kept
+ * in memory. Everything between the two is written into a bank file while
+ * samples are being loaded. Once loading has finished, the bank is memory
+ * mapped and a prefetch thread keeps a ring of upcoming frames filled for
+ * every voice which is playing through the streamed part of a sample.
+ *
+ * The decoder never touches the bank. If the ring for a voice does not
+ * contain the frame which needs to be read, the frame is replaced with
+ * silence and an underrun is recorded. Voices which have made it into the
+ * loop region (or which never leave the head) never need the prefetch
+ * thread at all.
+ *
+ * Streamed samples are always stored as 16-bit stereo. 12-bit samples are
+ * expanded when they are added to the bank.
+ *
+ * The process to use this is:
+ *   1) Initialise the stream using smplstream_init().
+ *   2) Give the stream to the loader using wavldr_set_stream() (or call
+ *      smplstream_add() yourself for every sample).
+ *   3) Once loading has finished, call smplstream_start() which maps the bank
+ *      and starts the prefetch thread.
+ *   4) Play things, calling smplstream_advance() as engine blocks are
+ *      rendered.
+ *   5) Call smplstream_destroy() once no decoders are running. */
+struct smplstream;
+
+/* Frames which are resident for a streamed sample. The decoder data pointer
+ * of a streamed dec_smpl points at one of these. */
+struct smplstream_smpl {
+	struct smplstream   *stream;
+
+	/* head_frames of data followed by all frames from loop_first to the end
+	 * of the sample. Interleaved 16-bit stereo. */
+	const int_least16_t *resident;
+	uint_fast32_t        head_frames;
+	uint_fast32_t        loop_first;
+
+	/* Frame offset of frame head_frames in the bank. There are
+	 * (loop_first - head_frames) frames stored in the bank. */
+	uint_fast64_t        bank_frame;
+
+	unsigned long        sample_rate;
+};
+
+/* Initialise a stream.
+ *
+ * bank_filename is the name of a file which will be created to hold the
+ * streamed audio. It is removed by smplstream_destroy().
+ *
+ * head_ms specifies how much of the start of every attack and release should
+ * be kept resident. This needs to be long enough to hide the time it takes
+ * the prefetch thread to get the first frames off the disk.
+ *
+ * max_voices specifies the maximum number of voices which can be streaming
+ * at any one time. Voices which cannot get a ring will still play their head
+ * and loops, but will output silence in between (and count as starved in the
+ * statistics).
+ *
+ * ring_frames is the length of each voice ring and must be a power of two.
+ *
+ * Returns zero on success. */
+int
+smplstream_init
+	(struct smplstream *stream
+	,const char        *bank_filename
+	,unsigned           head_ms
+	,unsigned           max_voices
+	,unsigned           ring_frames
+	);
+
+/* Set up the decoder for a sample. The data pointed to by frames is the
+ * complete quantised sample and does not need to exist after this function
+ * returns. loop_first is the first frame of the earliest loop in the sample.
+ * bits must be either 16 (frames points to interleaved int_least16_t) or 12
+ * (frames points to packed 12-bit stereo as produced by the loader).
+ *
+ * If the sample is too short to be worth streaming, it is copied into memory
+ * obtained from allocator and uses the regular decoders. Otherwise, the
+ * streamed part is appended to the bank. The data and instantiate members of
+ * smpl are populated. Everything else in smpl is left alone.
+ *
+ * This function can be called from multiple threads at once. Returns NULL on
+ * success or an error string. */
+const char *
+smplstream_add
+	(struct smplstream      *stream
+	,struct dec_smpl        *smpl
+	,const void             *frames
+	,uint_fast32_t           nb_frames
+	,uint_fast32_t           loop_first
+	,unsigned                bits
+	,unsigned long           sample_rate
+	,struct cop_alloc_iface *allocator
+	);
+
+/* Returns non-zero if smpl was set up by smplstream_add() to be streamed.
+ * Instantiating a streamed sample claims a voice ring, so it must only be
+ * done for a decoder which is going to be played. */
+int smplstream_is_streamed(const struct dec_smpl *smpl);
+
+/* Close the bank file, map it and start the prefetch thread. Returns NULL on
+ * success or an error string. */
+const char *smplstream_start(struct smplstream *stream);
+
+/* Stop the prefetch thread, unmap and remove the bank file and free all
+ * memory. */
+void smplstream_destroy(struct smplstream *stream);
+
+/* Advance the stream clock by nb_blocks engine blocks. This must be called
+ * by whatever runs the engine, after it has rendered the blocks. The clock
+ * is used to find rings held by voices which the engine dropped before they
+ * reached their loops; a ring is reclaimed once its voice has not been
+ * decoded for a few hundred blocks. nb_blocks should be no more than a few
+ * tens of blocks per call. This never blocks. */
+void smplstream_advance(struct smplstream *stream, unsigned nb_blocks);
+
+/* Lead time histogram bin edges in milliseconds. The final bin counts
+ * everything greater than or equal to the last edge. */
+#define SMPLSTREAM_LEAD_BINS (8)
+#define SMPLSTREAM_LEAD_EDGES_MS {1, 2, 5, 10, 20, 50, 100}
+
+struct smplstream_stats {
+	/* Number of frames which were needed but were not in a ring. */
+	unsigned long underrun_frames;
+
+	/* Number of decode blocks which contained at least one underrun. */
+	unsigned long underrun_blocks;
+
+	/* Number of voices which wanted to stream but could not get a ring. */
+	unsigned long starved_voices;
+
+	/* Voices currently holding a ring and the most that ever have. */
+	unsigned      active_voices;
+	unsigned      peak_voices;
+
+	/* Prefetch lead is the amount of audio (in milliseconds at the original
+	 * pitch of the sample) which was sitting in a ring ahead of the read
+	 * position at the start of a decode block. Only blocks which read from
+	 * the streamed region are measured. min_lead_ms is UINT_MAX if nothing
+	 * was measured. */
+	unsigned      min_lead_ms;
+	unsigned long lead_histogram[SMPLSTREAM_LEAD_BINS];
+
+	/* Memory usage. */
+	uint_fast64_t resident_bytes;
+	uint_fast64_t bank_bytes;
+	uint_fast64_t prefetched_bytes;
+};
+
+/* Get the current streaming statistics. If reset is non-zero, the underrun
+ * counters, lead-time measurements and peak voice count are cleared after
+ * being read. This can be called from any thread. */
+void smplstream_query_stats(struct smplstream *stream, struct smplstream_stats *stats, int reset);
+
+/* Private Parts
+ * ---------------------------------------------------------------------------
+ * Don't touch them. Only defined so you can bung them on the stack. */
+
+struct smplstream_voice {
+	/* SMPLSTREAM_VOICE_* */
+	odatomic_u32                  state;
+	odatomic_u32                  generation;
+
+	/* Frame positions relative to the head of the sample. The decoder owns
+	 * read_frame, the prefetch thread owns write_frame. */
+	odatomic_u32                  read_frame;
+	odatomic_u32                  write_frame;
+
+	/* Value of the stream clock (in engine blocks) at the last decode. Used
+	 * to reclaim voices which were dropped by the engine before reaching
+	 * their loops. */
+	odatomic_u32                  last_tick;
+
+	const struct smplstream_smpl *smpl;
+	int_least16_t                *ring;
+};
+
+struct smplstream {
+	/* Constants. */
+	unsigned                 head_ms;
+	unsigned                 max_voices;
+	uint_fast32_t            ring_frames;
+	char                    *bank_filename;
+
+	/* Bank writer (loader side). */
+	cop_mutex                bank_lock;
+	FILE                    *bank_file;
+	uint_fast64_t            bank_frames;
+	const char              *bank_error;
+	uint_fast64_t            resident_bytes;
+
+	/* Bank reader (playback side). */
+	struct cop_filemap       bank_map;
+	int                      bank_mapped;
+	const int_least16_t     *bank;
+
+	struct smplstream_voice *voices;
+	odatomic_u32             tick;
+
+	/* Statistics written by the decoders. */
+	odatomic_u32             underrun_frames;
+	odatomic_u32             underrun_blocks;
+	odatomic_u32             starved_voices;
+	odatomic_u32             active_voices;
+	odatomic_u32             peak_voices;
+	odatomic_u32             min_lead_ms;
+	odatomic_u32             lead_histogram[SMPLSTREAM_LEAD_BINS];
+
+	/* Prefetch thread. */
+	int                      thread_running;
+	int                      thread_quit;
+	odatomic_u32             kick_pending;
+	cop_thread               thread;
+	cop_mutex                thread_lock;
+	cop_cond                 thread_cond;
+
+	/* Only touched while holding thread_lock. */
+	uint_fast64_t            prefetched_frames;
+};
+
+#endif /* SMPLSTREAM_H */
@@ -19,125 +19,208 @@
  * DEALINGS IN THE SOFTWARE. */
 
 #include "wav_dumper.h"
+#include "dither.h"
 #include "cop/cop_conversions.h"
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
+/* The header is laid out so that it can be turned into an RF64 header in
+ * place when the recording ends up too long for 32-bit sizes (see EBU Tech
+ * 3306). The JUNK chunk reserves the room for the ds64 chunk. Float output
+ * also needs the extended fmt chunk and a fact chunk. */
 #define RIFF_CHUNK_HEADER_SIZE (8)
-#define PCM_HEADER_SIZE        (44)
 #define RIFF_CHUNK_SIZE_OFFSET (4)
-#define DATA_CHUNK_SIZE_OFFSET (40)
-
-#define INTIAL_RIFF_SIZE       (PCM_HEADER_SIZE - RIFF_CHUNK_HEADER_SIZE)
-
-static COP_ATTR_UNUSED COP_ATTR_ALWAYSINLINE uint_fast32_t update_rnd(uint_fast32_t rnd)
+#define DS64_OFFSET            (12)
+#define DS64_SIZE              (28)
+#define FMT_OFFSET             (DS64_OFFSET + RIFF_CHUNK_HEADER_SIZE + DS64_SIZE)
+#define MAX_HEADER_SIZE        (128)
+
+#define WAVE_FORMAT_PCM        (1)
+#define WAVE_FORMAT_IEEE_FLOAT (3)
+
+/* Biggest size which fits in the 32-bit size fields. Anything which does not
+ * fit is stored in the ds64 chunk and the field is set to this. */
+#define RIFF_SIZE_LIMIT        (0xFFFFFFFFu)
+
+/* Number of samples quantised at a time before being packed. */
+#define QUANTISE_CHUNK (256)
+
+/* Quantise samples to signed integers of the given number of bits with TPDF
+ * dither. The two halves of the hash are the two uniform variables. The
+ * samples are offset by full scale so that truncation is a floor and the
+ * clipping is done on the doubles. */
+static void quantise_chunk(int32_t *out, const float *in, unsigned nb_samples, uint32_t counter, unsigned bits)
 {
-	return rnd * 1103515245 + 12345;
+	const double full_scale = (double)(((uint32_t)1) << (bits - 1));
+	const double max_level  = 2.0 * full_scale - 1.0;
+	const int32_t offset    = (int32_t)(((uint32_t)1) << (bits - 1));
+	unsigned i;
+	for (i = 0; i < nb_samples; i++) {
+		uint32_t h = dither_hash(counter + i);
+		double   d = (double)(int32_t)((h & 0xFFFFu) + (h >> 16)) * (1.0 / 131072.0);
+		double   x = in[i] * full_scale + full_scale + d;
+		x          = (x < 0.0) ? 0.0 : x;
+		x          = (x > max_level) ? max_level : x;
+		out[i]     = (int32_t)x - offset;
+	}
 }
 
-static int write_interleaved_buffer(struct wav_dumper *dump, struct wav_dumper_buffer *buf)
+/* Convert the samples of a buffer into the output format in dst. Returns the
+ * number of bytes stored. */
+static size_t pack_buffer(struct wav_dumper *dump, unsigned char *dst, const struct wav_dumper_buffer *buf)
 {
-	int            err        = 0;
-	unsigned       nb_frames  = buf->nb_frames;
-	float         *data       = buf->buf;
-	unsigned char *wbp        = dump->write_buffer;
-	unsigned       nb_samples = nb_frames * dump->channels;
-	size_t         block_size = nb_frames * dump->block_align;
-	uint_fast32_t  rseed      = dump->rseed;
-
-	assert(nb_frames);
-
-	if (dump->bits_per_sample == 24) {
-		while (nb_samples--) {
-			float         sample = *data++;
-			uint_fast32_t d1     = update_rnd(rseed);
-			uint_fast32_t d2     = update_rnd(d1);
-			int_fast64_t  iq;
-			rseed  = d2;
-			iq     = (int_fast64_t)(d1 & 0xFFFFFFFFu);
-			iq    += (int_fast64_t)(d2 & 0xFFFFFFFFu);
-			iq    += (int_fast64_t)(sample * (float)(((uint_fast64_t)1) << (33 + 23)));
-			iq     = iq >> 33; /* Implementation defined... anything care? */
-			if (iq < -(int_fast64_t)0x800000)
-				iq = -(int_fast64_t)0x800000;
-			else if (iq > (int_fast64_t)0x7FFFFF)
-				iq = (int_fast64_t)0x7FFFFF;
-			cop_st_sle24(wbp, (int_fast32_t)iq);
-			wbp += 3;
+	const float   *data       = buf->buf;
+	unsigned       nb_samples = buf->nb_frames * dump->channels;
+	unsigned char *wbp        = dst;
+
+	assert(buf->nb_frames);
+
+	if (dump->bits_per_sample == 32) {
+		unsigned i;
+		for (i = 0; i < nb_samples; i++) {
+			union { float f; uint32_t u; } v;
+			v.f = data[i];
+			cop_st_ule32(wbp, v.u);
+			wbp += 4;
 		}
-		if (fwrite(dump->write_buffer, block_size, 1, dump->f) != 1)
-			err = -1;
 	} else {
-		while (nb_samples--) {
-			float         sample = *data++;
-			uint_fast32_t d1     = update_rnd(rseed);
-			uint_fast32_t d2     = update_rnd(d1);
-			int_fast64_t  iq;
-			rseed  = d2;
-			iq     = (int_fast64_t)(d1 & 0xFFFFFFFFu);
-			iq    += (int_fast64_t)(d2 & 0xFFFFFFFFu);
-			iq    += (int_fast64_t)(sample * (float)(((uint_fast64_t)1) << (33 + 15)));
-			iq     = iq >> 33; /* Implementation defined... anything care? */
-			if (iq < -(int_fast64_t)0x8000)
-				iq = -(int_fast64_t)0x8000;
-			else if (iq > (int_fast64_t)0x7FFF)
-				iq = (int_fast64_t)0x7FFF;
-			cop_st_sle16(wbp, (int_fast32_t)iq);
-			wbp += 2;
+		int32_t  q[QUANTISE_CHUNK];
+		unsigned bytes = dump->bits_per_sample / 8;
+		while (nb_samples) {
+			unsigned n = (nb_samples < QUANTISE_CHUNK) ? nb_samples : QUANTISE_CHUNK;
+			unsigned i;
+			quantise_chunk(q, data, n, (uint32_t)dump->rseed, dump->bits_per_sample);
+			if (bytes == 3) {
+				for (i = 0; i < n; i++, wbp += 3)
+					cop_st_sle24(wbp, q[i]);
+			} else {
+				for (i = 0; i < n; i++, wbp += 2)
+					cop_st_sle16(wbp, q[i]);
+			}
+			dump->rseed += n;
+			data        += n;
+			nb_samples  -= n;
 		}
-		if (fwrite(dump->write_buffer, block_size, 1, dump->f) != 1)
-			err = -1;
 	}
 
-	dump->rseed = rseed;
-	buf->nb_frames = 0;
+	return wbp - dst;
+}
 
-	return err;
+static int write_bytes(struct wav_dumper *dump, size_t nb_bytes)
+{
+	return (nb_bytes && fwrite(dump->write_buffer, nb_bytes, 1, dump->f) != 1) ? -1 : 0;
+}
+
+/* Wake the writer thread. This must never block, so the lock is only tried.
+ * That is not enough on its own: the writer holds the lock between finding
+ * kick_pending clear and going to sleep, and a kick which fails to get the
+ * lock in that window would never be signalled. So kick_pending stays set
+ * until the writer has woken up and cleared it under the lock, and every
+ * later call into the dumper kicks again while it is set (see
+ * wav_dumper_write_from_floats()). A kick can be late by one call, but it
+ * cannot be lost. */
+static void wav_dumper_kick(struct wav_dumper *dump)
+{
+	odatomic_store(&dump->kick_pending, 1);
+	if (cop_mutex_trylock(&dump->thread_lock)) {
+		cop_cond_signal(&dump->thread_cond);
+		cop_mutex_unlock(&dump->thread_lock);
+	}
 }
 
 static void *wav_dumper_threadproc(void *argument)
 {
 	struct wav_dumper *dump = argument;
+	uint32_t consumed = odatomic_load(&dump->consumed);
 
-	do {
-		struct wav_dumper_buffer  *outbuf;
-		int err;
+	cop_mutex_lock(&dump->thread_lock);
+	while (1) {
+		int quit;
 
-		/* Obtain buffer list. */
-		cop_mutex_lock(&dump->thread_lock);
-		while (dump->length == 0 && !dump->end_thread) {
-			cop_cond_wait(&dump->thread_cond, &dump->thread_lock);
-		}
-		if (dump->end_thread)
-			outbuf = NULL;
-		else
-			outbuf = dump->buffers + dump->out_pos;
+		odatomic_store(&dump->kick_pending, 0);
+		quit = dump->end_thread;
 		cop_mutex_unlock(&dump->thread_lock);
 
-		/* Quitting? */
-		if (outbuf == NULL)
-			return NULL;
+		/* Write everything which has been handed over. When quitting, this
+		 * includes the last buffer as it is handed over before end_thread
+		 * is set. Each buffer goes back to the caller as soon as it has been
+		 * packed and everything which is queued goes out in one write. */
+		while (odatomic_load(&dump->produced) != consumed) {
+			size_t   used   = 0;
+			unsigned nb_buf = 0;
+			do {
+				struct wav_dumper_buffer *buf = dump->buffers + dump->out_pos;
+				used          += pack_buffer(dump, dump->write_buffer + used, buf);
+				buf->nb_frames = 0;
+				dump->out_pos  = (dump->out_pos + 1) % dump->nb_buffers;
+				odatomic_store(&dump->consumed, ++consumed);
+			} while (++nb_buf < dump->nb_buffers && odatomic_load(&dump->produced) != consumed);
+			if (write_bytes(dump, used))
+				dump->write_error = -1;
+
+			/* A blocking caller may be waiting for the buffers which were
+			 * just released. */
+			cop_mutex_lock(&dump->thread_lock);
+			if (dump->space_waiting)
+				cop_cond_signal(&dump->space_cond);
+			cop_mutex_unlock(&dump->thread_lock);
+		}
+
+		if (quit)
+			break;
 
-		/* Write samples to file. */
-		err = write_interleaved_buffer(dump, outbuf);
-		
-		/* Modify queue. */
 		cop_mutex_lock(&dump->thread_lock);
-		dump->length  = dump->length - 1;
-		dump->out_pos = (dump->out_pos + 1) % dump->nb_buffers;
-		if (err)
-			dump->write_error = err;
-		cop_mutex_unlock(&dump->thread_lock);
-	} while (1);
+		if (!dump->end_thread && !odatomic_load(&dump->kick_pending))
+			cop_cond_wait(&dump->thread_cond, &dump->thread_lock);
+	}
 
 	return NULL;
 }
 
+/* Pass the buffer being filled to the writer (or write it out when there is
+ * no writer thread). */
+static void hand_over_buffer(struct wav_dumper *dump)
+{
+	if (dump->nb_buffers > 1) {
+		dump->in_pos = (dump->in_pos + 1) % dump->nb_buffers;
+		odatomic_store(&dump->produced, odatomic_load(&dump->produced) + 1);
+		wav_dumper_kick(dump);
+	} else {
+		size_t used = pack_buffer(dump, dump->write_buffer, dump->buffers);
+		dump->buffers->nb_frames = 0;
+		if (write_bytes(dump, used))
+			dump->write_error = -1;
+	}
+}
+
+/* Sleep until the writer has released at least one buffer. The writer is
+ * signalled with the lock held, so it is either running or asleep on
+ * thread_cond and cannot miss it. */
+static void wait_for_space(struct wav_dumper *dump)
+{
+	cop_mutex_lock(&dump->thread_lock);
+	while (odatomic_load(&dump->produced) - odatomic_load(&dump->consumed) >= dump->nb_buffers) {
+		dump->space_waiting = 1;
+		odatomic_store(&dump->kick_pending, 1);
+		cop_cond_signal(&dump->thread_cond);
+		cop_cond_wait(&dump->space_cond, &dump->thread_lock);
+	}
+	dump->space_waiting = 0;
+	cop_mutex_unlock(&dump->thread_lock);
+}
+
 unsigned wav_dumper_write_from_floats(struct wav_dumper *dump, const float *data, unsigned num_samples, unsigned sample_stride, unsigned channel_stride)
 {
 	unsigned num_written = 0;
+
+	/* Deliver a kick which may not have been signalled. */
+	if (dump->nb_buffers > 1 && odatomic_load(&dump->kick_pending))
+		wav_dumper_kick(dump);
+
 	while (num_written < num_samples) {
 		unsigned nb_can_write_into_buffer;
-		uint_fast32_t nb_can_write_into_wave;
+		uint_fast64_t nb_can_write_into_wave;
 		unsigned can_write;
 		unsigned remain;
 		unsigned i, ch;
@@ -145,24 +228,21 @@ unsigned wav_dumper_write_from_floats(struct wav_dumper *dump, const float *data
 
 		struct wav_dumper_buffer *buf;
 
-		if (dump->nb_buffers > 1) {
-			cop_mutex_lock(&dump->thread_lock);
-			if (dump->length < dump->nb_buffers) {
-				buf = dump->buffers + dump->in_pos;
-			}
-			else {
-				buf = NULL;
+		/* How much is left to write? */
+		remain                   = num_samples - num_written;
+
+		/* Every buffer is queued. Drop the rest rather than wait unless the
+		 * caller asked to wait. */
+		if (dump->nb_buffers > 1 && odatomic_load(&dump->produced) - odatomic_load(&dump->consumed) >= dump->nb_buffers) {
+			if (!dump->blocking) {
+				odatomic_add(&dump->overflow_frames, remain);
+				wav_dumper_kick(dump);
+				return num_written;
 			}
-			cop_mutex_unlock(&dump->thread_lock);
-		} else {
-			buf = dump->buffers;
+			wait_for_space(dump);
 		}
 
-		if (buf == NULL)
-			return num_written;
-
-		/* How much is left to write? */
-		remain                   = num_samples - num_written;
+		buf = dump->buffers + dump->in_pos;
 
 		/* Limit the write so that it does not overflow the current buffer. */
 		nb_can_write_into_buffer = dump->buffer_frames - buf->nb_frames;
@@ -194,22 +274,23 @@ unsigned wav_dumper_write_from_floats(struct wav_dumper *dump, const float *data
 		/* If we did not write the amount remaining, this indicates that
 		 * either the wave file is full or the current buffer is now full.
 		 * Flush the current buffer to the output file. */
-		if (can_write != remain || buf->nb_frames == dump->buffer_frames) {
-			if (dump->nb_buffers > 1) {
-				cop_mutex_lock(&dump->thread_lock);
-				dump->length = dump->length + 1;
-				dump->in_pos = (dump->in_pos + 1) % dump->nb_buffers;
-				cop_cond_signal(&dump->thread_cond);
-				cop_mutex_unlock(&dump->thread_lock);
-			} else {
-				write_interleaved_buffer(dump, buf);
-			}
-		}
+		if (can_write != remain || buf->nb_frames == dump->buffer_frames)
+			hand_over_buffer(dump);
 	}
 
 	return num_written;
 }
 
+unsigned long wav_dumper_query_overflow(struct wav_dumper *dump)
+{
+	return odatomic_load(&dump->overflow_frames);
+}
+
+void wav_dumper_set_blocking(struct wav_dumper *dump, int blocking)
+{
+	dump->blocking = blocking;
+}
+
 static size_t align_pad(size_t val, unsigned next_align_mask)
 {
 	return (1u + next_align_mask - (((unsigned)val) & next_align_mask)) & next_align_mask;
@@ -237,14 +318,19 @@ wav_dumper_begin
 	,unsigned           buffer_length
 	)
 {
-	unsigned char header[PCM_HEADER_SIZE];
+	unsigned char header[MAX_HEADER_SIZE];
 	size_t memsz;
+	size_t write_sz;
 	unsigned i;
 	void *x;
 	float *bufdata;
+	int is_float = (bits_per_sample == 32);
 
 	assert(nb_buffers);
 
+	if (bits_per_sample != 16 && bits_per_sample != 24 && !is_float)
+		return -1;
+
 	if (nb_buffers > 1) {
 		if (cop_mutex_create(&dump->thread_lock))
 			return -1;
@@ -252,22 +338,34 @@ wav_dumper_begin
 			cop_mutex_destroy(&dump->thread_lock);
 			return -1;
 		}
+		if (cop_cond_create(&dump->space_cond)) {
+			cop_cond_destroy(&dump->thread_cond);
+			cop_mutex_destroy(&dump->thread_lock);
+			return -1;
+		}
 	}
 	dump->rseed             = 0x1EA7F00Du;
 	dump->buffer_frames     = buffer_length;
 	dump->in_pos            = 0;
 	dump->out_pos           = 0;
-	dump->length            = 0;
 	dump->nb_buffers        = nb_buffers;
 	dump->write_error       = 0;
 	dump->end_thread        = 0;
+	dump->space_waiting     = 0;
+	dump->blocking          = 0;
 	dump->channels          = channels;
 	dump->bits_per_sample   = bits_per_sample;
 	dump->block_align       = channels * ((bits_per_sample + 7) / 8);
-	dump->max_frames        = (0xFFFFFFFFu - INTIAL_RIFF_SIZE) / dump->block_align;
+	dump->max_frames        = UINT64_MAX / 2 / dump->block_align;
 	dump->nb_frames         = 0;
-
-	memsz                   = align_first(31)      + sizeof(unsigned char) * buffer_length * dump->block_align;
+	odatomic_store(&dump->produced, 0);
+	odatomic_store(&dump->consumed, 0);
+	odatomic_store(&dump->kick_pending, 0);
+	odatomic_store(&dump->overflow_frames, 0);
+
+	/* With a writer thread, every buffer can be packed into one write. */
+	write_sz                = sizeof(unsigned char) * nb_buffers * buffer_length * dump->block_align;
+	memsz                   = align_first(31)      + write_sz;
 	memsz                  += align_pad(memsz, 31) + sizeof(struct wav_dumper_buffer) * nb_buffers;
 	memsz                  += align_pad(memsz, 31) + sizeof(float) * nb_buffers * buffer_length * channels;
 	dump->mem_base          = (x = malloc(memsz));
@@ -275,13 +373,14 @@ wav_dumper_begin
 	if (dump->mem_base == NULL) {
 		if (dump->nb_buffers > 1) {
 			cop_cond_destroy(&dump->thread_cond);
+			cop_cond_destroy(&dump->space_cond);
 			cop_mutex_destroy(&dump->thread_lock);
 		}
 		return -1;
 	}
 
 	dump->write_buffer      = (x = align_buf(x, 31));
-	dump->buffers           = (x = align_buf((char *)x + sizeof(unsigned char) * buffer_length * dump->block_align, 31));
+	dump->buffers           = (x = align_buf((char *)x + write_sz, 31));
 	bufdata                 = (x = align_buf((char *)x + sizeof(struct wav_dumper_buffer) * nb_buffers, 31));
 
 	for (i = 0; i < nb_buffers; i++) {
@@ -295,41 +394,48 @@ wav_dumper_begin
 		free(dump->mem_base);
 		if (dump->nb_buffers > 1) {
 			cop_cond_destroy(&dump->thread_cond);
+			cop_cond_destroy(&dump->space_cond);
 			cop_mutex_destroy(&dump->thread_lock);
 		}
 		return -1;
 	}
 
-	header[0] = 'R';
-	header[1] = 'I';
-	header[2] = 'F';
-	header[3] = 'F';
-	cop_st_ule32(header + 4, INTIAL_RIFF_SIZE);
-	header[8] = 'W';
-	header[9] = 'A';
-	header[10] = 'V';
-	header[11] = 'E';
-	header[12] = 'f';
-	header[13] = 'm';
-	header[14] = 't';
-	header[15] = ' ';
-	cop_st_ule32(header + 16, 16);
-	cop_st_ule16(header + 20, 1);
-	cop_st_ule16(header + 22, dump->channels);
-	cop_st_ule32(header + 24, rate);
-	cop_st_ule32(header + 28, rate * dump->block_align);
-	cop_st_ule16(header + 32, dump->block_align);
-	cop_st_ule16(header + 34, dump->bits_per_sample);
-	header[36] = 'd';
-	header[37] = 'a';
-	header[38] = 't';
-	header[39] = 'a';
-	cop_st_ule32(header + DATA_CHUNK_SIZE_OFFSET, 0);
-
-	if (fwrite(header, PCM_HEADER_SIZE, 1, dump->f) != 1) {
+	/* Everything after the header is written in big blocks which do not
+	 * need another copy through a stdio buffer. */
+	(void)setvbuf(dump->f, NULL, _IONBF, 0);
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, "RIFF", 4);
+	memcpy(header + 8, "WAVE", 4);
+	memcpy(header + DS64_OFFSET, "JUNK", 4);
+	cop_st_ule32(header + DS64_OFFSET + 4, DS64_SIZE);
+	memcpy(header + FMT_OFFSET, "fmt ", 4);
+	cop_st_ule32(header + FMT_OFFSET + 4, is_float ? 18 : 16);
+	cop_st_ule16(header + FMT_OFFSET + 8, is_float ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM);
+	cop_st_ule16(header + FMT_OFFSET + 10, dump->channels);
+	cop_st_ule32(header + FMT_OFFSET + 12, rate);
+	cop_st_ule32(header + FMT_OFFSET + 16, rate * dump->block_align);
+	cop_st_ule16(header + FMT_OFFSET + 20, dump->block_align);
+	cop_st_ule16(header + FMT_OFFSET + 22, dump->bits_per_sample);
+	dump->header_size = FMT_OFFSET + RIFF_CHUNK_HEADER_SIZE + 16;
+	dump->fact_offset = 0;
+	if (is_float) {
+		/* cbSize (zero) followed by the fact chunk. */
+		dump->header_size += 2;
+		dump->fact_offset  = dump->header_size;
+		memcpy(header + dump->fact_offset, "fact", 4);
+		cop_st_ule32(header + dump->fact_offset + 4, 4);
+		dump->header_size += RIFF_CHUNK_HEADER_SIZE + 4;
+	}
+	memcpy(header + dump->header_size, "data", 4);
+	dump->header_size += RIFF_CHUNK_HEADER_SIZE;
+	cop_st_ule32(header + RIFF_CHUNK_SIZE_OFFSET, dump->header_size - RIFF_CHUNK_HEADER_SIZE);
+
+	if (fwrite(header, dump->header_size, 1, dump->f) != 1) {
 		free(dump->mem_base);
 		if (dump->nb_buffers > 1) {
 			cop_cond_destroy(&dump->thread_cond);
+			cop_cond_destroy(&dump->space_cond);
 			cop_mutex_destroy(&dump->thread_lock);
 		}
 		fclose(dump->f);
@@ -340,6 +446,7 @@ wav_dumper_begin
 		free(dump->mem_base);
 		fclose(dump->f);
 		cop_cond_destroy(&dump->thread_cond);
+		cop_cond_destroy(&dump->space_cond);
 		cop_mutex_destroy(&dump->thread_lock);
 		return -1;
 	}
@@ -351,6 +458,16 @@ int wav_dumper_end(struct wav_dumper *dump)
 {
 	int ret = 0;
 
+	/* Whatever has been collected in the current buffer gets written too. If
+	 * every buffer is queued, the current one is not ours to look at, but
+	 * then nothing can have been collected in it either. */
+	if  (   (   dump->nb_buffers == 1
+	        ||  odatomic_load(&dump->produced) - odatomic_load(&dump->consumed) < dump->nb_buffers
+	        )
+	    &&  dump->buffers[dump->in_pos].nb_frames
+	    )
+		hand_over_buffer(dump);
+
 	if (dump->nb_buffers > 1) {
 		cop_mutex_lock(&dump->thread_lock);
 		dump->end_thread = 1;
@@ -358,29 +475,64 @@ int wav_dumper_end(struct wav_dumper *dump)
 		cop_mutex_unlock(&dump->thread_lock);
 		cop_thread_join(dump->thread, NULL);
 		cop_cond_destroy(&dump->thread_cond);
+		cop_cond_destroy(&dump->space_cond);
 		cop_mutex_destroy(&dump->thread_lock);
-		ret = dump->write_error;
-	} else {
-		while (dump->length--) {
-			ret = write_interleaved_buffer(dump, dump->buffers + dump->out_pos);
-			dump->out_pos = (dump->out_pos + 1) % dump->nb_buffers;
-		}
 	}
+	ret = dump->write_error;
 
 	assert(dump->f != NULL);
 
 	if (!ret && dump->nb_frames) {
-		unsigned char riff_sz_buf[4];
-		unsigned char data_sz_buf[4];
-		uint_fast32_t written = dump->nb_frames * dump->block_align;
-		cop_st_ule32(riff_sz_buf, INTIAL_RIFF_SIZE + written);
-		cop_st_ule32(data_sz_buf, written);
-		ret =
-			(   fseek(dump->f, RIFF_CHUNK_SIZE_OFFSET, SEEK_SET) != 0
-			||  fwrite(riff_sz_buf, 4, 1, dump->f) != 1
-			||  fseek(dump->f, DATA_CHUNK_SIZE_OFFSET, SEEK_SET) != 0
-			||  fwrite(data_sz_buf, 4, 1, dump->f) != 1
-			);
+		unsigned char hdr[DS64_SIZE];
+		uint_fast64_t data_sz = dump->nb_frames * dump->block_align;
+		uint_fast64_t riff_sz = dump->header_size - RIFF_CHUNK_HEADER_SIZE + data_sz + (data_sz & 1);
+		int           is_rf64 = (riff_sz > RIFF_SIZE_LIMIT);
+
+		/* Chunks are padded to an even length. */
+		if (data_sz & 1) {
+			hdr[0] = 0;
+			ret = (fwrite(hdr, 1, 1, dump->f) != 1);
+		}
+
+		/* Anything which is too big for the 32-bit fields goes in the ds64
+		 * chunk instead of the JUNK chunk and RIFF becomes RF64. */
+		if (!ret && is_rf64) {
+			cop_st_ule32(hdr + 0,  (uint_fast32_t)(riff_sz & 0xFFFFFFFFu));
+			cop_st_ule32(hdr + 4,  (uint_fast32_t)(riff_sz >> 32));
+			cop_st_ule32(hdr + 8,  (uint_fast32_t)(data_sz & 0xFFFFFFFFu));
+			cop_st_ule32(hdr + 12, (uint_fast32_t)(data_sz >> 32));
+			cop_st_ule32(hdr + 16, (uint_fast32_t)(dump->nb_frames & 0xFFFFFFFFu));
+			cop_st_ule32(hdr + 20, (uint_fast32_t)(dump->nb_frames >> 32));
+			cop_st_ule32(hdr + 24, 0);
+			ret =
+				(   fseek(dump->f, 0, SEEK_SET) != 0
+				||  fwrite("RF64", 4, 1, dump->f) != 1
+				||  fseek(dump->f, DS64_OFFSET, SEEK_SET) != 0
+				||  fwrite("ds64", 4, 1, dump->f) != 1
+				||  fseek(dump->f, DS64_OFFSET + RIFF_CHUNK_HEADER_SIZE, SEEK_SET) != 0
+				||  fwrite(hdr, DS64_SIZE, 1, dump->f) != 1
+				);
+		}
+
+		if (!ret) {
+			unsigned char riff_sz_buf[4];
+			unsigned char data_sz_buf[4];
+			unsigned char fact_buf[4];
+			cop_st_ule32(riff_sz_buf, is_rf64 ? RIFF_SIZE_LIMIT : (uint_fast32_t)riff_sz);
+			cop_st_ule32(data_sz_buf, is_rf64 ? RIFF_SIZE_LIMIT : (uint_fast32_t)data_sz);
+			cop_st_ule32(fact_buf, (dump->nb_frames > RIFF_SIZE_LIMIT) ? RIFF_SIZE_LIMIT : (uint_fast32_t)dump->nb_frames);
+			ret =
+				(   fseek(dump->f, RIFF_CHUNK_SIZE_OFFSET, SEEK_SET) != 0
+				||  fwrite(riff_sz_buf, 4, 1, dump->f) != 1
+				||  fseek(dump->f, dump->header_size - 4, SEEK_SET) != 0
+				||  fwrite(data_sz_buf, 4, 1, dump->f) != 1
+				||  (   dump->fact_offset
+				    &&  (   fseek(dump->f, dump->fact_offset + RIFF_CHUNK_HEADER_SIZE, SEEK_SET) != 0
+				        ||  fwrite(fact_buf, 4, 1, dump->f) != 1
+				        )
+				    )
+				);
+		}
 	}
 
 	free(dump->mem_base);
@@ -23,6 +23,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include "odatomic.h"
 #include "cop/cop_thread.h"
 
 struct wav_dumper_buffer {
@@ -32,37 +33,61 @@ struct wav_dumper_buffer {
 
 struct wav_dumper {
 	/* Constants */
-	uint_fast32_t              max_frames;
+	uint_fast64_t              max_frames;
 	unsigned                   channels;
 	unsigned                   bits_per_sample;
 	unsigned                   block_align;
+	unsigned                   header_size;
+	unsigned                   fact_offset;
 
-	/* These are completely owned by the thread. */
+	/* These are completely owned by the thread. rseed counts the samples
+	 * which have been dithered. */
 	uint_fast32_t              rseed;
 	unsigned                   buffer_frames;
 	unsigned char             *write_buffer;
 	int                        write_error;
+	unsigned                   out_pos;
 	FILE                      *f;
 
-	/* Don't touch unless thread_lock is held. */
+	/* The buffers form a single-producer/single-consumer ring. Only the
+	 * calling code advances produced and only the thread advances consumed.
+	 * The buffer at in_pos belongs to the calling code as long as fewer than
+	 * nb_buffers buffers are waiting to be written. Nothing here ever needs
+	 * thread_lock, which is only used to put the thread to sleep. */
 	struct wav_dumper_buffer  *buffers;
 	unsigned                   nb_buffers;
-	unsigned                   length;
-	unsigned                   in_pos;
-	unsigned                   out_pos;
+	odatomic_u32               produced;
+	odatomic_u32               consumed;
+	odatomic_u32               kick_pending;
+	odatomic_u32               overflow_frames;
+
+	/* Don't touch unless thread_lock is held. space_waiting is set while the
+	 * calling code is waiting on space_cond for a buffer to be released. */
 	int                        end_thread;
+	int                        space_waiting;
 
 	/* These are completely owned by the calling code. */
 	void                      *mem_base;
-	uint_fast32_t              nb_frames;
+	uint_fast64_t              nb_frames;
+	unsigned                   in_pos;
+	int                        blocking;
 
 	/* Synchronisation stuff. */
 	cop_thread                 thread;
 	cop_cond                   thread_cond;
+	cop_cond                   space_cond;
 	cop_mutex                  thread_lock;
 };
 
 /* Starts a wave dumper with the given format configuration.
+ *
+ * bits_per_sample is 16 or 24 for dithered PCM or 32 for IEEE float. The
+ * file is written as a normal wave file unless it grows past 4 GiB, in
+ * which case wav_dumper_end() turns it into an RF64 file.
+ *
+ * If nb_buffers is greater than one, a thread is started which does all of
+ * the format conversion and writing.
+ *
  * Return value is zero if the wave file was opened and initialised
  * successfully. */
 int
@@ -82,7 +107,12 @@ wav_dumper_begin
  * case, this represents the number of samples that were successfully queued
  * for writing. In the single threaded case, this may be limited due to
  * being unable to write any more samples into the file or if a write error
- * has occured. */
+ * has occured.
+ *
+ * In the multi-threaded case, this never blocks and never takes a lock so it
+ * can be called from an audio callback. If every buffer is waiting to be
+ * written, the samples are dropped and counted (see
+ * wav_dumper_query_overflow()). */
 unsigned
 wav_dumper_write_from_floats
 	(struct wav_dumper *dump
@@ -92,6 +122,16 @@ wav_dumper_write_from_floats
 	,unsigned           channel_stride
 	);
 
+/* Number of frames which have been dropped because the writer thread had
+ * not finished with the buffers. Can be called from any thread. */
+unsigned long wav_dumper_query_overflow(struct wav_dumper *dump);
+
+/* Make wav_dumper_write_from_floats() wait for the writer thread instead of
+ * dropping samples when every buffer is queued. This is for offline
+ * rendering where nothing must be lost and must not be used from an audio
+ * callback. Call it before the first write. */
+void wav_dumper_set_blocking(struct wav_dumper *dump, int blocking);
+
 /* Close the wave dumper.
  * Undefined to close a dumper that is not opened.
  * Returns zero if the header was updated successfully. */
@@ -26,9 +26,40 @@
 #include "decode_least16x2.h"
 #include "wavldr.h"
 #include "wav_dumper.h"
+#include "dither.h"
 #include "smplwav/smplwav_mount.h"
 #include "smplwav/smplwav_convert.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* Monotonic wall clock in nanoseconds. Only used for profiling. */
+static uint_fast64_t profile_now_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint_fast64_t)((count.QuadPart / freq.QuadPart) * 1000000000 + ((count.QuadPart % freq.QuadPart) * 1000000000) / freq.QuadPart);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint_fast64_t)ts.tv_sec * 1000000000u + (uint_fast64_t)ts.tv_nsec;
+#endif
+}
+
+/* Add the time since "since" to the given stage and return the current
+ * time so that calls can be chained from one stage to the next. */
+static uint_fast64_t profile_stage(struct wavldr_profile *prof, unsigned stage, uint_fast64_t since)
+{
+	uint_fast64_t now = profile_now_ns();
+	prof->stage_ns[stage] += now - since;
+	return now;
+}
+
 struct smpl_comp {
 	const char    *filename;
 
@@ -241,46 +272,38 @@ static float find_max(float *buf1, float *buf2, unsigned length)
 	return vlf_hmax(maxv);
 }
 
-/* These are the A coefficients for 4 different LCGs operating with a modulus
- * of M=2^32. C is designed to be 1 for all of these generators which
- * satisfies that M and C are relatively prime. The coefficients are written
- * some-what explicitly to show that:
+/* We need 4 random numbers to dither one stereo sample. These used to come
+ * from running 4 LCGs one step per sample, but that creates a dependency
+ * from every sample to the previous one which stops the loop from being
+ * vectorised. Instead, the random numbers are hashes of a counter (the
+ * sample index offset by the seed) - i.e. a counter based generator. Every
+ * sample uses two counters, 2*c for the left channel and 2*c+1 for the
+ * right, and the two 16-bit halves of each hash are the two uniform
+ * variables of that channel's triangular dither:
  *
- *   - A-1 is divisible by all prime factors of M (i.e. 2)
- *   - A-1 is divisible by 4 (because M is divisible by 4)
+ *   HL = dither_hash(2*c),   R0 = HL << 16,  R1 = HL & 0xFFFF0000
+ *   HR = dither_hash(2*c+1), R2 = HR << 16,  R3 = HR & 0xFFFF0000
  *
- * According to Wikipedia, these requirements are refered to as the Hull-
- * Dobell Theorem. I am no expert in this business. The whacko extra numbers
- * in the expression are big prime numbers which I chose for no good reason.
+ * Deriving all four from one hash (by multiplying it by different
+ * constants) made them correlated. Separate hashes are independent and the
+ * halves of a hash are as good as independent because of its avalanche
+ * behaviour. 16 bits is still far more resolution than the dither needs.
+ * This is the same as what wav_dumper does for its output.
  *
- * The random number generators are used in a somewhat obscure way to remove
- * circular dependencies. We need 4 random numbers to dither one stereo
- * sample. The obvious way to do this would be to evaluate one random number
- * generator 4 times - this is however inefficient as it ends up creating a
- * sequence of dependent results. The way we do it is pick one random number
- * generator to generate the first random variable - the other three are
- * derived from the seed such that:
- *
- *   R0 = Rprev * RNG_A0
- *   R1 = Rprev * RNG_A1
- *   R2 = Rprev * RNG_A2
- *   R3 = Rprev * RNG_A3
- *   ...
- *   Rprev = R0 + 1
- *
- * The Rx values are intermediate pseudo random variables which we use as our
- * random states. This eliminates any dependency to produce our randomness. I
- * did test this in another small C program to look at the covariance of the
- * 4 random numbers over time and the results were very good (assuming that
- * the constants used for the generators are good - I have chosen some well-
- * spaced prime numbers which gave good results).
- *
- * This method will enable more parallel random numbers to be computed if the
- * need ever arises. Just remember to check the covariance first. :) */
-#define RNG_A0 (1u+4u*899809363u)
-#define RNG_A1 (1u+4u*920419823u)
-#define RNG_A2 (1u+4u*941083987u)
-#define RNG_A3 (1u+4u*961748941u)
+ * The seed only needs to be different for every buffer which gets
+ * quantised. It is derived from the file name rather than rand() so that
+ * loading the same sample always gives exactly the same data. */
+
+/* FNV-1a of the file name. */
+static uint_fast32_t dither_seed_from_name(const char *name)
+{
+	uint32_t h = 2166136261u;
+	while (*name != '\0') {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
 
 /* How my triangular dither code works...
  *
@@ -337,7 +360,7 @@ static float quantize_boost_interleave
 	,unsigned        fmtbits
 	)
 {
-	uint_fast32_t rseed = *dither_seed;
+	uint32_t rseed = (uint32_t)*dither_seed;
 	float maxv = 0.0f;
 	float boost;
 
@@ -351,12 +374,14 @@ static float quantize_boost_interleave
 			maxv  *= 1.0f / 2048.0f;
 			boost  = 1.0f / maxv;
 			for (j = 0; j < in_length; j++) {
+				uint32_t hl      = dither_hash(2u * (rseed + j));
+				uint32_t hr      = dither_hash(2u * (rseed + j) + 1u);
 				float s1         = in_bufs[j] * boost;
 				float s2         = in_bufs[chan_stride+j] * boost;
-				int_fast32_t r1  = (rseed = update_rnd(rseed)) & 0x3FFFFFFFu;
-				int_fast32_t r2  = (rseed = update_rnd(rseed)) & 0x3FFFFFFFu;
-				int_fast32_t r3  = (rseed = update_rnd(rseed)) & 0x3FFFFFFFu;
-				int_fast32_t r4  = (rseed = update_rnd(rseed)) & 0x3FFFFFFFu;
+				int_fast32_t r1  = (int_fast32_t)((hl & 0xFFFFu) << 14);
+				int_fast32_t r2  = (int_fast32_t)((hl >> 16) << 14);
+				int_fast32_t r3  = (int_fast32_t)((hr & 0xFFFFu) << 14);
+				int_fast32_t r4  = (int_fast32_t)((hr >> 16) << 14);
 				float d1         = (r1 + r2) * (1.0f / 0x7FFFFFFF);
 				float d2         = (r3 + r4) * (1.0f / 0x7FFFFFFF);
 				int_fast32_t v1  = (int_fast32_t)(d1 + s1 + 2048.0f) - 2048;
@@ -375,31 +400,18 @@ static float quantize_boost_interleave
 			maxv  = (maxv + (4.0f / 32768.0f)) / 32768.0f;
 			boost = ((float)((((uint_fast64_t)1u) << 33))) / maxv;
 
-			/* 4091ms */
 			for (j = 0; j < in_length; j++) {
-				uint_fast32_t d1, d2, d3, d4;
-				float f1, f2;
+				uint32_t hl = dither_hash(2u * (rseed + j));
+				uint32_t hr = dither_hash(2u * (rseed + j) + 1u);
 				int_fast64_t lch, rch;
-				f1     = in_bufs[j];
-				f2     = in_bufs[chan_stride+j];
-				d1     = rseed * RNG_A0;
-				d2     = rseed * RNG_A1;
-				d3     = rseed * RNG_A2;
-				d4     = rseed * RNG_A3;
-				f1    *= boost;
-				f2    *= boost;
-				rseed  = (d1 + 1) & 0xFFFFFFFFu;
-				lch    = (int_fast64_t)f1;
-				rch    = (int_fast64_t)f2;
-				lch   += (int_fast64_t)(d1 & 0xFFFFFFFFu);
-				rch   += (int_fast64_t)(d2 & 0xFFFFFFFFu);
-				lch   += (int_fast64_t)(d3 & 0xFFFFFFFFu);
-				rch   += (int_fast64_t)(d4 & 0xFFFFFFFFu);
-				lch    = lch >> 33;
-				rch    = rch >> 33;
-
-				out_buf[2*j+0] = (int_least16_t)lch;
-				out_buf[2*j+1] = (int_least16_t)rch;
+				lch  = (int_fast64_t)(in_bufs[j] * boost);
+				rch  = (int_fast64_t)(in_bufs[chan_stride+j] * boost);
+				lch += (int_fast64_t)(uint32_t)(hl << 16);
+				lch += (int_fast64_t)(uint32_t)(hl & 0xFFFF0000u);
+				rch += (int_fast64_t)(uint32_t)(hr << 16);
+				rch += (int_fast64_t)(uint32_t)(hr & 0xFFFF0000u);
+				out_buf[2*j+0] = (int_least16_t)(lch >> 33);
+				out_buf[2*j+1] = (int_least16_t)(rch >> 33);
 			}
 			for (; j < out_length; j++) {
 				out_buf[2*j+0] = 0;
@@ -413,10 +425,110 @@ static float quantize_boost_interleave
 		abort();
 	}
 
+	/* Move the counter past everything which was used. */
+	rseed += in_length;
+
 	*dither_seed = rseed;
 	return maxv;
 }
 
+/* Split prefilter jobs are divided into this many parts per loader thread
+ * so that threads which become idle part way through can still help. */
+#define WAVLDR_SPLIT_PARTS_PER_THREAD (2)
+
+/* Run the next part of a split job. Must be called with the state lock held
+ * and the job must have parts left to hand out. The lock is released while
+ * the part is running. */
+static void split_work(struct wavldr *ls, struct wavldr_split_job *job, struct odfilter_temporaries *tmps)
+{
+	unsigned part = job->next_part++;
+
+	/* Nobody else needs to find the job once every part has been taken. */
+	if (job->next_part == job->nb_parts) {
+		struct wavldr_split_job **p = &(ls->split_jobs);
+		while (*p != job)
+			p = &((*p)->next);
+		*p = job->next;
+	}
+
+	cop_mutex_unlock(&(ls->state_lock));
+	odfilter_run_part
+		(job->input
+		,job->output
+		,0
+		,job->susp_start
+		,job->length
+		,job->pre_read
+		,job->is_looped
+		,tmps
+		,ls->prefilter
+		,part
+		,job->nb_parts
+		,(part + 1 < job->nb_parts) ? job->tails + part * (ls->prefilter->kern_len - 1) : NULL
+		);
+	cop_mutex_lock(&(ls->state_lock));
+
+	if (++job->parts_done == job->nb_parts)
+		cop_cond_broadcast(&(ls->work_cond));
+}
+
+/* Run the prefilter over one channel of a segment. If splitter is not NULL
+ * and the segment is long enough, the work is shared with any loader threads
+ * which are idle. */
+static
+void
+run_prefilter
+	(struct wavldr               *splitter
+	,const float                 *input
+	,float                       *output
+	,unsigned long                susp_start
+	,unsigned long                length
+	,unsigned                     pre_read
+	,int                          is_looped
+	,struct cop_alloc_iface      *tail_alloc
+	,const struct odfilter       *prefilter
+	,struct odfilter_temporaries *tmps
+	)
+{
+	struct wavldr_split_job job;
+	unsigned                part;
+
+	if  (   splitter == NULL
+	    ||  splitter->split_length == 0
+	    ||  length < splitter->split_length
+	    ||  splitter->nb_threads < 2
+	    ||  (job.tails = cop_alloc(tail_alloc, sizeof(float) * (prefilter->kern_len - 1) * splitter->nb_threads * WAVLDR_SPLIT_PARTS_PER_THREAD, 64)) == NULL
+	    ) {
+		odfilter_run(input, output, 0, susp_start, length, pre_read, is_looped, tmps, prefilter);
+		return;
+	}
+
+	job.input      = input;
+	job.output     = output;
+	job.susp_start = susp_start;
+	job.length     = length;
+	job.pre_read   = pre_read;
+	job.is_looped  = is_looped;
+	job.nb_parts   = splitter->nb_threads * WAVLDR_SPLIT_PARTS_PER_THREAD;
+	job.next_part  = 0;
+	job.parts_done = 0;
+
+	/* Publish the job and then help with it until there is nothing left to
+	 * hand out. */
+	cop_mutex_lock(&(splitter->state_lock));
+	job.next             = splitter->split_jobs;
+	splitter->split_jobs = &job;
+	cop_cond_broadcast(&(splitter->work_cond));
+	while (job.next_part < job.nb_parts)
+		split_work(splitter, &job, tmps);
+	while (job.parts_done < job.nb_parts)
+		cop_cond_wait(&(splitter->work_cond), &(splitter->state_lock));
+	cop_mutex_unlock(&(splitter->state_lock));
+
+	for (part = 0; part + 1 < job.nb_parts; part++)
+		odfilter_run_part_tail(output, length, pre_read, prefilter, part, job.nb_parts, job.tails + part * (prefilter->kern_len - 1));
+}
+
 /* This takes a memory wave and overwrites all of its channels with filtered
  * versions. This is designed to compensate for the high-frequency roll-off
  * which is introduced by the interpolation filters.
@@ -447,6 +559,7 @@ apply_prefilter
 	,struct cop_alloc_iface      *out_alloc
 	,const struct odfilter       *prefilter
 	,struct odfilter_temporaries *tmps
+	,struct wavldr               *splitter
 	,const char                  *debug_prefix
 	)
 {
@@ -461,16 +574,17 @@ apply_prefilter
 
 		for (ch = 0; ch < channels; ch++) {
 			size_t i;
-			odfilter_run
-				(/* input */           as->data + ch*as->chan_stride
+			run_prefilter
+				(/* splitter */        splitter
+				,/* input */           as->data + ch*as->chan_stride
 				,/* output */          optr + ch*new_stride
-				,/* add_to_output */   0
 				,/* sustain start */   as->atk_end_loop_start
 				,/* total length */    as->length
 				,/* pre-read */        (SMPL_INVERSE_FILTER_LEN-1)/2
 				,/* is looped */       1
-				,/* tmps */            tmps
+				,/* tail memory */     out_alloc
 				,/* filter */          prefilter
+				,/* tmps */            tmps
 				);
 			for (i = as->length; i < new_stride; i++)
 				optr[ch*new_stride+i] = 0.0f;
@@ -505,16 +619,17 @@ apply_prefilter
 
 		for (ch = 0; ch < channels; ch++) {
 			size_t i;
-			odfilter_run
-				(/* input */           rel->data + ch*rel->chan_stride
+			run_prefilter
+				(/* splitter */        splitter
+				,/* input */           rel->data + ch*rel->chan_stride
 				,/* output */          optr + ch*new_stride
-				,/* add_to_output */   0
 				,/* sustain start */   0
 				,/* total length */    rel->length
 				,/* pre-read */        (SMPL_INVERSE_FILTER_LEN-1)/2 + SMPL_INVERSE_FILTER_LEN/8
 				,/* is looped */       0
-				,/* tmps */            tmps
+				,/* tail memory */     out_alloc
 				,/* filter */          prefilter
+				,/* tmps */            tmps
 				);
 			for (i = rel->length; i < new_stride; i++)
 				optr[ch*new_stride+i] = 0.0f;
@@ -550,10 +665,13 @@ load_smpl_lists
 	,uint_fast32_t                norm_rate
 	,struct cop_alloc_iface      *out_alloc
 	,struct cop_alloc_iface      *allocator
-	,struct fftset               *fftset
-	,cop_mutex                   *fft_lock
+	,struct filtcache            *filtcache
+	,struct filtcache_temps      *env_tmps
 	,const struct odfilter       *prefilter
 	,struct odfilter_temporaries *tmps
+	,struct wavldr               *splitter
+	,struct smplstream           *stream
+	,struct wavldr_profile       *prof
 	,const char                  *file_ref
 	)
 {
@@ -577,9 +695,15 @@ load_smpl_lists
 
 	/* release has 32 samples of extra zero slop for a fake loop */
 	const unsigned release_slop   = 32;
-	uint_fast32_t rseed = rand();
+	uint_fast32_t rseed = dither_seed_from_name(file_ref);
 	unsigned i;
 	unsigned nb_releases;
+	uint_fast32_t loop_first;
+	uint_fast64_t stage_time;
+
+	/* When streaming, the quantised audio only needs to exist until the
+	 * stream has taken the parts it needs. */
+	struct cop_alloc_iface *qalloc = (stream != NULL) ? out_alloc : allocator;
 
 	{
 		struct as_data  *tmp;
@@ -599,6 +723,7 @@ load_smpl_lists
 	}
 
 	/* Prefilter and adjust audio. */
+	stage_time = profile_now_ns();
 	apply_prefilter
 		(as_bits
 		,rel_bits
@@ -607,8 +732,10 @@ load_smpl_lists
 		,out_alloc
 		,prefilter
 		,tmps
+		,splitter
 		,file_ref
 		);
+	stage_time = profile_stage(prof, WAVLDR_STAGE_PREFILTER, stage_time);
 
 	pipe->frequency   = norm_rate / as_bits->period;
 	pipe->sample_rate = norm_rate;
@@ -643,6 +770,11 @@ load_smpl_lists
 			pipe->attack.starts[i].first_valid_end++;
 	}
 
+	for (i = 0, loop_first = as_bits->atk_end_loop_start; i < as_bits->nloop; i++) {
+		if (pipe->attack.starts[i].start_smpl < loop_first)
+			loop_first = pipe->attack.starts[i].start_smpl;
+	}
+
 	assert(pipe->attack.ends[as_bits->nloop-1].end_smpl+1 == as_bits->length);
 	assert(pipe->attack.starts[pipe->attack.ends[as_bits->nloop-1].start_idx].start_smpl == as_bits->atk_end_loop_start);
 
@@ -656,7 +788,7 @@ load_smpl_lists
 			pipe->releases[i].ends[0].start_idx         = 0;
 
 			if (rel->load_format == 12 && channels == 2) {
-				void *buf = cop_alloc(allocator, sizeof(unsigned char) * (rel->length + release_slop + 1) * 3, 0);
+				void *buf = cop_alloc(qalloc, sizeof(unsigned char) * (rel->length + release_slop + 1) * 3, 0);
 				pipe->releases[i].gain =
 					quantize_boost_interleave
 						(buf
@@ -671,7 +803,7 @@ load_smpl_lists
 				pipe->releases[i].data = buf;
 				pipe->releases[i].instantiate = u12c2_instantiate;
 			} else if (rel->load_format == 16 && channels == 2) {
-				void *buf = cop_alloc(allocator, sizeof(int_least16_t) * (rel->length + release_slop + 1) * 2, 0);
+				void *buf = cop_alloc(qalloc, sizeof(int_least16_t) * (rel->length + release_slop + 1) * 2, 0);
 				pipe->releases[i].gain =
 					quantize_boost_interleave
 						(buf
@@ -688,11 +820,27 @@ load_smpl_lists
 			} else {
 				abort();
 			}
+
+			if (stream != NULL) {
+				const char *err =
+					smplstream_add
+						(stream
+						,&(pipe->releases[i])
+						,pipe->releases[i].data
+						,rel->length + release_slop + 1
+						,rel->length
+						,rel->load_format
+						,norm_rate
+						,allocator
+						);
+				if (err != NULL)
+					return err;
+			}
 		}
 	}
 
 	if (as_bits->load_format == 12 && channels == 2) {
-		void *buf = cop_alloc(allocator, sizeof(unsigned char) * (as_bits->length + 1) * 3, 0);
+		void *buf = cop_alloc(qalloc, sizeof(unsigned char) * (as_bits->length + 1) * 3, 0);
 		pipe->attack.gain =
 			quantize_boost_interleave
 				(buf
@@ -707,7 +855,7 @@ load_smpl_lists
 		pipe->attack.data = buf;
 		pipe->attack.instantiate = u12c2_instantiate;
 	} else if (as_bits->load_format == 16 && channels == 2) {
-		void *buf = cop_alloc(allocator, sizeof(int_least16_t) * (as_bits->length + 1) * 2, 0);
+		void *buf = cop_alloc(qalloc, sizeof(int_least16_t) * (as_bits->length + 1) * 2, 0);
 		pipe->attack.gain =
 			quantize_boost_interleave
 				(buf
@@ -725,27 +873,55 @@ load_smpl_lists
 		abort();
 	}
 
+	if (stream != NULL) {
+		const char *err =
+			smplstream_add
+				(stream
+				,&(pipe->attack)
+				,pipe->attack.data
+				,as_bits->length + 1
+				,loop_first
+				,as_bits->load_format
+				,norm_rate
+				,allocator
+				);
+		if (err != NULL)
+			return err;
+	}
+
+	stage_time = profile_stage(prof, WAVLDR_STAGE_QUANTISE, stage_time);
+
 #if 1
 	{
 		float *envelope_buf;
 		float *mse_buf;
 		unsigned env_width;
-		float relpowers[16];
-		float *powptr;
+		float relpowers[WAVLDR_MAX_RELEASES];
+		float *xcorr_bufs[WAVLDR_MAX_RELEASES];
 		unsigned ch;
-		struct odfilter             filt;
-		struct odfilter_temporaries filt_tmps;
+		const struct odfilter       *filt;
+		struct odfilter_multi        xcorr_filt;
+		struct odfilter_temporaries *filt_tmps;
 		size_t buf_stride = VLF_PAD_LENGTH(as_bits->length);
 		struct rel_data *r;
 
 		env_width    = (unsigned)(as_bits->period * 2.0f + 0.5f);
 
-		cop_mutex_lock(fft_lock);
-		odfilter_init_filter(&filt, out_alloc, fftset, env_width);
-		cop_mutex_unlock(fft_lock);
-		odfilter_init_temporaries(&filt_tmps, out_alloc, &filt);
-
-		envelope_buf = cop_alloc(out_alloc, sizeof(float) * (buf_stride * (1 + nb_releases)), 64);
+		/* The envelope kernel only depends on the period, so it is shared
+		 * with every other pipe which has the same one. */
+		if  (   (filt = filtcache_get_rect(filtcache, env_width, 1.0f / env_width)) == NULL
+		    ||  filtcache_multi_init(filtcache, &xcorr_filt, out_alloc, env_width, nb_releases)
+		    ||  filtcache_reserve_temps(filtcache, env_tmps, filt->conv_len)
+		    )
+			return "out of memory";
+		filt_tmps = &(env_tmps->tmps);
+
+		/* The power of the attack is built in mse_buf before the release
+		 * correlations are written over it, so it always needs one buffer
+		 * even if there are no releases. */
+		envelope_buf = cop_alloc(out_alloc, sizeof(float) * (buf_stride * (1 + (nb_releases ? nb_releases : 1))), 64);
+		if (envelope_buf == NULL)
+			return "out of memory";
 		mse_buf      = envelope_buf + buf_stride;
 
 		if (channels == 2) {
@@ -762,9 +938,6 @@ load_smpl_lists
 			}
 		}
 
-		/* Build the evelope kernel. */
-		odfilter_build_rect(&filt, &filt_tmps, env_width, 1.0f / env_width);
-
 		/* Get the envelope */
 		odfilter_run
 			(/* input */         mse_buf
@@ -774,40 +947,36 @@ load_smpl_lists
 			,/* total length */  as_bits->length
 			,/* pre-read */      env_width-1
 			,/* is looped */     1
-			,/* tmps */          &filt_tmps
-			,/* filter */        &filt
+			,/* tmps */          filt_tmps
+			,/* filter */        filt
 			);
 
-		r      = rel_bits;
-		powptr = relpowers;
-		while (r != NULL) {
-			/* Build the cross correlation kernel. */
-			float rel_power = 0.0f;
-			for (ch = 0; ch < channels; ch++) {
-				rel_power += odfilter_build_xcorr(&filt, &filt_tmps, env_width, r->data + ch*r->chan_stride, 1.0f / env_width);
-
-				odfilter_run
-					(as_bits->data + ch*as_bits->chan_stride
-					,mse_buf
-					,(ch != 0)
-					,as_bits->atk_end_loop_start
-					,as_bits->length
-					,env_width-1
-					,1
-					,&filt_tmps
-					,&filt
-					);
+		/* Cross correlate every release with the attack. Each channel of the
+		 * attack only gets transformed once for all of the releases. */
+		for (i = 0; i < nb_releases; i++) {
+			relpowers[i]  = 0.0f;
+			xcorr_bufs[i] = mse_buf + i * buf_stride;
+		}
+		for (ch = 0; ch < channels && nb_releases; ch++) {
+			for (i = 0, r = rel_bits; r != NULL; i++, r = r->next) {
+				/* Build the cross correlation kernel. */
+				relpowers[i] += odfilter_multi_build_xcorr(&xcorr_filt, filt_tmps, i, env_width, r->data + ch*r->chan_stride, 1.0f / env_width);
 			}
 
-			rel_power /= env_width;
-
-			*powptr  = rel_power;
-			powptr  += 1;
-			mse_buf += buf_stride;
-			r        = r->next;
+			odfilter_run_multi
+				(as_bits->data + ch*as_bits->chan_stride
+				,xcorr_bufs
+				,(ch != 0)
+				,as_bits->atk_end_loop_start
+				,as_bits->length
+				,env_width-1
+				,1
+				,filt_tmps
+				,&xcorr_filt
+				);
 		}
-
-		mse_buf      = envelope_buf + buf_stride;
+		for (i = 0; i < nb_releases; i++)
+			relpowers[i] /= env_width;
 
 #if OPENDIAPASON_VERBOSE_DEBUG
 		if (strlen(file_ref) < 1024 - 50) {
@@ -821,7 +990,12 @@ load_smpl_lists
 		}
 #endif
 
-		reltable_build(&pipe->reltable, envelope_buf, mse_buf, relpowers, nb_releases, buf_stride, as_bits->length, as_bits->period, file_ref);
+		stage_time = profile_stage(prof, WAVLDR_STAGE_ENVELOPE, stage_time);
+
+		if (reltable_build(&pipe->reltable, envelope_buf, mse_buf, relpowers, nb_releases, buf_stride, as_bits->length, as_bits->period, file_ref))
+			return "out of memory";
+
+		(void)profile_stage(prof, WAVLDR_STAGE_RELTABLE, stage_time);
 	}
 #endif
 
@@ -844,10 +1018,13 @@ load_smpl_comp
 	,struct cop_salloc_iface     *tls1 /* empty */
 	,struct cop_salloc_iface     *tls2 /* memory wave */
 	,struct cop_alloc_iface      *allocator
-	,struct fftset               *fftset
-	,cop_mutex                   *fft_lock
+	,struct filtcache            *filtcache
+	,struct filtcache_temps      *env_tmps
 	,const struct odfilter       *prefilter
 	,struct odfilter_temporaries *tmps
+	,struct wavldr               *splitter
+	,struct smplstream           *stream
+	,struct wavldr_profile       *prof
 	,const char                  *debug_id
 	)
 {
@@ -900,10 +1077,13 @@ load_smpl_comp
 				,mw[0].rate
 				,&(tls1->iface)
 				,allocator
-				,fftset
-				,fft_lock
+				,filtcache
+				,env_tmps
 				,prefilter
 				,tmps
+				,splitter
+				,stream
+				,prof
 				,debug_id
 				);
 	}
@@ -918,6 +1098,17 @@ int wavldr_initialise(struct wavldr *load_set)
 	load_set->max_nb_elems = LOAD_SET_GROW_RATE;
 	load_set->nb_elems = 0;
 	load_set->cur_elem = 0;
+	load_set->stream = NULL;
+	load_set->mode = WAVLDR_MODE_ALL;
+	load_set->callback = NULL;
+	load_set->callback_ctx = NULL;
+	load_set->elem_status = NULL;
+	load_set->profile_file = NULL;
+	load_set->split_length = 0;
+	load_set->nb_profiled = 0;
+	load_set->begin_ns = 0;
+	load_set->end_ns = 0;
+	memset(&(load_set->profile), 0, sizeof(load_set->profile));
 	load_set->elems = malloc(sizeof(struct sample_load_info) * load_set->max_nb_elems);
 	if (load_set->elems == NULL)
 		return -1;
@@ -938,20 +1129,48 @@ struct sample_load_info *wavldr_add_sample(struct wavldr *load_set)
 	struct sample_load_info *ns;
 	unsigned new_ele_count;
 
-	if (load_set->nb_elems < load_set->max_nb_elems)
-		return load_set->elems + load_set->nb_elems++;
+	if (load_set->nb_elems >= load_set->max_nb_elems) {
+		assert(load_set->nb_elems == load_set->max_nb_elems);
 
-	assert(load_set->nb_elems == load_set->max_nb_elems);
+		new_ele_count = load_set->max_nb_elems + LOAD_SET_GROW_RATE;
+		ns = realloc(load_set->elems, sizeof(struct sample_load_info) * new_ele_count);
+		if (ns == NULL)
+			return NULL;
 
-	new_ele_count = load_set->max_nb_elems + LOAD_SET_GROW_RATE;
-	ns = realloc(load_set->elems, sizeof(struct sample_load_info) * new_ele_count);
-	if (ns != NULL) {
 		load_set->elems = ns;
 		load_set->max_nb_elems = new_ele_count;
-		return load_set->elems + load_set->nb_elems++;
 	}
 
-	return NULL;
+	ns = load_set->elems + load_set->nb_elems++;
+	ns->group     = 0;
+	ns->allocator = NULL;
+	return ns;
+}
+
+void wavldr_set_mode(struct wavldr *load_set, unsigned mode)
+{
+	load_set->mode = mode;
+}
+
+void wavldr_set_callback(struct wavldr *load_set, wavldr_loaded_callback callback, void *context)
+{
+	load_set->callback     = callback;
+	load_set->callback_ctx = context;
+}
+
+void wavldr_set_stream(struct wavldr *load_set, struct smplstream *stream)
+{
+	load_set->stream = stream;
+}
+
+void wavldr_set_split_length(struct wavldr *load_set, unsigned long min_length)
+{
+	load_set->split_length = min_length;
+}
+
+void wavldr_set_profile_file(struct wavldr *load_set, const char *filename)
+{
+	load_set->profile_file = filename;
 }
 
 static void *load_file_to_memory(const char *fname, struct cop_alloc_iface *mem, size_t *pfsz)
@@ -978,33 +1197,252 @@ static void *load_file_to_memory(const char *fname, struct cop_alloc_iface *mem,
 	return NULL;
 }
 
+#define WAVLDR_ELEM_QUEUED    (0)
+#define WAVLDR_ELEM_REQUESTED (1)
+#define WAVLDR_ELEM_LOADING   (2)
+#define WAVLDR_ELEM_DONE      (3)
+#define WAVLDR_ELEM_WAITING   (4)
+#define WAVLDR_ELEM_FAILED    (5)
+
+/* Two samples share their data if their inputs are identical. */
+static int same_inputs(const struct sample_load_info *a, const struct sample_load_info *b)
+{
+	unsigned i;
+	if (a->num_files != b->num_files || a->load_format != b->load_format)
+		return 0;
+	for (i = 0; i < a->num_files; i++)
+		if (a->load_flags[i] != b->load_flags[i] || strcmp(a->filenames[i], b->filenames[i]))
+			return 0;
+	return 1;
+}
+
+/* 64-bit FNV-1a */
+#define FNV_OFFSET_BASIS (UINT64_C(14695981039346656037))
+#define FNV_PRIME        (UINT64_C(1099511628211))
+
+static uint_fast64_t fnv1a(uint_fast64_t h, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	size_t i;
+	for (i = 0; i < size; i++)
+		h = ((h ^ p[i]) * FNV_PRIME) & UINT64_C(0xFFFFFFFFFFFFFFFF);
+	return h;
+}
+
+static uint_fast64_t hash_inputs(const struct sample_load_info *li)
+{
+	uint_fast64_t h = FNV_OFFSET_BASIS;
+	unsigned i;
+	h = fnv1a(h, &(li->num_files), sizeof(li->num_files));
+	h = fnv1a(h, &(li->load_format), sizeof(li->load_format));
+	for (i = 0; i < li->num_files; i++) {
+		h = fnv1a(h, &(li->load_flags[i]), sizeof(li->load_flags[i]));
+		h = fnv1a(h, li->filenames[i], strlen(li->filenames[i]) + 1);
+	}
+	return h;
+}
+
+/* Find the primary of every sample using an open-addressed hash table.
+ * Returns non-zero if out of memory. */
+static int find_shared(struct wavldr *ls)
+{
+	unsigned  table_size = 1;
+	unsigned *table;
+	unsigned  i;
+
+	while (table_size < 2 * ls->nb_elems)
+		table_size *= 2;
+
+	table = malloc(sizeof(*table) * table_size);
+	if (table == NULL)
+		return -1;
+
+	for (i = 0; i < table_size; i++)
+		table[i] = ls->nb_elems;
+
+	for (i = 0; i < ls->nb_elems; i++) {
+		unsigned slot = (unsigned)(hash_inputs(ls->elems + i) & (table_size - 1));
+		while (table[slot] != ls->nb_elems && !same_inputs(ls->elems + table[slot], ls->elems + i))
+			slot = (slot + 1) & (table_size - 1);
+		if (table[slot] == ls->nb_elems)
+			table[slot] = i;
+		ls->elem_status[i].primary     = table[slot];
+		ls->elem_status[i].waiters     = ls->nb_elems;
+		ls->elem_status[i].next_waiter = ls->nb_elems;
+	}
+
+	free(table);
+	return 0;
+}
+
+/* Give a sample the data of its primary which has finished loading. Must be
+ * called with the state lock held. */
+static void share_primary(struct wavldr *ls, unsigned idx)
+{
+	unsigned primary = ls->elem_status[idx].primary;
+	*(ls->elems[idx].dest)         = *(ls->elems[primary].dest);
+	ls->elem_status[idx].state     = WAVLDR_ELEM_DONE;
+	ls->nb_done++;
+	ls->nb_shared++;
+	ls->bytes_saved += ls->elem_status[primary].profile.data_bytes;
+}
+
+/* Record that a sample (and every sample waiting for it to finish) could not
+ * be loaded. Only used in ON_DEMAND mode, where a bad file must not stop the
+ * loader from serving requests for other groups. The samples are counted as
+ * done so that progress can still reach zero. Must be called with the state
+ * lock held. */
+static void fail_sample(struct wavldr *ls, unsigned idx, const char *err)
+{
+	unsigned i;
+	ls->elem_status[idx].state = WAVLDR_ELEM_FAILED;
+	ls->elem_status[idx].error = err;
+	ls->nb_done++;
+	for (i = ls->elem_status[idx].waiters; i < ls->nb_elems; i = ls->elem_status[i].next_waiter) {
+		ls->elem_status[i].state = WAVLDR_ELEM_FAILED;
+		ls->elem_status[i].error = err;
+		ls->nb_done++;
+	}
+}
+
+/* Find the next sample which should be loaded. Must be called with the state
+ * lock held. Returns nb_elems if there is nothing to do right now. Requested
+ * samples always go first (most recent request first). If we are loading
+ * everything, continue on from where we were up to. */
+static unsigned loader_next(struct wavldr *load_state)
+{
+	unsigned i;
+	unsigned best = load_state->nb_elems;
+
+	if (load_state->nb_requested != 0) {
+		for (i = 0; i < load_state->nb_elems; i++) {
+			if  (   load_state->elem_status[i].state == WAVLDR_ELEM_REQUESTED
+			    &&  (   best == load_state->nb_elems
+			        ||  load_state->elem_status[i].request_seq > load_state->elem_status[best].request_seq
+			        )
+			    ) {
+				best = i;
+			}
+		}
+		if (best != load_state->nb_elems)
+			return best;
+	}
+
+	if (load_state->mode == WAVLDR_MODE_ALL) {
+		while (load_state->cur_elem < load_state->nb_elems && load_state->elem_status[load_state->cur_elem].state != WAVLDR_ELEM_QUEUED)
+			load_state->cur_elem++;
+		best = load_state->cur_elem;
+	}
+
+	return best;
+}
+
 /* This function returns NULL if either an error condition is active in the
- * loader state OR if there are no more samples to load. If an error occurs
- * in this function and the error state was not already set, the error will
- * indicate what went wrong in here. */
+ * loader state OR if there are no more samples to load. If the files of the
+ * returned sample could not be read, *read_error is set and the caller must
+ * treat the sample as failed. In ON_DEMAND mode, this blocks until something
+ * is requested or the loader is closed. While there is nothing to load, the
+ * thread helps with split prefilter jobs using tmps. */
 static struct sample_load_info *
 loader_pop
-	(struct wavldr *load_state
-	,struct cop_alloc_iface *mem
-	,struct smpl_comp       *comps
+	(struct wavldr               *load_state
+	,struct cop_alloc_iface      *mem
+	,struct smpl_comp            *comps
+	,struct wavldr_profile       *prof
+	,int                         *shared
+	,struct odfilter_temporaries *tmps
+	,const char                 **read_error
 	)
 {
 	struct sample_load_info *ret;
 
+	*shared     = 0;
+	*read_error = NULL;
+
 	cop_mutex_lock(&(load_state->state_lock));
-	if (load_state->error == NULL && load_state->cur_elem < load_state->nb_elems) {
-		ret = load_state->elems + load_state->cur_elem++;
-	} else {
-		ret = NULL;
+	for (;;) {
+		unsigned idx;
+
+		if (load_state->error != NULL) {
+			ret = NULL;
+			break;
+		}
+
+		idx = loader_next(load_state);
+		if (idx < load_state->nb_elems) {
+			struct wavldr_elem *es      = load_state->elem_status;
+			unsigned            primary = es[idx].primary;
+
+			if (primary == idx) {
+				es[idx].state = WAVLDR_ELEM_LOADING;
+				load_state->nb_busy++;
+				ret = load_state->elems + idx;
+				break;
+			}
+
+			if (es[primary].state == WAVLDR_ELEM_DONE) {
+				/* Nothing to load. The caller only needs to run the
+				 * callback. */
+				share_primary(load_state, idx);
+				ret     = load_state->elems + idx;
+				*shared = 1;
+				break;
+			}
+
+			if (es[primary].state == WAVLDR_ELEM_FAILED) {
+				/* The same files have already failed to load. */
+				fail_sample(load_state, idx, es[primary].error);
+				continue;
+			}
+
+			/* Wait for the primary to finish. If nobody has started loading
+			 * it yet, do it now. */
+			es[idx].state       = WAVLDR_ELEM_WAITING;
+			es[idx].next_waiter = es[primary].waiters;
+			es[primary].waiters = idx;
+
+			if (es[primary].state == WAVLDR_ELEM_QUEUED || es[primary].state == WAVLDR_ELEM_REQUESTED) {
+				/* The primary is now effectively requested. */
+				if (es[primary].state == WAVLDR_ELEM_QUEUED)
+					load_state->nb_requested++;
+				es[primary].state = WAVLDR_ELEM_LOADING;
+				load_state->nb_busy++;
+				ret = load_state->elems + primary;
+				break;
+			}
+
+			continue;
+		}
+
+		if (load_state->split_jobs != NULL) {
+			split_work(load_state, load_state->split_jobs, tmps);
+			continue;
+		}
+
+		/* When splitting is enabled, stay around until everyone else has
+		 * finished in case they have something to share. */
+		if  (   (load_state->mode != WAVLDR_MODE_ON_DEMAND || load_state->closing)
+		    &&  (load_state->split_length == 0 || load_state->nb_busy == 0)
+		    ) {
+			ret = NULL;
+			break;
+		}
+
+		cop_cond_wait(&(load_state->work_cond), &(load_state->state_lock));
 	}
 	cop_mutex_unlock(&(load_state->state_lock));
 
-	if (ret != NULL) {
+	if (ret != NULL && !*shared) {
 		unsigned i;
+		uint_fast64_t stage_time;
 
 		assert(ret->num_files <= 1+WAVLDR_MAX_RELEASES);
 
+		memset(prof, 0, sizeof(*prof));
+		stage_time = profile_now_ns();
+
 		cop_mutex_lock(&(load_state->read_lock));
+		stage_time = profile_stage(prof, WAVLDR_STAGE_READ_WAIT, stage_time);
 		for (i = 0; i < ret->num_files; i++) {
 			comps[i].filename    = ret->filenames[i];
 			comps[i].load_flags  = ret->load_flags[i];
@@ -1012,21 +1450,35 @@ loader_pop
 			comps[i].data        = load_file_to_memory(ret->filenames[i], mem, &(comps[i].size));
 			if (comps[i].data == NULL)
 				break;
+			prof->bytes_read += comps[i].size;
 		}
 		cop_mutex_unlock(&(load_state->read_lock));
+		(void)profile_stage(prof, WAVLDR_STAGE_READ, stage_time);
 
-		if (i != ret->num_files) {
-			cop_mutex_lock(&(load_state->state_lock));
-			if (load_state->error == NULL)
-				load_state->error = "failed to read a file to memory";
-			cop_mutex_unlock(&(load_state->state_lock));
-			ret = NULL;
-		}
+		if (i != ret->num_files)
+			*read_error = "failed to read a file to memory";
 	}
 
 	return ret;
 }
 
+/* Wraps the allocator used for playback data to find out how much memory
+ * each sample uses. */
+struct counting_alloc {
+	struct cop_alloc_iface  iface;
+	struct cop_alloc_iface *inner;
+	uint_fast64_t           bytes;
+};
+
+static void *counting_alloc_alloc(struct cop_alloc_iface *a, size_t size, size_t align)
+{
+	struct counting_alloc *ca = a->ctx;
+	void *ret = cop_alloc(ca->inner, size, align);
+	if (ret != NULL)
+		ca->bytes += size;
+	return ret;
+}
+
 static void *loader_thread_proc(void *argument)
 {
 	struct loader_thread_state *ts = argument;
@@ -1034,39 +1486,102 @@ static void *loader_thread_proc(void *argument)
 	struct smpl_comp            comps[1+WAVLDR_MAX_RELEASES];
 	size_t                      if1_reset, if2_reset;
 	const char                 *err = NULL;
+	struct wavldr_profile       prof;
+	int                         shared;
+	int                         failed;
 
 	if1_reset = cop_salloc_save(&(ts->if1));
 	if2_reset = cop_salloc_save(&(ts->if2));
 
-	while ((li = loader_pop(ts->lstate, &(ts->if1.iface), comps)) != NULL) {
-		unsigned i;
-		struct memory_wave *mw = cop_salloc(&(ts->if2), sizeof(*mw) * li->num_files, 0);
-		if (mw == NULL)
+	while ((li = loader_pop(ts->lstate, &(ts->if1.iface), comps, &prof, &shared, &(ts->tmps), &err)) != NULL) {
+		unsigned i, waiter;
+		uint_fast64_t stage_time;
+		struct memory_wave *mw = NULL;
+		struct counting_alloc data_alloc;
+
+		if (shared) {
+			if (ts->lstate->callback != NULL)
+				ts->lstate->callback(ts->lstate->callback_ctx, li);
+			continue;
+		}
+
+		stage_time             = profile_now_ns();
+		data_alloc.iface.ctx   = &data_alloc;
+		data_alloc.iface.alloc = counting_alloc_alloc;
+		data_alloc.inner       = (li->allocator != NULL) ? li->allocator : &(ts->lstate->allocator);
+		data_alloc.bytes       = 0;
+
+		if (err == NULL && (mw = cop_salloc(&(ts->if2), sizeof(*mw) * li->num_files, 0)) == NULL)
 			err = "out of memory";
 
 		/* Load contributing samples. */
 		for (i = 0; i < li->num_files && err == NULL; i++)
 			err = load_smpl_mem(mw + i, &(ts->if2.iface), comps[i].data, comps[i].size, comps[i].load_format);
 
+		(void)profile_stage(&prof, WAVLDR_STAGE_DECODE, stage_time);
+		prof.peak_arena = (cop_salloc_save(&(ts->if1)) - if1_reset) + (cop_salloc_save(&(ts->if2)) - if2_reset);
+
 		if (err == NULL) {
+			size_t arena;
+
 			/* The memory wave data has been loaded into if2. if1 contained the
 			 * raw file data and can be reset now. */
 			cop_salloc_restore(&(ts->if1), if1_reset);
 
 			/* At this point: if1 is empty, if2 contains the memory wave. */
-			err = load_smpl_comp(li->dest, mw, li->num_files, &(ts->if1), &(ts->if2), &(ts->lstate->allocator), ts->lstate->fftset, &(ts->lstate->state_lock), ts->lstate->prefilter, &(ts->tmps), li->filenames[0]);
+			err = load_smpl_comp(li->dest, mw, li->num_files, &(ts->if1), &(ts->if2), &(data_alloc.iface), &(ts->lstate->filtcache), &(ts->env_tmps), ts->lstate->prefilter, &(ts->tmps), ts->lstate, ts->lstate->stream, &prof, li->filenames[0]);
 
-			cop_salloc_restore(&(ts->if1), if1_reset);
-			cop_salloc_restore(&(ts->if2), if2_reset);
+			/* Nothing is released from the arenas during processing, so this is
+			 * the most they held. */
+			arena = (cop_salloc_save(&(ts->if1)) - if1_reset) + (cop_salloc_save(&(ts->if2)) - if2_reset);
+			if (arena > prof.peak_arena)
+				prof.peak_arena = arena;
 		}
 
+		cop_salloc_restore(&(ts->if1), if1_reset);
+		cop_salloc_restore(&(ts->if2), if2_reset);
+
+		prof.data_bytes = data_alloc.bytes;
+		waiter          = ts->lstate->nb_elems;
+		failed          = 0;
+
 		cop_mutex_lock(&(ts->lstate->state_lock));
+		ts->lstate->nb_busy--;
+		if (ts->lstate->split_length != 0)
+			cop_cond_broadcast(&(ts->lstate->work_cond));
+		if (err == NULL) {
+			struct wavldr_profile *total = &(ts->lstate->profile);
+			struct wavldr_elem    *es    = ts->lstate->elem_status + (li - ts->lstate->elems);
+			es->state   = WAVLDR_ELEM_DONE;
+			es->profile = prof;
+			ts->lstate->nb_done++;
+			for (i = 0; i < WAVLDR_NB_STAGES; i++)
+				total->stage_ns[i] += prof.stage_ns[i];
+			total->bytes_read += prof.bytes_read;
+			total->data_bytes += prof.data_bytes;
+			if (prof.peak_arena > total->peak_arena)
+				total->peak_arena = prof.peak_arena;
+			ts->lstate->nb_profiled++;
+
+			/* Nothing else can be added to the waiter list now that we are
+			 * done, so it can be walked again without the lock. */
+			waiter = es->waiters;
+			for (i = waiter; i < ts->lstate->nb_elems; i = ts->lstate->elem_status[i].next_waiter)
+				share_primary(ts->lstate, i);
+		}
 		if (ts->lstate->error != NULL) {
 			/* If the loader error flag is already set, set our local error
 			 * variable to whatever it is. It doesn't matter what the error
 			 * is, all that matters is that it is not NULL for the checks
 			 * below. */
 			err = ts->lstate->error;
+		} else if (err != NULL && ts->lstate->mode == WAVLDR_MODE_ON_DEMAND) {
+			/* Only this sample (and anything sharing its files) is lost.
+			 * The error is reported through wavldr_query_group_error() and
+			 * wavldr_finish(). */
+			fail_sample(ts->lstate, (unsigned)(li - ts->lstate->elems), err);
+			failed = 1;
+			err    = NULL;
 		} else if (err != NULL) {
 			/* The loader error flag is not set, but something in this thread
 			 * buggered up. Store the loader error flag this will cause the
@@ -1078,6 +1593,20 @@ static void *loader_thread_proc(void *argument)
 		/* If there was a local error or loader error, bomb out now. */
 		if (err != NULL)
 			break;
+
+		if (!failed && ts->lstate->callback != NULL) {
+			ts->lstate->callback(ts->lstate->callback_ctx, li);
+			for (; waiter < ts->lstate->nb_elems; waiter = ts->lstate->elem_status[waiter].next_waiter)
+				ts->lstate->callback(ts->lstate->callback_ctx, ts->lstate->elems + waiter);
+		}
+	}
+
+	/* Wake up anyone who is sleeping in loader_pop() so they can see the
+	 * error. */
+	if (err != NULL) {
+		cop_mutex_lock(&(ts->lstate->state_lock));
+		cop_cond_broadcast(&(ts->lstate->work_cond));
+		cop_mutex_unlock(&(ts->lstate->state_lock));
 	}
 
 	return NULL;
@@ -1086,6 +1615,7 @@ static void *loader_thread_proc(void *argument)
 static int init_thread_state(struct loader_thread_state *ts, struct wavldr *ls)
 {
 	ts->lstate = ls;
+	ts->env_tmps.conv_len = 0;
 	if (cop_alloc_grp_temps_init(&(ts->if1_impl), &(ts->if1), 16 * 1024 * 1024, 0, 16))
 		return -1;
 	if (cop_alloc_grp_temps_init(&(ts->if2_impl), &(ts->if2), 16 * 1024 * 1024, 0, 16)) {
@@ -1128,13 +1658,51 @@ wavldr_begin_load
 	load_set->prefilter           = prefilter;
 	load_set->error               = NULL;
 	load_set->nb_threads          = nb_threads;
+	load_set->nb_done             = 0;
+	load_set->nb_requested        = 0;
+	load_set->request_seq         = 0;
+	load_set->closing             = 0;
+	load_set->split_jobs          = NULL;
+	load_set->nb_busy             = 0;
+	load_set->nb_profiled         = 0;
+	load_set->nb_shared           = 0;
+	load_set->bytes_saved         = 0;
+	load_set->begin_ns            = profile_now_ns();
+	load_set->end_ns              = 0;
+	memset(&(load_set->profile), 0, sizeof(load_set->profile));
 
 	assert(nb_threads <= WAVLDR_MAX_LOAD_THREADS);
 
-	if (cop_mutex_create(&(load_set->state_lock)))
+	load_set->elem_status = calloc(load_set->nb_elems ? load_set->nb_elems : 1, sizeof(load_set->elem_status[0]));
+	if (load_set->elem_status == NULL)
+		return "out of memory";
+
+	if (find_shared(load_set)) {
+		free(load_set->elem_status);
+		load_set->elem_status = NULL;
+		return "out of memory";
+	}
+
+	if (cop_mutex_create(&(load_set->state_lock))) {
+		free(load_set->elem_status);
 		return "could not create lock";
+	}
 	if (cop_mutex_create(&(load_set->read_lock))) {
 		cop_mutex_destroy(&(load_set->state_lock));
+		free(load_set->elem_status);
+		return "could not create lock";
+	}
+	if (cop_cond_create(&(load_set->work_cond))) {
+		cop_mutex_destroy(&(load_set->read_lock));
+		cop_mutex_destroy(&(load_set->state_lock));
+		free(load_set->elem_status);
+		return "could not create condition";
+	}
+	if (filtcache_init(&(load_set->filtcache), &(load_set->allocator), fftset)) {
+		cop_cond_destroy(&(load_set->work_cond));
+		cop_mutex_destroy(&(load_set->read_lock));
+		cop_mutex_destroy(&(load_set->state_lock));
+		free(load_set->elem_status);
 		return "could not create lock";
 	}
 
@@ -1148,8 +1716,11 @@ wavldr_begin_load
 			cop_alloc_grp_temps_free(&(load_set->thread_states[i].if1_impl));
 			cop_alloc_grp_temps_free(&(load_set->thread_states[i].if2_impl));
 		}
+		filtcache_destroy(&(load_set->filtcache));
+		cop_cond_destroy(&(load_set->work_cond));
 		cop_mutex_destroy(&(load_set->read_lock));
 		cop_mutex_destroy(&(load_set->state_lock));
+		free(load_set->elem_status);
 		return "out of memory";
 	}
 
@@ -1164,9 +1735,9 @@ int wavldr_query_progress(struct wavldr *ls, unsigned *nb_samples)
 	unsigned total;
 	unsigned remaining;
 	cop_mutex_lock(&(ls->state_lock));
-	total     = ls->nb_elems;
-	if (ls->error == NULL) {
-		remaining = total - ls->cur_elem;
+	total     = (ls->mode == WAVLDR_MODE_ON_DEMAND) ? ls->nb_requested : ls->nb_elems;
+	if (ls->error == NULL && total > ls->nb_done) {
+		remaining = total - ls->nb_done;
 	} else {
 		remaining = 0;
 	}
@@ -1176,9 +1747,160 @@ int wavldr_query_progress(struct wavldr *ls, unsigned *nb_samples)
 	return remaining;
 }
 
+void wavldr_request_group(struct wavldr *ls, unsigned group)
+{
+	unsigned i;
+	int      found = 0;
+
+	cop_mutex_lock(&(ls->state_lock));
+	ls->request_seq++;
+	for (i = 0; i < ls->nb_elems; i++) {
+		if (ls->elems[i].group != group)
+			continue;
+		if (ls->elem_status[i].state == WAVLDR_ELEM_QUEUED) {
+			ls->elem_status[i].state = WAVLDR_ELEM_REQUESTED;
+			ls->nb_requested++;
+			found = 1;
+		}
+		if (ls->elem_status[i].state == WAVLDR_ELEM_REQUESTED)
+			ls->elem_status[i].request_seq = ls->request_seq;
+	}
+	if (found)
+		cop_cond_broadcast(&(ls->work_cond));
+	cop_mutex_unlock(&(ls->state_lock));
+}
+
+void wavldr_cancel(struct wavldr *ls)
+{
+	unsigned i;
+
+	cop_mutex_lock(&(ls->state_lock));
+	for (i = 0; i < ls->nb_elems; i++) {
+		if (ls->elem_status[i].state == WAVLDR_ELEM_REQUESTED) {
+			ls->elem_status[i].state = WAVLDR_ELEM_QUEUED;
+			ls->nb_requested--;
+		}
+	}
+	ls->mode    = WAVLDR_MODE_ON_DEMAND;
+	ls->closing = 1;
+	cop_cond_broadcast(&(ls->work_cond));
+	cop_mutex_unlock(&(ls->state_lock));
+}
+
+unsigned wavldr_query_group(struct wavldr *ls, unsigned group)
+{
+	unsigned i;
+	unsigned remaining = 0;
+
+	cop_mutex_lock(&(ls->state_lock));
+	for (i = 0; i < ls->nb_elems; i++) {
+		if (ls->elems[i].group == group && ls->elem_status[i].state != WAVLDR_ELEM_DONE)
+			remaining++;
+	}
+	cop_mutex_unlock(&(ls->state_lock));
+
+	return remaining;
+}
+
+const char *wavldr_query_group_error(struct wavldr *ls, unsigned group)
+{
+	unsigned i;
+	const char *err = NULL;
+
+	cop_mutex_lock(&(ls->state_lock));
+	for (i = 0; i < ls->nb_elems && err == NULL; i++) {
+		if (ls->elems[i].group == group)
+			err = ls->elem_status[i].error;
+	}
+	cop_mutex_unlock(&(ls->state_lock));
+
+	return err;
+}
+
+const char *wavldr_stage_name(unsigned stage)
+{
+	static const char *NAMES[WAVLDR_NB_STAGES] =
+		{"read_wait"
+		,"read"
+		,"decode"
+		,"prefilter"
+		,"quantise"
+		,"envelope"
+		,"reltable"
+		};
+	return (stage < WAVLDR_NB_STAGES) ? NAMES[stage] : "unknown";
+}
+
+static void write_json_string(FILE *f, const char *str)
+{
+	fputc('"', f);
+	for (; *str != '\0'; str++) {
+		unsigned char c = (unsigned char)*str;
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+static void write_json_profile(FILE *f, const struct wavldr_profile *prof)
+{
+	unsigned i;
+	fprintf(f, "\"stage_ns\": {");
+	for (i = 0; i < WAVLDR_NB_STAGES; i++)
+		fprintf(f, "%s\"%s\": %llu", i ? ", " : "", wavldr_stage_name(i), (unsigned long long)prof->stage_ns[i]);
+	fprintf(f, "}, \"bytes_read\": %llu, \"peak_arena\": %llu, \"data_bytes\": %llu", (unsigned long long)prof->bytes_read, (unsigned long long)prof->peak_arena, (unsigned long long)prof->data_bytes);
+}
+
+/* Called by wavldr_finish() once all the loader threads have stopped. Errors
+ * writing the profile do not affect the load. */
+static void write_profile(struct wavldr *ls)
+{
+	FILE *f = fopen(ls->profile_file, "w");
+	unsigned i;
+	int first = 1;
+	unsigned long cache_hits, cache_misses;
+
+	if (f == NULL) {
+		fprintf(stderr, "could not create load profile '%s'\n", ls->profile_file);
+		return;
+	}
+
+	filtcache_query(&(ls->filtcache), &cache_hits, &cache_misses);
+
+	fprintf(f, "{\n\"wall_ns\": %llu,\n\"threads\": %u,\n\"samples_loaded\": %u,\n\"samples_shared\": %u,\n\"bytes_saved\": %llu,\n\"filter_cache_hits\": %lu,\n\"filter_cache_misses\": %lu,\n\"total\": {", (unsigned long long)(ls->end_ns - ls->begin_ns), ls->nb_threads, ls->nb_profiled, ls->nb_shared, (unsigned long long)ls->bytes_saved, cache_hits, cache_misses);
+	write_json_profile(f, &(ls->profile));
+	fprintf(f, "},\n\"samples\": [");
+	for (i = 0; i < ls->nb_elems; i++) {
+		if (ls->elem_status[i].state != WAVLDR_ELEM_DONE)
+			continue;
+		fprintf(f, "%s\n  {\"index\": %u, \"group\": %u, \"file\": ", first ? "" : ",", i, ls->elems[i].group);
+		write_json_string(f, ls->elems[i].filenames[0]);
+		if (ls->elem_status[i].primary != i) {
+			fprintf(f, ", \"shared_with\": %u}", ls->elem_status[i].primary);
+		} else {
+			fprintf(f, ", ");
+			write_json_profile(f, &(ls->elem_status[i].profile));
+			fprintf(f, "}");
+		}
+		first = 0;
+	}
+	fprintf(f, "\n]\n}\n");
+	fclose(f);
+}
+
 const char *wavldr_finish(struct wavldr *load_set)
 {
 	unsigned i;
+	const char *err;
+
+	cop_mutex_lock(&(load_set->state_lock));
+	load_set->closing = 1;
+	cop_cond_broadcast(&(load_set->work_cond));
+	cop_mutex_unlock(&(load_set->state_lock));
 
 	for (i = 0; i < load_set->nb_threads; i++) {
 		cop_thread_join(load_set->thread_states[i].thread_handle, NULL);
@@ -1186,10 +1908,73 @@ const char *wavldr_finish(struct wavldr *load_set)
 		cop_alloc_grp_temps_free(&(load_set->thread_states[i].if2_impl));
 	}
 
+	load_set->end_ns = profile_now_ns();
+
+	if (load_set->profile_file != NULL)
+		write_profile(load_set);
+
+	/* Samples which failed in ON_DEMAND mode did not stop the load, but the
+	 * load still failed. */
+	err = load_set->error;
+	for (i = 0; i < load_set->nb_elems && err == NULL; i++)
+		err = load_set->elem_status[i].error;
+
+	filtcache_destroy(&(load_set->filtcache));
+	cop_cond_destroy(&(load_set->work_cond));
 	cop_mutex_destroy(&(load_set->read_lock));
 	cop_mutex_destroy(&(load_set->state_lock));
+	free(load_set->elem_status);
+	load_set->elem_status = NULL;
+
+	return err;
+}
+
+void
+wavldr_query_profile
+	(struct wavldr         *ls
+	,struct wavldr_profile *total
+	,unsigned              *nb_loaded
+	,uint_fast64_t         *wall_ns
+	)
+{
+	/* The state lock does not exist after wavldr_finish() but nothing can
+	 * change the profile at that point either. */
+	int locked = (ls->elem_status != NULL);
+	if (locked)
+		cop_mutex_lock(&(ls->state_lock));
+	if (total != NULL)
+		*total = ls->profile;
+	if (nb_loaded != NULL)
+		*nb_loaded = ls->nb_profiled;
+	if (wall_ns != NULL)
+		*wall_ns = (ls->end_ns ? ls->end_ns : profile_now_ns()) - ls->begin_ns;
+	if (locked)
+		cop_mutex_unlock(&(ls->state_lock));
+}
 
-	return load_set->error;
+void wavldr_query_sharing(struct wavldr *ls, unsigned *nb_shared, uint_fast64_t *bytes_saved)
+{
+	int locked = (ls->elem_status != NULL);
+	if (locked)
+		cop_mutex_lock(&(ls->state_lock));
+	if (nb_shared != NULL)
+		*nb_shared = ls->nb_shared;
+	if (bytes_saved != NULL)
+		*bytes_saved = ls->bytes_saved;
+	if (locked)
+		cop_mutex_unlock(&(ls->state_lock));
+}
+
+int wavldr_query_sample_profile(struct wavldr *ls, unsigned index, struct wavldr_profile *profile)
+{
+	int ret = -1;
+	cop_mutex_lock(&(ls->state_lock));
+	if (index < ls->nb_elems && ls->elem_status[index].state == WAVLDR_ELEM_DONE) {
+		*profile = ls->elem_status[index].profile;
+		ret      = 0;
+	}
+	cop_mutex_unlock(&(ls->state_lock));
+	return ret;
 }
 
 
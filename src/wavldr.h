@@ -22,7 +22,9 @@
 #define WAVELDR_H
 
 #include "decode_types.h"
+#include "filtcache.h"
 #include "reltable.h"
+#include "smplstream.h"
 #include "cop/cop_alloc.h"
 #include "cop/cop_thread.h"
 #include "fftset/fftset.h"
@@ -72,6 +74,68 @@ struct sample_load_info {
 	unsigned                 harmonic_number;
 	unsigned                 load_format;
 	struct pipe_v1          *dest;
+
+	/* Samples are requested in groups (e.g. all the pipes of one rank). The
+	 * value is only used by wavldr_request_group(). */
+	unsigned                 group;
+
+	/* If not NULL, the decoded sample data is allocated from this instead of
+	 * the allocator given to wavldr_initialise(). It must be safe to call
+	 * from multiple threads at once. wavldr_add_sample() sets this to
+	 * NULL. */
+	struct cop_alloc_iface  *allocator;
+};
+
+/* Load modes passed to wavldr_set_mode().
+ *
+ *   ALL       - every sample is loaded. Samples belonging to groups passed to
+ *               wavldr_request_group() are loaded first. This is the
+ *               default.
+ *   ON_DEMAND - only samples belonging to groups passed to
+ *               wavldr_request_group() are loaded. The loader threads sleep
+ *               until something is requested or wavldr_finish() is
+ *               called. A sample which fails to load does not stop the
+ *               loader; see wavldr_query_group_error().
+ *
+ * In ALL mode, the first sample to fail stops the whole load. */
+#define WAVLDR_MODE_ALL       (0)
+#define WAVLDR_MODE_ON_DEMAND (1)
+
+/* Called from a loader thread every time a sample has been loaded
+ * successfully. Once this has been called, the pipe_v1 of the sample can be
+ * used by any thread which has observed the call. */
+typedef void (*wavldr_loaded_callback)(void *context, struct sample_load_info *sample);
+
+/* Stages of loading a sample which are timed by the loader.
+ *
+ *   READ_WAIT - waiting for another thread to finish reading files.
+ *   READ      - reading the files of the sample into memory.
+ *   DECODE    - parsing the wave files and converting them to floats.
+ *   PREFILTER - running the interpolation pre-filter over the audio.
+ *   QUANTISE  - dithering and quantising the audio (and writing it to the
+ *               stream bank if streaming is enabled).
+ *   ENVELOPE  - building the envelope and release correlation signals.
+ *   RELTABLE  - building the release alignment table. */
+#define WAVLDR_STAGE_READ_WAIT (0)
+#define WAVLDR_STAGE_READ      (1)
+#define WAVLDR_STAGE_DECODE    (2)
+#define WAVLDR_STAGE_PREFILTER (3)
+#define WAVLDR_STAGE_QUANTISE  (4)
+#define WAVLDR_STAGE_ENVELOPE  (5)
+#define WAVLDR_STAGE_RELTABLE  (6)
+#define WAVLDR_NB_STAGES       (7)
+
+/* Profile of loading one sample (or the sum of all of them). Times are in
+ * nanoseconds of wall clock time spent by the loader thread. peak_arena is
+ * the largest amount of loader temporary memory which was in use at a stage
+ * boundary (for the sum, it is the largest of all samples). */
+struct wavldr_profile {
+	uint_fast64_t stage_ns[WAVLDR_NB_STAGES];
+	uint_fast64_t bytes_read;
+	size_t        peak_arena;
+
+	/* Bytes of sample data which were allocated for playback. */
+	uint_fast64_t data_bytes;
 };
 
 /* The wavldr structure has all the data required to load all the samples. It
@@ -93,6 +157,33 @@ int wavldr_initialise(struct wavldr *load_set);
 
 struct sample_load_info *wavldr_add_sample(struct wavldr *load_set);
 
+/* Set the load mode. Must be called before wavldr_begin_load(). */
+void wavldr_set_mode(struct wavldr *load_set, unsigned mode);
+
+/* Set a function to be called when each sample finishes loading. Must be
+ * called before wavldr_begin_load(). */
+void wavldr_set_callback(struct wavldr *load_set, wavldr_loaded_callback callback, void *context);
+
+/* Move every sample of the given group which has not started loading to
+ * the front of the queue. The most recently requested group always goes
+ * first. In ON_DEMAND mode, this is the only way samples get loaded. Can be
+ * called from any thread between wavldr_begin_load() and wavldr_finish(). */
+void wavldr_request_group(struct wavldr *load_set, unsigned group);
+
+/* Enable disk streaming for everything which gets loaded. Must be called
+ * before wavldr_begin_load(). The stream must remain valid for as long as
+ * any of the loaded pipes are used and smplstream_start() must be called
+ * after wavldr_finish() has returned successfully. Passing NULL disables
+ * streaming (which is the default). */
+void wavldr_set_stream(struct wavldr *load_set, struct smplstream *stream);
+
+/* Prefilter segments of at least min_length samples are split into parts
+ * which any loader thread with nothing else to do can help with. This stops
+ * one long sample (e.g. a pedal pipe) from holding up the end of a load
+ * while the other threads sit idle. Zero disables splitting (which is the
+ * default). Must be called before wavldr_begin_load(). */
+void wavldr_set_split_length(struct wavldr *load_set, unsigned long min_length);
+
 /* Begins loader threads. nb_threads must be less than WAVLDR_MAX_LOAD_THREADS. */
 const char *
 wavldr_begin_load
@@ -103,12 +194,66 @@ wavldr_begin_load
 	,unsigned                 nb_threads
 	);
 
-/* Returns number of samples left to load */
+/* Stop loading anything which has not already started loading. Samples which
+ * are being loaded will still complete. Use this before wavldr_finish() to
+ * stop the loader early. */
+void wavldr_cancel(struct wavldr *ls);
+
+/* Returns number of samples left to load. In ON_DEMAND mode, this only
+ * counts samples which have been requested. */
 int wavldr_query_progress(struct wavldr *ls, unsigned *nb_samples);
 
-/* Wait for the load process to finish. */
+/* Returns the number of samples in the given group which have not finished
+ * loading. Samples which failed to load are included. */
+unsigned wavldr_query_group(struct wavldr *ls, unsigned group);
+
+/* Returns the error which stopped a sample of the given group from loading in
+ * ON_DEMAND mode or NULL if nothing in the group has failed. */
+const char *wavldr_query_group_error(struct wavldr *ls, unsigned group);
+
+/* Wait for the load process to finish. In ON_DEMAND mode, this stops the
+ * loader once everything which has been requested has been loaded. If a
+ * profile filename was given, the profile is written to it as JSON. Returns
+ * NULL if every sample which was loaded succeeded or an error string. */
 const char *wavldr_finish(struct wavldr *ls);
 
+/* Get the profile summed over every sample which has finished loading so far
+ * along with the number of those samples and the wall clock time since
+ * wavldr_begin_load() in nanoseconds (either of which may be NULL). Can be
+ * called from any thread after wavldr_begin_load() and after
+ * wavldr_finish(). */
+void
+wavldr_query_profile
+	(struct wavldr         *ls
+	,struct wavldr_profile *total
+	,unsigned              *nb_loaded
+	,uint_fast64_t         *wall_ns
+	);
+
+/* Get the profile of one sample. index is the order in which the sample was
+ * added using wavldr_add_sample(). Returns non-zero if the sample has not
+ * finished loading. Can only be called between wavldr_begin_load() and
+ * wavldr_finish(). */
+int wavldr_query_sample_profile(struct wavldr *ls, unsigned index, struct wavldr_profile *profile);
+
+/* Samples which have exactly the same files, load flags and load format are
+ * only loaded once. The first of them to be loaded is processed as usual and
+ * the playback data (including the release table) is shared with the others
+ * once it has finished. This gets the number of samples which have been
+ * satisfied by sharing so far and the number of bytes of sample data which
+ * sharing saved (either may be NULL). Can be called at the same times as
+ * wavldr_query_profile(). */
+void wavldr_query_sharing(struct wavldr *ls, unsigned *nb_shared, uint_fast64_t *bytes_saved);
+
+/* Returns a short name for one of the WAVLDR_STAGE_* values. */
+const char *wavldr_stage_name(unsigned stage);
+
+/* Write the load profile (the totals and the profile of every sample) to the
+ * given file as JSON when wavldr_finish() is called. Must be called before
+ * wavldr_begin_load(). The string must remain valid until wavldr_finish()
+ * returns. */
+void wavldr_set_profile_file(struct wavldr *load_set, const char *filename);
+
 /* Private Parts
  * ---------------------------------------------------------------------------
  * Don't touch them. Only defined so you can bung them on the stack. */
@@ -121,9 +266,47 @@ struct loader_thread_state {
 	struct cop_alloc_grp_temps  if1_impl;
 	struct cop_alloc_grp_temps  if2_impl;
 	struct odfilter_temporaries tmps;
+	struct filtcache_temps      env_tmps;
 	cop_thread                  thread_handle;
 };
 
+/* A prefilter operation which has been split into parts. The job lives on
+ * the stack of the thread which created it. Parts are handed out under the
+ * state lock. */
+struct wavldr_split_job {
+	const float             *input;
+	float                   *output;
+	unsigned long            susp_start;
+	unsigned long            length;
+	unsigned                 pre_read;
+	int                      is_looped;
+
+	/* kern_len-1 elements per part. */
+	float                   *tails;
+
+	unsigned                 nb_parts;
+	unsigned                 next_part;
+	unsigned                 parts_done;
+	struct wavldr_split_job *next;
+};
+
+struct wavldr_elem {
+	unsigned char            state;
+	unsigned                 request_seq;
+	struct wavldr_profile    profile;
+
+	/* Index of the first sample with identical inputs (which is the index
+	 * of this sample if there is none) and the head of the list of
+	 * samples waiting for this one to finish. nb_elems terminates the
+	 * list. */
+	unsigned                 primary;
+	unsigned                 waiters;
+	unsigned                 next_waiter;
+
+	/* Why the sample failed to load (ON_DEMAND mode only). */
+	const char              *error;
+};
+
 struct wavldr {
 	/* Things which are read-only by threads. */
 	const struct odfilter   *prefilter;
@@ -145,11 +328,41 @@ struct wavldr {
 	
 
 	cop_mutex                state_lock;
+	cop_cond                 work_cond;
 	struct sample_load_info *elems;
+	struct wavldr_elem      *elem_status;
+	unsigned                 nb_done;
+	unsigned                 nb_requested;
+	unsigned                 request_seq;
+	unsigned                 mode;
+	int                      closing;
+	wavldr_loaded_callback   callback;
+	void                    *callback_ctx;
 	const char              *error;
 	struct cop_alloc_iface  *protected_allocator;
 	struct cop_alloc_iface   allocator;
 	struct fftset           *fftset;
+	struct smplstream       *stream;
+
+	/* Envelope kernels and FFT plans shared by all of the threads. Nothing
+	 * else uses fftset during the load. */
+	struct filtcache         filtcache;
+
+	/* Split prefilter jobs which still have parts to hand out and the
+	 * number of threads which are loading something (and so might create
+	 * more jobs). */
+	unsigned long            split_length;
+	struct wavldr_split_job *split_jobs;
+	unsigned                 nb_busy;
+
+	/* Profiling. These are protected by state_lock. */
+	struct wavldr_profile    profile;
+	unsigned                 nb_profiled;
+	unsigned                 nb_shared;
+	uint_fast64_t            bytes_saved;
+	uint_fast64_t            begin_ns;
+	uint_fast64_t            end_ns;
+	const char              *profile_file;
 };
 
 #endif /* WAVELDR_H */